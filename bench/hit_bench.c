@@ -0,0 +1,163 @@
+/*
+ * Benchmark for many clients hitting the cache at once, see the shards in
+ * cache.c.
+ *
+ * A few thousand small pages are cached, and then 1 to MAX_THREADS threads
+ * look them up at random and copy each one out the way write_cached() sends
+ * it, with the odd miss thrown in. Every thread does the same number of
+ * lookups, and the total lookups per second are reported along with the
+ * speedup over a single thread. The same is then timed with every lookup
+ * going through one lock, the way the cache worked before it had shards.
+ * That stays flat, while the shards should scale with the number of cores
+ * (so neither goes past what "nproc" says).
+ *
+ * Run with "make bench".
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../cache.h"
+
+#define PAGES 4096       //pages cached
+#define PAGE_SIZE 4096   //bytes per page, header included
+#define LOOKUPS 100000   //lookups per thread
+#define MISS_EVERY 64    //one lookup in this many is for a page we don't have
+#define MAX_THREADS 16
+
+static char page[PAGE_SIZE];
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static int use_global_lock; //true to serialize the lookups
+
+/*
+ * Returns the current time in nanoseconds.
+ */
+static long
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Writes the path of page <i> into <out>.
+ */
+static void
+path_of(long i, char* out, size_t size)
+{
+	snprintf(out, size, "/page/%ld.html", i);
+}
+
+/*
+ * The main function for a client thread, doing LOOKUPS lookups with the
+ * random seed pointed to by <arg>, which is set to the number of misses
+ * when it's done.
+ */
+static void*
+run_client(void* arg)
+{
+	unsigned long seed = *(unsigned long*) arg;
+	char path[64];
+	char out[PAGE_SIZE];
+	unsigned long misses = 0;
+
+	for (long k = 0; k < LOOKUPS; k++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		long i = (long) (seed % PAGES);
+		if (k % MISS_EVERY == 0) i += PAGES;
+		path_of(i, path, sizeof(path));
+
+		if (use_global_lock) pthread_mutex_lock(&global_lock);
+		C_block* cb = search_cache("bench.example", path);
+		long off = 0;
+		for (R_block* r = cb == NULL ? NULL : cb->response;
+				r != NULL && off + r->size <= PAGE_SIZE; r = r->next) {
+			memcpy(out + off, r->text, r->size);
+			off += r->size;
+		}
+		if (cb != NULL) release_cache(cb);
+		if (use_global_lock) pthread_mutex_unlock(&global_lock);
+
+		if (cb == NULL) {
+			misses++;
+			continue;
+		}
+		if (off != PAGE_SIZE || out[PAGE_SIZE - 1] != page[PAGE_SIZE - 1]) {
+			fprintf(stderr, "ERROR: page %ld came out wrong\n", i);
+			exit(1);
+		}
+	}
+	*(unsigned long*) arg = misses;
+	return NULL;
+}
+
+/*
+ * Runs <n> client threads at once, serializing their lookups if <global> is
+ * true.
+ *
+ * Returns the total lookups per second.
+ */
+static double
+time_clients(int n, int global)
+{
+	use_global_lock = global;
+	pthread_t threads[MAX_THREADS];
+	unsigned long seeds[MAX_THREADS];
+
+	long start = now_ns();
+	for (int t = 0; t < n; t++) {
+		seeds[t] = 88172645463325252UL + 7919 * t;
+		pthread_create(&threads[t], NULL, run_client, &seeds[t]);
+	}
+	for (int t = 0; t < n; t++) {
+		pthread_join(threads[t], NULL);
+		if (seeds[t] != (LOOKUPS + MISS_EVERY - 1) / MISS_EVERY) {
+			fprintf(stderr, "ERROR: %lu lookups missed\n", seeds[t]);
+			exit(1);
+		}
+	}
+	long elapsed = now_ns() - start;
+	return (double) n * LOOKUPS / (elapsed / 1e9);
+}
+
+int
+main()
+{
+	init_cache(0); //no size limit
+
+	int len = snprintf(page, sizeof(page), "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n");
+	memset(page + len, 'x', PAGE_SIZE - len);
+	for (long i = 0; i < PAGES; i++) {
+		char path[64];
+		path_of(i, path, sizeof(path));
+		C_block* cb = add_cache("bench.example", path, page, PAGE_SIZE, PAGE_SIZE, 200, "OK", 0, "");
+		if (cb == NULL) {
+			fprintf(stderr, "ERROR: couldn't cache page %ld\n", i);
+			return 1;
+		}
+		finish_cache(cb);
+	}
+
+	printf("%10s %14s %10s %14s %10s\n", "threads", "lookups/s", "speedup",
+			"1 lock", "speedup");
+	double single = 0, single_global = 0;
+	for (int n = 1; n <= MAX_THREADS; n *= 2) {
+		double rate = time_clients(n, 0);
+		double global = time_clients(n, 1);
+		if (n == 1) {
+			single = rate;
+			single_global = global;
+		}
+		printf("%10d %14.0f %10.2f %14.0f %10.2f\n", n, rate, rate / single,
+				global, global / single_global);
+	}
+	return 0;
+}
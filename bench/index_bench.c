@@ -0,0 +1,147 @@
+/*
+ * Microbenchmark for cache lookups, see the index in cache.c.
+ *
+ * The cache is grown from 100 to 1,000,000 entries, and at every size a
+ * batch of lookups is timed for keys that are cached (hits) and keys that
+ * aren't (misses). Some entries are removed and cached again between sizes,
+ * while the index is still rehashing, and must never be found in between.
+ *
+ * Hits over the whole cache get slower as it grows even though the number of
+ * probes doesn't, because the index slots and blocks stop fitting in the CPU
+ * caches. The "hot" column looks up only the first HOT entries at every size,
+ * which keeps them cached and shows the cost of the lookup itself.
+ *
+ * Run with "make bench".
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../cache.h"
+
+#define LOOKUPS 1000000 //lookups timed at every size
+#define REPLACE 64      //entries removed and cached again at every size
+#define HOT 1000        //entries the hot lookups are spread over
+
+static char* BODY = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+
+/*
+ * Returns the current time in nanoseconds.
+ */
+static long
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Writes the path of entry <i> into <out>.
+ */
+static void
+path_of(long i, char* out, size_t size)
+{
+	snprintf(out, size, "/page/%ld.html", i);
+}
+
+/*
+ * Caches entry <i>.
+ */
+static void
+add_entry(long i)
+{
+	char path[64];
+	path_of(i, path, sizeof(path));
+	long len = 0;
+	while (BODY[len] != '\0') len++;
+
+	C_block* cb = add_cache("bench.example", path, BODY, len, len, 200, "OK", 0, "");
+	if (cb == NULL) {
+		fprintf(stderr, "ERROR: couldn't cache entry %ld\n", i);
+		exit(1);
+	}
+	finish_cache(cb);
+}
+
+/*
+ * Times LOOKUPS lookups of the <n> entries from <first>, checking that they
+ * are found if <first> is below <cached> and not found otherwise.
+ *
+ * Returns the nanoseconds per lookup.
+ */
+static double
+time_lookups(long first, long n, long cached)
+{
+	int miss = first >= cached;
+	char path[64];
+	unsigned long seed = 88172645463325252UL;
+	long found = 0;
+
+	long start = now_ns();
+	for (long k = 0; k < LOOKUPS; k++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		long i = first + (long) (seed % n);
+		path_of(i, path, sizeof(path));
+
+		C_block* cb = search_cache("bench.example", path);
+		if (cb != NULL) {
+			found++;
+			release_cache(cb);
+		}
+	}
+	long elapsed = now_ns() - start;
+
+	if (found != (miss ? 0 : LOOKUPS)) {
+		fprintf(stderr, "ERROR: %ld of %d lookups found a block\n", found, LOOKUPS);
+		exit(1);
+	}
+	return (double) elapsed / LOOKUPS;
+}
+
+/*
+ * Removes REPLACE of the entries below <n>, checking that they can't be
+ * found any more, and caches them again.
+ */
+static void
+replace_entries(long n)
+{
+	char path[64];
+	for (long k = 0; k < REPLACE; k++) {
+		long i = (k * 7919) % n;
+		path_of(i, path, sizeof(path));
+
+		C_block* cb = search_cache("bench.example", path);
+		free_cache_block(cb);
+		release_cache(cb);
+		if (search_cache("bench.example", path) != NULL) {
+			fprintf(stderr, "ERROR: entry %ld found after being removed\n", i);
+			exit(1);
+		}
+		add_entry(i);
+	}
+}
+
+int
+main()
+{
+	init_cache(0); //no size limit
+
+	printf("%10s %12s %12s %12s\n", "entries", "hit ns/op", "miss ns/op", "hot ns/op");
+	long cached = 0;
+	for (long n = 100; n <= 1000000; n *= 10) {
+		while (cached < n) add_entry(cached++);
+		replace_entries(n);
+
+		double hit = time_lookups(0, n, cached);
+		double miss = time_lookups(n, n, cached);
+		double hot = time_lookups(0, n < HOT ? n : HOT, cached);
+		printf("%10ld %12.1f %12.1f %12.1f\n", n, hit, miss, hot);
+	}
+	return 0;
+}
@@ -0,0 +1,413 @@
+/*
+ * Microbenchmark for parsing message headers, see http.c.
+ *
+ * A small corpus of request and response headers is parsed with the
+ * incremental parser and with the parser the proxy had before it, which
+ * looked for the empty line with memmem() and then went through a strdup()
+ * of the header with strsep() and sscanf(). Both are timed with the header
+ * arriving in one read and in reads of SPLIT bytes, where the old way had to
+ * search the whole buffer again after every read. The fields both parsers
+ * find are compared first.
+ *
+ * Run with "make bench".
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../http.h"
+#include "../project_4.h"
+
+#define ROUNDS 200000 //times the corpus is parsed per measurement
+#define SPLIT 64      //bytes per read when the header arrives in pieces
+
+static const char* REQUESTS[] = {
+	"GET http://example.com/ HTTP/1.1\r\n"
+	"Host: example.com\r\n"
+	"\r\n",
+
+	"GET http://www.example.org/static/js/app.4f2a9c.js HTTP/1.1\r\n"
+	"Host: www.example.org\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+	"Accept: */*\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Referer: http://www.example.org/index.html\r\n"
+	"Connection: keep-alive\r\n"
+	"Cookie: session=6b1f0c2e9a7d4e58b3c1; theme=dark; consent=1\r\n"
+	"Sec-Fetch-Dest: script\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"If-None-Match: \"4f2a9c-1a2b\"\r\n"
+	"If-Modified-Since: Tue, 15 Oct 2024 08:12:31 GMT\r\n"
+	"\r\n",
+
+	"GET http://api.example.net/v2/items?page=3&limit=50 HTTP/1.1\r\n"
+	"Host: api.example.net\r\n"
+	"User-Agent: curl/8.5.0\r\n"
+	"Accept: application/json\r\n"
+	"Connection: close\r\n"
+	"\r\n",
+};
+
+static const char* RESPONSES[] = {
+	"HTTP/1.1 200 OK\r\n"
+	"Content-Type: text/html; charset=utf-8\r\n"
+	"Content-Length: 1256\r\n"
+	"\r\n",
+
+	"HTTP/1.1 200 OK\r\n"
+	"Date: Thu, 17 Oct 2024 10:04:55 GMT\r\n"
+	"Server: nginx/1.24.0\r\n"
+	"Content-Type: application/javascript\r\n"
+	"Content-Length: 183402\r\n"
+	"Last-Modified: Tue, 15 Oct 2024 08:12:31 GMT\r\n"
+	"ETag: \"4f2a9c-1a2b\"\r\n"
+	"Cache-Control: public, max-age=31536000, immutable\r\n"
+	"Accept-Ranges: bytes\r\n"
+	"Vary: Accept-Encoding\r\n"
+	"X-Content-Type-Options: nosniff\r\n"
+	"Strict-Transport-Security: max-age=63072000; includeSubDomains\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n",
+
+	"HTTP/1.1 404 Not Found\r\n"
+	"Content-Type: application/json\r\n"
+	"Transfer-Encoding: chunked\r\n"
+	"Connection: close\r\n"
+	"\r\n",
+};
+
+#define N_REQUESTS (int) (sizeof(REQUESTS) / sizeof(REQUESTS[0]))
+#define N_RESPONSES (int) (sizeof(RESPONSES) / sizeof(RESPONSES[0]))
+
+/*
+ * Returns the current time in nanoseconds.
+ */
+static long
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * parse_request() as it was before http.c, taking a NUL-terminated header.
+ */
+static int
+old_parse_request(char* request, struct request* rptr)
+{
+	//scan the method and url into the pointer
+	if (sscanf(request, "%7s %2047s %9s\r\n", rptr->method, rptr->url,
+				rptr->http_v) < 3) {
+		return -1;
+	}
+
+	rptr->has_connection = 0;
+	rptr->has_encoding = 0;
+
+	char* token, * string, * tofree;
+	tofree = string = strdup(request);
+	//loop through the request line by line (saved to token)
+	while ((token = strsep(&string, "\r\n")) != NULL) {
+		if (strncmp(token, "Host: ", 6) == 0) {
+			char* host = token + 6;
+			strncpy(rptr->host, host, sizeof(rptr->host));
+
+			char* path_offset = strstr(rptr->url, host);
+			path_offset+=strlen(host);
+			strncpy(rptr->path, path_offset, sizeof(rptr->path));
+		}
+		else if (strncmp(token, "Connection: ", 12) == 0) {
+			char* conn = token + 12;
+			strncpy(rptr->connection, conn, sizeof(rptr->connection));
+			rptr->has_connection = 1;
+		}
+		else if (strncmp(token, "Accept-Encoding: ", 17) == 0) {
+			char* enc = token + 17;
+			strncpy(rptr->encoding, enc, sizeof(rptr->encoding));
+			rptr->has_encoding= 1;
+		}
+		else if (strncmp(token, "User-Agent: ", 12) == 0) {
+			char* userag = token + 12;
+			strncpy(rptr->useragent, userag, sizeof(rptr->useragent));
+		}
+		else if (strlen(token) == 0) {
+			//we've reached the end of the header, expecting body now
+			break;
+		}
+		//skip over the \n character and break when we reach the end
+		if (strlen(string) <= 2) {
+			break;
+		}
+		string += 1;
+	}
+	free(tofree);
+	return 0;
+}
+
+/*
+ * parse_response() as it was before http.c, taking a NUL-terminated header.
+ */
+static long
+old_parse_response(char* response, struct response* r_ptr)
+{
+	r_ptr->has_length = 0;
+	r_ptr->has_type = 0;
+	r_ptr->chunked = 0;
+	r_ptr->conn_close = 0;
+	//scan the method and url into the pointer
+	if (sscanf(response, "%9s %d %255[^\r\n]\r\n", r_ptr->http_v,
+			&r_ptr->status_no, r_ptr->status) < 3) {
+		r_ptr->conn_close = 1;
+		return 0;
+	}
+
+	//HTTP/1.0 servers close the connection unless they say otherwise
+	int keep_alive = strcmp(r_ptr->http_v, "HTTP/1.0") != 0;
+
+	char* token, * string, * tofree;
+	tofree = string = strdup(response);
+	//loop through the request line by line (saved to token)
+	while ((token = strsep(&string, "\r\n")) != NULL) {
+		if (strncmp(token, "Content-Type: ", 14) == 0) {
+			char* type = token + 14;
+			strncpy(r_ptr->c_type, type, sizeof(r_ptr->c_type));
+			r_ptr->has_type = 1;
+		}
+		else if (strncmp(token, "Content-Length: ", 16) == 0) {
+			char* len = token + 16;
+			strncpy(r_ptr->c_length, len, sizeof(r_ptr->c_length));
+			r_ptr->has_length = 1;
+		}
+		else if (strncmp(token, "Transfer-Encoding: ", 19) == 0) {
+			r_ptr->chunked = strstr(token + 19, "chunked") != NULL;
+		}
+		else if (strncmp(token, "Connection: ", 12) == 0) {
+			keep_alive = strcmp(token + 12, "close") != 0;
+		}
+		else if (strlen(token) == 0) {
+			//we've reached the end of the header, expecting body now
+			break;
+		}
+		//skip over the \n character and break when we reach the end
+		if (strlen(string) <= 2) {
+			break;
+		}
+		string += 1;
+	}
+
+	//a chunked response has no use for its length
+	if (r_ptr->chunked) r_ptr->has_length = 0;
+	r_ptr->conn_close = !keep_alive;
+
+	long header_length = strlen(response) - strlen(string) + 1;
+	free(tofree);
+	return header_length;
+}
+
+/*
+ * Copies the fields of a request the old parser found from <parser>, the
+ * way parse_request() does.
+ */
+static void
+new_request(H_parser* parser, const char* buf, struct request* rptr)
+{
+	http_copy(buf, parser->start[0], rptr->method, sizeof(rptr->method));
+	http_copy(buf, parser->start[1], rptr->url, sizeof(rptr->url));
+	http_copy(buf, parser->start[2], rptr->http_v, sizeof(rptr->http_v));
+	rptr->has_connection = 0;
+	rptr->has_encoding = 0;
+
+	for (int i = 0; i < parser->count; i++) {
+		H_view name = parser->fields[i].name;
+		H_view value = parser->fields[i].value;
+
+		if (http_is(buf, name, "Host")) {
+			http_copy(buf, value, rptr->host, sizeof(rptr->host));
+		}
+		else if (http_is(buf, name, "Connection")) {
+			http_copy(buf, value, rptr->connection, sizeof(rptr->connection));
+			rptr->has_connection = 1;
+		}
+		else if (http_is(buf, name, "Accept-Encoding")) {
+			http_copy(buf, value, rptr->encoding, sizeof(rptr->encoding));
+			rptr->has_encoding = 1;
+		}
+		else if (http_is(buf, name, "User-Agent")) {
+			http_copy(buf, value, rptr->useragent, sizeof(rptr->useragent));
+		}
+	}
+}
+
+/*
+ * Copies the fields of a response the old parser found from <parser>, the
+ * way parse_response() does.
+ */
+static void
+new_response(H_parser* parser, const char* buf, struct response* r_ptr)
+{
+	r_ptr->has_length = 0;
+	r_ptr->has_type = 0;
+	r_ptr->chunked = 0;
+	http_copy(buf, parser->start[0], r_ptr->http_v, sizeof(r_ptr->http_v));
+	r_ptr->status_no = atoi(buf + parser->start[1].off);
+	http_copy(buf, parser->start[2], r_ptr->status, sizeof(r_ptr->status));
+	int keep_alive = !http_is(buf, parser->start[0], "HTTP/1.0");
+
+	for (int i = 0; i < parser->count; i++) {
+		H_view name = parser->fields[i].name;
+		H_view value = parser->fields[i].value;
+
+		if (http_is(buf, name, "Content-Type")) {
+			http_copy(buf, value, r_ptr->c_type, sizeof(r_ptr->c_type));
+			r_ptr->has_type = 1;
+		}
+		else if (http_is(buf, name, "Content-Length")) {
+			http_copy(buf, value, r_ptr->c_length, sizeof(r_ptr->c_length));
+			r_ptr->has_length = 1;
+		}
+		else if (http_is(buf, name, "Transfer-Encoding")) {
+			r_ptr->chunked = http_has_token(buf, value, "chunked");
+		}
+		else if (http_is(buf, name, "Connection")) {
+			keep_alive &= !http_has_token(buf, value, "close");
+		}
+	}
+	if (r_ptr->chunked) r_ptr->has_length = 0;
+	r_ptr->conn_close = !keep_alive;
+}
+
+/*
+ * Parses <text> like the proxy used to, as if it arrived <step> bytes at a
+ * time into <buf>: look for the end of the header after every read, then
+ * parse it. <out> is a struct request if <request> is true, otherwise a
+ * struct response.
+ */
+static void
+parse_old(const char* text, long len, long step, char* buf, int request, void* out)
+{
+	char* end = NULL;
+	for (long have = 0; end == NULL && have < len; ) {
+		long n = len - have < step ? len - have : step;
+		memcpy(buf + have, text + have, n);
+		have += n;
+		end = memmem(buf, have, "\r\n\r\n", 4);
+	}
+	long header_length = end + 4 - buf;
+	buf[header_length] = '\0';
+
+	if (request) old_parse_request(buf, out);
+	else old_parse_response(buf, out);
+}
+
+/*
+ * Parses <text> with http_parse(), as if it arrived <step> bytes at a time
+ * into <buf>. <out> is as for parse_old().
+ */
+static void
+parse_new(const char* text, long len, long step, char* buf, int request, void* out)
+{
+	H_parser parser;
+	http_init(&parser);
+	for (long have = 0; have < len; ) {
+		long n = len - have < step ? len - have : step;
+		memcpy(buf + have, text + have, n);
+		have += n;
+		if (http_parse(&parser, buf, have) != HTTP_MORE) break;
+	}
+	if (parser.state != HTTP_DONE) {
+		fprintf(stderr, "ERROR: the parser didn't finish a header\n");
+		exit(1);
+	}
+
+	if (request) new_request(&parser, buf, out);
+	else new_response(&parser, buf, out);
+}
+
+/*
+ * Checks that both parsers find the same fields in every header of the
+ * corpus.
+ */
+static void
+check_corpus()
+{
+	char buf[MAX_BUF];
+	for (int i = 0; i < N_REQUESTS; i++) {
+		struct request a, b;
+		memset(&a, 0, sizeof(a));
+		memset(&b, 0, sizeof(b));
+		parse_old(REQUESTS[i], strlen(REQUESTS[i]), MAX_BUF, buf, 1, &a);
+		parse_new(REQUESTS[i], strlen(REQUESTS[i]), SPLIT, buf, 1, &b);
+		if (strcmp(a.method, b.method) != 0 || strcmp(a.url, b.url) != 0 ||
+				strcmp(a.host, b.host) != 0 ||
+				strcmp(a.useragent, b.useragent) != 0 ||
+				strcmp(a.encoding, b.encoding) != 0 ||
+				strcmp(a.connection, b.connection) != 0) {
+			fprintf(stderr, "ERROR: the parsers disagree on request %d\n", i);
+			exit(1);
+		}
+	}
+	for (int i = 0; i < N_RESPONSES; i++) {
+		struct response a, b;
+		memset(&a, 0, sizeof(a));
+		memset(&b, 0, sizeof(b));
+		parse_old(RESPONSES[i], strlen(RESPONSES[i]), MAX_BUF, buf, 0, &a);
+		parse_new(RESPONSES[i], strlen(RESPONSES[i]), SPLIT, buf, 0, &b);
+		if (a.status_no != b.status_no || strcmp(a.status, b.status) != 0 ||
+				strcmp(a.c_type, b.c_type) != 0 ||
+				strcmp(a.c_length, b.c_length) != 0 ||
+				a.chunked != b.chunked || a.conn_close != b.conn_close) {
+			fprintf(stderr, "ERROR: the parsers disagree on response %d\n", i);
+			exit(1);
+		}
+	}
+}
+
+/*
+ * Parses the whole corpus ROUNDS times with <parse>, reading <step> bytes at
+ * a time.
+ *
+ * Returns the nanoseconds per header.
+ */
+static double
+time_parse(void (*parse)(const char*, long, long, char*, int, void*), long step)
+{
+	static char buf[MAX_BUF];
+	static struct request req;
+	static struct response res;
+	long lens[N_REQUESTS + N_RESPONSES];
+	for (int i = 0; i < N_REQUESTS; i++) lens[i] = strlen(REQUESTS[i]);
+	for (int i = 0; i < N_RESPONSES; i++) lens[N_REQUESTS + i] = strlen(RESPONSES[i]);
+
+	long start = now_ns();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int i = 0; i < N_REQUESTS; i++) {
+			parse(REQUESTS[i], lens[i], step, buf, 1, &req);
+		}
+		for (int i = 0; i < N_RESPONSES; i++) {
+			parse(RESPONSES[i], lens[N_REQUESTS + i], step, buf, 0, &res);
+		}
+	}
+	long elapsed = now_ns() - start;
+	return (double) elapsed / ROUNDS / (N_REQUESTS + N_RESPONSES);
+}
+
+int
+main()
+{
+	init_http();
+	check_corpus();
+
+	printf("%12s %12s %12s\n", "parser", "1 read", "64B reads");
+	printf("%12s %9.0f ns %9.0f ns\n", "old", time_parse(parse_old, MAX_BUF),
+		time_parse(parse_old, SPLIT));
+	printf("%12s %9.0f ns %9.0f ns\n", "incremental", time_parse(parse_new, MAX_BUF),
+		time_parse(parse_new, SPLIT));
+	return 0;
+}
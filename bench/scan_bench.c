@@ -0,0 +1,142 @@
+/*
+ * Microbenchmark for the line scanners of http.c.
+ *
+ * Every scanner this CPU can run goes through a corpus of request and
+ * response headers line by line, the way http_parse() does, and the bytes
+ * scanned per second are reported. Browsers send long lines (cookies, user
+ * agents) where the wider scanners should help the most, so the corpus has
+ * a few of those as well as short response fields.
+ *
+ * Run with "make bench".
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../http.h"
+
+#define ROUNDS 200000 //times the corpus is scanned per scanner
+
+static const char* SCANNERS[] = { "scalar", "sse2", "avx2" };
+
+static const char* CORPUS[] = {
+	"GET http://www.example.org/static/js/app.4f2a9c.js HTTP/1.1\r\n"
+	"Host: www.example.org\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Referer: http://www.example.org/index.html\r\n"
+	"Connection: keep-alive\r\n"
+	"Cookie: session=6b1f0c2e9a7d4e58b3c1; theme=dark; consent=1; _ga=GA1.2.1234567890.1700000000; "
+	"_gid=GA1.2.987654321.1700000000; prefs=eyJsYW5nIjoiZW4iLCJ0eiI6IlVUQyJ9\r\n"
+	"Sec-Fetch-Dest: script\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"If-None-Match: \"4f2a9c-1a2b\"\r\n"
+	"If-Modified-Since: Tue, 15 Oct 2024 08:12:31 GMT\r\n"
+	"\r\n",
+
+	"GET http://api.example.net/v2/items?page=3&limit=50 HTTP/1.1\r\n"
+	"Host: api.example.net\r\n"
+	"User-Agent: curl/8.5.0\r\n"
+	"Accept: application/json\r\n"
+	"\r\n",
+
+	"HTTP/1.1 200 OK\r\n"
+	"Date: Thu, 17 Oct 2024 10:04:55 GMT\r\n"
+	"Server: nginx/1.24.0\r\n"
+	"Content-Type: application/javascript\r\n"
+	"Content-Length: 183402\r\n"
+	"Last-Modified: Tue, 15 Oct 2024 08:12:31 GMT\r\n"
+	"ETag: \"4f2a9c-1a2b\"\r\n"
+	"Cache-Control: public, max-age=31536000, immutable\r\n"
+	"Accept-Ranges: bytes\r\n"
+	"Vary: Accept-Encoding\r\n"
+	"X-Content-Type-Options: nosniff\r\n"
+	"Strict-Transport-Security: max-age=63072000; includeSubDomains\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n",
+
+	"HTTP/1.1 404 Not Found\r\n"
+	"Content-Type: application/json\r\n"
+	"Transfer-Encoding: chunked\r\n"
+	"\r\n",
+};
+
+#define N_CORPUS (int) (sizeof(CORPUS) / sizeof(CORPUS[0]))
+
+/*
+ * Returns the current time in nanoseconds.
+ */
+static long
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Scans the <len> bytes of <text> line by line with <scan>.
+ *
+ * Returns the number of lines, plus the colons found so that the compiler
+ * can't drop the work.
+ */
+static long
+scan_header(http_scanner scan, const char* text, long len)
+{
+	long lines = 0;
+	long off = 0;
+	long nl, colon;
+
+	while ((nl = scan(text, off, len, &colon)) != -1) {
+		lines += 1 + (colon != -1);
+		off = nl + 1;
+	}
+	return lines;
+}
+
+int
+main()
+{
+	long lens[N_CORPUS];
+	long bytes = 0;
+	for (int i = 0; i < N_CORPUS; i++) {
+		lens[i] = strlen(CORPUS[i]);
+		bytes += lens[i];
+	}
+
+	printf("%12s %12s %12s\n", "scanner", "ns/header", "MB/s");
+	long expected = -1;
+	for (int s = 0; s < (int) (sizeof(SCANNERS) / sizeof(SCANNERS[0])); s++) {
+		http_scanner scan = http_scanner_named(SCANNERS[s]);
+		if (scan == NULL) {
+			printf("%12s %12s\n", SCANNERS[s], "unsupported");
+			continue;
+		}
+
+		long found = 0;
+		long start = now_ns();
+		for (int r = 0; r < ROUNDS; r++) {
+			for (int i = 0; i < N_CORPUS; i++) {
+				found += scan_header(scan, CORPUS[i], lens[i]);
+			}
+		}
+		long elapsed = now_ns() - start;
+
+		if (expected == -1) expected = found;
+		if (found != expected) {
+			fprintf(stderr, "ERROR: the %s scanner found different lines\n", SCANNERS[s]);
+			return 1;
+		}
+		printf("%12s %12.1f %12.0f\n", SCANNERS[s],
+			(double) elapsed / ROUNDS / N_CORPUS,
+			(double) bytes * ROUNDS / (1 << 20) / (elapsed / 1e9));
+	}
+	return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * Microbenchmark for relaying response bodies, see splice_body() in
+ * project_4.c.
+ *
+ * A body is pushed through two loopback TCP connections, the way the proxy
+ * sits between a server and a client, once with the recv()/write() loop of
+ * relay_response() and once through a pipe with splice(). The client end
+ * checks that every byte arrives intact.
+ *
+ * Run with "make bench".
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../project_4.h"
+
+#define BODY_SIZE (256L << 20) //bytes relayed per run
+#define RUNS 3                 //runs per way of relaying, the best one counts
+
+/*
+ * Returns the current time in nanoseconds.
+ */
+static long
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+//the body repeats the bytes 0 to 255, so that the byte at offset <off> is
+//found at pattern[off % 256]
+static char pattern[SPLICE_SIZE + 256];
+
+/*
+ * Opens a loopback TCP connection, setting <a> and <b> to its two ends.
+ */
+static void
+connect_pair(int* a, int* b)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == -1 || bind(listener, (struct sockaddr*) &addr, len) == -1 ||
+			listen(listener, 1) == -1 ||
+			getsockname(listener, (struct sockaddr*) &addr, &len) == -1) {
+		perror("ERROR: couldn't listen on loopback");
+		exit(1);
+	}
+	*a = socket(AF_INET, SOCK_STREAM, 0);
+	if (*a == -1 || connect(*a, (struct sockaddr*) &addr, len) == -1 ||
+			(*b = accept(listener, NULL, NULL)) == -1) {
+		perror("ERROR: couldn't connect on loopback");
+		exit(1);
+	}
+	close(listener);
+}
+
+/*
+ * The main function for the server end, writing the body to the socket
+ * pointed to by <arg> and closing it.
+ */
+static void*
+serve_body(void* arg)
+{
+	int fd = *(int*) arg;
+
+	for (long off = 0; off < BODY_SIZE; ) {
+		long n = BODY_SIZE - off < SPLICE_SIZE ? BODY_SIZE - off : SPLICE_SIZE;
+		for (long sent = 0; sent < n; ) {
+			ssize_t got = write(fd, pattern + sent, n - sent);
+			if (got <= 0) {
+				perror("ERROR: server end couldn't write");
+				exit(1);
+			}
+			sent += got;
+		}
+		off += n;
+	}
+	close(fd);
+	return NULL;
+}
+
+/*
+ * The main function for the client end, reading the body from the socket
+ * pointed to by <arg> until it's closed and checking every byte.
+ */
+static void*
+check_body(void* arg)
+{
+	int fd = *(int*) arg;
+	char buf[SPLICE_SIZE];
+	long off = 0;
+	ssize_t got;
+
+	while ((got = read(fd, buf, sizeof(buf))) > 0) {
+		if (memcmp(buf, pattern + off % 256, got) != 0) {
+			fprintf(stderr, "ERROR: bytes after %ld arrived wrong\n", off);
+			exit(1);
+		}
+		off += got;
+	}
+	if (off != BODY_SIZE) {
+		fprintf(stderr, "ERROR: %ld of %ld bytes arrived\n", off, BODY_SIZE);
+		exit(1);
+	}
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Relays everything from <in> to <out> with recv() and write(), like
+ * relay_response() does without -splice.
+ */
+static long
+relay_copy(int in, int out)
+{
+	char buf[MAX_BUF];
+	long relayed = 0;
+	ssize_t nbytes;
+
+	while ((nbytes = recv(in, buf, MAX_BUF, 0)) > 0) {
+		if (write(out, buf, nbytes) != nbytes) break;
+		relayed += nbytes;
+	}
+	return relayed;
+}
+
+/*
+ * Relays everything from <in> to <out> through a pipe, like splice_body()
+ * does when nothing needs a copy of the bytes.
+ */
+static long
+relay_splice(int in, int out)
+{
+	int p[2];
+	long relayed = 0;
+
+	if (pipe(p) == -1) {
+		perror("ERROR: couldn't make a pipe");
+		exit(1);
+	}
+	for (;;) {
+		ssize_t n = splice(in, NULL, p[1], NULL, SPLICE_SIZE,
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n <= 0) break;
+
+		long moved = 0;
+		while (moved < n) {
+			ssize_t sent = splice(p[0], NULL, out, NULL, n - moved,
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (sent <= 0) break;
+			moved += sent;
+		}
+		relayed += moved;
+		if (moved < n) break;
+	}
+	close(p[0]);
+	close(p[1]);
+	return relayed;
+}
+
+/*
+ * Relays one body with <relay>, checking that all of it arrives.
+ *
+ * Returns the throughput in MB/s.
+ */
+static double
+time_relay(long (*relay)(int, int))
+{
+	int server, from_server, to_client, client;
+	connect_pair(&server, &from_server);
+	connect_pair(&to_client, &client);
+
+	pthread_t serving, checking;
+	pthread_create(&serving, NULL, serve_body, &server);
+	pthread_create(&checking, NULL, check_body, &client);
+
+	long start = now_ns();
+	long relayed = relay(from_server, to_client);
+	close(to_client);
+	pthread_join(checking, NULL);
+	long elapsed = now_ns() - start;
+	pthread_join(serving, NULL);
+	close(from_server);
+
+	if (relayed != BODY_SIZE) {
+		fprintf(stderr, "ERROR: relayed %ld of %ld bytes\n", relayed, BODY_SIZE);
+		exit(1);
+	}
+	return (double) BODY_SIZE / (1 << 20) / (elapsed / 1e9);
+}
+
+int
+main()
+{
+	for (long i = 0; i < (long) sizeof(pattern); i++) pattern[i] = (char) i;
+
+	double copy = 0, spliced = 0;
+	for (int i = 0; i < RUNS; i++) {
+		double mbs = time_relay(relay_copy);
+		if (mbs > copy) copy = mbs;
+		mbs = time_relay(relay_splice);
+		if (mbs > spliced) spliced = mbs;
+	}
+
+	printf("%12s %12s\n", "relay", "MB/s");
+	printf("%12s %12.0f\n", "read/write", copy);
+	printf("%12s %12.0f\n", "splice", spliced);
+	return 0;
+}
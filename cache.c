@@ -1,35 +1,141 @@
+#include <limits.h>
+#include <semaphore.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "cache.h"
+#include "intern.h"
+#include "slab.h"
 
+#define INDEX_MIN_CAP 64 //initial number of slots in the hash index
+#define REHASH_STEP 32   //old slots migrated per index operation
 
-C_block* cache_start = NULL; //starting cache block
-C_block* cache_end = NULL;   //ending cache block
+/*
+ * Open addressing (linear probing) hash index over the cache blocks.
+ *
+ * When the index has to grow, a new table is allocated and the entries of the
+ * old one are migrated into it REHASH_STEP slots at a time on every insert,
+ * remove and lookup. That way no single request pays for the whole rehash.
+ * While this is happening a block lives in exactly one of the two tables.
+ */
+typedef struct H_index {
+	C_block** slots;
+	unsigned long cap;      //number of slots, always a power of two
+	unsigned long used;     //live entries plus tombstones in <slots>
+	unsigned long live;     //live entries across both tables
+	C_block** old;          //table being migrated from, NULL if not rehashing
+	unsigned long old_cap;
+	unsigned long old_pos;  //next slot of <old> to migrate
+} H_index;
 
-int cache_count = 0; //current items in the cache
-long cache_size = 0; //total size of the cache in bytes
-int lru_count = 0;   //current maximum LRU count
+//marks a slot whose block was removed so probing continues past it
+static C_block tombstone_block;
+#define TOMBSTONE (&tombstone_block)
+
+/*
+ * One of the CACHE_SHARDS independent parts of the cache. Keys are hashed to
+ * a shard, and everything about a block (its place in the recency list, the
+ * index and the size accounting) is protected by that shard's lock only.
+ *
+ * <size> and <count> are only written with the lock held but are read
+ * without it when aggregating the global stats.
+ */
+typedef struct C_shard {
+	sem_t lock;
+	C_block* start; //most recently used cache block
+	C_block* end;   //least recently used cache block
+	H_index index;
+	long size;      //total size of the shard in bytes
+	int count;      //current items in the shard
+	long evictions; //blocks evicted from the shard to make space
+} C_shard;
+
+static C_shard shards[CACHE_SHARDS];
+static unsigned int evict_next = 0; //shard to try evicting from next
+static void (*spill)(C_block*) = NULL; //where evicted blocks go, if anywhere
 long max_cache_size = 0; //in bytes
 
 
+/*
+ * Sets up the shards and sets the maximum size of the whole cache to <mb>
+ * megabytes. Must be called before any other cache function.
+ */
+void
+init_cache(int mb)
+{
+	max_cache_size = (long) mb * BYTESINMB;
+	init_slab();
+	init_intern();
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		memset(&shards[i], 0, sizeof(C_shard));
+		sem_init(&shards[i].lock, 0, 1);
+	}
+}
+
+/*
+ * Has every block evicted from now on handed to <hook> (without any lock
+ * held) before it's freed, e.g. to keep it somewhere else.
+ */
 void
-set_max_cache_size(int mb)
+set_spill(void (*hook)(C_block*))
+{
+	spill = hook;
+}
+
+/*
+ * Returns the shard responsible for keys hashing to <hash>. The top bits are
+ * used since the index inside the shard probes with the bottom ones.
+ */
+static C_shard*
+shard_of(unsigned long hash)
 {
-	max_cache_size = mb * BYTESINMB;
+	return &shards[(hash >> 48) % CACHE_SHARDS];
 }
 
 long
 get_current_cache_size()
 {
-	return cache_size;
+	long total = 0;
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		total += __atomic_load_n(&shards[i].size, __ATOMIC_RELAXED);
+	}
+	return total;
 }
 
 int
 get_cache_count()
 {
-	return cache_count;
+	int total = 0;
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		total += __atomic_load_n(&shards[i].count, __ATOMIC_RELAXED);
+	}
+	return total;
+}
+
+/*
+ * Returns the number of blocks evicted to make space so far.
+ */
+long
+get_eviction_count()
+{
+	long total = 0;
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		total += __atomic_load_n(&shards[i].evictions, __ATOMIC_RELAXED);
+	}
+	return total;
+}
+
+/*
+ * Adjusts the accounting of shard <s> by <nbytes> bytes and <items> blocks.
+ * The shard's lock must be held.
+ */
+static void
+account(C_shard* s, long nbytes, int items)
+{
+	__atomic_store_n(&s->size, s->size + nbytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->count, s->count + items, __ATOMIC_RELAXED);
 }
 
 /*
@@ -39,7 +145,8 @@ get_cache_count()
 int
 can_fit(long nbytes)
 {
-	return max_cache_size == 0 || cache_size + nbytes < max_cache_size;
+	return max_cache_size == 0 ||
+		get_current_cache_size() + nbytes < max_cache_size;
 }
 
 /*
@@ -53,58 +160,200 @@ could_fit(long nbytes)
 }
 
 /*
- * Searches the cache for the cache block matching <host> and <port>.
+ * Returns the 64-bit FNV-1a hash of <host> followed by <path>. A zero byte is
+ * mixed in between the two so that e.g. ("ab", "/c") and ("a", "b/c") differ.
+ */
+unsigned long
+hash_key(const char *host, const char *path)
+{
+	unsigned long h = 14695981039346656037UL;
+	const unsigned char* c;
+
+	for (c = (const unsigned char*) host; *c != '\0'; c++) {
+		h = (h ^ *c) * 1099511628211UL;
+	}
+	h *= 1099511628211UL;
+	for (c = (const unsigned char*) path; *c != '\0'; c++) {
+		h = (h ^ *c) * 1099511628211UL;
+	}
+	return h;
+}
+
+/*
+ * Looks for the block matching <host> and <path> in the table <slots>.
  *
- * Returns a pointer to the cache block if successful, and NULL otherwise.
+ * Returns the slot holding the block, or NULL if it isn't in the table.
  */
-C_block*
-search_cache(char *host, char *path)
+static C_block**
+index_probe(C_block** slots, unsigned long cap, unsigned long hash,
+		const char *host, const char *path)
 {
-	C_block* ref = cache_start;
+	if (slots == NULL) return NULL;
 
-	while (ref != NULL) {
-		if (strcmp(ref->host, host) == 0 &&
-				strcmp(ref->path, path) == 0) {
-			ref->lru = ++lru_count;
-			return ref;
+	unsigned long mask = cap - 1;
+	for (unsigned long i = hash & mask; slots[i] != NULL; i = (i + 1) & mask) {
+		C_block* cb = slots[i];
+		if (cb != TOMBSTONE && cb->hash == hash &&
+				strcmp(cb->host, host) == 0 &&
+				strcmp(cb->path, path) == 0) {
+			return &slots[i];
 		}
-		ref = ref->next;
 	}
 	return NULL;
 }
 
 /*
- * Frees the memory allocated to the response block <r>.
- *
- * First free's the text, then goes down the linked list freeing every the
- * following blocks. Finally frees itself.
+ * Places <cb> in the first free slot of the index's current table. The caller
+ * must make sure there is room.
+ */
+static void
+index_place(H_index* idx, C_block* cb)
+{
+	unsigned long mask = idx->cap - 1;
+	unsigned long i = cb->hash & mask;
+
+	while (idx->slots[i] != NULL && idx->slots[i] != TOMBSTONE) {
+		i = (i + 1) & mask;
+	}
+	if (idx->slots[i] == NULL) idx->used++;
+	idx->slots[i] = cb;
+}
+
+/*
+ * Migrates up to <n> slots of the old table into the current one, freeing the
+ * old table once it's empty. A migrated slot is left as a tombstone so that
+ * the block is only ever found (and removed) in the current table, while
+ * probes for blocks further along in the old table still get past it.
+ */
+static void
+index_migrate(H_index* idx, unsigned long n)
+{
+	if (idx->old == NULL) return;
+
+	while (n-- > 0 && idx->old_pos < idx->old_cap) {
+		C_block* cb = idx->old[idx->old_pos];
+		if (cb != NULL && cb != TOMBSTONE) {
+			index_place(idx, cb);
+			idx->old[idx->old_pos] = TOMBSTONE;
+		}
+		idx->old_pos++;
+	}
+
+	if (idx->old_pos == idx->old_cap) {
+		free(idx->old);
+		idx->old = NULL;
+		idx->old_cap = 0;
+		idx->old_pos = 0;
+	}
+}
+
+/*
+ * Swaps in a fresh table and starts migrating the current one into it. The
+ * table only doubles if it's mostly live entries; a table that's full of
+ * tombstones is just rebuilt at the same size.
  *
- * It does this recursively.
+ * Returns 0 if successful, -1 if we couldn't allocate the new table.
  */
-void
-free_response_block(R_block* r)
+static int
+index_grow(H_index* idx)
 {
-	if (r != NULL) {
-		if (r->text != NULL) free(r->text);
-		free_response_block(r->next);
-		free(r);
+	//never have more than one migration going at a time
+	index_migrate(idx, idx->old_cap);
+
+	unsigned long cap = idx->cap == 0 ? INDEX_MIN_CAP : idx->cap;
+	if (idx->live * 2 >= cap) cap *= 2;
+
+	C_block** slots = calloc(cap, sizeof(C_block*));
+	if (slots == NULL) {
+		perror("Failed to allocate memory for cache index");
+		return -1;
 	}
+
+	idx->old = idx->slots;
+	idx->old_cap = idx->slots == NULL ? 0 : idx->cap;
+	idx->old_pos = 0;
+	idx->slots = slots;
+	idx->cap = cap;
+	idx->used = 0;
+	index_migrate(idx, REHASH_STEP);
+	return 0;
+}
+
+/*
+ * Returns the block matching <host> and <path> in the index, NULL otherwise.
+ */
+static C_block*
+index_find(H_index* idx, unsigned long hash, const char *host, const char *path)
+{
+	index_migrate(idx, REHASH_STEP);
+
+	C_block** slot = index_probe(idx->slots, idx->cap, hash, host, path);
+	if (slot == NULL) slot = index_probe(idx->old, idx->old_cap, hash, host, path);
+	return slot == NULL ? NULL : *slot;
 }
 
 /*
- * Frees the cache block <cb> and the associated request block linked list.
+ * Adds <cb> to the index, growing it if it's getting too full.
  *
- * Returns the amount of space gained after freeing the structure.
+ * Returns 0 if successful, -1 otherwise.
  */
-long
-free_cache_block(C_block* cb)
+static int
+index_insert(H_index* idx, C_block* cb)
 {
-	if (cb == NULL) return 0;
+	index_migrate(idx, REHASH_STEP);
+
+	//keep the load factor (tombstones included) under 3/4
+	if ((idx->used + 1) * 4 > idx->cap * 3 && index_grow(idx) == -1 &&
+			idx->used + 1 >= idx->cap) {
+		return -1;
+	}
+
+	index_place(idx, cb);
+	idx->live++;
+	return 0;
+}
+
+/*
+ * Returns the slot in table <slots> holding exactly the block <cb>, or NULL.
+ * Matching on the pointer rather than the key means duplicate keys are fine.
+ */
+static C_block**
+index_slot_of(C_block** slots, unsigned long cap, C_block* cb)
+{
+	if (slots == NULL) return NULL;
+
+	unsigned long mask = cap - 1;
+	for (unsigned long i = cb->hash & mask; slots[i] != NULL; i = (i + 1) & mask) {
+		if (slots[i] == cb) return &slots[i];
+	}
+	return NULL;
+}
+
+/*
+ * Removes <cb> from whichever table of the index is holding it.
+ */
+static void
+index_remove(H_index* idx, C_block* cb)
+{
+	C_block** slot = index_slot_of(idx->slots, idx->cap, cb);
+	if (slot == NULL) slot = index_slot_of(idx->old, idx->old_cap, cb);
+	if (slot == NULL) return;
 
+	*slot = TOMBSTONE;
+	idx->live--;
+	index_migrate(idx, REHASH_STEP);
+}
+
+/*
+ * Takes <cb> out of its shard's recency list without freeing it.
+ */
+static void
+unlink_block(C_shard* s, C_block* cb)
+{
 	//fix following blocks
 	if (cb->next == NULL) {
-		//the block is at the end so update cache_end
-		cache_end = cb->prev;
+		//the block is at the end so update the shard's end
+		s->end = cb->prev;
 	} else {
 		//there's something after the block so update its prev
 		cb->next->prev = cb->prev;
@@ -113,40 +362,241 @@ free_cache_block(C_block* cb)
 	//fix previous blocks
 	if (cb->prev == NULL) {
 		//removing the first block
-		cache_start = cb->next;
+		s->start = cb->next;
 	} else {
 		//set the prev block, to cb's next
 		cb->prev->next = cb->next;
 	}
+}
+
+/*
+ * Puts <cb> at the start of its shard's recency list, marking it as the most
+ * recently used block.
+ */
+static void
+push_front(C_shard* s, C_block* cb)
+{
+	cb->prev = NULL;
+	cb->next = s->start;
+	if (s->start == NULL) {
+		//the shard was empty so this is also the last block
+		s->end = cb;
+	} else {
+		s->start->prev = cb;
+	}
+	s->start = cb;
+}
+
+/*
+ * Searches the cache for the complete cache block matching <host> and <path>.
+ *
+ * On a hit the block is moved to the start of the list since it's now the
+ * most recently used one. A complete block is never modified again, so the
+ * caller gets a reference to it and can read it without holding any lock.
+ * Every successful search must be paired with a call to release_cache().
+ *
+ * Returns a pointer to the cache block if successful, and NULL otherwise.
+ */
+C_block*
+search_cache(char *host, char *path)
+{
+	unsigned long hash = hash_key(host, path);
+	C_shard* s = shard_of(hash);
+
+	sem_wait(&s->lock);
+	C_block* ref = index_find(&s->index, hash, host, path);
+	if (ref == NULL || !ref->complete) {
+		sem_post(&s->lock);
+		return NULL;
+	}
+
+	if (ref != s->start) {
+		unlink_block(s, ref);
+		push_front(s, ref);
+	}
+	__atomic_add_fetch(&ref->refs, 1, __ATOMIC_RELAXED);
+	ref->used = time(NULL);
+	sem_post(&s->lock);
+	return ref;
+}
+
+/*
+ * Frees the chain of response segments starting at <r>.
+ */
+void
+free_response_block(R_block* r)
+{
+	while (r != NULL) {
+		R_block* next = r->next;
+		slab_free(r);
+		r = next;
+	}
+}
+
+/*
+ * Returns true if the response in <cb> has gone stale and has to be
+ * revalidated with the server before it's served again.
+ */
+int
+is_stale(C_block* cb)
+{
+	return time(NULL) >= __atomic_load_n(&cb->expires, __ATOMIC_RELAXED);
+}
 
-	cache_count--;
+/*
+ * Sets when the response in <cb> goes stale, as seconds since the epoch.
+ * This is the one thing that may change in a complete block, when the
+ * server tells us our copy is still good.
+ */
+void
+set_expiry(C_block* cb, long expires)
+{
+	if (expires < 0) expires = 0;
+	if (expires > UINT_MAX) expires = UINT_MAX;
+	__atomic_store_n(&cb->expires, (unsigned int) expires, __ATOMIC_RELAXED);
+}
 
-	long space_freed = cb->size;
-	cache_size -= space_freed;
-	free_response_block(cb->response);
-	free(cb);
+/*
+ * Takes another reference to the block <cb>, which the caller must already
+ * have one of.
+ */
+void
+hold_cache(C_block* cb)
+{
+	__atomic_add_fetch(&cb->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Drops a reference to the block <cb>. Once the block has been removed from
+ * the cache and the last reference is gone, its memory is freed.
+ */
+void
+release_cache(C_block* cb)
+{
+	if (__atomic_sub_fetch(&cb->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free_response_block(cb->response);
+		free_response_block(cb->variant);
+		intern_release(cb->host);
+		intern_release(cb->status);
+		intern_release(cb->c_type);
+		free(cb);
+	}
+}
+
+/*
+ * Removes <cb> from its shard and drops the cache's reference to it. The
+ * shard's lock must be held.
+ *
+ * Returns the amount of space gained.
+ */
+static long
+drop_block(C_shard* s, C_block* cb)
+{
+	if (!cb->linked) return 0;
+
+	index_remove(&s->index, cb);
+	unlink_block(s, cb);
+	cb->linked = 0;
+
+	long space_freed = cb->charge;
+	account(s, -space_freed, -1);
+	release_cache(cb);
+	return space_freed;
+}
+
+/*
+ * Removes the cache block <cb> from the cache. Anyone still holding a
+ * reference can keep reading it; the memory goes away with the last one.
+ *
+ * Returns the amount of space gained after removing the block.
+ */
+long
+free_cache_block(C_block* cb)
+{
+	if (cb == NULL) return 0;
+
+	C_shard* s = cb->shard;
+	sem_wait(&s->lock);
+	long space_freed = drop_block(s, cb);
+	sem_post(&s->lock);
 	return space_freed;
 }
 
 /*
- * Returns a pointer to the Least Recently Used cache block
+ * Evicts one Least Recently Used cache block.
+ *
+ * Each shard keeps its own recency list, so the shards take turns giving up
+ * the block at the end of their list. Blocks that are still being filled are
+ * skipped. If <report> isn't NULL it's called with the victim (and its shard
+ * locked) just before it's freed. The victim is then passed on to the hook
+ * given to set_spill(), if any.
+ *
+ * Returns the amount of space freed, or -1 if there was nothing to evict.
  */
-C_block*
-find_lru()
+long
+evict_lru(void (*report)(C_block*))
+{
+	unsigned int first = __atomic_fetch_add(&evict_next, 1, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		C_shard* s = &shards[(first + i) % CACHE_SHARDS];
+
+		sem_wait(&s->lock);
+		C_block* lru = s->end;
+		while (lru != NULL && !lru->complete) lru = lru->prev;
+		if (lru != NULL) {
+			if (report != NULL) report(lru);
+			if (spill != NULL) __atomic_add_fetch(&lru->refs, 1, __ATOMIC_RELAXED);
+			long space_freed = drop_block(s, lru);
+			__atomic_store_n(&s->evictions, s->evictions + 1, __ATOMIC_RELAXED);
+			sem_post(&s->lock);
+
+			if (spill != NULL) {
+				spill(lru);
+				release_cache(lru);
+			}
+			return space_freed;
+		}
+		sem_post(&s->lock);
+	}
+	return -1;
+}
+
+/*
+ * Collects every complete block in the cache, taking a reference to each.
+ * The blocks of each shard go from the least to the most recently used, so
+ * adding them back in this order restores their recency.
+ *
+ * Returns an array the caller has to free, after releasing the blocks in it,
+ * and sets <count> to its length. Returns NULL if we ran out of memory.
+ */
+C_block**
+collect_cache(int* count)
 {
-	//return if there's nothing in the cache
-	if (cache_start == NULL) return NULL;
+	int max = get_cache_count() + 64; //more may come in while we collect
+	C_block** blocks = malloc(max * sizeof(C_block*));
+	if (blocks == NULL) return NULL;
 
-	//set the first element as the minimum
-	C_block* min = cache_start;
-	C_block* curr = min->next;
+	int n = 0;
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		C_shard* s = &shards[i];
 
-	//while there is a next
-	while (curr != NULL) {
-		if (curr->lru < min->lru) min = curr;
-		curr = curr->next;
+		sem_wait(&s->lock);
+		for (C_block* cb = s->end; cb != NULL; cb = cb->prev) {
+			if (!cb->complete) continue;
+			if (n == max) {
+				C_block** more = realloc(blocks, max * 2 * sizeof(C_block*));
+				if (more == NULL) break;
+				blocks = more;
+				max *= 2;
+			}
+			__atomic_add_fetch(&cb->refs, 1, __ATOMIC_RELAXED);
+			blocks[n++] = cb;
+		}
+		sem_post(&s->lock);
 	}
-	return min;
+	*count = n;
+	return blocks;
 }
 
 /*
@@ -157,90 +607,227 @@ free_up(long nbytes)
 {
 	if (!could_fit(nbytes)) return 0;
 
-	long freed_space = 0;
-	while (freed_space < nbytes) {
-		C_block* lru = find_lru();
-		if (lru == NULL) return 0;
-		free_cache_block(lru);
+	while (!can_fit(nbytes)) {
+		if (evict_lru(NULL) == -1) return 0;
 	}
 	return 1;
 }
 
 /*
- * Creates a cache_block and adds it to the cache linked list. The body of the
- * response is stored in a response_block attached to the cache_block.
+ * Returns the memory taken up by the segments from <r> up to and including
+ * <last>.
+ */
+static long
+segment_charge(R_block* r, R_block* last)
+{
+	long charge = 0;
+	for (; r != NULL; r = r->next) {
+		charge += sizeof(R_block) + r->cap;
+		if (r == last) break;
+	}
+	return charge;
+}
+
+/*
+ * Copies the <nbytes> bytes at <text> to the end of the response of <cb>,
+ * adding segments as needed. Segments grow as the response does, so that a
+ * big response of unknown length only needs a handful of them.
+ *
+ * The segments added are linked onto <cb> by the caller; <last> is set to
+ * the last one.
+ *
+ * Returns the first new segment (NULL if none were needed, or <failed> is
+ * set if we ran out of memory).
+ */
+static R_block*
+fill_segments(R_block* end, const char* text, long nbytes, R_block** last, int* failed)
+{
+	R_block* first = NULL;
+	*last = end;
+	*failed = 0;
+
+	while (nbytes > 0) {
+		if (end == NULL || end->size == end->cap) {
+			//twice the last segment, but no less than what's left
+			long cap = end == NULL ? SLAB_MIN : end->cap * 2;
+			if (cap > slab_max()) cap = slab_max();
+			if (cap < nbytes) cap = nbytes;
+
+			R_block* r = slab_alloc(cap, 0);
+			if (r == NULL) {
+				free_response_block(first);
+				*failed = 1;
+				return NULL;
+			}
+			if (first == NULL) first = r;
+			else end->next = r;
+			end = r;
+			*last = r;
+		}
+
+		long n = end->cap - end->size < nbytes ? end->cap - end->size : nbytes;
+		memcpy(end->text + end->size, text, n);
+		end->size += n;
+		text += n;
+		nbytes -= n;
+	}
+	return first;
+}
+
+static C_block*
+insert_block(char *host, char *path, R_block* r_block, long nbytes, int status_no, char* status, int has_type, char* c_type);
+
+/*
+ * Creates a cache_block and adds it to the cache linked list. The <nbytes>
+ * bytes at <reference> are the start of the response, which is <total> bytes
+ * long in all, or -1 if we won't know until we've seen all of it. A known
+ * response is stored in one contiguous segment. Any older block with the same
+ * key is removed from the cache.
+ *
+ * The caller holds a reference to the new block and is the only one allowed
+ * to add to it. It isn't visible to searches (nor evicted) until
+ * finish_cache() is called on it.
  *
  * Returns a pointer to the cache_block if successfully allocated space.
  * Returns NULL if failed to allocate space, or the required space is too big
  * for the cache itself.
  */
 C_block*
-add_cache(char *host, char *path, char *reference, long nbytes, int status_no, char* status, int has_type, char* c_type)
+add_cache(char *host, char *path, char *reference, long nbytes, long total, int status_no, char* status, int has_type, char* c_type)
 {
-	//return if we couldn't allocate enough space
-	if (!can_fit(nbytes) && !free_up(nbytes)) return NULL;
+	//return if we couldn't allocate enough space for what we know of,
+	//metadata included
+	size_t path_size = strlen(path) + 1;
+	long need = (total >= nbytes ? total : nbytes) + sizeof(C_block) +
+		sizeof(R_block) + path_size;
+	if (!can_fit(need) && !free_up(need)) return NULL;
 
-	//allocate space for the response block
-	R_block* r_block = calloc(1, sizeof(R_block));
-	if (r_block == NULL) {
-		perror("Failed to allocate memory for cache's response block");
-		return NULL;
+	//allocate space for the response
+	R_block* r_block;
+	if (total >= nbytes) {
+		r_block = slab_alloc(total, 1);
+		if (r_block == NULL) return NULL;
+		memcpy(r_block->text, reference, nbytes);
+		r_block->size = nbytes;
+	} else {
+		int failed;
+		R_block* last;
+		r_block = fill_segments(NULL, reference, nbytes, &last, &failed);
+		if (failed) return NULL;
+		if (r_block == NULL && (r_block = slab_alloc(SLAB_MIN, 0)) == NULL) {
+			return NULL;
+		}
 	}
 
-	//allocate space for the response text
-	r_block->text = calloc(1, nbytes+1);
-	if (r_block->text == NULL) {
-		perror("Failed to allocate memory for response text");
-		free(r_block);
+	return insert_block(host, path, r_block, nbytes, status_no, status, has_type, c_type);
+}
+
+/*
+ * Adds a block for the response <r_block> (<nbytes> long, all of it already
+ * there) to the cache, like add_cache() does. The block takes over the
+ * response segments, which are freed if it can't be added.
+ *
+ * This is how responses kept somewhere else, like in a snapshot, are put
+ * back in the cache without copying them.
+ */
+C_block*
+adopt_cache(char *host, char *path, R_block* r_block, long nbytes, int status_no, char* status, int has_type, char* c_type)
+{
+	long need = segment_charge(r_block, NULL) + sizeof(C_block) + strlen(path) + 1;
+	if (!can_fit(need) && !free_up(need)) {
+		free_response_block(r_block);
 		return NULL;
 	}
+	return insert_block(host, path, r_block, nbytes, status_no, status, has_type, c_type);
+}
 
-	//allocate space for the cache block
-	C_block *c_block = calloc(1, sizeof(C_block));
+/*
+ * Creates the cache block for <r_block> and links it into its shard. See
+ * add_cache() for the rest.
+ */
+static C_block*
+insert_block(char *host, char *path, R_block* r_block, long nbytes, int status_no, char* status, int has_type, char* c_type)
+{
+	//allocate space for the cache block, path included
+	size_t path_size = strlen(path) + 1;
+	C_block *c_block = calloc(1, sizeof(C_block) + path_size);
 	if (c_block == NULL) {
 		perror("Failed to allocate memory for cache block");
-		free(r_block->text);
-		free(r_block);
+		free_response_block(r_block);
 		return NULL;
 	}
 
-	//copy the text to the response_text
-	memcpy(r_block->text, reference, nbytes);
-	r_block->size = nbytes;
-	r_block->next = NULL;
-
 	//setup cache block
-	strncpy(c_block->host, host, sizeof(c_block->host));
-	strncpy(c_block->path, path, sizeof(c_block->path));
+	memcpy(c_block->path, path, path_size);
+	c_block->host = intern(host);
+	c_block->status = intern(status);
+	c_block->c_type = intern(has_type ? c_type : "");
+	if (c_block->host == NULL || c_block->status == NULL || c_block->c_type == NULL) {
+		intern_release(c_block->host);
+		intern_release(c_block->status);
+		intern_release(c_block->c_type);
+		free_response_block(r_block);
+		free(c_block);
+		return NULL;
+	}
+	c_block->hash = hash_key(c_block->host, c_block->path);
+	c_block->shard = shard_of(c_block->hash);
 	c_block->response = r_block;
 	c_block->end = r_block;
-	c_block->lru = ++lru_count;
+	while (c_block->end->next != NULL) c_block->end = c_block->end->next;
 	c_block->size = nbytes;
+	c_block->charge = sizeof(C_block) + path_size + segment_charge(r_block, NULL);
+	c_block->refs = 2; //one for the cache and one for the caller
+	c_block->linked = 1;
 	c_block->status_no = status_no;
+	c_block->used = time(NULL);
 	c_block->has_type = has_type;
-	strcpy(c_block->status, status);
-	strcpy(c_block->c_type, c_type);
-	c_block->next = NULL;
 
-	cache_size += nbytes;
-	cache_count++;
+	C_shard* s = c_block->shard;
+	sem_wait(&s->lock);
 
-	if (cache_start == NULL) {
-		//adding to the start of cache
-		c_block->prev = NULL;
-		cache_start = c_block;
-	} else {
-		//add to end cache
-		c_block->prev = cache_end;
-		cache_end->next = c_block;
+	//the new response replaces whatever we had for this key before
+	C_block* stale = index_find(&s->index, c_block->hash, c_block->host, c_block->path);
+	if (stale != NULL) drop_block(s, stale);
+
+	//make sure lookups can find the block before linking it in
+	if (index_insert(&s->index, c_block) == -1) {
+		sem_post(&s->lock);
+		c_block->refs = 1;
+		release_cache(c_block);
+		return NULL;
 	}
-	cache_end = c_block;
+
+	account(s, c_block->charge, 1);
+
+	//a new block is the most recently used one
+	push_front(s, c_block);
+	sem_post(&s->lock);
 
 	return c_block;
 }
 
 /*
- * This adds another response block to the chain of response blocks at <cb>.
+ * Marks the block <cb> returned by add_cache() as complete, making it
+ * immutable and visible to searches, and drops the caller's reference.
+ *
+ * To give up on a block instead, call free_cache_block() and then
+ * release_cache() on it.
+ */
+void
+finish_cache(C_block* cb)
+{
+	C_shard* s = cb->shard;
+	sem_wait(&s->lock);
+	cb->complete = 1;
+	sem_post(&s->lock);
+	release_cache(cb);
+}
+
+/*
+ * This adds the next <nbytes> bytes of the response at <response> to <cb>.
+ * They go into the free space at the end of the last segment first, and
+ * into new segments when that runs out.
  *
  * Returns true if a fail occured and false otherwise.
  *
@@ -248,36 +835,215 @@ add_cache(char *host, char *path, char *reference, long nbytes, int status_no, c
  * an off chance that the total number size of the response (sum of all the
  * individual blocks) could exceed the maximum size of the cache (chunked
  * encoding means we don't know how many bytes to expect).
- * As a result, technically when we go to free the LRU, we could end up freeing
- * the cache_block that we are trying to add to.
  */
 int
 add_response_block(C_block *cb, char* response, long nbytes)
 {
-	int failed = 1;
-	//allocate space for response block
-	R_block* rb = calloc(1, sizeof(R_block));
-	if (rb == NULL) {
-		perror("Failed to allocate memory for additional response block");
-		return failed;
+	//only the filler writes to an incomplete block and nobody reads it, so
+	//the copying can be done without the lock
+	int failed;
+	R_block* last;
+	R_block* added = fill_segments(cb->end, response, nbytes, &last, &failed);
+	if (failed) return failed;
+	long charge = segment_charge(added, last);
+
+	C_shard* s = cb->shard;
+	sem_wait(&s->lock);
+	if (added != NULL) cb->end->next = added;
+	cb->end = last;
+	cb->size += nbytes;
+	cb->charge += charge;
+	//a block that was already removed doesn't count towards the cache
+	if (cb->linked) account(s, charge, 0);
+	sem_post(&s->lock);
+	return failed;
+}
+
+/*
+ * Overwrites the <nbytes> bytes of the response of <cb> from <offset> on
+ * with <text>, for filling in what wasn't known when the block was added.
+ * Like add_response_block(), only the filler of an incomplete block may do
+ * this.
+ */
+void
+patch_response(C_block* cb, long offset, const char *text, long nbytes)
+{
+	for (R_block* r = cb->response; r != NULL && nbytes > 0; r = r->next) {
+		if (offset >= r->size) {
+			offset -= r->size;
+			continue;
+		}
+		long n = r->size - offset < nbytes ? r->size - offset : nbytes;
+		memcpy(r->text + offset, text, n);
+		text += n;
+		nbytes -= n;
+		offset = 0;
 	}
+}
 
-	//allocate space for response text
-	rb->text = calloc(1, nbytes+1);
-	if (rb->text == NULL) {
-		perror("Failed to allocate memory for response text");
-		free(rb);
-		return failed;
+/*
+ * Gives the block <cb> the <nbytes> bytes at <text> as its variant: the same
+ * response in another encoding, see compress.c. The variant counts against
+ * the cache like the response does and goes away with the block. A block
+ * only ever gets one, and readers may pick it up as soon as it's there.
+ *
+ * Returns -1 if the block already has one or there's no room for it, 0
+ * otherwise.
+ */
+int
+add_variant(C_block* cb, const char *text, long nbytes)
+{
+	if (!can_fit(nbytes) && !free_up(nbytes)) return -1;
+
+	int failed;
+	R_block* last;
+	R_block* variant = fill_segments(NULL, text, nbytes, &last, &failed);
+	if (failed || variant == NULL) {
+		free_response_block(variant);
+		return -1;
 	}
-	memcpy(rb->text, response, nbytes);
-	rb->size = nbytes;
-	rb->next = NULL;
+	long charge = segment_charge(variant, last);
 
-	//add this block to the end of the cache block
-	cb->end->next = rb;
-	cb->size += nbytes;
-	cb->end = rb;
-	cache_size += nbytes;
-	return !failed;
+	C_shard* s = cb->shard;
+	sem_wait(&s->lock);
+	if (cb->variant != NULL) {
+		sem_post(&s->lock);
+		free_response_block(variant);
+		return -1;
+	}
+	cb->variant_size = nbytes;
+	__atomic_store_n(&cb->variant, variant, __ATOMIC_RELEASE);
+	cb->charge += charge;
+	if (cb->linked) account(s, charge, 0);
+	sem_post(&s->lock);
+	return 0;
+}
+
+/*
+ * Collects up to <max> complete blocks that haven't been looked up for
+ * <age> seconds and that the cold pass hasn't looked at yet, starting from
+ * the least recently used end of each shard, taking a reference to each.
+ * The blocks are marked as looked at.
+ *
+ * Returns an array the caller has to free, after releasing the blocks in it,
+ * and sets <count> to its length. Returns NULL if we ran out of memory.
+ */
+C_block**
+collect_cold(long age, int max, int* count)
+{
+	C_block** blocks = malloc(max * sizeof(C_block*));
+	if (blocks == NULL) return NULL;
+	unsigned int cutoff = time(NULL) - age;
+
+	int n = 0;
+	for (int i = 0; i < CACHE_SHARDS && n < max; i++) {
+		C_shard* s = &shards[i];
+		sem_wait(&s->lock);
+		for (C_block* cb = s->end; cb != NULL && n < max; cb = cb->prev) {
+			//the rest of the list was looked up even more recently
+			if (cb->used > cutoff) break;
+			if (!cb->complete || cb->cold) continue;
+			cb->cold = 1;
+			__atomic_add_fetch(&cb->refs, 1, __ATOMIC_RELAXED);
+			blocks[n++] = cb;
+		}
+		sem_post(&s->lock);
+	}
+	*count = n;
+	return blocks;
 }
 
+/*
+ * Replaces the complete block <old> with a new block for the same page,
+ * holding the <nbytes> bytes at <text> as its response and the
+ * <variant_size> bytes at <variant> as its variant (see add_variant()).
+ * <size> is the length of the whole response, which is more than <nbytes>
+ * if <packed> is true: then <text> is just the header, and the body is only
+ * kept in the variant (see cold.c). Everything else, the block's place in
+ * the recency list included, stays as it was.
+ *
+ * Returns the new block, which the caller holds a reference to, or NULL if
+ * <old> is no longer in the cache or we ran out of memory.
+ */
+C_block*
+repack_cache(C_block* old, const char *text, long nbytes, long size, const char *variant, long variant_size, int packed)
+{
+	int failed;
+	R_block* last;
+	R_block* response = fill_segments(NULL, text, nbytes, &last, &failed);
+	R_block* variant_last;
+	R_block* variant_r = failed ? NULL :
+		fill_segments(NULL, variant, variant_size, &variant_last, &failed);
+	size_t path_size = strlen(old->path) + 1;
+	C_block* cb = failed ? NULL : malloc(sizeof(C_block) + path_size);
+	if (cb == NULL) {
+		free_response_block(response);
+		free_response_block(variant_r);
+		return NULL;
+	}
+
+	memcpy(cb, old, sizeof(C_block) + path_size);
+	cb->host = intern(old->host);
+	cb->status = intern(old->status);
+	cb->c_type = intern(old->c_type);
+	cb->response = response;
+	cb->end = last;
+	cb->variant = variant_r;
+	cb->variant_size = variant_size;
+	cb->size = size;
+	cb->charge = sizeof(C_block) + path_size + segment_charge(response, NULL) +
+		segment_charge(variant_r, NULL);
+	cb->packed = packed;
+	cb->cold = packed;
+	cb->warmth = 0;
+	cb->refs = 2; //one for the cache and one for the caller
+	if (cb->host == NULL || cb->status == NULL || cb->c_type == NULL) {
+		cb->refs = 1;
+		release_cache(cb);
+		return NULL;
+	}
+
+	C_shard* s = old->shard;
+	sem_wait(&s->lock);
+	C_block** slot = index_slot_of(s->index.slots, s->index.cap, old);
+	if (slot == NULL) slot = index_slot_of(s->index.old, s->index.old_cap, old);
+	if (!old->linked || slot == NULL) {
+		sem_post(&s->lock);
+		cb->refs = 1;
+		release_cache(cb);
+		return NULL;
+	}
+
+	//the new block takes the old one's place everywhere
+	*slot = cb;
+	cb->prev = old->prev;
+	cb->next = old->next;
+	if (cb->prev == NULL) s->start = cb;
+	else cb->prev->next = cb;
+	if (cb->next == NULL) s->end = cb;
+	else cb->next->prev = cb;
+	cb->expires = old->expires;
+	cb->used = old->used;
+	old->linked = 0;
+	account(s, cb->charge - old->charge, 0);
+	sem_post(&s->lock);
+
+	//the cache's reference to the old block
+	release_cache(old);
+	return cb;
+}
+
+/*
+ * Frees a response built for one client out of views into cached blocks,
+ * like the ones from range_view() and cold_hit(), but not the cached text
+ * they point at.
+ */
+void
+free_view(R_block* view)
+{
+	while (view != NULL) {
+		R_block* next = view->next;
+		free(view);
+		view = next;
+	}
+}
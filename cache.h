@@ -2,30 +2,60 @@
 #define CACHE_H
 
 #define BYTESINMB 1048576 //how many bytes are in a megabyte
+#define CACHE_SHARDS 16 //number of independently locked parts of the cache
 
+/*
+ * A segment of a cached response, see slab.c.
+ */
 typedef struct R_block {
 	unsigned char *text;
-	long size;
+	long size;  //bytes of <text> in use
+	long cap;   //bytes <text> has room for
+	int class;  //size class the segment came from, -1 if exactly sized,
+	            //SLAB_WRAPPED if the text isn't ours to free
 	struct R_block* next; //NULL if complete
 } R_block;
 
+/*
+ * A cached response. The fields needed to look a block up and to keep it in
+ * recency order come first so that they share a cache line. The hostname,
+ * status text and content type are interned (see intern.c), and the path is
+ * stored inline with exactly as much room as it needs.
+ */
 typedef struct C_block {
-	char host[2048];
-	char path[2048];
+	unsigned long hash; //precomputed hash of (host, path), see hash_key()
+	const char* host;
+	struct C_block* prev; //more recently used block, NULL if at the start
+	struct C_block* next; //less recently used block, NULL if at the end
+	struct C_shard* shard; //the shard that owns this block
+	int refs;     //references held by the cache and by readers/fillers
+	unsigned char linked;   //true while the block is reachable through its shard
+	unsigned char complete; //true once the whole response has been added
+	unsigned char keep_alive; //true if the response lets the client send another request
+	unsigned char has_type;
+	unsigned char packed; //true if the body is only kept gzipped in <variant>, see cold.c
+	unsigned char cold;   //true once the cold pass has looked at the block
+	unsigned char warmth; //hits that had to unpack the body since it was packed
+
 	R_block *response;
-	int lru;
-	long size;
-	int status_no;
-	int has_type;
-	char status[256];
-	char c_type[256]; //content type
-	struct C_block* prev; //NULL
-	struct C_block* next; //NULL
 	R_block* end; //points to the last response block
+	R_block* variant; //the response gzipped, NULL if it has none (see compress.c)
+	long size;   //bytes of response
+	long variant_size; //bytes of <variant>
+	long charge; //bytes counted against the cache, metadata included
+	int status_no;
+	unsigned int expires; //when the response goes stale, in seconds since the epoch
+	unsigned int used;    //when the block was last looked up, ditto
+	const char* status;
+	const char* c_type; //content type
+	char path[];
 } C_block;
 
 void
-set_max_cache_size(int mb);
+init_cache(int mb);
+
+void
+set_spill(void (*hook)(C_block*));
 
 long
 get_current_cache_size();
@@ -33,32 +63,74 @@ get_current_cache_size();
 int
 get_cache_count();
 
+long
+get_eviction_count();
+
 int
 can_fit(long nbytes);
 
 int
 could_fit(long nbytes);
 
+unsigned long
+hash_key(const char *host, const char *path);
+
 C_block*
 search_cache(char *host, char *path);
 
+void
+hold_cache(C_block* cb);
+
+int
+is_stale(C_block* cb);
+
+void
+set_expiry(C_block* cb, long expires);
+
+void
+release_cache(C_block* cb);
+
 void
 free_response_block(R_block* r);
 
 long
 free_cache_block(C_block* cb);
 
-C_block*
-find_lru();
+long
+evict_lru(void (*report)(C_block*));
+
+C_block**
+collect_cache(int* count);
 
 int
 free_up(long nbytes);
 
 C_block*
-add_cache(char* host, char* path, char* reference, long nbytes, int status_no, char* status, int has_type, char* c_type);
+add_cache(char* host, char* path, char* reference, long nbytes, long total, int status_no, char* status, int has_type, char* c_type);
+
+C_block*
+adopt_cache(char* host, char* path, R_block* r_block, long nbytes, int status_no, char* status, int has_type, char* c_type);
+
+void
+finish_cache(C_block* cb);
 
 int
 add_response_block(C_block* c_block_ptr, char *response, long nbytes);
 
+void
+patch_response(C_block* cb, long offset, const char *text, long nbytes);
+
+int
+add_variant(C_block* cb, const char *text, long nbytes);
+
+C_block**
+collect_cold(long age, int max, int* count);
+
+C_block*
+repack_cache(C_block* old, const char *text, long nbytes, long size, const char *variant, long variant_size, int packed);
+
+void
+free_view(R_block* view);
+
 #endif
 
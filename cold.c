@@ -0,0 +1,268 @@
+/*
+ * Compressed storage of cold cached pages.
+ *
+ * With -cold, a background pass looks for pages that nobody has asked for
+ * in a while and keeps only their gzipped copy (the -comp variant if they
+ * have one, otherwise one made then): the cached response shrinks to its
+ * header, so the same memory holds more pages. A hit on a packed page gets
+ * the gzipped copy as is when the client accepts gzip, and otherwise has
+ * the body inflated just for it. A page that keeps getting hits like that
+ * is hot again, and is unpacked for good.
+ *
+ * Without a faster codec to hand, -coldfast trades some of the savings for
+ * speed by packing at zlib's fastest level instead.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "cache.h"
+#include "compress.h"
+#include "http.h"
+#include "slab.h"
+#include "cold.h"
+#include "log.h"
+
+static int enabled = 0;
+static long cold_age;  //seconds without a lookup before a page is packed
+static int cold_level; //zlib level pages are packed at
+static struct cold_stats stats; //only updated atomically
+
+
+/*
+ * Returns the CPU time the calling thread has used, in microseconds.
+ */
+static long
+cpu_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * Returns a copy of the <size> bytes in the segments from <r> on, which the
+ * caller has to free, or NULL if we ran out of memory.
+ */
+static char*
+flatten(R_block* r, long size)
+{
+	char* out = malloc(size > 0 ? size : 1);
+	if (out == NULL) return NULL;
+	for (long pos = 0; r != NULL; r = r->next) {
+		memcpy(out + pos, r->text, r->size);
+		pos += r->size;
+	}
+	return out;
+}
+
+/*
+ * Returns the length of the header of the response starting at the segment
+ * <r>, or -1 if it doesn't hold a whole header.
+ */
+static long
+header_length(R_block* r)
+{
+	H_parser parser;
+	http_init(&parser);
+	if (http_parse(&parser, (char*) r->text, r->size) != HTTP_DONE) return -1;
+	return parser.pos;
+}
+
+/*
+ * Packs the page in <cb>, if it has a body worth gzipping, by replacing it
+ * with a block that only keeps the header and the gzipped copy.
+ */
+static void
+pack(C_block* cb)
+{
+	long head = header_length(cb->response);
+	if (head == -1 || cb->status_no != 200) return;
+
+	//a -comp variant already is the gzipped copy we need
+	long len, raw, packed;
+	char* text;
+	R_block* variant = __atomic_load_n(&cb->variant, __ATOMIC_ACQUIRE);
+	if (variant != NULL) {
+		len = cb->variant_size;
+		raw = cb->size - head;
+		packed = len - header_length(variant);
+		text = flatten(variant, len);
+	} else {
+		text = gzip_response(cb, cold_level, &len, &raw, &packed);
+	}
+	if (text == NULL) return;
+
+	C_block* repacked = repack_cache(cb, (char*) cb->response->text, head, cb->size, text, len, 1);
+	free(text);
+	if (repacked == NULL) return;
+
+	__atomic_add_fetch(&stats.packed, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.raw_bytes, raw, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.packed_bytes, len, __ATOMIC_RELAXED);
+	if (variant != NULL) __atomic_add_fetch(&stats.reused, 1, __ATOMIC_RELAXED);
+	log_note(LOG_DEBUG, "[PRX packed cold page %s%s, %ld to %ld bytes]", cb->host, cb->path, raw, packed);
+	release_cache(repacked);
+}
+
+/*
+ * Body of the thread packing pages that have gone cold.
+ */
+static void*
+cold_main(void* arg)
+{
+	(void) arg;
+	for (;;) {
+		sleep(cold_age < COLD_INTERVAL ? cold_age : COLD_INTERVAL);
+
+		int count;
+		C_block** blocks = collect_cold(cold_age, COLD_BATCH, &count);
+		if (blocks == NULL) continue;
+		for (int i = 0; i < count; i++) {
+			pack(blocks[i]);
+			release_cache(blocks[i]);
+		}
+		free(blocks);
+	}
+	return NULL;
+}
+
+/*
+ * Starts packing pages that haven't been looked up for <age> seconds, at
+ * zlib's fastest level if <fast> is true.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int
+init_cold(long age, int fast)
+{
+	cold_age = age > 0 ? age : 1;
+	cold_level = fast ? Z_BEST_SPEED : COMPRESS_LEVEL;
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, cold_main, NULL) != 0) {
+		perror("ERROR: Couldn't start cold storage thread");
+		return -1;
+	}
+	pthread_detach(tid);
+	enabled = 1;
+	return 0;
+}
+
+int
+cold_enabled()
+{
+	return enabled;
+}
+
+/*
+ * Inflates the response of the packed block <cb>.
+ *
+ * Returns the whole response as a single segment of its own, to be freed
+ * with free_view(), or NULL if it couldn't be inflated.
+ */
+R_block*
+cold_unpack(C_block* cb)
+{
+	R_block* variant = __atomic_load_n(&cb->variant, __ATOMIC_ACQUIRE);
+	long skip = variant == NULL ? -1 : header_length(variant);
+	if (skip == -1) return NULL;
+
+	R_block* view = malloc(sizeof(R_block) + cb->size);
+	if (view == NULL) return NULL;
+	view->text = (unsigned char*) (view + 1);
+	view->size = cb->size;
+	view->cap = cb->size;
+	view->class = SLAB_WRAPPED;
+	view->next = NULL;
+
+	//the header is kept as is
+	long head = 0;
+	for (R_block* r = cb->response; r != NULL; r = r->next) {
+		memcpy(view->text + head, r->text, r->size);
+		head += r->size;
+	}
+
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 15 + 16) != Z_OK) {
+		free(view);
+		return NULL;
+	}
+	long started = cpu_us();
+	z.next_out = view->text + head;
+	z.avail_out = cb->size - head;
+
+	//the gzipped body starts after the variant's own header
+	int ret = Z_OK;
+	for (R_block* r = variant; r != NULL && ret == Z_OK; r = r->next) {
+		if (skip >= r->size) {
+			skip -= r->size;
+			continue;
+		}
+		z.next_in = r->text + skip;
+		z.avail_in = r->size - skip;
+		skip = 0;
+		ret = inflate(&z, Z_NO_FLUSH);
+	}
+	long body = z.total_out;
+	inflateEnd(&z);
+	__atomic_add_fetch(&stats.cpu_us, cpu_us() - started, __ATOMIC_RELAXED);
+
+	if (ret != Z_STREAM_END || head + body != cb->size) {
+		fprintf(stderr, "Failed to unpack %s%s\n", cb->host, cb->path);
+		free(view);
+		return NULL;
+	}
+	__atomic_add_fetch(&stats.unpacked, 1, __ATOMIC_RELAXED);
+	return view;
+}
+
+/*
+ * Counts a hit on the packed block <cb> by a client that doesn't take gzip,
+ * and unpacks the block for good once it has had COLD_PROMOTE of them,
+ * keeping the gzipped copy as its variant if <keep_variant> is true.
+ *
+ * Returns the response to send, see cold_unpack().
+ */
+R_block*
+cold_hit(C_block* cb, int keep_variant)
+{
+	R_block* view = cold_unpack(cb);
+	if (view == NULL) return NULL;
+	if (__atomic_add_fetch(&cb->warmth, 1, __ATOMIC_RELAXED) != COLD_PROMOTE) return view;
+
+	long grown = cb->size - (keep_variant ? 0 : cb->variant_size);
+	if (!can_fit(grown) && !free_up(grown)) return view;
+	char* variant = keep_variant ? flatten(cb->variant, cb->variant_size) : NULL;
+	if (keep_variant && variant == NULL) return view;
+
+	C_block* promoted = repack_cache(cb, (char*) view->text, cb->size, cb->size,
+			variant, keep_variant ? cb->variant_size : 0, 0);
+	free(variant);
+	if (promoted != NULL) {
+		__atomic_add_fetch(&stats.promoted, 1, __ATOMIC_RELAXED);
+		log_note(LOG_DEBUG, "[PRX unpacked hot page %s%s]", cb->host, cb->path);
+		release_cache(promoted);
+	}
+	return view;
+}
+
+void
+cold_get_stats(struct cold_stats *out)
+{
+	out->packed = __atomic_load_n(&stats.packed, __ATOMIC_RELAXED);
+	out->raw_bytes = __atomic_load_n(&stats.raw_bytes, __ATOMIC_RELAXED);
+	out->packed_bytes = __atomic_load_n(&stats.packed_bytes, __ATOMIC_RELAXED);
+	out->reused = __atomic_load_n(&stats.reused, __ATOMIC_RELAXED);
+	out->unpacked = __atomic_load_n(&stats.unpacked, __ATOMIC_RELAXED);
+	out->promoted = __atomic_load_n(&stats.promoted, __ATOMIC_RELAXED);
+	out->cpu_us = __atomic_load_n(&stats.cpu_us, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,36 @@
+#ifndef COLD_H
+#define COLD_H
+
+#define COLD_INTERVAL 5  //most seconds between passes over the cache
+#define COLD_BATCH 256   //most pages packed per pass
+#define COLD_PROMOTE 2   //hits that unpack a page before it's kept unpacked again
+
+struct C_block;
+struct R_block;
+
+struct cold_stats {
+	long packed;       //pages whose body was packed
+	long raw_bytes;    //bytes of those bodies before packing
+	long packed_bytes; //and after, headers of the gzipped copies included
+	long reused;       //pages packed by keeping their -comp variant only
+	long unpacked;     //hits and spills that had to unpack a body
+	long promoted;     //pages unpacked for good because they got hot again
+	long cpu_us;       //CPU time spent unpacking, in microseconds
+};
+
+int
+init_cold(long age, int fast);
+
+int
+cold_enabled();
+
+struct R_block*
+cold_unpack(struct C_block* cb);
+
+struct R_block*
+cold_hit(struct C_block* cb, int keep_variant);
+
+void
+cold_get_stats(struct cold_stats *stats);
+
+#endif
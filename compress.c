@@ -0,0 +1,277 @@
+/*
+ * Compressed variants of cached responses.
+ *
+ * With -comp, a cached response with a compressible content type is gzipped
+ * once, when it's added to the cache, and the result is kept alongside it
+ * as its variant (see add_variant()). Each hit then gets the variant if the
+ * client's Accept-Encoding allows it and the response as is otherwise, so
+ * both kinds of client are served from the same cache key. The variant says
+ * Vary: Accept-Encoding, so caches further down don't mix them up either.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "cache.h"
+#include "http.h"
+#include "project_4.h"
+#include "compress.h"
+#include "log.h"
+
+static struct compress_stats stats; //only updated atomically
+
+//content types that compress well, besides text/*
+static const char* COMPRESSIBLE[] = {
+	"application/json", "application/javascript", "application/x-javascript",
+	"application/xml", "application/xhtml+xml", "image/svg+xml", NULL
+};
+
+
+/*
+ * Returns true if bodies of the content type <c_type> are worth compressing.
+ */
+int
+compressible(const char *c_type)
+{
+	size_t len = strcspn(c_type, "; \t");
+	if (strncasecmp(c_type, "text/", 5) == 0) return 1;
+	if ((len > 5 && strncasecmp(c_type + len - 5, "+json", 5) == 0) ||
+			(len > 4 && strncasecmp(c_type + len - 4, "+xml", 4) == 0)) {
+		return 1;
+	}
+	for (int i = 0; COMPRESSIBLE[i] != NULL; i++) {
+		if (len == strlen(COMPRESSIBLE[i]) && strncasecmp(c_type, COMPRESSIBLE[i], len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns true if the Accept-Encoding field <accept> (NULL if the client
+ * didn't send one) lets us send a gzipped response.
+ */
+int
+accepts_gzip(const char *accept)
+{
+	if (accept == NULL) return 0;
+
+	int gzip = -1; //whether gzip is acceptable, -1 if it isn't listed
+	int any = 0;   //whether * is
+	const char* s = accept;
+	while (*s != '\0') {
+		while (*s == ' ' || *s == '\t' || *s == ',') s++;
+		const char* name = s;
+		size_t len = strcspn(s, ",; \t");
+		s += len;
+
+		//a q of 0 means not acceptable, anything else is fine by us
+		int ok = 1;
+		while (*s != '\0' && *s != ',') {
+			if (*s++ != ';') continue;
+			while (*s == ' ' || *s == '\t') s++;
+			if ((*s == 'q' || *s == 'Q') && s[1] == '=') ok = strtod(s + 2, NULL) > 0;
+		}
+
+		if ((len == 4 && strncasecmp(name, "gzip", 4) == 0) ||
+				(len == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+			gzip = ok;
+		} else if (len == 1 && *name == '*') {
+			any = ok;
+		}
+	}
+	return gzip != -1 ? gzip : any;
+}
+
+/*
+ * Writes the header of the gzipped variant of the response parsed by
+ * <parser> from <text> into <out>, which can hold <size> bytes. It's the
+ * original with the framing of the compressed body of <length> bytes, Vary
+ * including Accept-Encoding, and a weak ETag since the bytes differ.
+ *
+ * Returns the length of the header, or -1 if it didn't fit.
+ */
+static int
+variant_header(H_parser* parser, const char *text, long length, char* out, size_t size)
+{
+	H_view* start = parser->start;
+	int len = snprintf(out, size, "%.*s %.*s %.*s\r\n", start[0].len, text + start[0].off,
+			start[1].len, text + start[1].off, start[2].len, text + start[2].off);
+	int vary = 0;
+
+	for (int i = 0; i < parser->count && len < (int) size; i++) {
+		H_view name = parser->fields[i].name;
+		H_view value = parser->fields[i].value;
+
+		if (http_is(text, name, "Content-Length") || http_is(text, name, "Transfer-Encoding")) {
+			continue;
+		}
+		if (http_is(text, name, "Vary")) {
+			vary = 1;
+			if (!http_has_token(text, value, "Accept-Encoding")) {
+				len += snprintf(out + len, size - len, "Vary: %.*s, Accept-Encoding\r\n",
+						value.len, text + value.off);
+				continue;
+			}
+		}
+		if (http_is(text, name, "ETag") && value.len > 0 && text[value.off] == '"') {
+			len += snprintf(out + len, size - len, "ETag: W/%.*s\r\n", value.len, text + value.off);
+			continue;
+		}
+		len += snprintf(out + len, size - len, "%.*s: %.*s\r\n",
+				name.len, text + name.off, value.len, text + value.off);
+	}
+	if (len < (int) size) {
+		len += snprintf(out + len, size - len, "%sContent-Encoding: gzip\r\n"
+				"Content-Length: %ld\r\n\r\n", vary ? "" : "Vary: Accept-Encoding\r\n", length);
+	}
+	return len < (int) size ? len : -1;
+}
+
+/*
+ * Returns the CPU time the calling thread has used, in microseconds.
+ */
+static long
+cpu_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * Gzips the complete response in <cb> at zlib level <level> if it's worth
+ * it: a 200 with a compressible content type and a Content-Length, that
+ * isn't encoded already, allows it (no no-transform) and gets at least 10%
+ * smaller.
+ *
+ * Returns the gzipped response, header included, which the caller has to
+ * free, and sets <len> to its length and <raw> and <packed> to the length of
+ * the body before and after. Returns NULL if it isn't worth it.
+ */
+char*
+gzip_response(C_block* cb, int level, long* len, long* raw, long* packed)
+{
+	if (cb->status_no != 200 || !compressible(cb->c_type)) return NULL;
+
+	char* text = (char*) cb->response->text;
+	H_parser parser;
+	http_init(&parser);
+	if (http_parse(&parser, text, cb->response->size) != HTTP_DONE) return NULL;
+	struct response res;
+	long skip = parse_response(&parser, text, &res);
+	long body = cb->size - skip;
+	H_view* control = http_find(&parser, text, "Cache-Control");
+	if (res.chunked || !res.has_length || body < COMPRESS_MIN || body > COMPRESS_MAX ||
+			http_find(&parser, text, "Content-Encoding") != NULL ||
+			(control != NULL && http_has_token(text, *control, "no-transform"))) {
+		return NULL;
+	}
+
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return NULL;
+	}
+
+	//the compressed body goes after room for the header, which is moved
+	//right in front of it once we know how long the body is
+	long room = MAX_BUF + 256;
+	long bound = deflateBound(&z, body);
+	char* out = malloc(room + bound);
+	if (out == NULL) {
+		deflateEnd(&z);
+		return NULL;
+	}
+	long started = cpu_us();
+	z.next_out = (unsigned char*) out + room;
+	z.avail_out = bound;
+
+	//the body starts after the header, wherever that ends
+	long pos = skip;
+	int ret = Z_OK;
+	for (R_block* r = cb->response; r != NULL && ret == Z_OK; r = r->next) {
+		if (pos >= r->size) {
+			pos -= r->size;
+			continue;
+		}
+		z.next_in = r->text + pos;
+		z.avail_in = r->size - pos;
+		pos = 0;
+		ret = deflate(&z, Z_NO_FLUSH);
+	}
+	if (ret == Z_OK) ret = deflate(&z, Z_FINISH);
+	long gz = z.total_out;
+	deflateEnd(&z);
+	__atomic_add_fetch(&stats.cpu_us, cpu_us() - started, __ATOMIC_RELAXED);
+
+	int head_len = -1;
+	if (ret == Z_STREAM_END && gz < body - body / 10) {
+		head_len = variant_header(&parser, text, gz, out, room);
+	}
+	if (head_len == -1) {
+		free(out);
+		return NULL;
+	}
+	memmove(out + head_len, out + room, gz);
+	*len = head_len + gz;
+	*raw = body;
+	*packed = gz;
+	return out;
+}
+
+/*
+ * Gives the complete response in <cb> a gzipped variant if it's worth it,
+ * see gzip_response().
+ */
+void
+compress_cache(C_block* cb)
+{
+	long len, raw, packed;
+	char* out = gzip_response(cb, COMPRESS_LEVEL, &len, &raw, &packed);
+	if (out == NULL) return;
+
+	if (add_variant(cb, out, len) == 0) {
+		__atomic_add_fetch(&stats.compressed, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats.raw_bytes, raw, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats.gz_bytes, packed, __ATOMIC_RELAXED);
+		log_note(LOG_DEBUG, "[PRX compressed %ld to %ld bytes]", raw, packed);
+	}
+	free(out);
+}
+
+/*
+ * Returns the response to send from <cb> to a client whose Accept-Encoding
+ * field is <accept> (NULL if it didn't send one): the gzipped variant if
+ * there is one and the client takes gzip, and the response as is otherwise.
+ */
+R_block*
+choose_variant(C_block* cb, const char *accept)
+{
+	R_block* variant = __atomic_load_n(&cb->variant, __ATOMIC_ACQUIRE);
+	if (variant == NULL || !accepts_gzip(accept)) return cb->response;
+
+	__atomic_add_fetch(&stats.hits, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.sent, cb->variant_size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.saved, cb->size - cb->variant_size, __ATOMIC_RELAXED);
+	log_note(LOG_DEBUG, "[PRX sending gzip variant, %ld of %ld bytes]", cb->variant_size, cb->size);
+	return variant;
+}
+
+void
+compress_get_stats(struct compress_stats *out)
+{
+	out->compressed = __atomic_load_n(&stats.compressed, __ATOMIC_RELAXED);
+	out->raw_bytes = __atomic_load_n(&stats.raw_bytes, __ATOMIC_RELAXED);
+	out->gz_bytes = __atomic_load_n(&stats.gz_bytes, __ATOMIC_RELAXED);
+	out->cpu_us = __atomic_load_n(&stats.cpu_us, __ATOMIC_RELAXED);
+	out->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+	out->sent = __atomic_load_n(&stats.sent, __ATOMIC_RELAXED);
+	out->saved = __atomic_load_n(&stats.saved, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,39 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#define COMPRESS_MIN 1024        //smallest body worth compressing
+#define COMPRESS_MAX (16 << 20)  //biggest body compressed when it's cached
+#define COMPRESS_LEVEL 6         //zlib compression level
+
+struct C_block;
+struct R_block;
+
+struct compress_stats {
+	long compressed; //responses given a gzip variant
+	long raw_bytes;  //bytes of their bodies before compression
+	long gz_bytes;   //and after
+	long cpu_us;     //CPU time spent compressing, in microseconds
+	long hits;       //hits served from a gzip variant
+	long sent;       //bytes those hits sent
+	long saved;      //bytes they didn't have to send
+};
+
+int
+compressible(const char *c_type);
+
+int
+accepts_gzip(const char *accept);
+
+char*
+gzip_response(struct C_block* cb, int level, long* len, long* raw, long* packed);
+
+void
+compress_cache(struct C_block* cb);
+
+struct R_block*
+choose_variant(struct C_block* cb, const char *accept);
+
+void
+compress_get_stats(struct compress_stats *stats);
+
+#endif
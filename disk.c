@@ -0,0 +1,577 @@
+/*
+ * Second cache tier, on disk.
+ *
+ * Blocks evicted from memory, and responses too big to ever fit in it, are
+ * appended to segment files in a directory of their own. Only the index of
+ * what's where is kept in memory. Once the segment files take up more than
+ * the tier's size limit, the oldest one is deleted along with everything in
+ * it, so eviction never has to rewrite anything.
+ *
+ * Hits are sent straight from the segment file with sendfile(). An object
+ * that keeps getting hit is moved back into memory.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "cold.h"
+#include "intern.h"
+#include "disk.h"
+#include "stats.h"
+
+#define PROMOTE_CHUNK 65536 //bytes read per call when moving an object to memory
+
+typedef struct D_segment {
+	int id;
+	int fd;
+	long size;   //bytes reserved in the file so far
+	int refs;    //one while listed, plus one per reader and filler
+	int listed;  //false once the segment has been evicted
+	D_entry* entries; //everything stored in the segment
+	struct D_segment* next; //next newer segment
+} D_segment;
+
+struct D_fill {
+	D_segment* seg;
+	long offset;  //where the reserved space starts
+	long size;    //bytes reserved
+	long written;
+	int failed;
+	D_entry* e;   //published once the fill is done
+};
+
+//everything below is guarded by <lock>, bar the reference counts
+static sem_t lock;
+static char* dir = NULL; //NULL if the tier is disabled
+static long limit = 0;   //in bytes
+static long total = 0;   //bytes in all the segments
+static long seg_size = DISK_SEGMENT_SIZE; //bytes after which a segment is full
+static int next_id = 0;
+static D_segment* oldest = NULL;
+static D_segment* newest = NULL;
+static D_entry* table[DISK_BUCKETS]; //the index, by hash of the key
+static struct disk_stats stats;
+
+
+/*
+ * Sets up the tier to keep at most <mb> megabytes in segment files under
+ * the directory <path>, which is created if needed. Segment files left over
+ * from before are deleted since nothing knows what's in them.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int
+init_disk(const char *path, long mb)
+{
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+		perror("ERROR: Couldn't create the disk cache directory");
+		return -1;
+	}
+
+	DIR* d = opendir(path);
+	if (d == NULL) {
+		perror("ERROR: Couldn't open the disk cache directory");
+		return -1;
+	}
+	struct dirent* de;
+	char name[PATH_MAX];
+	while ((de = readdir(d)) != NULL) {
+		if (strncmp(de->d_name, "seg-", 4) == 0) {
+			snprintf(name, sizeof(name), "%s/%s", path, de->d_name);
+			unlink(name);
+		}
+	}
+	closedir(d);
+
+	sem_init(&lock, 0, 1);
+	dir = strdup(path);
+	limit = mb * BYTESINMB;
+	//evicting a segment shouldn't throw away too much of a small tier
+	if (limit / 8 < seg_size) seg_size = limit / 8;
+	set_spill(&disk_store);
+	return 0;
+}
+
+int
+disk_enabled()
+{
+	return dir != NULL;
+}
+
+/*
+ * Returns the bucket of the index for <hash>.
+ */
+static D_entry**
+bucket_of(unsigned long hash)
+{
+	return &table[hash % DISK_BUCKETS];
+}
+
+/*
+ * Drops a reference to the segment <seg>, closing its file with the last.
+ */
+static void
+seg_release(D_segment* seg)
+{
+	if (__atomic_sub_fetch(&seg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(seg->fd);
+		free(seg);
+	}
+}
+
+/*
+ * Drops a reference to the entry <e>, freeing it with the last.
+ */
+static void
+entry_release(D_entry* e)
+{
+	if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		intern_release(e->host);
+		intern_release(e->status);
+		intern_release(e->c_type);
+		free(e);
+	}
+}
+
+/*
+ * Takes <e> out of the index. The lock must be held.
+ */
+static void
+index_unlink(D_entry* e)
+{
+	if (!e->linked) return;
+
+	D_entry** link = bucket_of(e->hash);
+	while (*link != e) link = &(*link)->next;
+	*link = e->next;
+	e->linked = 0;
+}
+
+/*
+ * Returns the entry for <host><path> in the index, NULL otherwise. The lock
+ * must be held.
+ */
+static D_entry*
+index_find(unsigned long hash, const char *host, const char *path)
+{
+	for (D_entry* e = *bucket_of(hash); e != NULL; e = e->next) {
+		if (e->hash == hash && strcmp(e->host, host) == 0 &&
+				strcmp(e->path, path) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Adds <e> to the index, replacing any older entry for the same key. The
+ * lock must be held.
+ */
+static void
+index_link(D_entry* e)
+{
+	D_entry* old = index_find(e->hash, e->host, e->path);
+	if (old != NULL) index_unlink(old);
+
+	D_entry** bucket = bucket_of(e->hash);
+	e->next = *bucket;
+	*bucket = e;
+	e->linked = 1;
+}
+
+/*
+ * Deletes the oldest segment and forgets about everything in it. Anyone
+ * still reading from it can carry on, the file is only closed once they're
+ * done. The lock must be held.
+ */
+static void
+drop_oldest()
+{
+	D_segment* seg = oldest;
+	oldest = seg->next;
+	if (newest == seg) newest = NULL;
+
+	D_entry* e = seg->entries;
+	while (e != NULL) {
+		D_entry* next = e->seg_next;
+		if (e->linked) {
+			index_unlink(e);
+			stats.evictions++;
+		}
+		entry_release(e);
+		e = next;
+	}
+
+	char name[PATH_MAX];
+	snprintf(name, sizeof(name), "%s/seg-%d", dir, seg->id);
+	unlink(name);
+
+	total -= seg->size;
+	stats.bytes -= seg->size;
+	stats.segments--;
+	seg->listed = 0;
+	seg_release(seg);
+}
+
+/*
+ * Reserves <nbytes> at the end of the newest segment, starting a new one if
+ * it's full, and evicts old segments to stay within the size limit. The
+ * caller gets a reference to the segment, which is returned, and <offset>
+ * is set to where the space starts. The lock must be held.
+ *
+ * Returns NULL if a new segment file couldn't be created.
+ */
+static D_segment*
+reserve(long nbytes, long* offset)
+{
+	if (newest == NULL || (newest->size > 0 &&
+			newest->size + nbytes > seg_size)) {
+		char name[PATH_MAX];
+		snprintf(name, sizeof(name), "%s/seg-%d", dir, next_id);
+
+		D_segment* seg = calloc(1, sizeof(D_segment));
+		if (seg == NULL) return NULL;
+		seg->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (seg->fd == -1) {
+			perror("Failed to create disk cache segment");
+			free(seg);
+			return NULL;
+		}
+		seg->id = next_id++;
+		seg->refs = 1;
+		seg->listed = 1;
+		if (newest != NULL) newest->next = seg;
+		else oldest = seg;
+		newest = seg;
+		stats.segments++;
+	}
+
+	D_segment* seg = newest;
+	*offset = seg->size;
+	seg->size += nbytes;
+	total += nbytes;
+	stats.bytes += nbytes;
+	__atomic_add_fetch(&seg->refs, 1, __ATOMIC_RELAXED);
+
+	while (total > limit && oldest != seg) drop_oldest();
+	return seg;
+}
+
+/*
+ * Starts writing a <size> byte response for <host><path> to disk. The rest
+ * of the arguments describe it like they do for add_cache(), and <expires>
+ * is when it goes stale like in set_expiry(). The bytes are
+ * then given with disk_append() or disk_splice(), and the response becomes
+ * visible to lookups once disk_finish() is called.
+ *
+ * Returns NULL if the response can't be stored on disk.
+ */
+D_fill*
+disk_begin(const char *host, const char *path, long size, int status_no,
+		const char *status, int has_type, const char *c_type, int keep_alive, long expires)
+{
+	if (!disk_enabled() || size <= 0 || size > limit) return NULL;
+
+	size_t path_size = strlen(path) + 1;
+	D_fill* fill = calloc(1, sizeof(D_fill));
+	D_entry* e = calloc(1, sizeof(D_entry) + path_size);
+	if (fill == NULL || e == NULL) {
+		perror("Failed to allocate memory for disk cache entry");
+		free(fill);
+		free(e);
+		return NULL;
+	}
+
+	memcpy(e->path, path, path_size);
+	e->host = intern(host);
+	e->status = intern(status);
+	e->c_type = intern(has_type ? c_type : "");
+	e->hash = hash_key(host, path);
+	e->size = size;
+	e->status_no = status_no;
+	e->has_type = has_type;
+	e->keep_alive = keep_alive;
+	e->expires = expires < 0 ? 0 : expires > UINT_MAX ? UINT_MAX : expires;
+
+	sem_wait(&lock);
+	fill->seg = reserve(size, &fill->offset);
+	sem_post(&lock);
+
+	if (fill->seg == NULL || e->host == NULL || e->status == NULL || e->c_type == NULL) {
+		if (fill->seg != NULL) seg_release(fill->seg);
+		e->refs = 1;
+		entry_release(e);
+		free(fill);
+		return NULL;
+	}
+	fill->size = size;
+	fill->e = e;
+	return fill;
+}
+
+/*
+ * Writes the next <nbytes> bytes at <buf> of the response being stored by
+ * <fill>.
+ *
+ * Returns true if a fail occured and false otherwise.
+ */
+int
+disk_append(D_fill* fill, const char *buf, long nbytes)
+{
+	if (fill->failed || fill->written + nbytes > fill->size) {
+		fill->failed = 1;
+		return 1;
+	}
+
+	while (nbytes > 0) {
+		ssize_t n = pwrite(fill->seg->fd, buf, nbytes, fill->offset + fill->written);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) {
+			perror("Failed to write to disk cache segment");
+			fill->failed = 1;
+			return 1;
+		}
+		buf += n;
+		nbytes -= n;
+		fill->written += n;
+	}
+	return 0;
+}
+
+/*
+ * Moves the next <nbytes> bytes of the response being stored by <fill> from
+ * the pipe <pipe_fd> into its segment file, without reading them.
+ *
+ * Returns the number of bytes moved. Anything left in the pipe is up to the
+ * caller.
+ */
+long
+disk_splice(D_fill* fill, int pipe_fd, long nbytes)
+{
+	if (fill->failed || fill->written + nbytes > fill->size) {
+		fill->failed = 1;
+		return 0;
+	}
+
+	long moved = 0;
+	while (moved < nbytes) {
+		loff_t off = fill->offset + fill->written;
+		ssize_t n = splice(pipe_fd, NULL, fill->seg->fd, &off, nbytes - moved,
+				SPLICE_F_MOVE);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) {
+			fill->failed = 1;
+			break;
+		}
+		moved += n;
+		fill->written += n;
+	}
+	return moved;
+}
+
+/*
+ * Ends the fill <fill>, publishing the response if <ok> is true and all of
+ * it was written.
+ */
+void
+disk_finish(D_fill* fill, int ok)
+{
+	if (fill == NULL) return;
+
+	D_segment* seg = fill->seg;
+	D_entry* e = fill->e;
+
+	sem_wait(&lock);
+	if (ok && !fill->failed && fill->written == fill->size && seg->listed) {
+		e->seg = seg;
+		e->offset = fill->offset;
+		e->refs = 1; //the segment's
+		e->seg_next = seg->entries;
+		seg->entries = e;
+		index_link(e);
+		stats.stores++;
+		e = NULL;
+	}
+	sem_post(&lock);
+
+	if (e != NULL) {
+		e->refs = 1;
+		entry_release(e);
+	}
+	seg_release(seg);
+	free(fill);
+}
+
+/*
+ * Writes the cache block <cb> that was evicted from memory to disk. Used as
+ * the cache's spill hook.
+ */
+void
+disk_store(C_block* cb)
+{
+	if (!cb->complete) return;
+
+	D_fill* fill = disk_begin(cb->host, cb->path, cb->size, cb->status_no,
+			cb->status, cb->has_type, cb->c_type, cb->keep_alive, cb->expires);
+	if (fill == NULL) return;
+
+	//a packed block only has the header, the body has to be unpacked
+	R_block* view = cb->packed ? cold_unpack(cb) : NULL;
+	int failed = cb->packed && view == NULL;
+	for (R_block* r = view != NULL ? view : cb->response; r != NULL && !failed; r = r->next) {
+		failed = disk_append(fill, (char*) r->text, r->size);
+	}
+	free_view(view);
+	disk_finish(fill, !failed);
+}
+
+/*
+ * Looks for <host><path> on disk, counting a hit or a miss.
+ *
+ * Returns the entry, which must be given back with disk_release(), or NULL
+ * if it isn't there.
+ */
+D_entry*
+disk_lookup(const char *host, const char *path)
+{
+	if (!disk_enabled()) return NULL;
+
+	sem_wait(&lock);
+	D_entry* e = index_find(hash_key(host, path), host, path);
+	if (e != NULL) {
+		__atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&e->seg->refs, 1, __ATOMIC_RELAXED);
+		stats.hits++;
+	} else {
+		stats.misses++;
+	}
+	sem_post(&lock);
+	return e;
+}
+
+/*
+ * Sends the response stored in <e> to <fd> straight from the segment file.
+ *
+ * Returns -1 if sending failed, 0 otherwise.
+ */
+int
+disk_send(D_entry* e, int fd)
+{
+	off_t off = e->offset;
+	long left = e->size;
+
+	while (left > 0) {
+		ssize_t n = sendfile(fd, e->seg->fd, &off, left);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		stats_bytes(STAT_CLIENT_OUT, n);
+		left -= n;
+	}
+	return 0;
+}
+
+/*
+ * Counts a hit on <e>, and moves its response back into memory if that
+ * makes it popular enough and it would fit.
+ *
+ * Returns true if it was moved.
+ */
+int
+disk_promote(D_entry* e)
+{
+	sem_wait(&lock);
+	int promote = e->linked && ++e->hits >= DISK_PROMOTE && could_fit(e->size);
+	//make sure nobody else moves it at the same time
+	if (promote) index_unlink(e);
+	sem_post(&lock);
+	if (!promote) return 0;
+
+	char* buf = malloc(PROMOTE_CHUNK);
+	C_block* cb = NULL;
+	int failed = buf == NULL;
+	long done = 0;
+
+	while (!failed && done < e->size) {
+		long want = e->size - done < PROMOTE_CHUNK ? e->size - done : PROMOTE_CHUNK;
+		ssize_t n = pread(e->seg->fd, buf, want, e->offset + done);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) {
+			failed = 1;
+		} else if (cb == NULL) {
+			cb = add_cache((char*) e->host, e->path, buf, n, e->size, e->status_no,
+					(char*) e->status, e->has_type, (char*) e->c_type);
+			failed = cb == NULL;
+			if (cb != NULL) {
+				cb->keep_alive = e->keep_alive;
+				set_expiry(cb, e->expires);
+			}
+		} else {
+			failed = add_response_block(cb, buf, n);
+		}
+		if (n > 0) done += n;
+	}
+	free(buf);
+
+	if (cb != NULL && failed) {
+		free_cache_block(cb);
+		release_cache(cb);
+	} else if (cb != NULL) {
+		finish_cache(cb);
+	}
+
+	sem_wait(&lock);
+	if (!failed) {
+		stats.promotions++;
+	} else if (e->seg->listed && index_find(e->hash, e->host, e->path) == NULL) {
+		//it's still on disk, so keep serving it from there
+		index_link(e);
+	}
+	sem_post(&lock);
+	return !failed;
+}
+
+/*
+ * Returns true if the response in <e> has gone stale. Stale responses on
+ * disk aren't revalidated, they're fetched again.
+ */
+int
+disk_is_stale(D_entry* e)
+{
+	return time(NULL) >= e->expires;
+}
+
+/*
+ * Gives back the entry <e> returned by disk_lookup().
+ */
+void
+disk_release(D_entry* e)
+{
+	D_segment* seg = e->seg;
+	entry_release(e);
+	seg_release(seg);
+}
+
+void
+disk_get_stats(struct disk_stats *out)
+{
+	if (!disk_enabled()) {
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+	sem_wait(&lock);
+	*out = stats;
+	sem_post(&lock);
+}
@@ -0,0 +1,88 @@
+#ifndef DISK_H
+#define DISK_H
+
+#define DISK_BUCKETS 4096           //hash buckets of the on-disk index
+#define DISK_SEGMENT_SIZE (64 << 20) //most bytes written to a segment file before starting another
+#define DISK_SIZE 1024              //default size limit of the disk tier in MB
+#define DISK_PROMOTE 2              //disk hits before an object is moved back to memory
+
+struct C_block;
+struct D_segment;
+
+/*
+ * A response stored in one of the segment files. Like cache blocks, the
+ * strings are interned and the path is stored inline.
+ */
+typedef struct D_entry {
+	unsigned long hash; //see hash_key()
+	const char* host;
+	struct D_segment* seg; //the segment file holding the response
+	long offset; //where in the segment file the response starts
+	long size;
+	int refs;   //held by the segment and by readers
+	int hits;
+	unsigned char linked; //true while lookups can find the entry
+	unsigned char has_type;
+	unsigned char keep_alive;
+	int status_no;
+	unsigned int expires; //see C_block
+	const char* status;
+	const char* c_type;
+	struct D_entry* next;     //next entry in the same bucket
+	struct D_entry* seg_next; //next entry in the same segment
+	char path[];
+} D_entry;
+
+typedef struct D_fill D_fill;
+
+struct disk_stats {
+	long hits;       //lookups that found the object on disk
+	long misses;     //lookups that didn't
+	long stores;     //objects written to disk
+	long promotions; //objects moved back to memory
+	long evictions;  //objects dropped along with their segment
+	long segments;   //segment files in use
+	long bytes;      //bytes in those segment files
+};
+
+int
+init_disk(const char *dir, long mb);
+
+int
+disk_enabled();
+
+D_fill*
+disk_begin(const char *host, const char *path, long size, int status_no,
+		const char *status, int has_type, const char *c_type, int keep_alive, long expires);
+
+int
+disk_append(D_fill* fill, const char *buf, long nbytes);
+
+long
+disk_splice(D_fill* fill, int pipe_fd, long nbytes);
+
+void
+disk_finish(D_fill* fill, int ok);
+
+void
+disk_store(struct C_block* cb);
+
+D_entry*
+disk_lookup(const char *host, const char *path);
+
+int
+disk_send(D_entry* e, int fd);
+
+int
+disk_promote(D_entry* e);
+
+int
+disk_is_stale(D_entry* e);
+
+void
+disk_release(D_entry* e);
+
+void
+disk_get_stats(struct disk_stats *stats);
+
+#endif
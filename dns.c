@@ -0,0 +1,404 @@
+/*
+ * Cache of resolved hostnames.
+ *
+ * Resolving a hostname used to mean a blocking getaddrinfo() on every miss.
+ * Now the addresses are remembered for a while (failures too, for a shorter
+ * while). Once an entry expires it's still served for up to DNS_STALE
+ * seconds while a background thread resolves the hostname again, so only
+ * the very first request for a hostname waits on the resolver.
+ *
+ * Entries loaded from a hosts file with dns_load_hosts() never expire, and
+ * the resolver itself can be swapped out with dns_set_resolver(), which
+ * makes it easy to run without any network.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "cache.h"
+#include "time.h"
+#include "dns.h"
+
+typedef struct D_entry {
+	char* name;
+	D_addr addrs[DNS_MAX_ADDRS];
+	int count;      //number of addresses, 0 if the lookup failed
+	int error;      //getaddrinfo() error code if the lookup failed
+	time_t expires;
+	int permanent;  //true if it came from the hosts file
+	int refreshing; //true while a background refresh is running
+	struct D_entry* next;
+} D_entry;
+
+typedef struct D_bucket {
+	sem_t lock;
+	D_entry* entries;
+} D_bucket;
+
+static int system_resolver(const char *name, D_addr *out, int max);
+
+static D_bucket buckets[DNS_BUCKETS];
+static int dns_ttl = DNS_TTL;
+static dns_resolver resolver = &system_resolver;
+static struct dns_stats stats; //only ever updated atomically
+
+
+/*
+ * The default resolver, which asks getaddrinfo().
+ */
+static int
+system_resolver(const char *name, D_addr *out, int max)
+{
+	struct addrinfo hints, *res, *res0;
+	int error;
+	int n = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((error = getaddrinfo(name, NULL, &hints, &res0)) != 0) {
+		return error < 0 ? error : -error;
+	}
+
+	for (res = res0; res != NULL && n < max; res = res->ai_next) {
+		if (res->ai_addrlen > sizeof(out[n].addr)) continue;
+		out[n].family = res->ai_family;
+		out[n].socktype = res->ai_socktype;
+		out[n].protocol = res->ai_protocol;
+		out[n].len = res->ai_addrlen;
+		memcpy(&out[n].addr, res->ai_addr, res->ai_addrlen);
+		n++;
+	}
+	freeaddrinfo(res0);
+	return n > 0 ? n : EAI_NONAME;
+}
+
+/*
+ * Sets up the cache so that resolved hostnames are fresh for <ttl> seconds.
+ */
+void
+init_dns(int ttl)
+{
+	dns_ttl = ttl;
+	for (int i = 0; i < DNS_BUCKETS; i++) {
+		sem_init(&buckets[i].lock, 0, 1);
+		buckets[i].entries = NULL;
+	}
+}
+
+/*
+ * Replaces the function used to resolve hostnames that aren't cached.
+ */
+void
+dns_set_resolver(dns_resolver r)
+{
+	resolver = r;
+}
+
+static D_bucket*
+bucket_of(const char *name)
+{
+	return &buckets[hash_key(name, "") % DNS_BUCKETS];
+}
+
+/*
+ * Returns the entry for <name> in bucket <b>, creating it if <create> is
+ * true. Entries that have been expired for longer than we'd serve them are
+ * thrown out on the way. The bucket's lock must be held.
+ */
+static D_entry*
+find_entry(D_bucket* b, const char *name, int create)
+{
+	time_t now = time(NULL);
+	D_entry** ep = &b->entries;
+
+	while (*ep != NULL) {
+		D_entry* e = *ep;
+		if (strcmp(e->name, name) == 0) return e;
+
+		if (!e->permanent && !e->refreshing && now > e->expires + DNS_STALE) {
+			*ep = e->next;
+			free(e->name);
+			free(e);
+			continue;
+		}
+		ep = &e->next;
+	}
+	if (!create) return NULL;
+
+	D_entry* e = calloc(1, sizeof(D_entry));
+	if (e == NULL) return NULL;
+	e->name = strdup(name);
+	if (e->name == NULL) {
+		free(e);
+		return NULL;
+	}
+	e->next = b->entries;
+	b->entries = e;
+	return e;
+}
+
+/*
+ * Copies the <n> addresses <addrs> into <out> (which holds <max> of them)
+ * with the port set to <port>.
+ *
+ * Returns the number of addresses copied.
+ */
+static int
+copy_addrs(D_addr *addrs, int n, const char *port, D_addr *out, int max)
+{
+	unsigned short p = htons((unsigned short) atoi(port));
+
+	if (n > max) n = max;
+	for (int i = 0; i < n; i++) {
+		out[i] = addrs[i];
+		if (out[i].family == AF_INET) {
+			((struct sockaddr_in*) &out[i].addr)->sin_port = p;
+		} else if (out[i].family == AF_INET6) {
+			((struct sockaddr_in6*) &out[i].addr)->sin6_port = p;
+		}
+	}
+	return n;
+}
+
+/*
+ * Copies the addresses of <e> into <out> like copy_addrs().
+ *
+ * Returns the number of addresses copied, or the lookup's error code if it
+ * failed.
+ */
+static int
+copy_out(D_entry* e, const char *port, D_addr *out, int max)
+{
+	if (e->count == 0) return e->error;
+	return copy_addrs(e->addrs, e->count, port, out, max);
+}
+
+/*
+ * Asks the resolver about <name>, keeping track of how long that took.
+ */
+static int
+lookup(const char *name, D_addr *addrs, int max)
+{
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	int n = resolver(name, addrs, max);
+	gettimeofday(&end, NULL);
+
+	long us = 1000000 * (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec);
+	__atomic_add_fetch(&stats.lookups, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.lookup_us, us, __ATOMIC_RELAXED);
+	if (n <= 0) __atomic_add_fetch(&stats.failures, 1, __ATOMIC_RELAXED);
+	return n;
+}
+
+/*
+ * Remembers the result <n> of looking up <e>'s hostname. The bucket's lock
+ * must be held.
+ */
+static void
+store(D_entry* e, D_addr *addrs, int n)
+{
+	if (n > 0) {
+		memcpy(e->addrs, addrs, n * sizeof(D_addr));
+		e->count = n;
+		e->error = 0;
+		e->expires = time(NULL) + dns_ttl;
+	} else {
+		e->count = 0;
+		e->error = n;
+		e->expires = time(NULL) + DNS_NEG_TTL;
+	}
+}
+
+/*
+ * The main function of a background refresh of the hostname <arg>. A failed
+ * refresh leaves the old addresses in place until they get too stale.
+ */
+static void*
+refresh_main(void* arg)
+{
+	char* name = (char*) arg;
+	D_addr addrs[DNS_MAX_ADDRS];
+	int n = lookup(name, addrs, DNS_MAX_ADDRS);
+
+	D_bucket* b = bucket_of(name);
+	sem_wait(&b->lock);
+	D_entry* e = find_entry(b, name, 0);
+	if (e != NULL) {
+		if (n > 0) store(e, addrs, n);
+		e->refreshing = 0;
+	}
+	sem_post(&b->lock);
+	free(name);
+	return NULL;
+}
+
+/*
+ * Starts refreshing the entry <e> in the background. The bucket's lock must
+ * be held.
+ */
+static void
+start_refresh(D_entry* e)
+{
+	char* name = strdup(e->name);
+	pthread_t thread_id;
+	pthread_attr_t attr;
+
+	if (name == NULL) return;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread_id, &attr, &refresh_main, name) == 0) {
+		e->refreshing = 1;
+	} else {
+		free(name);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Looks <name> up in the cache without ever waiting on the resolver, like
+ * dns_resolve() does otherwise. An expired entry is still answered with
+ * while it's being refreshed in the background.
+ *
+ * Returns the number of addresses found, a negative getaddrinfo() error code
+ * if the hostname is known not to resolve, or 0 if we'll have to ask the
+ * resolver.
+ */
+int
+dns_cached(const char *name, const char *port, D_addr *out, int max)
+{
+	D_bucket* b = bucket_of(name);
+	time_t now = time(NULL);
+	int n = 0;
+
+	sem_wait(&b->lock);
+	D_entry* e = find_entry(b, name, 0);
+	if (e != NULL && (e->permanent || now < e->expires)) {
+		__atomic_add_fetch(e->count > 0 ? &stats.hits : &stats.neg_hits, 1,
+				__ATOMIC_RELAXED);
+		n = copy_out(e, port, out, max);
+	} else if (e != NULL && e->count > 0 && now < e->expires + DNS_STALE) {
+		__atomic_add_fetch(&stats.stale_hits, 1, __ATOMIC_RELAXED);
+		if (!e->refreshing) start_refresh(e);
+		n = copy_out(e, port, out, max);
+	}
+	sem_post(&b->lock);
+	return n;
+}
+
+/*
+ * Resolves <name>, putting up to <max> of its addresses (with their port set
+ * to <port>) into <out>.
+ *
+ * Returns the number of addresses found, or a negative getaddrinfo() error
+ * code (see gai_strerror()) if the hostname couldn't be resolved.
+ */
+int
+dns_resolve(const char *name, const char *port, D_addr *out, int max)
+{
+	int n = dns_cached(name, port, out, max);
+	if (n != 0) return n;
+
+	//never seen it (or not for a long time), so we have to wait
+	D_bucket* b = bucket_of(name);
+	D_addr addrs[DNS_MAX_ADDRS];
+	n = lookup(name, addrs, DNS_MAX_ADDRS);
+
+	sem_wait(&b->lock);
+	D_entry* e = find_entry(b, name, 1);
+	if (e == NULL) {
+		//couldn't remember it, but we can still answer
+		sem_post(&b->lock);
+		return n > 0 ? copy_addrs(addrs, n, port, out, max) : n;
+	}
+	if (!e->permanent) store(e, addrs, n);
+	n = copy_out(e, port, out, max);
+	sem_post(&b->lock);
+	return n;
+}
+
+/*
+ * Loads the hosts file at <path> ("address hostname..." per line, # starts
+ * a comment). The hostnames it lists always resolve to those addresses.
+ *
+ * Returns the number of hostnames loaded, or -1 if the file couldn't be read.
+ */
+int
+dns_load_hosts(const char *path)
+{
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		perror("ERROR: couldn't open hosts file");
+		return -1;
+	}
+
+	char line[1024];
+	int loaded = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char* comment = strchr(line, '#');
+		if (comment != NULL) *comment = '\0';
+
+		char* save;
+		char* ip = strtok_r(line, " \t\r\n", &save);
+		if (ip == NULL) continue;
+
+		D_addr a;
+		memset(&a, 0, sizeof(a));
+		a.socktype = SOCK_STREAM;
+		struct sockaddr_in* v4 = (struct sockaddr_in*) &a.addr;
+		struct sockaddr_in6* v6 = (struct sockaddr_in6*) &a.addr;
+		if (inet_pton(AF_INET, ip, &v4->sin_addr) == 1) {
+			a.family = v4->sin_family = AF_INET;
+			a.len = sizeof(struct sockaddr_in);
+		} else if (inet_pton(AF_INET6, ip, &v6->sin6_addr) == 1) {
+			a.family = v6->sin6_family = AF_INET6;
+			a.len = sizeof(struct sockaddr_in6);
+		} else {
+			fprintf(stderr, "Skipping bad address in hosts file: %s\n", ip);
+			continue;
+		}
+
+		char* name;
+		while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+			D_bucket* b = bucket_of(name);
+			sem_wait(&b->lock);
+			D_entry* e = find_entry(b, name, 1);
+			if (e != NULL) {
+				if (!e->permanent) e->count = 0;
+				if (e->count < DNS_MAX_ADDRS) e->addrs[e->count++] = a;
+				e->permanent = 1;
+				e->error = 0;
+				loaded++;
+			}
+			sem_post(&b->lock);
+		}
+	}
+	fclose(f);
+	return loaded;
+}
+
+/*
+ * Copies the cache's counters into <out>.
+ */
+void
+dns_get_stats(struct dns_stats *out)
+{
+	out->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+	out->stale_hits = __atomic_load_n(&stats.stale_hits, __ATOMIC_RELAXED);
+	out->neg_hits = __atomic_load_n(&stats.neg_hits, __ATOMIC_RELAXED);
+	out->lookups = __atomic_load_n(&stats.lookups, __ATOMIC_RELAXED);
+	out->failures = __atomic_load_n(&stats.failures, __ATOMIC_RELAXED);
+	out->lookup_us = __atomic_load_n(&stats.lookup_us, __ATOMIC_RELAXED);
+}
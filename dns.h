@@ -0,0 +1,57 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <sys/socket.h>
+
+#define DNS_BUCKETS 64    //hash buckets of the resolved address cache
+#define DNS_MAX_ADDRS 8   //addresses kept per hostname
+#define DNS_TTL 60        //default seconds a resolved hostname is fresh for
+#define DNS_NEG_TTL 10    //seconds a failed lookup is remembered for
+#define DNS_STALE 300     //seconds an expired entry may still be served
+
+/*
+ * One address a hostname resolved to, ready to be handed to socket() and
+ * connect(). The port is filled in when the address is handed out.
+ */
+typedef struct D_addr {
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t len;
+	struct sockaddr_storage addr;
+} D_addr;
+
+/*
+ * A resolver puts up to <max> addresses for <name> into <out>. It returns
+ * how many it found, or a negative getaddrinfo() error code.
+ */
+typedef int (*dns_resolver)(const char *name, D_addr *out, int max);
+
+struct dns_stats {
+	long hits;        //answered from a fresh entry
+	long stale_hits;  //answered from an expired entry being refreshed
+	long neg_hits;    //answered with a remembered failure
+	long lookups;     //calls to the resolver
+	long failures;    //lookups that failed
+	long lookup_us;   //total microseconds spent in the resolver
+};
+
+void
+init_dns(int ttl);
+
+void
+dns_set_resolver(dns_resolver resolver);
+
+int
+dns_load_hosts(const char *path);
+
+int
+dns_cached(const char *name, const char *port, D_addr *out, int max);
+
+int
+dns_resolve(const char *name, const char *port, D_addr *out, int max);
+
+void
+dns_get_stats(struct dns_stats *stats);
+
+#endif
@@ -0,0 +1,1171 @@
+/*
+ * The epoll engine (-engine epoll).
+ *
+ * Instead of a thread per connection, a small fixed number of event loop
+ * threads share the listening socket. Every connection is non-blocking and
+ * carries its own little state machine:
+ *
+ *   REQUEST --> HIT ------------------------------------------> done
+ *           \-> REPLY ----------------------------------------> done
+ *           \-> FOLLOW ---------------------------------------> done
+ *           \-> (RESOLVE -->) CONNECT --> FORWARD --> RELAY --> done
+ *
+ * REQUEST reads and parses the client's request, HIT streams a cached block
+ * back, REPLY sends a reply the proxy made up itself (the stats), RESOLVE
+ * waits for a thread to look up a hostname the DNS cache doesn't know yet,
+ * CONNECT waits for the connection to the server, FORWARD sends it our
+ * request and RELAY passes the response on to the client (filling the cache
+ * as it goes). A miss for a page another request is already fetching goes
+ * to FOLLOW instead, and is sent that request's response as it comes in
+ * (see flight.c). The cache, parsers and logging are the same ones the
+ * threads use.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include "dns.h"
+#include "network.h"
+#include "cache.h"
+#include "flight.h"
+#include "http.h"
+#include "project_4.h"
+#include "pool.h"
+#include "refresh.h"
+#include "range.h"
+#include "compress.h"
+#include "event.h"
+#include "log.h"
+#include "stats.h"
+
+enum state { REQUEST, HIT, REPLY, FOLLOW, RESOLVE, CONNECT, FORWARD, RELAY, DONE };
+
+struct loop {
+	int epfd;
+	int listener;
+	int listening; //true while the listener is in our epoll set
+	int wakefd;    //eventfd the lookup threads signal once they are done, and
+	               //the fetches we follow whenever they move on
+	struct lookup* resolved; //finished lookups, pushed atomically
+	int flights_grown; //true once a fetch we follow has more for us, set atomically
+	struct conn* followers; //connections in FOLLOW
+	struct conn* dead; //connections closed during the current batch
+	char scratch[MAX_BUF]; //where requests are read into
+};
+
+/*
+ * A hostname being resolved for a connection by a thread of its own, so that
+ * the event loop never waits on the resolver. The thread hands it back to
+ * the connection's loop once it's done, see finish_lookups().
+ */
+struct lookup {
+	struct loop* loop;
+	struct conn* c; //NULL if the connection was closed in the meantime
+	char name[NI_MAXHOST];
+	char port[NI_MAXSERV];
+	D_addr addrs[DNS_MAX_ADDRS];
+	int n; //what dns_resolve() returned
+	struct lookup* next;
+};
+
+/*
+ * Everything we need to know about one client connection. Buffers are only
+ * allocated once the connection gets to the state that needs them, so an
+ * idle connection costs little more than this structure.
+ */
+struct conn {
+	struct loop* loop;
+	enum state state;
+	int fd;  //client socket
+	int srv; //server socket, -1 if we don't have one
+	char hoststr[NI_MAXHOST]; //readable client address
+	char portstr[NI_MAXSERV]; //readable client port
+	struct timeval start;
+
+	char* in;    //the request so far, if it spans several reads
+	long in_len;
+	H_parser parser; //the request's header, then the response's
+	struct request* req;
+
+	C_block* hit;     //cache block we're serving from
+	C_block* stale;   //stale cache block we're asking the server about
+	R_block* view;    //the parts of <hit> a Range field asked for, see range_view()
+	R_block* r_block; //response block we're up to
+	long r_off;       //bytes of <r_block> already sent
+
+	char* name;     //host and port of the server
+	char* port;
+	int reused;     //true if the server connection came from the pool
+	struct lookup* lookup; //the server's hostname being resolved, if it is
+	struct timeval connect_start; //when we started connecting to the server
+
+	F_entry* flight;  //the fetch we lead or follow, see flight.c
+	F_reader reader;  //our place in <flight> if we follow it
+	int following;    //true if we follow <flight>
+	struct conn* prev_follower; //neighbours in the loop's <followers>
+	struct conn* next_follower;
+
+	char* buf;      //bytes waiting to be sent to the server or the client
+	long buf_len;
+	long buf_off;
+	struct response* res;
+	int parsed;     //true once we've seen the response header
+	H_chunked chunks; //decoder following a chunked body
+	long length_at; //where the length goes in a de-chunked <fill>, or -1
+	long bytes_left; //body bytes still expected, if the length is known
+	int body_done;  //true once we've received the whole response
+	C_block* fill;  //cache block we're adding the response to
+	int failed;
+
+	struct conn* next_dead;
+};
+
+/*
+ * Packs <c> and which of its sockets an event is for into the event data.
+ * Connections are at least 8 byte aligned so the bottom bit is free. The
+ * listener is registered with 0 and the loop's eventfd with 1.
+ */
+static uint64_t
+tag(struct conn* c, int server)
+{
+	return (uint64_t) (uintptr_t) c | (server ? 1 : 0);
+}
+
+/*
+ * Sets the events we are interested in for socket <fd> of connection <c>.
+ */
+static void
+watch(struct conn* c, int fd, uint32_t events)
+{
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.u64 = tag(c, fd == c->srv);
+	if (epoll_ctl(c->loop->epfd, EPOLL_CTL_MOD, fd, &ev) == -1 && errno == ENOENT) {
+		epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+/*
+ * Puts the listener back in the loop's epoll set if we are allowed to take
+ * on more connections.
+ */
+static void
+resume_accepting(struct loop* l)
+{
+	if (l->listening) return;
+	if (opt.max_conn > 0 &&
+			__atomic_load_n(&thread_count, __ATOMIC_RELAXED) >= opt.max_conn) {
+		return;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.u64 = 0;
+	if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->listener, &ev) == 0) {
+		l->listening = 1;
+	}
+}
+
+/*
+ * Lets go of the fetch the connection <c> leads or follows, if any. A leader
+ * finishes it, <keep_alive> being whether the clients can carry on after the
+ * response (see flight_finish()), and a follower leaves it.
+ */
+static void
+end_flight(struct conn* c, int keep_alive)
+{
+	if (c->flight == NULL) return;
+
+	if (c->following) {
+		flight_leave(c->flight, &c->reader);
+		if (c->prev_follower != NULL) c->prev_follower->next_follower = c->next_follower;
+		else c->loop->followers = c->next_follower;
+		if (c->next_follower != NULL) c->next_follower->prev_follower = c->prev_follower;
+		c->following = 0;
+	} else {
+		flight_finish(c->flight, keep_alive);
+	}
+	flight_release(c->flight);
+	c->flight = NULL;
+}
+
+/*
+ * Closes the connection <c> and its server socket, giving back any cache
+ * blocks it holds. The memory is only freed at the end of the current batch
+ * of events, since later events in the batch may still point at it.
+ */
+static void
+close_conn(struct conn* c)
+{
+	if (c->state == DONE) return;
+
+	//a lookup still running is freed once it's done
+	if (c->lookup != NULL) c->lookup->c = NULL;
+	end_flight(c, 0);
+	free_view(c->view);
+	if (c->hit != NULL) release_cache(c->hit);
+	if (c->stale != NULL) release_cache(c->stale);
+	if (c->fill != NULL) {
+		//we never got the whole response
+		free_cache_block(c->fill);
+		release_cache(c->fill);
+	}
+
+	close(c->fd);
+	log_note(LOG_DEBUG, "[CLI disconnected]");
+	if (c->srv != -1) {
+		close(c->srv);
+		log_note(LOG_DEBUG, "[SRV disconnected]");
+	}
+
+	c->state = DONE;
+	c->next_dead = c->loop->dead;
+	c->loop->dead = c;
+	__atomic_sub_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+	resume_accepting(c->loop);
+}
+
+/*
+ * Frees the connections closed during the last batch of events.
+ */
+static void
+bury_dead(struct loop* l)
+{
+	while (l->dead != NULL) {
+		struct conn* c = l->dead;
+		l->dead = c->next_dead;
+		free(c->in);
+		free(c->req);
+		free(c->buf);
+		free(c->res);
+		free(c->name);
+		free(c->port);
+		free(c);
+	}
+}
+
+/*
+ * Accepts every pending connection on the listener.
+ */
+static void
+accept_clients(struct loop* l)
+{
+	while (1) {
+		if (opt.max_conn > 0 &&
+				__atomic_load_n(&thread_count, __ATOMIC_RELAXED) >= opt.max_conn) {
+			//leave the rest in the backlog until a connection closes
+			epoll_ctl(l->epfd, EPOLL_CTL_DEL, l->listener, NULL);
+			l->listening = 0;
+			return;
+		}
+
+		struct sockaddr_storage their_addr;
+		socklen_t sin_size = sizeof(their_addr);
+		int connfd = accept4(l->listener, (struct sockaddr*) &their_addr,
+				&sin_size, SOCK_NONBLOCK);
+		if (connfd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				perror("ERROR: accept() failed");
+			}
+			return;
+		}
+
+		struct conn* c = calloc(1, sizeof(struct conn));
+		if (c == NULL) {
+			perror("Couldn't allocate memory for connection");
+			close(connfd);
+			continue;
+		}
+		c->loop = l;
+		c->state = REQUEST;
+		c->fd = connfd;
+		c->srv = -1;
+		http_init(&c->parser);
+		getnameinfo((struct sockaddr*) &their_addr, sin_size, c->hoststr,
+				sizeof(c->hoststr), c->portstr, sizeof(c->portstr),
+				NI_NUMERICHOST | NI_NUMERICSERV);
+
+		__atomic_add_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+		watch(c, c->fd, EPOLLIN);
+	}
+}
+
+/*
+ * Sends as much of the cached block as the client will take. Once it's all
+ * out the connection is done.
+ */
+static void
+send_hit(struct conn* c)
+{
+	while (c->r_block != NULL) {
+		ssize_t n = send(c->fd, c->r_block->text + c->r_off,
+				c->r_block->size - c->r_off, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+			close_conn(c);
+			return;
+		}
+		stats_bytes(STAT_CLIENT_OUT, n);
+		c->r_off += n;
+		if (c->r_off == c->r_block->size) {
+			c->r_block = c->r_block->next;
+			c->r_off = 0;
+		}
+	}
+
+	log_cache_hit(c->hit, &c->start);
+	close_conn(c);
+}
+
+/*
+ * Starts sending the client the cached block <hit>, whose reference the
+ * connection takes over, or just the parts of it the client asked for, see
+ * write_cached().
+ */
+static void
+serve_hit(struct conn* c, C_block* hit)
+{
+	c->hit = hit;
+	c->state = HIT;
+	c->r_block = cached_response(hit, c->req, &c->view);
+	if (c->r_block == NULL) {
+		close_conn(c);
+		return;
+	}
+	c->r_off = 0;
+	watch(c, c->fd, EPOLLOUT);
+	send_hit(c);
+}
+
+/*
+ * Called when the server answered our conditional request with a 304 Not
+ * Modified: the stale block is made fresh again and sent to the client, and
+ * the server connection is done with.
+ */
+static void
+serve_revalidated(struct conn* c)
+{
+	revalidate_cache(c->stale, c->res);
+	__atomic_add_fetch(&fresh_stats.revalidated, 1, __ATOMIC_RELAXED);
+
+	//our followers find the block fresh again
+	end_flight(c, 0);
+
+	epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->srv, NULL);
+	if (!c->res->conn_close) {
+		pool_give(c->name, c->port, c->srv);
+		c->srv = -1;
+		log_note(LOG_DEBUG, "[SRV kept alive]");
+	}
+
+	C_block* hit = c->stale;
+	c->stale = NULL;
+	serve_hit(c, hit);
+}
+
+/*
+ * Called when the server failed us: the client gets our stale copy if there
+ * is one and -sie allows it, and a 502 Bad Gateway otherwise.
+ */
+static void
+fail_server(struct conn* c)
+{
+	//our followers have to make do on their own
+	end_flight(c, 0);
+
+	if (c->stale == NULL || !may_serve_stale(c->stale, opt.stale_error)) {
+		send(c->fd, GATEWAY_MSG, strlen(GATEWAY_MSG), MSG_NOSIGNAL);
+		stats_done(STAT_ERROR, &c->start);
+		close_conn(c);
+		return;
+	}
+	__atomic_add_fetch(&fresh_stats.stale_errors, 1, __ATOMIC_RELAXED);
+	log_note(LOG_WARN, "[SRV failed, serving stale copy]");
+
+	if (c->srv != -1) {
+		close(c->srv);
+		c->srv = -1;
+		log_note(LOG_DEBUG, "[SRV disconnected]");
+	}
+	C_block* hit = c->stale;
+	c->stale = NULL;
+	serve_hit(c, hit);
+}
+
+/*
+ * Sends the pending bytes in the connection's buffer to socket <fd>.
+ *
+ * Returns 1 once the buffer is empty, 0 if we have to wait for the socket to
+ * become writable and -1 if sending failed.
+ */
+static int
+flush(struct conn* c, int fd)
+{
+	while (c->buf_off < c->buf_len) {
+		ssize_t n = send(fd, c->buf + c->buf_off, c->buf_len - c->buf_off,
+				MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		stats_bytes(fd == c->fd ? STAT_CLIENT_OUT : STAT_SERVER_OUT, n);
+		c->buf_off += n;
+	}
+	c->buf_off = c->buf_len = 0;
+	return 1;
+}
+
+/*
+ * Sends as much of the reply in the connection's buffer as the client will
+ * take. Once it's all out the connection is done.
+ */
+static void
+send_reply(struct conn* c)
+{
+	if (flush(c, c->fd) != 0) close_conn(c);
+}
+
+/*
+ * Wraps up a relayed response: the cache block is completed (or dropped if
+ * we didn't get all of it) and the connection is closed. If the response was
+ * framed and the server is happy to keep going, its connection goes back to
+ * the pool.
+ */
+static void
+finish_relay(struct conn* c)
+{
+	int cached = c->fill != NULL && !c->failed && c->body_done;
+	if (c->fill != NULL) {
+		if (c->failed || !c->body_done) {
+			free_cache_block(c->fill);
+			release_cache(c->fill);
+		} else {
+			if (opt.comp_enabled) compress_cache(c->fill);
+			finish_cache(c->fill);
+		}
+		c->fill = NULL;
+	}
+	if (c->parsed) log_relayed(c->res, &c->start, cached ? STAT_MISS : STAT_SKIP);
+
+	int keep_alive = c->parsed && c->body_done && !c->res->conn_close &&
+		(c->res->chunked || expected_body(c->res) >= 0);
+	end_flight(c, keep_alive);
+	if (keep_alive) {
+		epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->srv, NULL);
+		pool_give(c->name, c->port, c->srv);
+		c->srv = -1;
+		log_note(LOG_DEBUG, "[SRV kept alive]");
+	}
+	close_conn(c);
+}
+
+/*
+ * Starts connecting to the server at the first of the <n> addresses <addrs>
+ * that will take it, or fails the request if the server's hostname didn't
+ * resolve (<n> being the lookup's error code then).
+ */
+static void
+start_connect(struct conn* c, D_addr* addrs, int n)
+{
+	if (n < 0) fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(n));
+	c->srv = n > 0 ? connect_addrs_nonblock(c->name, addrs, n) : -1;
+	if (c->srv == -1) {
+		stats_connect(&c->connect_start, 0);
+		fail_server(c);
+		return;
+	}
+	c->state = CONNECT;
+	watch(c, c->srv, EPOLLOUT);
+}
+
+/*
+ * The main function of a lookup thread: resolves the hostname of the lookup
+ * <arg> (which also puts it in the DNS cache) and hands the lookup back to
+ * its loop.
+ */
+static void*
+lookup_main(void* arg)
+{
+	struct lookup* lk = (struct lookup*) arg;
+	struct loop* l = lk->loop;
+	lk->n = dns_resolve(lk->name, lk->port, lk->addrs, DNS_MAX_ADDRS);
+
+	lk->next = __atomic_load_n(&l->resolved, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&l->resolved, &lk->next, lk, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	uint64_t one = 1;
+	if (write(l->wakefd, &one, sizeof(one)) == -1) perror("ERROR: couldn't wake event loop");
+	return NULL;
+}
+
+/*
+ * Resolves the server's hostname on a thread of its own, and waits in
+ * RESOLVE until it's done.
+ */
+static void
+start_lookup(struct conn* c)
+{
+	struct lookup* lk = calloc(1, sizeof(struct lookup));
+	if (lk == NULL) {
+		perror("Couldn't allocate memory for lookup");
+		close_conn(c);
+		return;
+	}
+	lk->loop = c->loop;
+	lk->c = c;
+	snprintf(lk->name, sizeof(lk->name), "%s", c->name);
+	snprintf(lk->port, sizeof(lk->port), "%s", c->port);
+
+	pthread_t thread_id;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int failed = pthread_create(&thread_id, &attr, &lookup_main, lk) != 0;
+	pthread_attr_destroy(&attr);
+	if (failed) {
+		perror("ERROR: couldn't start lookup thread");
+		free(lk);
+		close_conn(c);
+		return;
+	}
+	c->lookup = lk;
+	c->state = RESOLVE;
+}
+
+/*
+ * Picks up the lookups the lookup threads have finished for loop <l>, and
+ * carries on connecting the connections they were for.
+ */
+static void
+finish_lookups(struct loop* l)
+{
+	uint64_t count;
+	if (read(l->wakefd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		perror("ERROR: couldn't read eventfd");
+	}
+
+	struct lookup* lk = __atomic_exchange_n(&l->resolved, NULL, __ATOMIC_ACQUIRE);
+	while (lk != NULL) {
+		struct lookup* next = lk->next;
+		if (lk->c != NULL) {
+			lk->c->lookup = NULL;
+			start_connect(lk->c, lk->addrs, lk->n);
+		}
+		free(lk);
+		lk = next;
+	}
+}
+
+/*
+ * Gets a connection to the server: an idle one from the pool if there is
+ * one (unless <fresh> is true), otherwise a new one. Either way we wait for
+ * it to be writable before sending our request. A hostname the DNS cache
+ * can't answer for is resolved off the loop first, see start_lookup().
+ */
+static void
+connect_server(struct conn* c, int fresh)
+{
+	c->srv = fresh ? -1 : pool_take(c->name, c->port, 1);
+	c->reused = c->srv != -1;
+	if (c->reused) {
+		c->state = CONNECT;
+		watch(c, c->srv, EPOLLOUT);
+		return;
+	}
+
+	gettimeofday(&c->connect_start, NULL);
+	D_addr addrs[DNS_MAX_ADDRS];
+	int n = dns_cached(c->name, c->port, addrs, DNS_MAX_ADDRS);
+	if (n == 0) {
+		start_lookup(c);
+		return;
+	}
+	start_connect(c, addrs, n);
+}
+
+/*
+ * The server closed a connection we took from the pool before answering,
+ * probably just as we took it. Since it's a GET we can safely start over on
+ * a fresh connection.
+ */
+static void
+retry_fresh(struct conn* c)
+{
+	close(c->srv);
+	c->srv = -1;
+	connect_server(c, 1);
+}
+
+/*
+ * Passes whatever is in the buffer on to the client, then goes back to
+ * reading from the server (or finishes if that was the last of it).
+ */
+static void
+relay_to_client(struct conn* c)
+{
+	switch (flush(c, c->fd)) {
+	case -1:
+		close_conn(c);
+		return;
+	case 0:
+		//stop reading from the server until the client catches up
+		watch(c, c->srv, 0);
+		watch(c, c->fd, EPOLLOUT);
+		return;
+	}
+
+	if (c->body_done) {
+		finish_relay(c);
+		return;
+	}
+	watch(c, c->fd, 0);
+	watch(c, c->srv, EPOLLIN);
+}
+
+/*
+ * Reads the next part of the response from the server and hands it to
+ * relay_to_client(), adding it to the cache on the way.
+ */
+static void
+read_response(struct conn* c)
+{
+	//until we've seen the whole header, what we receive is kept together
+	long kept = c->parsed ? 0 : c->buf_len;
+	ssize_t nbytes = recv(c->srv, c->buf + kept, MAX_BUF - 1 - kept, 0);
+	if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+	if (nbytes <= 0 && !c->parsed && c->reused) {
+		retry_fresh(c);
+		return;
+	}
+	if (nbytes <= 0 && !c->parsed) {
+		fail_server(c);
+		return;
+	}
+	if (nbytes == -1) {
+		perror("ERROR: recv() failed");
+		finish_relay(c);
+		return;
+	}
+	if (nbytes == 0) {
+		//without chunks or a length the response ends when the server
+		//hangs up, otherwise we didn't get all of it
+		if (c->parsed && !c->res->chunked && expected_body(c->res) < 0) {
+			c->body_done = 1;
+		}
+		finish_relay(c);
+		return;
+	}
+	stats_bytes(STAT_SERVER_IN, nbytes);
+
+	long body_start = 0; //where the body starts in the buffer
+	if (!c->parsed) {
+		nbytes += kept;
+		c->buf_len = nbytes;
+		if (http_parse(&c->parser, c->buf, nbytes) == HTTP_MORE && nbytes < MAX_BUF - 1) {
+			return;
+		}
+		long header_length = parse_response(&c->parser, c->buf, c->res);
+		c->parsed = 1;
+		log_response(c->res);
+
+		if (c->stale != NULL && c->res->status_no == 304) {
+			serve_revalidated(c);
+			return;
+		}
+		if (c->stale != NULL && c->res->status_no >= 500 &&
+				may_serve_stale(c->stale, opt.stale_error)) {
+			fail_server(c);
+			return;
+		}
+		if (c->stale != NULL) __atomic_add_fetch(&fresh_stats.refetched, 1, __ATOMIC_RELAXED);
+		body_start = header_length;
+		http_chunked_init(&c->chunks);
+		c->length_at = -1;
+
+		c->bytes_left = expected_body(c->res);
+		if (c->bytes_left >= 0) {
+			c->fill = safe_add_cache(c->req->host, c->req->path, c->buf, nbytes, header_length, *c->res);
+			c->bytes_left -= nbytes - header_length;
+		} else if (opt.chunk_enabled && opt.dechunk_enabled && c->res->chunked &&
+				c->parser.state == HTTP_DONE) {
+			c->fill = add_dechunked(c->req->host, c->req->path, &c->parser, c->buf, *c->res, &c->length_at);
+		} else if (opt.chunk_enabled) {
+			c->fill = safe_add_cache(c->req->host, c->req->path, c->buf, nbytes, header_length, *c->res);
+		}
+	} else {
+		c->bytes_left -= nbytes;
+		if (c->fill != NULL && c->length_at < 0) {
+			c->failed |= add_response_block(c->fill, c->buf, nbytes);
+		}
+	}
+
+	if (expected_body(c->res) >= 0) {
+		c->body_done = c->bytes_left <= 0;
+	} else if (c->res->chunked) {
+		//follow the chunks to find out where the response ends
+		C_block* data_block = c->length_at >= 0 ? c->fill : NULL;
+		c->failed |= dechunk(&c->chunks, c->buf + body_start, nbytes - body_start, data_block);
+		c->failed |= http_chunked_failed(&c->chunks);
+		c->body_done = http_chunked_done(&c->chunks);
+		if (c->body_done && data_block != NULL) {
+			finish_dechunked(data_block, &c->chunks, c->length_at);
+		}
+	}
+
+	flight_append(c->flight, c->buf, nbytes);
+	c->buf_len = nbytes;
+	c->buf_off = 0;
+	relay_to_client(c);
+}
+
+/*
+ * Called once the connection to the server is established (or failed).
+ * Builds our request into the buffer and starts sending it.
+ */
+static void
+server_connected(struct conn* c)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	int failed = getsockopt(c->srv, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0;
+	if (!c->reused) stats_connect(&c->connect_start, !failed);
+	if (failed) {
+		fprintf(stderr, "Couldn't connect to the host: %s\n", c->req->host);
+		fail_server(c);
+		return;
+	}
+
+	c->buf_len = build_request(c->req, c->buf, MAX_BUF);
+	c->buf_off = 0;
+	log_forward(c->req);
+	log_note(LOG_DEBUG, "[SRV connected to %s:%s]", c->name, c->port);
+	c->state = FORWARD;
+}
+
+/*
+ * Sends our request to the server. Once it's all out, starts waiting for the
+ * response.
+ */
+static void
+forward_request(struct conn* c)
+{
+	switch (flush(c, c->srv)) {
+	case -1:
+		if (c->reused) {
+			retry_fresh(c);
+			return;
+		}
+		perror("Error writing to socket");
+		close_conn(c);
+		return;
+	case 0:
+		return;
+	}
+
+	c->state = RELAY;
+	http_init(&c->parser);
+	watch(c, c->srv, EPOLLIN);
+}
+
+/*
+ * Tells the loop <arg> that a fetch one of its connections follows has more
+ * for it, see flight_watch(). Called by whoever leads the fetch.
+ */
+static void
+wake_followers(void* arg)
+{
+	struct loop* l = (struct loop*) arg;
+	__atomic_store_n(&l->flights_grown, 1, __ATOMIC_RELEASE);
+	uint64_t one = 1;
+	if (write(l->wakefd, &one, sizeof(one)) == -1) perror("ERROR: couldn't wake event loop");
+}
+
+/*
+ * Sends the client as much of the response the connection's flight has
+ * received as the client will take, see follow_fetch() for the threads.
+ * Once it's all out the connection is done. If the leader got nothing, the
+ * client gets our copy of the page if the leader found it still good, or
+ * the page is fetched on our own if we fell behind before sending anything.
+ */
+static void
+follow_flight(struct conn* c)
+{
+	long nbytes;
+	while (1) {
+		switch (flush(c, c->fd)) {
+		case -1:
+			close_conn(c);
+			return;
+		case 0:
+			watch(c, c->fd, EPOLLOUT);
+			return;
+		}
+
+		nbytes = flight_poll(c->flight, &c->reader, c->buf);
+		if (nbytes == FLIGHT_PENDING) {
+			watch(c, c->fd, 0);
+			return;
+		}
+		if (nbytes <= 0) break;
+		if (!c->parsed) {
+			//the leader's first part holds the response header
+			http_parse(&c->parser, c->buf, nbytes);
+			parse_response(&c->parser, c->buf, c->res);
+			c->parsed = 1;
+			log_response(c->res);
+		}
+		c->buf_len = nbytes;
+		c->buf_off = 0;
+	}
+
+	if (c->parsed) {
+		//if we were dropped partway through, the client got a cut off
+		//response, which closing the connection tells it
+		log_relayed(c->res, &c->start, c->res->no_store ? STAT_SKIP : STAT_MISS);
+		close_conn(c);
+		return;
+	}
+	end_flight(c, 0);
+
+	if (nbytes == -1) {
+		log_note(LOG_DEBUG, "[SRV fetching on our own]");
+		watch(c, c->fd, 0);
+		connect_server(c, 0);
+		return;
+	}
+
+	//the fetch may have found our copy to still be good, and then it has
+	//nothing to pass on, or it may have failed
+	C_block* found = search_cache(c->req->host, c->req->path);
+	if (found != NULL && !is_stale(found)) {
+		__atomic_add_fetch(&fresh_stats.hits, 1, __ATOMIC_RELAXED);
+		if (c->stale != NULL) release_cache(c->stale);
+		c->stale = NULL;
+		serve_hit(c, found);
+		return;
+	}
+	if (found != NULL) {
+		if (c->stale != NULL) release_cache(c->stale);
+		c->stale = found;
+	}
+	fail_server(c);
+}
+
+/*
+ * Carries on with every connection of loop <l> that follows a fetch, if any
+ * of the fetches has moved on since we last looked.
+ */
+static void
+follow_flights(struct loop* l)
+{
+	if (!__atomic_exchange_n(&l->flights_grown, 0, __ATOMIC_ACQUIRE)) return;
+
+	struct conn* c = l->followers;
+	while (c != NULL) {
+		struct conn* next = c->next_follower;
+		follow_flight(c);
+		c = next;
+	}
+}
+
+/*
+ * Handles a complete request <text> from the client: replies from the cache
+ * if we can, otherwise starts connecting to the server.
+ */
+static void
+start_request(struct conn* c, char* text)
+{
+	c->req = calloc(1, sizeof(struct request));
+	if (c->req == NULL) {
+		perror("Couldn't allocate memory for request");
+		close_conn(c);
+		return;
+	}
+
+	if (parse_request(&c->parser, text, c->req) == -1 || strcmp(c->req->method, "GET") != 0) {
+		//Return a 403 Forbidden error if they attempt to load
+		//something needing SSL/HTTPS
+		send(c->fd, ERROR_MSG, strlen(ERROR_MSG), MSG_NOSIGNAL);
+		close_conn(c);
+		return;
+	}
+
+	//the proxy answers its reserved paths itself
+	if (stats_path(c->req->path)) {
+		c->buf = stats_reply(c->req->path, &c->buf_len);
+		if (c->buf == NULL) {
+			close_conn(c);
+			return;
+		}
+		c->buf_off = 0;
+		c->state = REPLY;
+		watch(c, c->fd, EPOLLOUT);
+		send_reply(c);
+		return;
+	}
+
+	gettimeofday(&c->start, NULL);
+	log_request(c->req, c->hoststr, c->portstr, &c->start);
+
+	//we won't be reading anything else from the client
+	watch(c, c->fd, 0);
+
+	//if it's in the cache (and still fresh) serve it from there
+	C_block* found = search_cache(c->req->host, c->req->path);
+	if (found != NULL && !is_stale(found)) {
+		__atomic_add_fetch(&fresh_stats.hits, 1, __ATOMIC_RELAXED);
+		serve_hit(c, found);
+		return;
+	}
+	if (found != NULL && refresh_enabled() && may_serve_stale(found, opt.stale_window)) {
+		//the client gets our copy right away, see check_cache()
+		refresh_later(c->req->host, c->req->path);
+		__atomic_add_fetch(&fresh_stats.stale, 1, __ATOMIC_RELAXED);
+		serve_hit(c, found);
+		return;
+	}
+
+	if (found != NULL) {
+		//ask the server whether our copy is still good
+		log_commit(log_begin(RECORD_STALE, LOG_INFO));
+		c->stale = found;
+		conditional_fields(found, c->req->conditional, sizeof(c->req->conditional));
+	} else {
+		log_commit(log_begin(RECORD_MISS, LOG_INFO));
+	}
+	char name[NI_MAXHOST];
+	char port[NI_MAXSERV];
+	split_host(c->req->host, name, sizeof(name), port, sizeof(port));
+
+	//if someone is already fetching the page, follow along with them
+	int leader;
+	c->flight = flight_join(c->req->host, c->req->path, &leader, &c->reader);
+	c->following = !leader;
+
+	//followers get the leader's parts whole, see flight_next()
+	c->buf = malloc(leader ? MAX_BUF : FLIGHT_CHUNK + 1);
+	c->res = calloc(1, sizeof(struct response));
+	c->name = strdup(name);
+	c->port = strdup(port);
+	if (c->following) {
+		c->next_follower = c->loop->followers;
+		if (c->next_follower != NULL) c->next_follower->prev_follower = c;
+		c->loop->followers = c;
+	}
+	if (c->buf == NULL || c->res == NULL || c->name == NULL || c->port == NULL) {
+		perror("Couldn't allocate memory for response");
+		close_conn(c);
+		return;
+	}
+
+	if (c->following) {
+		log_note(LOG_DEBUG, "[SRV already being fetched]");
+		c->state = FOLLOW;
+		flight_watch(c->flight, &c->reader, wake_followers, c->loop);
+		follow_flight(c);
+		return;
+	}
+	connect_server(c, 0);
+}
+
+/*
+ * Reads (part of) the client's request. Short requests usually arrive in one
+ * go and are parsed straight from the loop's scratch buffer, otherwise they
+ * are collected in the connection's own buffer until the header is complete.
+ * A header that doesn't fit in MAX_BUF gets a 431.
+ */
+static void
+read_request(struct conn* c)
+{
+	char* scratch = c->loop->scratch;
+	ssize_t nbytes = recv(c->fd, scratch, MAX_BUF - 1 - c->in_len, 0);
+	if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+	if (nbytes <= 0) {
+		close_conn(c);
+		return;
+	}
+	stats_bytes(STAT_CLIENT_IN, nbytes);
+
+	char* text = scratch;
+	long len = nbytes;
+	if (c->in != NULL) {
+		memcpy(c->in + c->in_len, scratch, nbytes);
+		text = c->in;
+		len = c->in_len += nbytes;
+	}
+
+	if (http_parse(&c->parser, text, len) != HTTP_MORE) {
+		start_request(c, text);
+		return;
+	}
+	if (len >= MAX_BUF - 1) {
+		//the header doesn't fit in the buffer, see serve_client()
+		send(c->fd, TOO_LARGE_MSG, strlen(TOO_LARGE_MSG), MSG_NOSIGNAL);
+		close_conn(c);
+		return;
+	}
+
+	//not the whole header yet, hang on to what we have
+	if (c->in == NULL) {
+		c->in = malloc(MAX_BUF);
+		if (c->in == NULL) {
+			perror("Couldn't allocate memory for request");
+			close_conn(c);
+			return;
+		}
+		memcpy(c->in, scratch, nbytes);
+		c->in_len = nbytes;
+	}
+}
+
+/*
+ * Dispatches the events <events> that happened on the client's (or the
+ * server's if <server> is true) socket of connection <c>.
+ */
+static void
+handle_event(struct conn* c, int server, uint32_t events)
+{
+	//errors on the server socket show up when we next read or write to it,
+	//so let those handle them
+	if (server && (events & (EPOLLERR | EPOLLHUP))) events |= EPOLLIN | EPOLLOUT;
+
+	switch (c->state) {
+	case REQUEST:
+		if (!server && (events & EPOLLIN)) read_request(c);
+		break;
+	case HIT:
+		//send_hit() finds out if the client went away
+		if (!server && (events & EPOLLOUT)) send_hit(c);
+		break;
+	case REPLY:
+		if (!server && (events & EPOLLOUT)) send_reply(c);
+		break;
+	case FOLLOW:
+		if (events & (EPOLLERR | EPOLLHUP)) close_conn(c);
+		else if (events & EPOLLOUT) follow_flight(c);
+		break;
+	case RESOLVE:
+		//the client hung up on us while we were resolving
+		if (!server) close_conn(c);
+		break;
+	case CONNECT:
+		if (!server) {
+			//the client hung up on us while we were connecting
+			close_conn(c);
+		} else if (events & EPOLLOUT) {
+			server_connected(c);
+			if (c->state == FORWARD) forward_request(c);
+		}
+		break;
+	case FORWARD:
+		if (server && (events & EPOLLOUT)) forward_request(c);
+		else if (!server) close_conn(c);
+		break;
+	case RELAY:
+		if (server && (events & EPOLLIN)) read_response(c);
+		else if (!server && (events & (EPOLLERR | EPOLLHUP))) close_conn(c);
+		else if (!server && (events & EPOLLOUT)) relay_to_client(c);
+		break;
+	case DONE:
+		break;
+	}
+}
+
+/*
+ * The main function for an event loop thread.
+ */
+static void*
+loop_main(void* arg)
+{
+	struct loop* l = (struct loop*) arg;
+	struct epoll_event events[MAX_EVENTS];
+
+	while (1) {
+		int n = epoll_wait(l->epfd, events, MAX_EVENTS,
+				l->listening ? -1 : LOOP_TIMEOUT);
+		if (n == -1 && errno != EINTR) {
+			perror("ERROR: epoll_wait() failed");
+			exit(1);
+		}
+
+		for (int i = 0; i < n; i++) {
+			uint64_t data = events[i].data.u64;
+			if (data == 0) {
+				accept_clients(l);
+				continue;
+			}
+			if (data == 1) {
+				finish_lookups(l);
+				follow_flights(l);
+				continue;
+			}
+			struct conn* c = (struct conn*) (uintptr_t) (data & ~(uint64_t) 1);
+			handle_event(c, data & 1, events[i].events);
+		}
+		bury_dead(l);
+		resume_accepting(l);
+	}
+	return NULL;
+}
+
+/*
+ * Serves every connection on <listener> from a set of event loops, one per
+ * CPU. The calling thread runs the first loop, so this never returns.
+ */
+void
+run_event_loops(int listener)
+{
+	long nloops = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nloops < 1) nloops = 1;
+	if (nloops > MAX_LOOPS) nloops = MAX_LOOPS;
+
+	if (set_nonblocking(listener) == -1) {
+		perror("ERROR: couldn't make the listener non-blocking");
+		exit(1);
+	}
+
+	struct loop* loops = calloc(nloops, sizeof(struct loop));
+	if (loops == NULL) {
+		perror("Couldn't allocate memory for event loops");
+		exit(1);
+	}
+
+	for (long i = 0; i < nloops; i++) {
+		loops[i].epfd = epoll_create1(0);
+		if (loops[i].epfd == -1) {
+			perror("ERROR: epoll_create1() failed");
+			exit(1);
+		}
+		loops[i].listener = listener;
+		loops[i].wakefd = eventfd(0, EFD_NONBLOCK);
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u64 = 1;
+		if (loops[i].wakefd == -1 ||
+				epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wakefd, &ev) == -1) {
+			perror("ERROR: couldn't set up eventfd");
+			exit(1);
+		}
+		resume_accepting(&loops[i]);
+	}
+	log_note(LOG_INFO, "Running %ld event loops", nloops);
+
+	for (long i = 1; i < nloops; i++) {
+		pthread_t thread_id;
+		pthread_create(&thread_id, NULL, &loop_main, &loops[i]);
+		pthread_detach(thread_id);
+	}
+	loop_main(&loops[0]);
+}
@@ -0,0 +1,11 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#define MAX_LOOPS 64     //most event loop threads we'll ever run
+#define MAX_EVENTS 256   //events handled per epoll_wait() call
+#define LOOP_TIMEOUT 1000 //ms to wait for events while not accepting
+
+void
+run_event_loops(int listener);
+
+#endif
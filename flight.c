@@ -0,0 +1,481 @@
+/*
+ * Table of fetches that are in flight, for collapsing concurrent misses.
+ *
+ * The first miss for a host and path becomes the leader and fetches the
+ * response from the server. Misses that come in while it's doing so join
+ * its entry and are sent the response bytes as the leader receives them,
+ * instead of each opening their own connection to the server.
+ *
+ * The leader only keeps the bytes that some follower hasn't read yet. If a
+ * slow follower would make it keep more than FLIGHT_MAX_RETAIN, the follower
+ * is dropped, and has to fetch the page on its own.
+ *
+ * Threads follow with flight_next(), which waits for the leader. The event
+ * loops can't wait, so they follow with flight_poll() and have flight_watch()
+ * tell them when to try again.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "flight.h"
+
+struct F_chunk {
+	char *text;
+	long size;
+	struct F_chunk* next; //NULL until the leader receives more
+};
+
+struct F_entry {
+	unsigned long hash; //see hash_key()
+	char* host;
+	char* path;
+	int refs;   //the leader plus its followers
+	int listed; //true while new misses can join, guarded by the bucket lock
+
+	//followers sleep on <grown> until the leader adds to the response, so
+	//this needs a condition variable rather than a semaphore
+	pthread_mutex_t lock;
+	pthread_cond_t grown;
+	int joinable; //<listed>, but guarded by <lock>
+	int retain;   //false once nobody can need the received bytes any more
+	F_reader* readers;
+	F_chunk* first; //oldest part some reader still needs
+	F_chunk* last;
+	long size;      //bytes received so far
+	long held;      //bytes in the parts from <first> on
+	int done;       //true once the leader has received all it's going to
+	int keep_alive; //see flight_finish()
+
+	struct F_entry* next; //next entry in the same bucket
+};
+
+typedef struct F_bucket {
+	sem_t lock;
+	F_entry* entries;
+} F_bucket;
+
+static F_bucket buckets[FLIGHT_BUCKETS];
+
+
+void
+init_flight()
+{
+	for (int i = 0; i < FLIGHT_BUCKETS; i++) {
+		sem_init(&buckets[i].lock, 0, 1);
+		buckets[i].entries = NULL;
+	}
+}
+
+/*
+ * Frees the received response of <f>.
+ */
+static void
+free_chunks(F_entry* f)
+{
+	F_chunk* chunk = f->first;
+	while (chunk != NULL) {
+		F_chunk* next = chunk->next;
+		free(chunk->text);
+		free(chunk);
+		chunk = next;
+	}
+	f->first = f->last = NULL;
+	f->held = 0;
+}
+
+/*
+ * Frees the parts of the response of <f> that no reader needs any more,
+ * once no more readers can join. The entry lock must be held.
+ */
+static void
+trim(F_entry* f)
+{
+	if (f->joinable) return;
+	if (f->readers == NULL) f->retain = 0;
+
+	while (f->first != NULL) {
+		F_reader* r = f->readers;
+		while (r != NULL && r->next != f->first) r = r->after;
+		if (r != NULL) break;
+
+		F_chunk* chunk = f->first;
+		f->first = chunk->next;
+		f->held -= chunk->size;
+		free(chunk->text);
+		free(chunk);
+	}
+	if (f->first == NULL) f->last = NULL;
+}
+
+/*
+ * Wakes up the readers of <f>, since there's more for them to read or the
+ * fetch is over. The entry lock must be held.
+ */
+static void
+wake_readers(F_entry* f)
+{
+	pthread_cond_broadcast(&f->grown);
+	for (F_reader* r = f->readers; r != NULL; r = r->after) {
+		if (r->wake != NULL) r->wake(r->wake_arg);
+	}
+}
+
+/*
+ * Takes <reader> off the readers of <f>, setting its <cut> to <cut>. A reader
+ * that is cut is told so. The entry lock must be held.
+ */
+static void
+drop_reader(F_entry* f, F_reader* reader, int cut)
+{
+	F_reader** link = &f->readers;
+	while (*link != reader) link = &(*link)->after;
+	*link = reader->after;
+	reader->linked = 0;
+	reader->cut = cut;
+	if (cut && reader->wake != NULL) reader->wake(reader->wake_arg);
+}
+
+/*
+ * Takes <f> out of the table, so that later misses fetch the page on their
+ * own.
+ */
+static void
+unlist(F_entry* f)
+{
+	F_bucket* b = &buckets[f->hash % FLIGHT_BUCKETS];
+
+	sem_wait(&b->lock);
+	if (f->listed) {
+		F_entry** link = &b->entries;
+		while (*link != f) link = &(*link)->next;
+		*link = f->next;
+		f->listed = 0;
+	}
+
+	//nobody can join any more, so only the bytes the readers still need
+	//have to be kept around
+	pthread_mutex_lock(&f->lock);
+	f->joinable = 0;
+	trim(f);
+	pthread_mutex_unlock(&f->lock);
+	sem_post(&b->lock);
+}
+
+/*
+ * Joins the fetch of <host><path> if one is in flight, or starts a new one.
+ * <leader> is set to true if the caller has to do the fetching. A follower
+ * reads the response through <reader>, which may only be NULL for callers
+ * that don't want to follow.
+ *
+ * Returns the entry, which must be released with flight_release(). NULL is
+ * returned (to a leader) if we ran out of memory.
+ */
+F_entry*
+flight_join(const char *host, const char *path, int *leader, F_reader* reader)
+{
+	unsigned long hash = hash_key(host, path);
+	F_bucket* b = &buckets[hash % FLIGHT_BUCKETS];
+
+	sem_wait(&b->lock);
+	for (F_entry* f = b->entries; f != NULL; f = f->next) {
+		if (f->hash == hash && strcmp(f->host, host) == 0 &&
+				strcmp(f->path, path) == 0) {
+			__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+			if (reader != NULL) {
+				pthread_mutex_lock(&f->lock);
+				reader->next = f->first;
+				reader->linked = 1;
+				reader->cut = 0;
+				reader->got = 0;
+				reader->wake = NULL;
+				reader->after = f->readers;
+				f->readers = reader;
+				pthread_mutex_unlock(&f->lock);
+			}
+			sem_post(&b->lock);
+			*leader = 0;
+			return f;
+		}
+	}
+
+	*leader = 1;
+	F_entry* f = calloc(1, sizeof(F_entry));
+	if (f == NULL || (f->host = strdup(host)) == NULL ||
+			(f->path = strdup(path)) == NULL) {
+		sem_post(&b->lock);
+		perror("Failed to allocate memory for in-flight fetch");
+		if (f != NULL) free(f->host);
+		free(f);
+		return NULL;
+	}
+	f->hash = hash;
+	f->refs = 1;
+	f->listed = 1;
+	f->joinable = 1;
+	f->retain = 1;
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->grown, NULL);
+	f->next = b->entries;
+	b->entries = f;
+	sem_post(&b->lock);
+	return f;
+}
+
+/*
+ * Drops every reader of <f> and stops keeping the response, after running
+ * out of memory for it.
+ */
+static void
+give_up(F_entry* f)
+{
+	unlist(f);
+	pthread_mutex_lock(&f->lock);
+	while (f->readers != NULL) drop_reader(f, f->readers, 1);
+	trim(f);
+	wake_readers(f);
+	pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * Adds the <nbytes> bytes at <buf> to the response of <f> as one part.
+ *
+ * Returns false if nobody needs the bytes any more.
+ */
+static int
+append_chunk(F_entry* f, const char *buf, long nbytes)
+{
+	F_chunk* chunk = calloc(1, sizeof(F_chunk));
+	char* text = malloc(nbytes + 1);
+	if (chunk == NULL || text == NULL) {
+		//readers would get a response with a hole in it, so they have to
+		//fetch it on their own
+		perror("Failed to allocate memory for in-flight response");
+		free(chunk);
+		free(text);
+		give_up(f);
+		return 0;
+	}
+	memcpy(text, buf, nbytes);
+	text[nbytes] = '\0';
+	chunk->text = text;
+	chunk->size = nbytes;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->done || !f->retain) {
+		pthread_mutex_unlock(&f->lock);
+		free(text);
+		free(chunk);
+		return 0;
+	}
+	if (f->last != NULL) f->last->next = chunk;
+	else f->first = chunk;
+	f->last = chunk;
+	f->size += nbytes;
+	f->held += nbytes;
+	for (F_reader* r = f->readers; r != NULL; r = r->after) {
+		if (r->next == NULL) r->next = chunk;
+	}
+
+	//the readers furthest behind hold on to the most, drop them until we're
+	//under the limit again
+	while (f->held > FLIGHT_MAX_RETAIN && !f->joinable && f->first != NULL) {
+		F_reader* r = f->readers;
+		while (r != NULL) {
+			F_reader* after = r->after;
+			if (r->next == f->first) drop_reader(f, r, 1);
+			r = after;
+		}
+		trim(f);
+	}
+	wake_readers(f);
+	pthread_mutex_unlock(&f->lock);
+	return 1;
+}
+
+/*
+ * Adds the <nbytes> bytes at <buf> the leader received to the response of
+ * <f>, waking up the followers.
+ */
+void
+flight_append(F_entry* f, const char *buf, long nbytes)
+{
+	if (f == NULL) return;
+
+	while (nbytes > 0) {
+		long part = nbytes < FLIGHT_CHUNK ? nbytes : FLIGHT_CHUNK;
+		if (!append_chunk(f, buf, part)) return;
+		buf += part;
+		nbytes -= part;
+	}
+
+	//don't let new followers make us hold on to huge responses
+	if (f->size > FLIGHT_MAX_JOIN && f->listed) unlist(f);
+}
+
+/*
+ * Marks the fetch <f> as over, <keep_alive> being true if the response was
+ * received in full and framed so that the clients can send another request
+ * after it. Wakes up the followers.
+ */
+void
+flight_finish(F_entry* f, int keep_alive)
+{
+	if (f == NULL) return;
+
+	unlist(f);
+	pthread_mutex_lock(&f->lock);
+	if (!f->done) {
+		f->done = 1;
+		f->keep_alive = keep_alive;
+	}
+	wake_readers(f);
+	pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * Stops new misses from joining <f>, for a leader that would rather not keep
+ * a copy of the response.
+ *
+ * Returns true if nobody has joined, so that the leader doesn't need to pass
+ * on what it receives.
+ */
+int
+flight_detach(F_entry* f)
+{
+	if (f == NULL) return 1;
+
+	unlist(f);
+	pthread_mutex_lock(&f->lock);
+	int retain = f->retain;
+	pthread_mutex_unlock(&f->lock);
+	return !retain;
+}
+
+/*
+ * Has <wake> called with <arg> whenever <reader> may have more to read from
+ * <f>, or has been dropped. It's called with the entry locked, so it mustn't
+ * do more than note that the reader should try again.
+ */
+void
+flight_watch(F_entry* f, F_reader* reader, void (*wake)(void*), void* arg)
+{
+	pthread_mutex_lock(&f->lock);
+	reader->wake = wake;
+	reader->wake_arg = arg;
+	pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * Copies the next part of the response of <f> for <reader> into <buf> like
+ * flight_next(), waiting for the leader to receive it if <wait> is true.
+ *
+ * Returns what flight_next() does, or FLIGHT_PENDING if we'd have to wait.
+ */
+static long
+next_part(F_entry* f, F_reader* reader, char* buf, int wait)
+{
+	long nbytes;
+
+	pthread_mutex_lock(&f->lock);
+	while (wait && reader->linked && reader->next == NULL && !f->done) {
+		pthread_cond_wait(&f->grown, &f->lock);
+	}
+	if (reader->cut) {
+		nbytes = -1;
+	} else if (reader->linked && reader->next == NULL && !f->done) {
+		nbytes = FLIGHT_PENDING;
+	} else if (reader->next == NULL) {
+		nbytes = 0;
+		drop_reader(f, reader, 0);
+		trim(f);
+	} else {
+		F_chunk* chunk = reader->next;
+		nbytes = chunk->size;
+		memcpy(buf, chunk->text, nbytes);
+		buf[nbytes] = '\0';
+		reader->got += nbytes;
+		reader->next = chunk->next;
+		trim(f);
+	}
+	pthread_mutex_unlock(&f->lock);
+	return nbytes;
+}
+
+/*
+ * Copies the next part of the response of <f> for <reader> into <buf>, which
+ * must have room for FLIGHT_CHUNK + 1 bytes, waiting for the leader to
+ * receive it if needed. The part is NUL-terminated.
+ *
+ * Returns the size of the part, 0 when the fetch is over and there's nothing
+ * more, or -1 if the reader fell too far behind and was dropped.
+ */
+long
+flight_next(F_entry* f, F_reader* reader, char* buf)
+{
+	return next_part(f, reader, buf, 1);
+}
+
+/*
+ * Copies the next part of the response of <f> for <reader> into <buf> like
+ * flight_next(), but never waits for the leader.
+ *
+ * Returns what flight_next() does, or FLIGHT_PENDING if the leader hasn't
+ * received the next part yet.
+ */
+long
+flight_poll(F_entry* f, F_reader* reader, char* buf)
+{
+	return next_part(f, reader, buf, 0);
+}
+
+/*
+ * Stops reading the response of <f> through <reader>, which must be done
+ * before releasing <f>.
+ */
+void
+flight_leave(F_entry* f, F_reader* reader)
+{
+	pthread_mutex_lock(&f->lock);
+	if (reader->linked) {
+		drop_reader(f, reader, 0);
+		trim(f);
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * Returns the <keep_alive> the fetch <f> was finished with.
+ */
+int
+flight_keep_alive(F_entry* f)
+{
+	pthread_mutex_lock(&f->lock);
+	int keep_alive = f->done && f->keep_alive;
+	pthread_mutex_unlock(&f->lock);
+	return keep_alive;
+}
+
+/*
+ * Drops a reference to <f>. The leader must have finished it first.
+ */
+void
+flight_release(F_entry* f)
+{
+	if (f == NULL) return;
+
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free_chunks(f);
+		pthread_mutex_destroy(&f->lock);
+		pthread_cond_destroy(&f->grown);
+		free(f->host);
+		free(f->path);
+		free(f);
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#define FLIGHT_BUCKETS 64             //hash buckets of the in-flight table
+#define FLIGHT_MAX_JOIN (16 << 20)    //bytes after which a fetch can't be joined
+#define FLIGHT_MAX_RETAIN (32 << 20)  //bytes kept around for slow followers
+#define FLIGHT_CHUNK (64 << 10)       //most bytes in one part of a response
+#define FLIGHT_PENDING -2             //flight_poll() has nothing to read yet
+
+typedef struct F_chunk F_chunk;
+
+typedef struct F_entry F_entry;
+
+/*
+ * A follower's place in the response of the fetch it joined. It belongs to
+ * the follower, and is linked into the entry while the follower reads.
+ */
+typedef struct F_reader {
+	F_chunk* next; //part to read next, NULL until the leader receives it
+	int linked;    //true while the entry holds on to bytes for the reader
+	int cut;       //true once the reader fell too far behind and was dropped
+	long got;      //bytes read so far
+	void (*wake)(void*); //called when there's more to read, see flight_watch()
+	void* wake_arg;
+	struct F_reader* after; //next reader of the same entry
+} F_reader;
+
+void
+init_flight();
+
+F_entry*
+flight_join(const char *host, const char *path, int *leader, F_reader* reader);
+
+void
+flight_append(F_entry* f, const char *buf, long nbytes);
+
+void
+flight_finish(F_entry* f, int keep_alive);
+
+int
+flight_detach(F_entry* f);
+
+void
+flight_watch(F_entry* f, F_reader* reader, void (*wake)(void*), void* arg);
+
+long
+flight_next(F_entry* f, F_reader* reader, char* buf);
+
+long
+flight_poll(F_entry* f, F_reader* reader, char* buf);
+
+void
+flight_leave(F_entry* f, F_reader* reader);
+
+int
+flight_keep_alive(F_entry* f);
+
+void
+flight_release(F_entry* f);
+
+#endif
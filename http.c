@@ -0,0 +1,527 @@
+/*
+ * Parser for the header of HTTP requests and responses.
+ *
+ * The parser never copies or allocates anything: the start line and the
+ * header fields are recorded as views into the buffer the message was
+ * received into. It can be run again every time more of the message
+ * arrives, and picks up at the first line it hasn't seen in full yet.
+ *
+ * Lines are found with a scanner that looks for the end of the line and
+ * the colon of a field in the same pass, 16 or 32 bytes at a time where the
+ * CPU allows it. init_http() picks the widest one the CPU supports.
+ *
+ * There's also a decoder for chunked bodies, which follows the framing
+ * byte by byte so that it never matters how the body was split up into
+ * reads.
+ */
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SIMD
+#endif
+
+#include "http.h"
+
+
+/*
+ * Scans from <off> one byte at a time. <colon> is only set if it's still
+ * -1, so that the wider scanners can finish off with this.
+ */
+static long
+scan_bytes(const char *buf, long off, long len, long *colon)
+{
+	for (long i = off; i < len; i++) {
+		if (buf[i] == '\n') return i;
+		if (buf[i] == ':' && *colon == -1) *colon = i;
+	}
+	return -1;
+}
+
+/*
+ * Returns the offset of the first newline from <off> in the first <len>
+ * bytes of <buf>, or -1 if there's none yet. <colon> is set to the offset of
+ * the first colon before it, or -1.
+ */
+static long
+scan_scalar(const char *buf, long off, long len, long *colon)
+{
+	*colon = -1;
+	return scan_bytes(buf, off, len, colon);
+}
+
+#ifdef HTTP_SIMD
+/*
+ * Records the first colon in a block starting at <i> if there's one before
+ * the first newline, given the masks of where both are in the block.
+ */
+static inline void
+first_colon(unsigned long newlines, unsigned long colons, long i, long *colon)
+{
+	if (newlines != 0) colons &= (newlines & -newlines) - 1;
+	if (colons != 0 && *colon == -1) *colon = i + __builtin_ctzl(colons);
+}
+
+/*
+ * See scan_scalar(), 16 bytes at a time.
+ */
+__attribute__((target("sse2")))
+static long
+scan_sse2(const char *buf, long off, long len, long *colon)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i co = _mm_set1_epi8(':');
+	long i = off;
+
+	*colon = -1;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (buf + i));
+		unsigned long newlines = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		unsigned long colons = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, co));
+		first_colon(newlines, colons, i, colon);
+		if (newlines != 0) return i + __builtin_ctzl(newlines);
+	}
+	return scan_bytes(buf, i, len, colon);
+}
+
+/*
+ * See scan_scalar(), 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static long
+scan_avx2(const char *buf, long off, long len, long *colon)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	const __m256i co = _mm256_set1_epi8(':');
+	long i = off;
+
+	*colon = -1;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (buf + i));
+		unsigned long newlines = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		unsigned long colons = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, co));
+		first_colon(newlines, colons, i, colon);
+		if (newlines != 0) return i + __builtin_ctzl(newlines);
+	}
+	return scan_bytes(buf, i, len, colon);
+}
+#endif
+
+static http_scanner scan = scan_scalar;
+
+//where in a chunked body the decoder is
+enum chunk_state {
+	CHUNK_SIZE,     //reading the chunk size
+	CHUNK_EXT,      //skipping chunk extensions up to the end of the line
+	CHUNK_DATA,     //in the middle of chunk data
+	CHUNK_DATA_END, //expecting the line end after chunk data
+	CHUNK_TRAILER,  //at the start of a trailer line (or the final empty line)
+	CHUNK_FIELD,    //skipping a trailer field
+	CHUNK_LAST,     //expecting the line end of the final empty line
+	CHUNK_DONE,
+	CHUNK_ERROR
+};
+
+
+/*
+ * Picks the fastest line scanner this CPU can run.
+ */
+void
+init_http()
+{
+#ifdef HTTP_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) scan = scan_avx2;
+	else if (__builtin_cpu_supports("sse2")) scan = scan_sse2;
+#endif
+}
+
+/*
+ * Returns the line scanner called <name> ("scalar", "sse2" or "avx2"), or
+ * NULL if this build or CPU can't run it. The parser doesn't need this, it's
+ * for comparing the scanners with each other.
+ */
+http_scanner
+http_scanner_named(const char *name)
+{
+	if (strcmp(name, "scalar") == 0) return scan_scalar;
+#ifdef HTTP_SIMD
+	__builtin_cpu_init();
+	if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) return scan_sse2;
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) return scan_avx2;
+#endif
+	return NULL;
+}
+
+
+void
+http_init(H_parser* p)
+{
+	p->state = HTTP_MORE;
+	p->pos = 0;
+	p->lines = 0;
+	p->count = 0;
+	memset(p->start, 0, sizeof(p->start));
+}
+
+/*
+ * Returns true if <c> is whitespace allowed around field values.
+ */
+static int
+is_space(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+/*
+ * Splits the start line from <off> to <end> in <buf> into its three parts.
+ * The last one takes the rest of the line, since reason phrases can have
+ * spaces in them.
+ */
+static int
+parse_start(H_parser* p, const char *buf, int off, int end)
+{
+	for (int i = 0; i < 2; i++) {
+		const char* space = memchr(buf + off, ' ', end - off);
+		if (space == NULL) {
+			//a response is allowed to leave out the reason
+			if (i == 0) return HTTP_ERROR;
+			p->start[i] = (H_view) { off, end - off };
+			p->start[2] = (H_view) { end, 0 };
+			return HTTP_MORE;
+		}
+		p->start[i] = (H_view) { off, space - (buf + off) };
+		off = space - buf + 1;
+	}
+	p->start[2] = (H_view) { off, end - off };
+	return p->start[0].len > 0 && p->start[1].len > 0 ? HTTP_MORE : HTTP_ERROR;
+}
+
+/*
+ * Records the header field from <off> to <end> in <buf>, whose first colon
+ * is at <colon> (-1 if it has none).
+ */
+static int
+parse_field(H_parser* p, const char *buf, int off, int end, long colon)
+{
+	//an indented line continues the value of the field before it
+	if (is_space(buf[off])) {
+		if (p->count == 0) return HTTP_ERROR;
+		H_view* value = &p->fields[p->count - 1].value;
+		while (end > off && is_space(buf[end - 1])) end--;
+		if (end > off) value->len = end - value->off;
+		return HTTP_MORE;
+	}
+
+	if (colon == -1 || colon == off || is_space(buf[colon - 1])) {
+		return HTTP_ERROR;
+	}
+	if (p->count == HTTP_MAX_FIELDS) return HTTP_ERROR;
+
+	H_field* f = &p->fields[p->count++];
+	f->name = (H_view) { off, colon - off };
+	int v = colon + 1;
+	while (v < end && is_space(buf[v])) v++;
+	while (end > v && is_space(buf[end - 1])) end--;
+	f->value = (H_view) { v, end - v };
+	return HTTP_MORE;
+}
+
+/*
+ * Parses as much of the header in the first <len> bytes of <buf> as it can,
+ * continuing from where the last call for <p> left off.
+ *
+ * Returns HTTP_DONE once the empty line ending the header has been seen
+ * (<p>->pos is then the length of the header), HTTP_MORE if more bytes are
+ * needed and HTTP_ERROR if the header is malformed.
+ */
+int
+http_parse(H_parser* p, const char *buf, long len)
+{
+	while (p->state == HTTP_MORE) {
+		long colon;
+		long nl = scan(buf, p->pos, len, &colon);
+		if (nl == -1) break;
+
+		int off = p->pos;
+		int end = nl;
+		if (end > off && buf[end - 1] == '\r') end--;
+		p->pos = nl + 1;
+
+		if (end == off) {
+			//empty lines before the start line are to be ignored
+			if (p->lines > 0) p->state = HTTP_DONE;
+			continue;
+		}
+		p->state = p->lines++ == 0 ? parse_start(p, buf, off, end)
+			: parse_field(p, buf, off, end, colon);
+	}
+	return p->state;
+}
+
+/*
+ * Returns true if the view <v> of <buf> is <s>, ignoring case.
+ */
+int
+http_is(const char *buf, H_view v, const char *s)
+{
+	return (size_t) v.len == strlen(s) && strncasecmp(buf + v.off, s, v.len) == 0;
+}
+
+/*
+ * Returns true if <token> is one of the comma separated values in the view
+ * <v> of <buf>, ignoring case.
+ */
+int
+http_has_token(const char *buf, H_view v, const char *token)
+{
+	int off = v.off;
+	int end = v.off + v.len;
+
+	while (off < end) {
+		const char* comma = memchr(buf + off, ',', end - off);
+		int stop = comma != NULL ? comma - buf : end;
+
+		H_view item = { off, stop - off };
+		while (item.len > 0 && is_space(buf[item.off])) {
+			item.off++;
+			item.len--;
+		}
+		while (item.len > 0 && is_space(buf[item.off + item.len - 1])) item.len--;
+		if (http_is(buf, item, token)) return 1;
+		off = stop + 1;
+	}
+	return 0;
+}
+
+/*
+ * Returns the value of the first header field called <name> (ignoring case)
+ * parsed by <p> from <buf>, or NULL if there's none.
+ */
+H_view*
+http_find(H_parser* p, const char *buf, const char *name)
+{
+	for (int i = 0; i < p->count; i++) {
+		if (http_is(buf, p->fields[i].name, name)) return &p->fields[i].value;
+	}
+	return NULL;
+}
+
+/*
+ * Returns the number of seconds given to the directive <name> (as in
+ * "max-age=60") among the comma separated values in the view <v> of <buf>,
+ * or -1 if it isn't there or isn't a number.
+ */
+long
+http_directive(const char *buf, H_view v, const char *name)
+{
+	size_t name_len = strlen(name);
+	int off = v.off;
+	int end = v.off + v.len;
+
+	while (off < end) {
+		while (off < end && (is_space(buf[off]) || buf[off] == ',')) off++;
+		const char* comma = memchr(buf + off, ',', end - off);
+		int stop = comma != NULL ? comma - buf : end;
+
+		if ((size_t) (stop - off) > name_len && buf[off + name_len] == '=' &&
+				strncasecmp(buf + off, name, name_len) == 0) {
+			long seconds = 0;
+			int i = off + name_len + 1;
+			if (i < stop && buf[i] == '"') i++;
+			if (i == stop || buf[i] < '0' || buf[i] > '9') return -1;
+			for (; i < stop && buf[i] >= '0' && buf[i] <= '9'; i++) {
+				//anything too big to count is as good as forever
+				if (seconds < INT_MAX) seconds = seconds * 10 + buf[i] - '0';
+			}
+			return seconds < INT_MAX ? seconds : INT_MAX;
+		}
+		off = stop + 1;
+	}
+	return -1;
+}
+
+/*
+ * Returns the time the HTTP-date in the view <v> of <buf> stands for, or -1
+ * if it isn't one. All three formats HTTP has used are understood.
+ */
+time_t
+http_date(const char *buf, H_view v)
+{
+	static const char* formats[] = {
+		"%a, %d %b %Y %H:%M:%S GMT", //Sun, 06 Nov 1994 08:49:37 GMT
+		"%A, %d-%b-%y %H:%M:%S GMT", //Sunday, 06-Nov-94 08:49:37 GMT
+		"%a %b %e %H:%M:%S %Y"       //Sun Nov  6 08:49:37 1994
+	};
+	char date[64];
+	if (v.len >= (int) sizeof(date)) return -1;
+	http_copy(buf, v, date, sizeof(date));
+
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		struct tm tm;
+		memset(&tm, 0, sizeof(tm));
+		char* end = strptime(date, formats[i], &tm);
+		if (end != NULL && *end == '\0') return timegm(&tm);
+	}
+	return -1;
+}
+
+/*
+ * Copies the view <v> of <buf> into <out>, which can hold <size> bytes,
+ * cutting it short if it doesn't fit and terminating it.
+ *
+ * Returns the number of bytes copied.
+ */
+long
+http_copy(const char *buf, H_view v, char *out, long size)
+{
+	long n = v.len < size - 1 ? v.len : size - 1;
+	memcpy(out, buf + v.off, n);
+	out[n] = '\0';
+	return n;
+}
+
+void
+http_chunked_init(H_chunked* c)
+{
+	c->state = CHUNK_SIZE;
+	c->digits = 0;
+	c->left = 0;
+	c->body = 0;
+}
+
+/*
+ * Returns the value of the hex digit <ch>, or -1 if it isn't one.
+ */
+static int
+hex_value(char ch)
+{
+	if (ch >= '0' && ch <= '9') return ch - '0';
+	if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+	if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Called at the end of a chunk size line.
+ */
+static void
+end_size_line(H_chunked* c)
+{
+	if (c->digits == 0) c->state = CHUNK_ERROR;
+	else if (c->left == 0) c->state = CHUNK_TRAILER;
+	else c->state = CHUNK_DATA;
+}
+
+/*
+ * Decodes the next part of a chunked body from the first <len> bytes of
+ * <buf>, continuing from where the last call for <c> left off. It stops
+ * after the next piece of chunk data, which <data> is set to (as a view of
+ * <buf>, with length 0 if there's none), or at the end of <buf>.
+ *
+ * Returns the number of bytes used up. Call it again with the rest until
+ * it has used up all of <buf>. Bytes after the end of the body are never
+ * used up.
+ */
+long
+http_chunked(H_chunked* c, const char *buf, long len, H_view* data)
+{
+	long i = 0;
+	*data = (H_view) { 0, 0 };
+
+	while (i < len) {
+		char ch = buf[i];
+		switch (c->state) {
+		case CHUNK_SIZE: {
+			int v = hex_value(ch);
+			if (v >= 0) {
+				//a size that doesn't fit in a long is no size at all
+				if (c->left > (LONG_MAX >> 4)) {
+					c->state = CHUNK_ERROR;
+					return i;
+				}
+				c->left = (c->left << 4) | v;
+				c->digits++;
+			} else if (ch == ';' || ch == ' ' || ch == '\t' || ch == '\r') {
+				c->state = CHUNK_EXT;
+			} else if (ch == '\n') {
+				end_size_line(c);
+			} else {
+				c->state = CHUNK_ERROR;
+				return i;
+			}
+			i++;
+			break;
+		}
+		case CHUNK_EXT:
+			if (ch == '\n') end_size_line(c);
+			i++;
+			break;
+		case CHUNK_DATA: {
+			long n = len - i < c->left ? len - i : c->left;
+			*data = (H_view) { i, n };
+			c->left -= n;
+			c->body += n;
+			if (c->left == 0) c->state = CHUNK_DATA_END;
+			return i + n;
+		}
+		case CHUNK_DATA_END:
+			if (ch == '\n') {
+				c->state = CHUNK_SIZE;
+				c->digits = 0;
+			} else if (ch != '\r') {
+				c->state = CHUNK_ERROR;
+				return i;
+			}
+			i++;
+			break;
+		case CHUNK_TRAILER:
+			if (ch == '\n') c->state = CHUNK_DONE;
+			else if (ch == '\r') c->state = CHUNK_LAST;
+			else c->state = CHUNK_FIELD;
+			i++;
+			break;
+		case CHUNK_FIELD:
+			if (ch == '\n') c->state = CHUNK_TRAILER;
+			i++;
+			break;
+		case CHUNK_LAST:
+			if (ch != '\n') {
+				c->state = CHUNK_ERROR;
+				return i;
+			}
+			c->state = CHUNK_DONE;
+			i++;
+			break;
+		default:
+			//done or broken, nothing more belongs to the body
+			return i;
+		}
+	}
+	return i;
+}
+
+/*
+ * Returns true once the decoder <c> has seen the end of the body.
+ */
+int
+http_chunked_done(H_chunked* c)
+{
+	return c->state == CHUNK_DONE;
+}
+
+/*
+ * Returns true if the decoder <c> found the body to be malformed.
+ */
+int
+http_chunked_failed(H_chunked* c)
+{
+	return c->state == CHUNK_ERROR;
+}
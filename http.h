@@ -0,0 +1,98 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <time.h>
+
+#define HTTP_MAX_FIELDS 100 //header fields a message may have
+
+#define HTTP_MORE 0   //the header isn't complete yet
+#define HTTP_DONE 1   //the whole header has been parsed
+#define HTTP_ERROR -1 //the header is malformed
+
+/*
+ * Part of a message, as an offset into the buffer holding it.
+ */
+typedef struct H_view {
+	int off;
+	int len;
+} H_view;
+
+typedef struct H_field {
+	H_view name;
+	H_view value; //without surrounding whitespace
+} H_field;
+
+/*
+ * State of a message header being parsed. The parser only ever looks at
+ * the buffer it is given, so it has to be passed the same buffer (with more
+ * bytes at the end) every time.
+ */
+typedef struct H_parser {
+	int state; //one of HTTP_*
+	int pos;   //where the next line starts, the header length once done
+	int lines; //lines seen so far, not counting leading empty ones
+	H_view start[3]; //method, target and version, or version, status and reason
+	H_field fields[HTTP_MAX_FIELDS];
+	int count;
+} H_parser;
+
+/*
+ * Finds the end of the line starting at <off> in the first <len> bytes of
+ * <buf>, and the first colon in the line. The scanners look at the same
+ * bytes the same way, just more of them at once.
+ */
+typedef long (*http_scanner)(const char *buf, long off, long len, long *colon);
+
+/*
+ * State of a chunked body being decoded, see http_chunked().
+ */
+typedef struct H_chunked {
+	int state;  //where in the chunk framing we are
+	int digits; //digits of the chunk size read so far
+	long left;  //bytes of chunk data still to come, or the size being read
+	long body;  //bytes of chunk data seen so far
+} H_chunked;
+
+void
+init_http();
+
+http_scanner
+http_scanner_named(const char *name);
+
+void
+http_init(H_parser* p);
+
+int
+http_parse(H_parser* p, const char *buf, long len);
+
+int
+http_is(const char *buf, H_view v, const char *s);
+
+int
+http_has_token(const char *buf, H_view v, const char *token);
+
+H_view*
+http_find(H_parser* p, const char *buf, const char *name);
+
+void
+http_chunked_init(H_chunked* c);
+
+long
+http_chunked(H_chunked* c, const char *buf, long len, H_view* data);
+
+int
+http_chunked_done(H_chunked* c);
+
+int
+http_chunked_failed(H_chunked* c);
+
+long
+http_directive(const char *buf, H_view v, const char *name);
+
+time_t
+http_date(const char *buf, H_view v);
+
+long
+http_copy(const char *buf, H_view v, char *out, long size);
+
+#endif
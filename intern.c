@@ -0,0 +1,116 @@
+/*
+ * Table of interned strings.
+ *
+ * Lots of cache blocks share the same hostname, status text and content
+ * type, so rather than every block carrying its own copy they all point at
+ * a single reference counted one from here.
+ */
+
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "intern.h"
+
+typedef struct I_entry {
+	unsigned long hash; //see hash_key()
+	int refs;
+	struct I_entry* next;
+	char text[];
+} I_entry;
+
+typedef struct I_bucket {
+	sem_t lock;
+	I_entry* entries;
+} I_bucket;
+
+static I_bucket buckets[INTERN_BUCKETS];
+static struct intern_stats stats;
+
+
+void
+init_intern()
+{
+	for (int i = 0; i < INTERN_BUCKETS; i++) {
+		sem_init(&buckets[i].lock, 0, 1);
+		buckets[i].entries = NULL;
+	}
+}
+
+/*
+ * Returns the shared copy of <s>, which must be given back with
+ * intern_release() once it's no longer needed.
+ *
+ * Returns NULL if we ran out of memory.
+ */
+const char*
+intern(const char *s)
+{
+	unsigned long hash = hash_key(s, "");
+	I_bucket* b = &buckets[hash % INTERN_BUCKETS];
+	I_entry* e;
+
+	sem_wait(&b->lock);
+	for (e = b->entries; e != NULL; e = e->next) {
+		if (e->hash == hash && strcmp(e->text, s) == 0) {
+			e->refs++;
+			sem_post(&b->lock);
+			return e->text;
+		}
+	}
+
+	size_t len = strlen(s);
+	e = malloc(sizeof(I_entry) + len + 1);
+	if (e == NULL) {
+		sem_post(&b->lock);
+		perror("Failed to allocate memory for interned string");
+		return NULL;
+	}
+	e->hash = hash;
+	e->refs = 1;
+	memcpy(e->text, s, len + 1);
+	e->next = b->entries;
+	b->entries = e;
+	sem_post(&b->lock);
+
+	__atomic_add_fetch(&stats.strings, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.bytes, sizeof(I_entry) + len + 1, __ATOMIC_RELAXED);
+	return e->text;
+}
+
+/*
+ * Gives back the string <s> returned by intern(), freeing it once nobody
+ * uses it any more.
+ */
+void
+intern_release(const char *s)
+{
+	if (s == NULL) return;
+
+	I_entry* e = (I_entry*) (s - offsetof(I_entry, text));
+	I_bucket* b = &buckets[e->hash % INTERN_BUCKETS];
+
+	sem_wait(&b->lock);
+	if (--e->refs > 0) {
+		sem_post(&b->lock);
+		return;
+	}
+	I_entry** link = &b->entries;
+	while (*link != e) link = &(*link)->next;
+	*link = e->next;
+	sem_post(&b->lock);
+
+	__atomic_sub_fetch(&stats.strings, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&stats.bytes, sizeof(I_entry) + strlen(e->text) + 1, __ATOMIC_RELAXED);
+	free(e);
+}
+
+void
+intern_get_stats(struct intern_stats *out)
+{
+	out->strings = __atomic_load_n(&stats.strings, __ATOMIC_RELAXED);
+	out->bytes = __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,23 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#define INTERN_BUCKETS 256 //hash buckets of the interned string table
+
+struct intern_stats {
+	long strings; //distinct strings currently interned
+	long bytes;   //memory taken up by them
+};
+
+void
+init_intern();
+
+const char*
+intern(const char *s);
+
+void
+intern_release(const char *s);
+
+void
+intern_get_stats(struct intern_stats *stats);
+
+#endif
@@ -0,0 +1,436 @@
+/*
+ * Asynchronous logging.
+ *
+ * Every thread that logs gets a ring of records of its own, which only it
+ * writes to and only the writer thread reads from, so logging never takes
+ * a lock or waits for the output. A record just holds the numbers and
+ * strings of what happened; the writer thread does the formatting, in the
+ * usual banners or one line per record with -logcompact, and the writing,
+ * to stdout or the file given with -logfile. When a ring is full, records
+ * are dropped and counted rather than making the thread wait.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "time.h"
+#include "log.h"
+
+typedef struct L_ring {
+	L_record records[LOG_RING];
+	unsigned long head; //records logged, only written by the owner
+	unsigned long tail; //records written out, only written by the writer
+	long dropped; //records dropped since the writer last looked
+	int owned;    //true while a thread logs into the ring
+	struct L_ring* next; //rings are never freed, just handed on
+} L_ring;
+
+static L_ring* rings = NULL; //every ring there is, pushed atomically
+static pthread_key_t ring_key; //the calling thread's ring
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static sem_t drain_lock; //serialises the readers of the rings
+static FILE* out = NULL; //NULL until the writer is started
+static int max_level = LOG_DEBUG;
+static int compact = 0;
+static struct log_stats stats; //only updated atomically
+
+static const char* LEVELS[] = { "error", "warn", "info", "debug" };
+
+
+/*
+ * Called when a thread that has a ring exits, so that the next new thread
+ * can take it over.
+ */
+static void
+give_up_ring(void* ring)
+{
+	__atomic_store_n(&((L_ring*) ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void
+make_ring_key()
+{
+	pthread_key_create(&ring_key, give_up_ring);
+}
+
+/*
+ * Returns the calling thread's ring, taking over one given up by a thread
+ * that exited or making a new one the first time it logs. Returns NULL if we
+ * ran out of memory.
+ */
+static L_ring*
+own_ring()
+{
+	pthread_once(&ring_once, make_ring_key);
+	L_ring* ring = pthread_getspecific(ring_key);
+	if (ring != NULL) return ring;
+
+	for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+		int owned = 0;
+		if (__atomic_compare_exchange_n(&ring->owned, &owned, 1, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	if (ring == NULL) {
+		ring = calloc(1, sizeof(L_ring));
+		if (ring == NULL) return NULL;
+		ring->owned = 1;
+		ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	pthread_setspecific(ring_key, ring);
+	return ring;
+}
+
+/*
+ * Returns the next string of <r> after the one ending before <pos>, moving
+ * <pos> past it, or "" if there are no more.
+ */
+static const char*
+next_string(L_record* r, int* pos)
+{
+	if (*pos >= r->used) return "";
+	const char* s = r->text + *pos;
+	*pos += strlen(s) + 1;
+	return s;
+}
+
+/*
+ * Prints the record <r> in the banner format, <now> being its time.
+ */
+static void
+print_banner(L_record* r, const char *now)
+{
+	int pos = 0;
+	const char* s[5];
+	for (int i = 0; i < 5; i++) s[i] = next_string(r, &pos);
+
+	switch (r->type) {
+	case RECORD_REQUEST:
+		fprintf(out, "-----------------------------------------------\n");
+		fprintf(out, "%ld [Conn: %ld/%ld] [Cache: %.2f/%ldMB] [Items: %ld]\n\n",
+				r->n[0], r->n[1], r->n[2], r->mb, r->n[4], r->n[3]);
+		fprintf(out, "[CLI connected to %s:%s]\n", s[0], s[1]);
+		fprintf(out, "[CLI ==> PRX --- SRV] @ %s\n", now);
+		fprintf(out, "> GET %s%s\n> %s\n", s[2], s[3], s[4]);
+		break;
+	case RECORD_FORWARD:
+		fprintf(out, "[CLI --- PRX ==> SRV] @ %s\n", now);
+		fprintf(out, "> GET %s%s\n> %s\n", s[0], s[1], s[2]);
+		break;
+	case RECORD_RESPONSE:
+		fprintf(out, "[CLI --- PRX <== SRV] @ %s\n", now);
+		fprintf(out, "> %d %s\n> %s\n", r->status, s[0], s[1]);
+		break;
+	case RECORD_RELAYED:
+		fprintf(out, "[CLI <== PRX --- SRV @ %s\n", now);
+		fprintf(out, "> %d %s\n> %s\n# %ldms\n", r->status, s[0], s[1], r->ms);
+		break;
+	case RECORD_HIT:
+	case RECORD_DISK_HIT:
+		if (r->type == RECORD_HIT) {
+			fprintf(out, "@@@@@@@@@@@@@@@@@@ CACHE HIT @@@@@@@@@@@@@@@@@@@@\n");
+		} else {
+			fprintf(out, "@@@@@@@@@@@@@@@@@@ DISK HIT @@@@@@@@@@@@@@@@@@@@@\n");
+		}
+		fprintf(out, "[CLI <== PRX --- SRV] @ %s\n", now);
+		fprintf(out, "> %d %s\n", r->status, s[0]);
+		if (r->count > 1) fprintf(out, "> %s\n", s[1]);
+		if (r->type == RECORD_DISK_HIT && r->n[0]) {
+			fprintf(out, "> This file has been moved back into memory\n");
+		}
+		fprintf(out, "# %ldms\n", r->ms);
+		break;
+	case RECORD_RANGE_HIT:
+		fprintf(out, "@@@@@@@@@@@@@@@@@@ RANGE HIT @@@@@@@@@@@@@@@@@@@@\n");
+		fprintf(out, "[CLI <== PRX --- SRV] @ %s\n", now);
+		fprintf(out, "> %ld ranges from %ld segments, %ld fetched\n", r->n[0], r->n[1], r->n[2]);
+		fprintf(out, "# %ldms\n", r->ms);
+		break;
+	case RECORD_ADDED:
+		fprintf(out, "################## CACHE ADDED ##################\n");
+		fprintf(out, "> %s%s %.2fMB @ %s\n", s[0], s[1], r->mb, now);
+		fprintf(out, "> This file has been added to the cache\n");
+		fprintf(out, "#################################################\n");
+		break;
+	case RECORD_SKIP:
+		fprintf(out, "################## CACHE SKIP ###################\n");
+		fprintf(out, "> %s%s %.2fMB @ %s\n", s[0], s[1], r->mb, now);
+		fprintf(out, "> This file is too big for the cache!\n");
+		fprintf(out, "#################################################\n");
+		break;
+	case RECORD_REMOVED:
+		fprintf(out, "################# CACHE REMOVED #################\n");
+		fprintf(out, "> %s%s %.2fMB @ %s\n", s[0], s[1], r->mb, now);
+		fprintf(out, "> This file has been removed due to LRU!\n");
+		break;
+	case RECORD_MISS:
+		fprintf(out, "################## CACHE MISS ###################\n");
+		break;
+	case RECORD_STALE:
+		fprintf(out, "################## CACHE STALE ##################\n");
+		break;
+	default:
+		fprintf(out, "%s\n", s[0]);
+	}
+}
+
+/*
+ * Prints the record <r> on one line starting with its time <now>, leaving
+ * out the user agent.
+ */
+static void
+print_compact(L_record* r, const char *now)
+{
+	int pos = 0;
+	const char* s[5];
+	for (int i = 0; i < 5; i++) s[i] = next_string(r, &pos);
+
+	switch (r->type) {
+	case RECORD_REQUEST:
+		fprintf(out, "%s REQ #%ld %s:%s GET %s%s conn=%ld/%ld cache=%.2f/%ldMB items=%ld\n",
+				now, r->n[0], s[0], s[1], s[2], s[3], r->n[1], r->n[2], r->mb, r->n[4], r->n[3]);
+		break;
+	case RECORD_FORWARD:
+		fprintf(out, "%s FWD GET %s%s\n", now, s[0], s[1]);
+		break;
+	case RECORD_RESPONSE:
+		fprintf(out, "%s SRV %d %s %s\n", now, r->status, s[0], s[1]);
+		break;
+	case RECORD_RELAYED:
+		fprintf(out, "%s SENT %d %s %s %ldms\n", now, r->status, s[0], s[1], r->ms);
+		break;
+	case RECORD_HIT:
+		fprintf(out, "%s HIT %d %s %s %ldms\n", now, r->status, s[0], s[1], r->ms);
+		break;
+	case RECORD_DISK_HIT:
+		fprintf(out, "%s DISK-HIT %d %s %s %ldms%s\n", now, r->status, s[0], s[1], r->ms,
+				r->n[0] ? " promoted" : "");
+		break;
+	case RECORD_RANGE_HIT:
+		fprintf(out, "%s RANGE-HIT %ld ranges %ld segments %ld fetched %ldms\n",
+				now, r->n[0], r->n[1], r->n[2], r->ms);
+		break;
+	case RECORD_ADDED:
+	case RECORD_SKIP:
+	case RECORD_REMOVED:
+		fprintf(out, "%s %s %s%s %.2fMB\n", now, r->type == RECORD_ADDED ? "ADDED" :
+				r->type == RECORD_SKIP ? "SKIP" : "REMOVED", s[0], s[1], r->mb);
+		break;
+	case RECORD_MISS:
+		fprintf(out, "%s MISS\n", now);
+		break;
+	case RECORD_STALE:
+		fprintf(out, "%s STALE\n", now);
+		break;
+	default:
+		fprintf(out, "%s %s\n", now, s[0]);
+	}
+}
+
+/*
+ * Writes out every record logged so far.
+ *
+ * Returns the number of records written.
+ */
+static long
+drain()
+{
+	long written = 0;
+	sem_wait(&drain_lock);
+	for (L_ring* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+		unsigned long tail = ring->tail;
+		unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (; tail != head; tail++) {
+			L_record* r = &ring->records[tail % LOG_RING];
+			char now[32];
+			format_time(&r->tv, now, sizeof(now));
+			if (compact) print_compact(r, now);
+			else print_banner(r, now);
+			written++;
+		}
+		//the thread may reuse the records now
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		long dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped > 0) {
+			fprintf(out, "[LOG dropped %ld records]\n", dropped);
+			__atomic_add_fetch(&stats.dropped, dropped, __ATOMIC_RELAXED);
+		}
+	}
+	if (written > 0) {
+		fflush(out);
+		__atomic_add_fetch(&stats.written, written, __ATOMIC_RELAXED);
+	}
+	sem_post(&drain_lock);
+	return written;
+}
+
+/*
+ * Body of the writer thread.
+ */
+static void*
+log_main(void* arg)
+{
+	(void) arg;
+
+	//signals are for the other threads to handle, see init_snapshot()
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (;;) {
+		if (drain() == 0) usleep(LOG_IDLE_US);
+	}
+	return NULL;
+}
+
+/*
+ * Starts writing the records of level <level> or lower to the file at
+ * <path> (stdout if NULL), one line each if <compact> is true.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int
+init_log(const char *path, int level, int compact_lines)
+{
+	FILE* f = path == NULL ? stdout : fopen(path, "a");
+	if (f == NULL) {
+		perror("ERROR: Couldn't open log file");
+		return -1;
+	}
+	max_level = level;
+	compact = compact_lines;
+	sem_init(&drain_lock, 0, 1);
+	out = f;
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, log_main, NULL) != 0) {
+		perror("ERROR: Couldn't start log writer thread");
+		return -1;
+	}
+	pthread_detach(tid);
+	atexit(log_flush);
+	return 0;
+}
+
+/*
+ * Returns the level called <name>, or -1 if there's none.
+ */
+int
+log_level(const char *name)
+{
+	for (int i = 0; i < (int) (sizeof(LEVELS) / sizeof(LEVELS[0])); i++) {
+		if (strcasecmp(name, LEVELS[i]) == 0) return i;
+	}
+	return -1;
+}
+
+/*
+ * Starts a record of type <type> (one of RECORD_*) with level <level>,
+ * stamped with the current time. The caller fills in the fields the type
+ * needs and hands it over with log_commit().
+ *
+ * Returns NULL if the record isn't wanted at this level, or has to be
+ * dropped because the calling thread's ring is full. Both log_string() and
+ * log_commit() take that as it is.
+ */
+L_record*
+log_begin(int type, int level)
+{
+	if (level > max_level) return NULL;
+	L_ring* ring = own_ring();
+	if (ring == NULL) return NULL;
+
+	unsigned long head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	L_record* r = &ring->records[head % LOG_RING];
+	gettimeofday(&r->tv, NULL);
+	r->type = type;
+	r->level = level;
+	r->count = 0;
+	r->used = 0;
+	r->status = 0;
+	r->ms = 0;
+	memset(r->n, 0, sizeof(r->n));
+	r->mb = 0;
+	return r;
+}
+
+/*
+ * Adds the string <s> to the record <r>, cutting it short if the record is
+ * running out of room.
+ */
+void
+log_string(L_record* r, const char *s)
+{
+	if (r == NULL || r->used >= LOG_TEXT) return;
+
+	size_t len = strnlen(s, LOG_TEXT - r->used - 1);
+	memcpy(r->text + r->used, s, len);
+	r->text[r->used + len] = '\0';
+	r->used += len + 1;
+	r->count++;
+}
+
+/*
+ * Hands the record <r> from log_begin() over to the writer thread.
+ */
+void
+log_commit(L_record* r)
+{
+	if (r == NULL) return;
+
+	L_ring* ring = pthread_getspecific(ring_key);
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Logs a line of text with level <level>, formatted like printf() does.
+ */
+void
+log_note(int level, const char *fmt, ...)
+{
+	L_record* r = log_begin(RECORD_NOTE, level);
+	if (r == NULL) return;
+
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(r->text, LOG_TEXT, fmt, args);
+	va_end(args);
+	r->used = (len < LOG_TEXT ? len : LOG_TEXT - 1) + 1;
+	r->count = 1;
+	log_commit(r);
+}
+
+/*
+ * Writes out everything logged so far, for when the program exits.
+ */
+void
+log_flush()
+{
+	if (out != NULL) drain();
+}
+
+void
+log_get_stats(struct log_stats *s)
+{
+	s->written = __atomic_load_n(&stats.written, __ATOMIC_RELAXED);
+	s->dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+}
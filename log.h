@@ -0,0 +1,87 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <sys/time.h>
+
+#define LOG_RING 128     //records each thread can have waiting to be written
+#define LOG_TEXT 512     //bytes of strings a record can carry
+#define LOG_IDLE_US 1000 //how long the writer sleeps when there's nothing to write
+
+//how much a record matters, a record is only kept if it's at most the
+//level given to init_log()
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+//what a record is about, which decides how its fields are printed
+#define RECORD_NOTE 0      //a line of text: s[0]
+#define RECORD_REQUEST 1   //a request came in: n[0..4] the request number, busy
+                           //connections, max connections, cached items and
+                           //max cache size, mb the cache size, s[0..4] the
+                           //client's address and port, the host, path and user agent
+#define RECORD_FORWARD 2   //a request was sent to the server: s[0..2] the
+                           //host, path and user agent
+#define RECORD_RESPONSE 3  //the server answered: status, s[0..1] the status
+                           //text and content type
+#define RECORD_RELAYED 4   //the answer was relayed: as RECORD_RESPONSE, plus ms
+#define RECORD_HIT 5       //served from memory: as RECORD_RELAYED, the
+                           //content type being optional
+#define RECORD_DISK_HIT 6  //served from disk: as RECORD_HIT, n[0] true if
+                           //the page was moved back into memory
+#define RECORD_RANGE_HIT 7 //served from segments: n[0..2] ranges, segments
+                           //and segments fetched, ms
+#define RECORD_ADDED 8     //cached: s[0..1] the host and path, mb its size
+#define RECORD_SKIP 9      //too big to cache: as RECORD_ADDED
+#define RECORD_REMOVED 10  //evicted: as RECORD_ADDED
+#define RECORD_MISS 11     //not cached, no fields
+#define RECORD_STALE 12    //cached but stale, no fields
+
+/*
+ * A log record, filled in by the thread logging it and printed later by the
+ * writer thread. The strings are stored one after another in <text>, see
+ * log_string().
+ */
+typedef struct L_record {
+	struct timeval tv; //when it happened
+	unsigned char type;  //one of RECORD_*
+	unsigned char level; //one of LOG_*
+	unsigned char count; //strings in <text>
+	int status;
+	int used; //bytes of <text> in use
+	long ms;  //milliseconds the request took
+	long n[5];
+	double mb;
+	char text[LOG_TEXT];
+} L_record;
+
+struct log_stats {
+	long written; //records written out
+	long dropped; //records lost because their thread's ring was full
+};
+
+int
+init_log(const char *path, int level, int compact);
+
+int
+log_level(const char *name);
+
+L_record*
+log_begin(int type, int level);
+
+void
+log_string(L_record* r, const char *s);
+
+void
+log_commit(L_record* r);
+
+void
+log_note(int level, const char *fmt, ...);
+
+void
+log_flush();
+
+void
+log_get_stats(struct log_stats *stats);
+
+#endif
@@ -1,11 +1,14 @@
 #define _GNU_SOURCE
 
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "dns.h"
 #include "network.h"
 
 /*
@@ -89,30 +92,63 @@ setup_server(int *listener, char *port)
 }
 
 /*
- * Returns a new socket having connected to <hostname> on port 80
+ * Puts the socket <fd> in non-blocking mode. Returns -1 if that failed.
  */
 int
-connect_host(char *hostname)
+set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1) return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * Splits the Host header value <host> (e.g. "example.com:8080" or
+ * "[::1]:8080") into the hostname <name> and the port <port>, which defaults
+ * to 80. <name> can hold <name_size> bytes and <port> <port_size> bytes.
+ */
+void
+split_host(const char *host, char *name, size_t name_size, char *port, size_t port_size)
+{
+	const char* colon = strrchr(host, ':');
+	const char* bracket = strrchr(host, ']');
+
+	//a colon inside the brackets of an IPv6 address isn't a port separator
+	if (colon == NULL || (bracket != NULL && bracket > colon)) {
+		colon = host + strlen(host);
+		snprintf(port, port_size, "80");
+	} else {
+		snprintf(port, port_size, "%s", colon + 1);
+	}
+
+	if (host[0] == '[' && bracket != NULL) {
+		snprintf(name, name_size, "%.*s", (int) (bracket - host - 1), host + 1);
+	} else {
+		snprintf(name, name_size, "%.*s", (int) (colon - host), host);
+	}
+}
+
+/*
+ * Returns a new socket having connected to <hostname> on port <port>, or -1
+ * if we couldn't resolve or connect to the host.
+ */
+int
+connect_host(char *hostname, char *port)
 {
 	//printf("Attempting to connect to: %s\n", hostname);
 
-	struct addrinfo hints, *res, *res0;
-	int error;
-	int s;
+	D_addr addrs[DNS_MAX_ADDRS];
+	int n;
+	int s = -1;
 	int yes = 1;
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-
-	if ((error = getaddrinfo(hostname, "80", &hints, &res0)) != 0) {
-		fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(error));
-		exit(1);
+	if ((n = dns_resolve(hostname, port, addrs, DNS_MAX_ADDRS)) < 0) {
+		fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(n));
+		return -1;
 	}
 
-	for (res = res0; res; res = res->ai_next) {
-		s = socket(res->ai_family, res->ai_socktype,
-				res->ai_protocol);
+	for (int i = 0; i < n; i++) {
+		s = socket(addrs[i].family, addrs[i].socktype, addrs[i].protocol);
 		if (s == -1) {
 			perror("ERROR: socket() failed");
 			continue;
@@ -121,12 +157,12 @@ connect_host(char *hostname)
 		//allow port reuse
 		if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
 			perror("ERROR: setsockopt() failed");
-			exit(1);
 		}
 
-		if (connect(s, res->ai_addr, res->ai_addrlen) < 0) {
+		if (connect(s, (struct sockaddr*) &addrs[i].addr, addrs[i].len) < 0) {
 			perror("ERROR: connect() failed");
 			close(s);
+			s = -1;
 			continue;
 		}
 
@@ -134,9 +170,64 @@ connect_host(char *hostname)
 	}
 	if (s < 0) {
 		fprintf(stderr, "Couldn't connect to the host: %s\n", hostname);
-		exit(1);
 	}
-	freeaddrinfo(res0);
 
 	return s;
 }
+
+/*
+ * Like connect_host() but the returned socket is non-blocking and its
+ * connection to <hostname> on port <port> may still be in progress. Wait for
+ * the socket to become writable and check SO_ERROR to find out how it went.
+ *
+ * Returns the new socket, or -1 if we couldn't start connecting to the host.
+ */
+int
+connect_host_nonblock(char *hostname, char *port)
+{
+	D_addr addrs[DNS_MAX_ADDRS];
+	int n;
+
+	if ((n = dns_resolve(hostname, port, addrs, DNS_MAX_ADDRS)) < 0) {
+		fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(n));
+		return -1;
+	}
+	return connect_addrs_nonblock(hostname, addrs, n);
+}
+
+/*
+ * Starts connecting to the first of the <n> already resolved addresses
+ * <addrs> of <hostname> that will take a connection, like
+ * connect_host_nonblock() does.
+ *
+ * Returns the new socket, or -1 if we couldn't start connecting to any.
+ */
+int
+connect_addrs_nonblock(char *hostname, struct D_addr *addrs, int n)
+{
+	int s = -1;
+
+	for (int i = 0; i < n; i++) {
+		s = socket(addrs[i].family, addrs[i].socktype | SOCK_NONBLOCK,
+				addrs[i].protocol);
+		if (s == -1) {
+			perror("ERROR: socket() failed");
+			continue;
+		}
+
+		if (connect(s, (struct sockaddr*) &addrs[i].addr, addrs[i].len) < 0 &&
+				errno != EINPROGRESS) {
+			perror("ERROR: connect() failed");
+			close(s);
+			s = -1;
+			continue;
+		}
+
+		break;  /* okay we got one (or will have soon) */
+	}
+
+	if (s < 0) {
+		fprintf(stderr, "Couldn't connect to the host: %s\n", hostname);
+	}
+	return s;
+}
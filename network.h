@@ -3,6 +3,8 @@
 
 #define BACKLOG 10 //how many pending connections the queue will hold
 
+struct D_addr; //see dns.h
+
 void
 *get_in_addr(struct sockaddr *sa);
 
@@ -10,6 +12,18 @@ void
 setup_server(int *listener, char *port);
 
 int
-connect_host(char *hostname);
+set_nonblocking(int fd);
+
+void
+split_host(const char *host, char *name, size_t name_size, char *port, size_t port_size);
+
+int
+connect_host(char *hostname, char *port);
+
+int
+connect_host_nonblock(char *hostname, char *port);
+
+int
+connect_addrs_nonblock(char *hostname, struct D_addr *addrs, int n);
 
 #endif
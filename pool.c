@@ -0,0 +1,224 @@
+/*
+ * Pool of idle keep-alive connections to servers.
+ *
+ * Connections are grouped by (host, port). A miss takes an idle connection
+ * for its server out of the pool if there is one, and gives it back once the
+ * response has been fully read and the server didn't ask to close it.
+ *
+ * The event loops use non-blocking sockets and everything else (client
+ * threads, refresh workers) blocking ones. Every idle connection remembers
+ * which kind it is, and is switched over when a caller of the other kind
+ * takes it, so that callers only ever get the kind they ask for while still
+ * sharing the connections.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "pool.h"
+
+typedef struct P_conn {
+	int fd;
+	int nonblock; //true if the socket is in non-blocking mode
+	time_t since; //when the connection became idle
+	struct P_conn* next;
+} P_conn;
+
+typedef struct P_server {
+	char* host;
+	char* port;
+	int idle_count;
+	P_conn* idle; //most recently used first
+	struct P_server* next;
+} P_server;
+
+typedef struct P_bucket {
+	sem_t lock;
+	P_server* servers;
+} P_bucket;
+
+static P_bucket buckets[POOL_BUCKETS];
+static int max_idle = 0;     //0 means the pool is disabled
+static int idle_timeout = 0; //in seconds
+
+
+/*
+ * Sets up the pool to keep at most <max> idle connections per server, for at
+ * most <timeout> seconds each. A <max> of 0 disables the pool.
+ */
+void
+init_pool(int max, int timeout)
+{
+	max_idle = max;
+	idle_timeout = timeout;
+	for (int i = 0; i < POOL_BUCKETS; i++) {
+		sem_init(&buckets[i].lock, 0, 1);
+		buckets[i].servers = NULL;
+	}
+}
+
+int
+pool_enabled()
+{
+	return max_idle > 0;
+}
+
+/*
+ * Returns the bucket for the server at <host>:<port>.
+ */
+static P_bucket*
+bucket_of(const char *host, const char *port)
+{
+	return &buckets[hash_key(host, port) % POOL_BUCKETS];
+}
+
+/*
+ * Returns the entry for <host>:<port> in bucket <b>, creating it if
+ * <create> is true. The bucket's lock must be held.
+ */
+static P_server*
+find_server(P_bucket* b, const char *host, const char *port, int create)
+{
+	P_server* srv;
+	for (srv = b->servers; srv != NULL; srv = srv->next) {
+		if (strcmp(srv->host, host) == 0 && strcmp(srv->port, port) == 0) {
+			return srv;
+		}
+	}
+	if (!create) return NULL;
+
+	srv = calloc(1, sizeof(P_server));
+	if (srv == NULL) return NULL;
+	srv->host = strdup(host);
+	srv->port = strdup(port);
+	if (srv->host == NULL || srv->port == NULL) {
+		free(srv->host);
+		free(srv->port);
+		free(srv);
+		return NULL;
+	}
+	srv->next = b->servers;
+	b->servers = srv;
+	return srv;
+}
+
+/*
+ * Returns true if the idle connection <fd> still looks usable: the server
+ * hasn't closed it and hasn't sent anything we weren't expecting.
+ */
+static int
+is_healthy(int fd)
+{
+	char c;
+	ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * Puts the socket of the idle connection <pc> in non-blocking mode if
+ * <nonblock> is true, and in blocking mode otherwise.
+ *
+ * Returns -1 if that failed.
+ */
+static int
+set_mode(P_conn* pc, int nonblock)
+{
+	if (pc->nonblock == nonblock) return 0;
+
+	int flags = fcntl(pc->fd, F_GETFL, 0);
+	if (flags == -1) return -1;
+	flags = nonblock ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+	return fcntl(pc->fd, F_SETFL, flags);
+}
+
+/*
+ * Takes an idle connection to <host>:<port> out of the pool, in non-blocking
+ * mode if <nonblock> is true and in blocking mode otherwise. Connections that
+ * have been idle for too long or fail the health check are closed.
+ *
+ * Returns the connection, or -1 if there is no usable one.
+ */
+int
+pool_take(const char *host, const char *port, int nonblock)
+{
+	if (!pool_enabled()) return -1;
+
+	P_bucket* b = bucket_of(host, port);
+	time_t now = time(NULL);
+	int fd = -1;
+
+	sem_wait(&b->lock);
+	P_server* srv = find_server(b, host, port, 0);
+	while (srv != NULL && srv->idle != NULL && fd == -1) {
+		P_conn* pc = srv->idle;
+		srv->idle = pc->next;
+		srv->idle_count--;
+
+		if (now - pc->since < idle_timeout && is_healthy(pc->fd) &&
+				set_mode(pc, nonblock) == 0) {
+			fd = pc->fd;
+		} else {
+			close(pc->fd);
+		}
+		free(pc);
+	}
+	sem_post(&b->lock);
+	return fd;
+}
+
+/*
+ * Gives the connection <fd> to <host>:<port> back to the pool, or closes it
+ * if there are already enough idle connections to that server.
+ */
+void
+pool_give(const char *host, const char *port, int fd)
+{
+	if (!pool_enabled()) {
+		close(fd);
+		return;
+	}
+
+	P_bucket* b = bucket_of(host, port);
+	P_conn* pc = malloc(sizeof(P_conn));
+
+	sem_wait(&b->lock);
+	P_server* srv = find_server(b, host, port, 1);
+
+	//close anything that has been sitting around for too long while we're here
+	P_conn** pp = srv == NULL ? NULL : &srv->idle;
+	while (pp != NULL && *pp != NULL) {
+		P_conn* old = *pp;
+		if (time(NULL) - old->since < idle_timeout) {
+			pp = &old->next;
+			continue;
+		}
+		*pp = old->next;
+		srv->idle_count--;
+		close(old->fd);
+		free(old);
+	}
+
+	if (srv == NULL || pc == NULL || srv->idle_count >= max_idle) {
+		sem_post(&b->lock);
+		free(pc);
+		close(fd);
+		return;
+	}
+	pc->fd = fd;
+	pc->nonblock = (fcntl(fd, F_GETFL, 0) & O_NONBLOCK) != 0;
+	pc->since = time(NULL);
+	pc->next = srv->idle;
+	srv->idle = pc;
+	srv->idle_count++;
+	sem_post(&b->lock);
+}
@@ -0,0 +1,20 @@
+#ifndef POOL_H
+#define POOL_H
+
+#define POOL_BUCKETS 64       //hash buckets of the upstream connection pool
+#define POOL_MAX_IDLE 8       //default idle connections kept per server
+#define POOL_IDLE_TIMEOUT 30  //seconds an idle connection is kept for
+
+void
+init_pool(int max_idle, int idle_timeout);
+
+int
+pool_enabled();
+
+int
+pool_take(const char *host, const char *port, int nonblock);
+
+void
+pool_give(const char *host, const char *port, int fd);
+
+#endif
@@ -9,28 +9,79 @@
 
 #define _GNU_SOURCE
 
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <netdb.h>
 #include <unistd.h>
 
 #include "time.h"
 #include "network.h"
 #include "cache.h"
+#include "flight.h"
+#include "disk.h"
+#include "http.h"
+#include "snapshot.h"
 #include "project_4.h"
+#include "event.h"
+#include "queue.h"
+#include "pool.h"
+#include "dns.h"
+#include "refresh.h"
+#include "range.h"
+#include "compress.h"
+#include "cold.h"
+#include "log.h"
+#include "stats.h"
 
 const char* ERROR_MSG = "HTTP/1.1 403 Forbidden\r\n\r\n";
-int count = 0; //total number of requests
-int thread_count = 0; //total number of threads currently running
+const char* BUSY_MSG = "HTTP/1.1 503 Service Unavailable\r\n"
+	"Content-Length: 0\r\n\r\n";
+const char* GATEWAY_MSG = "HTTP/1.1 502 Bad Gateway\r\n"
+	"Content-Length: 0\r\n\r\n";
+const char* TOO_LARGE_MSG = "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+	"Content-Length: 0\r\n\r\n";
+int count = 0; //total number of requests, only updated atomically
+int thread_count = 0; //total number of busy connections, ditto
 struct options opt; //global settings/options
-sem_t mutex; //semaphore for mutual exclusion
+struct fresh_stats fresh_stats; //how cache lookups turned out, only updated atomically
+C_queue conn_queue; //accepted connections waiting for a worker
 
 
+/*
+ * Logs the page <host><path> of <size> bytes having been added to, skipped
+ * by or removed from the cache, according to <type>.
+ */
+static void
+log_page(int type, const char *host, const char *path, long size)
+{
+	L_record* r = log_begin(type, LOG_INFO);
+	if (r == NULL) return;
+
+	r->mb = (float)size/BYTESINMB;
+	log_string(r, host);
+	log_string(r, path);
+	log_commit(r);
+}
+
+/*
+ * Logs the cache removal info for the block <min> evicted by make_space().
+ */
+static void
+report_removal(C_block* min)
+{
+	log_page(RECORD_REMOVED, min->host, min->path, min->size);
+}
+
 /*
  * Free cache space until we have at least <nbytes> bytes free.
  */
@@ -41,46 +92,34 @@ make_space(long nbytes) {
 
 	//keep removing the lowest LRU until we good
 	while (!can_fit(nbytes)) {
-		//find min
-		C_block* min = find_lru();
-		if (min == NULL) return -1;
-
-		//print cache removal info
-		struct timeval tv;
-		gettimeofday(&tv, NULL);
-		printf("################# CACHE REMOVED #################\n");
-		printf("> %s%s %.2fMB @ ", min->host, min->path,
-				(float)min->size/BYTESINMB);
-		print_time(&tv);
-		printf("> This file has been removed due to LRU!\n");
-		free_cache_block(min);
+		if (evict_lru(&report_removal) == -1) return -1;
 	}
 	return 0;
 }
 
 /*
- * Adds the response text <res_text> to the cache.
+ * Adds the response text <res_text> to the cache, the first <header_length>
+ * bytes of which are the header.
  *
  * If the total size of the response is known, we check to see if we can fit
- * the entire thing.
+ * the entire thing, and the cache stores it in one piece.
  *
  * If we successfully add to the cache, return a pointer to the cache block.
  * Return NULL otherwise.
  */
 C_block*
-safe_add_cache(char* host, char* path, char* res_text, long nbytes, struct response res)
+safe_add_cache(char* host, char* path, char* res_text, long nbytes, long header_length, struct response res)
 {
-	long total_size = res.has_length ? atof(res.c_length) : nbytes;
-	struct timeval tv;
+	long body = expected_body(&res);
+	long total = body >= 0 ? header_length + body : -1;
+	long total_size = total >= 0 ? total : nbytes;
+
+	//the server asked us not to
+	if (res.no_store) return NULL;
 
 	//if we can't fit the entire file then just return
 	if (!could_fit(total_size)) {
-		printf("################## CACHE SKIP ###################\n");
-		printf("> %s%s %.2fMB @ ", host, path, (float)total_size/BYTESINMB);
-		printf("> This file is too big for the cache!\n");
-		gettimeofday(&tv, NULL);
-		print_time(&tv);
-		printf("#################################################\n");
+		log_page(RECORD_SKIP, host, path, total_size);
 		return NULL;
 	}
 
@@ -89,370 +128,1319 @@ safe_add_cache(char* host, char* path, char* res_text, long nbytes, struct respo
 		return NULL;
 	}
 
-	C_block* block = add_cache(host, path, res_text, nbytes, res.status_no, res.status, res.has_type, res.c_type);
+	C_block* block = add_cache(host, path, res_text, nbytes, total, res.status_no, res.status, res.has_type, res.c_type);
 	if (block != NULL) {
-		printf("################## CACHE ADDED ##################\n");
-		printf("> %s%s %.2fMB @ ", host, path, (float)total_size/BYTESINMB);
-		gettimeofday(&tv, NULL);
-		print_time(&tv);
-		printf("> This file has been added to the cache\n");
-		printf("#################################################\n");
+		//nobody else can see the block until it's finished
+		block->keep_alive = can_persist(&res);
+		set_expiry(block, fresh_until(&res));
+		log_page(RECORD_ADDED, host, path, total_size);
 	}
 	return block;
 }
 
+/*
+ * Logs the banner for a new request <req> from the client at
+ * <hoststr>:<portstr>, received at time <start>.
+ */
+void
+log_request(struct request* req, char* hoststr, char* portstr, struct timeval* start)
+{
+	L_record* r = log_begin(RECORD_REQUEST, LOG_INFO);
+	if (r == NULL) return;
+
+	r->tv = *start;
+	r->n[0] = __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	r->n[1] = __atomic_load_n(&thread_count, __ATOMIC_RELAXED);
+	r->n[2] = opt.max_conn;
+	r->n[3] = get_cache_count();
+	r->n[4] = opt.max_size;
+	r->mb = (float)get_current_cache_size()/BYTESINMB;
+	log_string(r, hoststr);
+	log_string(r, portstr);
+	log_string(r, req->host);
+	log_string(r, req->path);
+	log_string(r, req->useragent);
+	log_commit(r);
+}
+
+/*
+ * Logs the info for a request served from the cache block <c_block>.
+ */
+void
+log_cache_hit(C_block* c_block, struct timeval* start)
+{
+	stats_done(STAT_HIT, start);
+	L_record* r = log_begin(RECORD_HIT, LOG_INFO);
+	if (r == NULL) return;
+
+	r->status = c_block->status_no;
+	r->ms = ms_elapsed(start, &r->tv);
+	log_string(r, c_block->status);
+	if (c_block->has_type) log_string(r, c_block->c_type);
+	log_commit(r);
+}
+
+/*
+ * Logs the info for a request served from the disk entry <e>. <promoted>
+ * is true if the hit moved it back into memory.
+ */
+void
+log_disk_hit(D_entry* e, int promoted, struct timeval* start)
+{
+	stats_done(STAT_HIT, start);
+	L_record* r = log_begin(RECORD_DISK_HIT, LOG_INFO);
+	if (r == NULL) return;
+
+	r->status = e->status_no;
+	r->ms = ms_elapsed(start, &r->tv);
+	r->n[0] = promoted;
+	log_string(r, e->status);
+	if (e->has_type) log_string(r, e->c_type);
+	log_commit(r);
+}
+
+/*
+ * Logs the request <req> we are forwarding to the server.
+ */
+void
+log_forward(struct request* req)
+{
+	L_record* r = log_begin(RECORD_FORWARD, LOG_INFO);
+	log_string(r, req->host);
+	log_string(r, req->path);
+	log_string(r, req->useragent);
+	log_commit(r);
+}
+
+/*
+ * Logs the status line of the response <res> we got back from the server.
+ */
+void
+log_response(struct response* res)
+{
+	L_record* r = log_begin(RECORD_RESPONSE, LOG_INFO);
+	if (r == NULL) return;
+
+	r->status = res->status_no;
+	log_string(r, res->status);
+	log_string(r, res->c_type);
+	log_commit(r);
+}
+
+/*
+ * Logs the info for the response <res> having been fully relayed to the
+ * client, <start> being the time the request came in. <class> is STAT_MISS
+ * if the response was cached on the way, STAT_SKIP if it wasn't, and -1 if
+ * there was no client to count it for.
+ */
+void
+log_relayed(struct response* res, struct timeval* start, int class)
+{
+	if (class >= 0) stats_done(class, start);
+	L_record* r = log_begin(RECORD_RELAYED, LOG_INFO);
+	if (r == NULL) return;
+
+	r->status = res->status_no;
+	r->ms = ms_elapsed(start, &r->tv);
+	log_string(r, res->status);
+	log_string(r, res->c_type);
+	log_commit(r);
+}
+
+/*
+ * Writes the response segments starting at <r> to <fd>, handing up to
+ * IOV_BATCH of them to each writev() call.
+ *
+ * Returns -1 if the write failed, 0 otherwise.
+ */
+int
+write_blocks(int fd, R_block* r)
+{
+	struct iovec iov[IOV_BATCH];
+
+	while (r != NULL) {
+		int n = 0;
+		for (; r != NULL && n < IOV_BATCH; r = r->next) {
+			iov[n].iov_base = r->text;
+			iov[n].iov_len = r->size;
+			n++;
+		}
+
+		//carry on where a short write left off
+		struct iovec* v = iov;
+		while (n > 0) {
+			ssize_t written = writev(fd, v, n);
+			if (written == -1) {
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			stats_bytes(STAT_CLIENT_OUT, written);
+			while (n > 0 && (size_t) written >= v->iov_len) {
+				written -= v->iov_len;
+				v++;
+				n--;
+			}
+			if (n > 0) {
+				v->iov_base = (char*) v->iov_base + written;
+				v->iov_len -= written;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns the cached response in <c_block> to send for the client request
+ * <req>: just the parts of it asked for by its Range field if it can be
+ * served in parts (see range_cached()), or else the variant of it matching
+ * its Accept-Encoding field (see choose_variant()), unpacked first if it's
+ * been packed (see cold.c).
+ *
+ * If the response had to be put together for this request, <view> is set to
+ * it and it must be freed with free_view() once sent. Returns NULL if that
+ * failed.
+ */
+R_block*
+cached_response(C_block* c_block, struct request* req, R_block** view)
+{
+	*view = req->range[0] != '\0' ? range_cached(c_block, req->range) : NULL;
+	if (*view != NULL) return *view;
+
+	R_block* r = choose_variant(c_block, req->has_encoding ? req->encoding : NULL);
+	if (r == c_block->response && c_block->packed) {
+		r = *view = cold_hit(c_block, opt.comp_enabled);
+	}
+	return r;
+}
+
+/*
+ * Writes the cached response in <c_block> to <fd> for the client request
+ * <req>, see cached_response().
+ *
+ * Returns -1 if the write failed, 0 otherwise.
+ */
+int
+write_cached(int fd, C_block* c_block, struct request* req)
+{
+	R_block* view;
+	R_block* r = cached_response(c_block, req, &view);
+	if (r == NULL) return -1;
+	int result = write_blocks(fd, r);
+	free_view(view);
+	return result;
+}
+
 /*
  * Check the cache to see if we have accessed the page before. If we have,
- * serve the page directly from the cache.
+ * serve the page directly from the cache. We only hold a reference to the
+ * cached block while writing it out, so slow clients don't hold anyone up.
+ * What exactly is served depends on the client request <req>, see
+ * write_cached().
+ * <keep_alive> is set to whether the cached response lets the client send
+ * another request on the same connection, which it can't if the response
+ * didn't get through.
+ *
+ * A response that has gone stale isn't served, unless it's still within
+ * the -swr window, in which case it's refreshed in the background. If
+ * <stale> isn't NULL it's set to the block instead, for revalidating it
+ * with the server, and the caller has to release it.
  *
  * Returns true if we successfully served from the cache, and false otherwise.
  */
 int
-check_cache(char* host, char* path, int connfd, struct timeval* start) {
-	C_block* c_block = search_cache(host, path);
+check_cache(struct request* req, int connfd, struct timeval* start, int* keep_alive, C_block** stale) {
+	C_block* c_block = search_cache(req->host, req->path);
 	if (c_block == NULL) return 0;
 
-	R_block* r_block = c_block->response;
-	write(connfd, r_block->text, r_block->size);
-	while (r_block->next != NULL) {
-		r_block = r_block->next;
-		write(connfd, r_block->text, r_block->size);
+	if (is_stale(c_block)) {
+		if (refresh_enabled() && may_serve_stale(c_block, opt.stale_window)) {
+			//the client gets our copy right away, the server can take its time
+			refresh_later(req->host, req->path);
+			__atomic_add_fetch(&fresh_stats.stale, 1, __ATOMIC_RELAXED);
+		} else {
+			if (stale != NULL) *stale = c_block;
+			else release_cache(c_block);
+			return 0;
+		}
+	} else {
+		__atomic_add_fetch(&fresh_stats.hits, 1, __ATOMIC_RELAXED);
 	}
-	struct timeval end;
-	gettimeofday(&end, NULL);
 
-	printf("@@@@@@@@@@@@@@@@@@ CACHE HIT @@@@@@@@@@@@@@@@@@@@\n");
-	printf("[CLI <== PRX --- SRV] @ ");
-	print_time(&end);
-	printf("> %d %s\n", c_block->status_no, c_block->status);
-	if (c_block->has_type) {
-		printf("> %s\n", c_block->c_type);
+	*keep_alive = c_block->keep_alive;
+
+	//a client that went away mid-response can't send another request
+	if (write_cached(connfd, c_block, req) == -1) *keep_alive = 0;
+
+	log_cache_hit(c_block, start);
+	release_cache(c_block);
+	return 1;
+}
+
+/*
+ * Writes the fields asking the server whether the response in <c_block> is
+ * still good into <out>, which can hold <size> bytes. They're made from its
+ * ETag and Last-Modified fields, and left empty if it has neither.
+ */
+void
+conditional_fields(C_block* c_block, char* out, size_t size)
+{
+	char* text = (char*) c_block->response->text;
+	H_parser parser;
+	http_init(&parser);
+	out[0] = '\0';
+	if (http_parse(&parser, text, c_block->response->size) != HTTP_DONE) return;
+
+	H_view* etag = http_find(&parser, text, "ETag");
+	H_view* modified = http_find(&parser, text, "Last-Modified");
+	size_t len = 0;
+	if (etag != NULL) {
+		len += snprintf(out, size, "If-None-Match: %.*s\r\n", etag->len, text + etag->off);
+	}
+	if (modified != NULL && len < size) {
+		len += snprintf(out + len, size - len, "If-Modified-Since: %.*s\r\n",
+				modified->len, text + modified->off);
+	}
+
+	//half a field would be worse than none
+	if (len >= size) out[0] = '\0';
+}
+
+/*
+ * Makes the stale response in <c_block> fresh again, now that the server
+ * answered <res> (a 304 Not Modified) to our conditional request for it.
+ * The new freshness lifetime comes from <res> if it has one, and from the
+ * cached response otherwise.
+ */
+void
+revalidate_cache(C_block* c_block, struct response* res)
+{
+	char* text = (char*) c_block->response->text;
+	H_parser parser;
+	http_init(&parser);
+	http_parse(&parser, text, c_block->response->size);
+
+	struct response stored;
+	parse_response(&parser, text, &stored);
+	if (res->max_age >= 0 || res->expires != -1) {
+		stored.max_age = res->max_age;
+		stored.expires = res->expires;
 	}
-	printf("# %ldms\n", ms_elapsed(start, &end));
+	if (res->last_modified != -1) stored.last_modified = res->last_modified;
+	stored.date = res->date;
+	stored.age = res->age;
+	set_expiry(c_block, fresh_until(&stored));
+}
+
+/*
+ * Returns true if the stale response in <c_block> went stale less than
+ * <window> seconds ago, and the server didn't ask for it to be revalidated
+ * before it's used again.
+ */
+int
+may_serve_stale(C_block* c_block, long window)
+{
+	long expires = __atomic_load_n(&c_block->expires, __ATOMIC_RELAXED);
+	if (time(NULL) - expires >= window) return 0;
+
+	char* text = (char*) c_block->response->text;
+	H_parser parser;
+	http_init(&parser);
+	if (http_parse(&parser, text, c_block->response->size) != HTTP_DONE) return 0;
+
+	struct response res;
+	parse_response(&parser, text, &res);
+	return !res.must_revalidate;
+}
+
+/*
+ * Serves the stale response in <c_block> to the client at <connfd> because
+ * the server failed us, if may_serve_stale() allows it within <window>
+ * seconds. <req>, <start> and <keep_alive> work like in check_cache().
+ *
+ * Returns true if the response was served, and false otherwise.
+ */
+int
+serve_stale(C_block* c_block, long window, struct request* req, int connfd, struct timeval* start, int* keep_alive)
+{
+	if (c_block == NULL || !may_serve_stale(c_block, window)) return 0;
+	__atomic_add_fetch(&fresh_stats.stale_errors, 1, __ATOMIC_RELAXED);
+
+	log_note(LOG_WARN, "[SRV failed, serving stale copy]");
+	*keep_alive = c_block->keep_alive;
+	if (write_cached(connfd, c_block, req) == -1) *keep_alive = 0;
+	log_cache_hit(c_block, start);
 	return 1;
 }
 
 /*
- * The main function for the thread.
+ * Check the disk tier for the page, and serve it from there if it's there.
+ * Works like check_cache().
  *
- * Stores the request info and handles GET requests. Writes an error to the
- * socket for all other request methods or HTTPS requests.
+ * Returns true if we successfully served from disk, and false otherwise.
  */
-void*
-thread_main(void* params)
+int
+check_disk(char* host, char* path, int connfd, struct timeval* start, int* keep_alive) {
+	D_entry* e = disk_lookup(host, path);
+	if (e == NULL) return 0;
+	if (disk_is_stale(e)) {
+		disk_release(e);
+		return 0;
+	}
+	__atomic_add_fetch(&fresh_stats.hits, 1, __ATOMIC_RELAXED);
+
+	*keep_alive = e->keep_alive;
+	if (disk_send(e, connfd) == -1) *keep_alive = 0;
+
+	log_disk_hit(e, disk_promote(e), start);
+	disk_release(e);
+	return 1;
+}
+
+/*
+ * Returns true if the client that sent <req> wants to keep the connection
+ * open for more requests.
+ */
+int
+wants_keep_alive(struct request* req)
 {
-	/* Cast the pointer to the correct type. */ 
-	struct thread_params* p = (struct thread_params*) params;
-	pthread_detach(pthread_self()); //we are never ever ever getting back together
+	if (strcmp(req->http_v, "HTTP/1.0") == 0) {
+		return req->has_connection && strcmp(req->connection, "keep-alive") == 0;
+	}
+	return !req->has_connection || strcmp(req->connection, "close") != 0;
+}
 
-	char buf[MAX_BUF]; //buffer for messages
+/*
+ * Reads requests from the client connection <p> and handles GET requests.
+ * Writes an error to the socket for all other request methods or HTTPS
+ * requests, and a 431 for a header that doesn't fit in MAX_BUF.
+ *
+ * With persistent connections enabled (-pc) we keep going until the client
+ * closes the connection, asks us to, sits idle for too long or reaches the
+ * request limit. Requests can be pipelined: whatever the client sends after
+ * the current request stays in the buffer, and is answered in order once
+ * we're done with the current one.
+ */
+void
+serve_client(struct thread_params* p)
+{
+	char buf[MAX_BUF]; //received requests we haven't handled yet
+	long len = 0;
 	int nbytes; //the number of received bytes
-	struct request req;
-	memset(&req, 0, sizeof(req));
+	int served = 0;
+	int keep_alive = 1;
 
-	if ((nbytes = recv(p->connfd, buf, MAX_BUF, 0)) > 0) {
-		//we received a request!
-		if (parse_request(buf, &req) != -1 && strcmp(req.method, "GET") == 0) {
-			handle_request(req, p);
-		} else {
+	if (opt.pc_enabled) {
+		struct timeval timeout = { PC_IDLE_TIMEOUT, 0 };
+		setsockopt(p->connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	}
+
+	while (keep_alive) {
+		//wait until we have the whole header of the next request, or as
+		//much of it as we can hold
+		H_parser parser;
+		http_init(&parser);
+		while (http_parse(&parser, buf, len) == HTTP_MORE && len < MAX_BUF - 1) {
+			if ((nbytes = recv(p->connfd, buf + len, MAX_BUF - 1 - len, 0)) <= 0) {
+				//closed by the client, or it has been idle for too long
+				keep_alive = 0;
+				break;
+			}
+			stats_bytes(STAT_CLIENT_IN, nbytes);
+			len += nbytes;
+		}
+		if (!keep_alive) break;
+
+		if (parser.state == HTTP_MORE) {
+			//the header doesn't fit in the buffer, and we can't serve
+			//half of it
+			write(p->connfd, TOO_LARGE_MSG, strlen(TOO_LARGE_MSG));
+			break;
+		}
+
+		long header_length = parser.state == HTTP_DONE ? parser.pos : len;
+		struct request req;
+		int ok = parse_request(&parser, buf, &req) != -1 && strcmp(req.method, "GET") == 0;
+
+		//leave just the pipelined requests in the buffer
+		memmove(buf, buf + header_length, len - header_length);
+		len -= header_length;
+
+		if (!ok) {
 			//Return a 403 Forbidden error if they attempt to load
 			//something needing SSL/HTTPS
 			write(p->connfd, ERROR_MSG, strlen(ERROR_MSG));
-			close(p->connfd);
+			break;
 		}
+
+		served++;
+		keep_alive = handle_request(req, p) && opt.pc_enabled &&
+			wants_keep_alive(&req) && served < PC_MAX_REQUESTS;
 	}
+	close(p->connfd);
+	if (served > 0) log_note(LOG_DEBUG, "[CLI disconnected]");
+}
 
-	sem_wait(&mutex);
-	thread_count--;
-	sem_post(&mutex);
-	free(params);
+/*
+ * The main function for the worker threads.
+ *
+ * Workers are spawned once at startup and spend their lives taking accepted
+ * connections off the queue and serving them. <thread_count> is the number
+ * of workers currently busy with a connection.
+ */
+void*
+thread_main(void* arg)
+{
+	(void) arg;
+	pthread_detach(pthread_self()); //we are never ever ever getting back together
+
+	struct thread_params p;
+	while (1) {
+		dequeue(&conn_queue, &p);
+		__atomic_add_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+		serve_client(&p);
+		__atomic_sub_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+	}
 	return NULL;
 }
 
 /*
- * Traverses <response> and stores attribute information into the response
- * structure pointed to by <res>. Returns the length of the response header.
+ * Returns true if the Vary field <v> of <buf> names anything but
+ * Accept-Encoding, in which case one cached response can't serve everyone.
  */
-int
-parse_response(char* response, struct response* r_ptr)
+static int
+varies(const char *buf, H_view v)
+{
+	const char* s = buf + v.off;
+	const char* end = s + v.len;
+	while (s < end) {
+		while (s < end && (*s == ' ' || *s == '\t' || *s == ',')) s++;
+		const char* token = s;
+		while (s < end && *s != ',' && *s != ' ' && *s != '\t') s++;
+		if (s > token && !(s - token == 15 && strncasecmp(token, "Accept-Encoding", 15) == 0)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Stores what <parser> found in the response header at the start of
+ * <response> into the response structure pointed to by <r_ptr>. The parser
+ * must have been run over the header first, see http_parse().
+ *
+ * Returns the length of the response header.
+ */
+long
+parse_response(H_parser* parser, char* response, struct response* r_ptr)
 {
-	//printf("\n\nPARSE RESPONSE: <%s>\n\n", response);
 	r_ptr->has_length = 0;
 	r_ptr->has_type = 0;
-	//scan the method and url into the pointer
-	if (sscanf(response, "%s %d %[^\r\n]\r\n", r_ptr->http_v,
-			&r_ptr->status_no, r_ptr->status) < 3) {
+	r_ptr->chunked = 0;
+	r_ptr->conn_close = 0;
+	r_ptr->status_no = 0;
+	r_ptr->no_store = 0;
+	r_ptr->must_revalidate = 0;
+	r_ptr->max_age = -1;
+	r_ptr->age = 0;
+	r_ptr->date = r_ptr->expires = r_ptr->last_modified = -1;
+
+	H_view* start = parser->start;
+	for (int i = 0; i < start[1].len && i < 3; i++) {
+		char digit = response[start[1].off + i];
+		if (digit < '0' || digit > '9') break;
+		r_ptr->status_no = r_ptr->status_no * 10 + digit - '0';
+	}
+	if (parser->state == HTTP_ERROR || r_ptr->status_no == 0) {
+		r_ptr->http_v[0] = r_ptr->status[0] = '\0';
+		r_ptr->conn_close = 1;
 		return 0;
 	}
-
-	char* token, * string, * tofree;
-	tofree = string = strdup(response);
-	//loop through the request line by line (saved to token)
-	while ((token = strsep(&string, "\r\n")) != NULL) {
-		if (strncmp(token, "Content-Type: ", 14) == 0) {
-			char* type = token + 14;
-			strncpy(r_ptr->c_type, type, sizeof(r_ptr->c_type));
+	http_copy(response, start[0], r_ptr->http_v, sizeof(r_ptr->http_v));
+	http_copy(response, start[2], r_ptr->status, sizeof(r_ptr->status));
+
+	//HTTP/1.0 servers close the connection unless they say otherwise, and
+	//if the header didn't fit in our buffer we can't tell where it ends
+	int keep_alive = !http_is(response, start[0], "HTTP/1.0") &&
+		parser->state == HTTP_DONE;
+
+	long s_maxage = -1; //max-age for shared caches like us, which wins
+	int no_cache = 0;   //true if the response has to be revalidated every time
+	for (int i = 0; i < parser->count; i++) {
+		H_view name = parser->fields[i].name;
+		H_view value = parser->fields[i].value;
+
+		if (http_is(response, name, "Content-Type")) {
+			http_copy(response, value, r_ptr->c_type, sizeof(r_ptr->c_type));
 			r_ptr->has_type = 1;
 		}
-		else if (strncmp(token, "Content-Length: ", 16) == 0) {
-			char* len = token + 16;
-			strncpy(r_ptr->c_length, len, sizeof(r_ptr->c_length));
+		else if (http_is(response, name, "Content-Length")) {
+			http_copy(response, value, r_ptr->c_length, sizeof(r_ptr->c_length));
 			r_ptr->has_length = 1;
 		}
-		else if (strlen(token) == 0) {
-			//we've reached the end of the header, expecting body now
-			break;
+		else if (http_is(response, name, "Transfer-Encoding")) {
+			r_ptr->chunked = http_has_token(response, value, "chunked");
 		}
-		//skip over the \n character and break when we reach the end
-		if (strlen(string) <= 2) {
-			break;
+		else if (http_is(response, name, "Connection")) {
+			keep_alive &= !http_has_token(response, value, "close");
+		}
+		else if (http_is(response, name, "Cache-Control")) {
+			r_ptr->no_store |= http_has_token(response, value, "no-store") ||
+				http_has_token(response, value, "private");
+			no_cache |= http_has_token(response, value, "no-cache");
+			r_ptr->must_revalidate |= http_has_token(response, value, "must-revalidate") ||
+				http_has_token(response, value, "proxy-revalidate");
+			long seconds = http_directive(response, value, "max-age");
+			if (seconds >= 0) r_ptr->max_age = seconds;
+			seconds = http_directive(response, value, "s-maxage");
+			if (seconds >= 0) s_maxage = seconds;
+		}
+		else if (http_is(response, name, "Expires")) {
+			//a date we can't read means it has already expired
+			r_ptr->expires = http_date(response, value);
+			if (r_ptr->expires == -1) r_ptr->expires = 0;
+		}
+		else if (http_is(response, name, "Date")) {
+			r_ptr->date = http_date(response, value);
+		}
+		else if (http_is(response, name, "Last-Modified")) {
+			r_ptr->last_modified = http_date(response, value);
+		}
+		else if (http_is(response, name, "Age")) {
+			r_ptr->age = atol(response + value.off);
+		}
+		else if (http_is(response, name, "Vary")) {
+			//we keep one response per page and pick the encoding ourselves
+			r_ptr->no_store |= varies(response, value);
 		}
-		string += 1;
 	}
 
-	//calculate header length (the plus one for the \n i believe)
-	long header_length = strlen(response) - strlen(string) + 1;
-	free(tofree);
-	return header_length;
+	if (s_maxage >= 0) r_ptr->max_age = s_maxage;
+	if (no_cache) r_ptr->max_age = 0;
+	r_ptr->must_revalidate |= no_cache;
+
+	//a chunked response has no use for its length
+	if (r_ptr->chunked) r_ptr->has_length = 0;
+	r_ptr->conn_close = !keep_alive;
+	return parser->pos;
 }
 
 /*
- * Reads through the request and extracts any useful information
- * into struct request pointed to by <req>.
+ * Stores what <parser> found in the request header at the start of
+ * <request> into struct request pointed to by <rptr>. The parser must have
+ * been run over the header first, see http_parse().
+ *
+ * The page is the target of the request if it's in absolute form
+ * (http://host/path), otherwise the Host field and the target.
+ *
  * Returns 0 if successful, -1 otherwise.
  */
 int
-parse_request(char* request, struct request* rptr)
+parse_request(H_parser* parser, char* request, struct request* rptr)
 {
-	//printf("\n\nPARSE REQUEST: <%s>\n\n", request);
-	//scan the method and url into the pointer
-	if (sscanf(request, "%s %s %s\r\n", rptr->method, rptr->url,
-				rptr->http_v) < 3) {
+	H_view* start = parser->start;
+	if (parser->state == HTTP_ERROR || start[2].len == 0 ||
+			start[0].len >= (int) sizeof(rptr->method) ||
+			start[1].len >= (int) sizeof(rptr->url) ||
+			start[2].len >= (int) sizeof(rptr->http_v)) {
 		return -1;
 	}
+	http_copy(request, start[0], rptr->method, sizeof(rptr->method));
+	http_copy(request, start[1], rptr->url, sizeof(rptr->url));
+	http_copy(request, start[2], rptr->http_v, sizeof(rptr->http_v));
 
 	rptr->has_connection = 0;
 	rptr->has_encoding = 0;
-
-	char* token, * string, * tofree;
-	tofree = string = strdup(request);
-	//loop through the request line by line (saved to token)
-	while ((token = strsep(&string, "\r\n")) != NULL) {
-		if (strncmp(token, "Host: ", 6) == 0) {
-			char* host = token + 6;
-			strncpy(rptr->host, host, sizeof(rptr->host));
-
-			char* path_offset = strstr(rptr->url, host);
-			path_offset+=strlen(host);
-			strncpy(rptr->path, path_offset, sizeof(rptr->path));
-		}
-		else if (strncmp(token, "Connection: ", 12) == 0) {
-			char* conn = token + 12;
-			strncpy(rptr->connection, conn, sizeof(rptr->connection));
+	rptr->useragent[0] = '\0';
+	rptr->conditional[0] = '\0';
+	rptr->range[0] = '\0';
+	rptr->upstream_range[0] = '\0';
+
+	int if_range = 0;
+	H_view host = { 0, 0 };
+	for (int i = 0; i < parser->count; i++) {
+		H_view name = parser->fields[i].name;
+		H_view value = parser->fields[i].value;
+
+		if (http_is(request, name, "Host")) {
+			host = value;
+		}
+		else if (http_is(request, name, "Connection")) {
+			http_copy(request, value, rptr->connection, sizeof(rptr->connection));
 			rptr->has_connection = 1;
 		}
-		else if (strncmp(token, "Accept-Encoding: ", 17) == 0) {
-			char* enc = token + 17;
-			strncpy(rptr->encoding, enc, sizeof(rptr->encoding));
-			rptr->has_encoding= 1;
+		else if (http_is(request, name, "Accept-Encoding")) {
+			http_copy(request, value, rptr->encoding, sizeof(rptr->encoding));
+			rptr->has_encoding = 1;
 		}
-		else if (strncmp(token, "User-Agent: ", 12) == 0) {
-			char* userag = token + 12;
-			strncpy(rptr->useragent, userag, sizeof(rptr->useragent));
+		else if (http_is(request, name, "User-Agent")) {
+			http_copy(request, value, rptr->useragent, sizeof(rptr->useragent));
 		}
-		else if (strlen(token) == 0) {
-			//we've reached the end of the header, expecting body now
-			break;
+		else if (http_is(request, name, "Range") && value.len < (int) sizeof(rptr->range)) {
+			http_copy(request, value, rptr->range, sizeof(rptr->range));
 		}
-		//skip over the \n character and break when we reach the end
-		if (strlen(string) <= 2) {
-			break;
+		else if (http_is(request, name, "If-Range")) {
+			if_range = 1;
 		}
-		string += 1;
 	}
-	free(tofree);
+
+	//we can't tell if our copy is the one the client has parts of, and the
+	//whole page is always a fine answer
+	if (if_range) rptr->range[0] = '\0';
+
+	H_view path = start[1];
+	if (path.len >= 7 && strncasecmp(request + path.off, "http://", 7) == 0) {
+		//the host in the target wins over the Host field
+		host = (H_view) { path.off + 7, 0 };
+		while (host.len < path.len - 7 && request[host.off + host.len] != '/' &&
+				request[host.off + host.len] != '?') {
+			host.len++;
+		}
+		path.off = host.off + host.len;
+		path.len -= 7 + host.len;
+	} else if (request[path.off] != '/') {
+		//anything else needs a tunnel (or isn't a page at all)
+		return -1;
+	}
+	if (host.len == 0 || host.len >= (int) sizeof(rptr->host)) return -1;
+	http_copy(request, host, rptr->host, sizeof(rptr->host));
+
+	//the path always starts with a slash, even if the target left it out
+	char* out = rptr->path;
+	if (path.len == 0 || request[path.off] != '/') *out++ = '/';
+	http_copy(request, path, out, sizeof(rptr->path) - (out - rptr->path));
 	return 0;
 }
 
 /*
- * Generates a custom request and sends it to the socket at <servconn>.
+ * Generates the custom request we send to the server for <req> into <out>,
+ * which can hold <size> bytes.
+ *
+ * Returns the length of the generated request.
  */
-ssize_t
-send_request(int servconn, struct request req)
+int
+build_request(struct request* req, char* out, size_t size)
 {
-	char enc[256];
-	if (req.has_encoding) {
-		snprintf(enc, sizeof enc, "Accept-Encoding: %s\r\n", req.encoding);
-	}
-	char* extra1 = opt.comp_enabled ? enc : "";
+	//the connection to the server is ours, not the client's, but we need a
+	//framed response if either of them is going to be reused
+	char* extra = pool_enabled() || opt.pc_enabled ? "Connection: keep-alive\r\n"
+		: "Connection: close\r\n";
 
-	char conn[256];
-	if (req.has_connection) {
-		snprintf(conn, sizeof conn, "Connection: %s\r\n", req.encoding);
-	}
-	char* extra2 = opt.pc_enabled ? conn : "";
-
-	char request[2048];
-	snprintf(request, sizeof(request),
+	int len = snprintf(out, size,
 			"GET %s HTTP/1.1\r\n"
 			"Host: %s\r\n"
 			"User-Agent: %s\r\n"
 			"%s"
 			"%s"
-			"\r\n", req.path, req.host, req.useragent, extra1, extra2);
+			"%s"
+			"\r\n", req->path, req->host, req->useragent, extra,
+			req->conditional, req->upstream_range);
+	return len < (int) size ? len : (int) size - 1;
+}
 
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
+/*
+ * Generates a custom request and sends it to the socket at <servconn>.
+ */
+ssize_t
+send_request(int servconn, struct request req)
+{
+	char request[MAX_BUF];
+	int len = build_request(&req, request, sizeof(request));
 
-	printf("[CLI --- PRX ==> SRV] @ ");
-	print_time(&tv);
-	printf("> GET %s%s\n", req.host, req.path);
-	printf("> %s\n", req.useragent);
-	//printf("%s\n", request);
-	return write(servconn, request, strlen(request));
+	log_forward(&req);
+	ssize_t sent = write(servconn, request, len);
+	stats_bytes(STAT_SERVER_OUT, sent);
+	return sent;
 }
 
 /*
- * Actually process the request.
+ * Feeds the <nbytes> body bytes at <buf> of a chunked response to the
+ * decoder <chunks>. If <c_block> is storing the response without its
+ * chunks (see add_dechunked()), the chunk data is added to it.
+ *
+ * Returns true if a fail occured adding to the block.
+ */
+int
+dechunk(H_chunked* chunks, char* buf, long nbytes, C_block* c_block)
+{
+	int failed = 0;
+	long off = 0;
+
+	while (off < nbytes && !http_chunked_done(chunks) && !http_chunked_failed(chunks)) {
+		H_view data;
+		long used = http_chunked(chunks, buf + off, nbytes - off, &data);
+		if (data.len > 0 && c_block != NULL) {
+			failed |= add_response_block(c_block, buf + off + data.off, data.len);
+		}
+		off += used;
+	}
+	return failed;
+}
+
+/*
+ * Adds the chunked response whose header <parser> parsed from <buf> to the
+ * cache, to be stored without its chunks (-dechunk). Its Transfer-Encoding
+ * is replaced by a Content-Length field, with room for the length at
+ * <length_at> until it's known.
  *
- * We access the cache in a mutually exclusive manner using semaphores.
+ * Returns the cache block, or NULL if it couldn't be added.
+ */
+C_block*
+add_dechunked(char* host, char* path, H_parser* parser, char* buf, struct response res, long* length_at)
+{
+	char header[MAX_BUF + 64];
+	long header_length = parser->pos;
+	long len = 0;
+	long from = 0;
+
+	//copy everything but the fields about the framing and the empty line
+	for (int i = 0; i < parser->count; i++) {
+		H_view name = parser->fields[i].name;
+		if (!http_is(buf, name, "Transfer-Encoding") &&
+				!http_is(buf, name, "Content-Length")) {
+			continue;
+		}
+		char* nl = memchr(buf + name.off, '\n', header_length - name.off);
+		memcpy(header + len, buf + from, name.off - from);
+		len += name.off - from;
+		from = nl - buf + 1;
+	}
+	long end = header_length - (buf[header_length - 2] == '\r' ? 2 : 1);
+	memcpy(header + len, buf + from, end - from);
+	len += end - from;
+
+	len += sprintf(header + len, "Content-Length: ");
+	*length_at = len;
+	len += sprintf(header + len, "%20s\r\n\r\n", "");
+
+	return safe_add_cache(host, path, header, len, len, res);
+}
+
+/*
+ * Fills in the length of the chunked response stored without its chunks in
+ * <c_block>, now that <chunks> has seen all of it. See add_dechunked().
  */
 void
-handle_request(struct request req, struct thread_params* p)
+finish_dechunked(C_block* c_block, H_chunked* chunks, long length_at)
 {
-	int connfd = p->connfd;
-	struct timeval start;
-	gettimeofday(&start, NULL);
+	char length[21];
+	int n = snprintf(length, sizeof(length), "%ld", chunks->body);
+	patch_response(c_block, length_at, length, n);
+}
 
-	sem_wait(&mutex);
-	printf("-----------------------------------------------\n");
-	printf("%d [Conn: %d/%d] [Cache: %.2f/%dMB] [Items: %d]\n\n",
-			++count, thread_count, opt.max_conn,
-			(float)get_current_cache_size()/BYTESINMB,
-			opt.max_size, get_cache_count());
-	printf("[CLI connected to %s:%s]\n", p->hoststr, p->portstr);
-	printf("[CLI ==> PRX --- SRV] @ ");
-	print_time(&start);
-	printf("> GET %s%s\n", req.host, req.path);
-	printf("> %s\n", req.useragent);
-
-	//if it's in the cache serve it from there
-	//if found, the LRU is increased which is why we need to have it in
-	//a mutex block
-	if (check_cache(req.host, req.path, connfd, &start)) {
-		close(connfd);
-		printf("[CLI disconnected]\n");
-		return;
-	}
-	sem_post(&mutex);
-
-	printf("################## CACHE MISS ###################\n");
-	int servconn = connect_host(req.host);
-	if (send_request(servconn, req) == -1) {
-		perror("Error writing to socket");
-		exit(1);
+/*
+ * Returns the number of body bytes to expect for the response <res>, or -1
+ * if we'll only know once we've seen the end of it.
+ */
+long
+expected_body(struct response* res)
+{
+	//these never have a body, whatever the headers say
+	if (res->status_no / 100 == 1 || res->status_no == 204 ||
+			res->status_no == 304) {
+		return 0;
 	}
-	printf("[SRV connected to %s:80]\n", req.host);
+	if (res->has_length) return atoll(res->c_length);
+	return -1;
+}
 
-	char buf[MAX_BUF]; //buffer for messages
-	long header_length;
-	struct response res;
-	struct timeval tv;
-
-	int nbytes = recv(servconn, buf, MAX_BUF,0);
-	long bytes_in = nbytes; //number of received bytes
-	long bytes_out = 0;
-
-	if (nbytes > 0) {
-		header_length = parse_response(buf, &res);
-		bytes_out += write(connfd, buf, nbytes);
-
-		gettimeofday(&tv, NULL);
-		printf("[CLI --- PRX <== SRV] @ ");
-		print_time(&tv);
-		printf("> %d %s\n", res.status_no, res.status);
-		printf("> %s\n", res.c_type);
-
-		C_block* c_block;
-		int failed = 0;
-
-		if (res.has_length) {
-			//we know exactly how many bytes we are expecting
-			//add this to the cache
-			sem_wait(&mutex);
-			c_block = safe_add_cache(req.host, req.path, buf, nbytes, res);
-			sem_post(&mutex);
-
-			//we know exactly how many bytes we're expecting
-			long bytes_left = atoll(res.c_length);
-			bytes_left -= (nbytes - header_length);
-			while (bytes_left > 0) {
-				memset(&buf, 0, sizeof(buf));
-				nbytes = recv(servconn, buf, MAX_BUF,0);
-				bytes_in += nbytes;
-				bytes_out += write(connfd, buf, nbytes);
-				bytes_left -= nbytes;
-
-				//add this to cache too
-				sem_wait(&mutex);
+/*
+ * Returns true if the response <res> is framed so that another one can
+ * follow it on the same connection, and the server doesn't mind that.
+ */
+int
+can_persist(struct response* res)
+{
+	return !res->conn_close && (res->chunked || expected_body(res) >= 0);
+}
+
+/*
+ * Returns when the response <res>, received just now, goes stale. This goes
+ * by its Cache-Control and Expires fields, or failing those, by how long ago
+ * it was last modified. Responses that say nothing at all stay fresh for
+ * FRESH_DEFAULT seconds.
+ */
+time_t
+fresh_until(struct response* res)
+{
+	time_t now = time(NULL);
+	time_t date = res->date != -1 && res->date < now ? res->date : now;
+	long lifetime;
+
+	if (res->max_age >= 0) {
+		lifetime = res->max_age;
+	} else if (res->expires != -1) {
+		lifetime = res->expires > date ? res->expires - date : 0;
+	} else if (res->last_modified != -1 && res->last_modified < date) {
+		//a page that hasn't changed in a while probably won't change soon
+		lifetime = (date - res->last_modified) / 10;
+		if (lifetime > FRESH_HEURISTIC_MAX) lifetime = FRESH_HEURISTIC_MAX;
+	} else {
+		lifetime = FRESH_DEFAULT;
+	}
+
+	//the time it spent in other caches and on the way here counts too
+	long age = res->age > now - date ? res->age : now - date;
+	return now + lifetime - age;
+}
+
+/*
+ * Relays <nbytes> bytes of a response body (or everything until the server
+ * closes the connection if <nbytes> is -1) from <servconn> to the client at
+ * <connfd> through a pipe, so that they never have to be copied into our
+ * memory. If the bytes are also needed for <c_block>, the followers of
+ * <flight> or the disk fill <disk>, they're duplicated into a second pipe
+ * with tee(). From there they're read, or moved straight into the file if
+ * only the disk needs them. <failed> is set if the cache block missed some
+ * of them.
+ *
+ * Returns the number of bytes relayed. This stops short if anything goes
+ * wrong with the pipes or the client, leaving the rest to the caller.
+ */
+long
+splice_body(int servconn, int connfd, long nbytes, C_block* c_block, F_entry* flight, D_fill* disk, int* failed)
+{
+	char buf[MAX_BUF];
+	int out[2]; //pipe towards the client
+	int copy[2] = { -1, -1 }; //pipe towards us
+	int keep_copy = c_block != NULL || flight != NULL || disk != NULL;
+	long relayed = 0;
+
+	if (pipe(out) == -1) return 0;
+	if (keep_copy && pipe(copy) == -1) {
+		close(out[0]);
+		close(out[1]);
+		return 0;
+	}
+
+	while (nbytes == -1 || relayed < nbytes) {
+		long want = nbytes == -1 || nbytes - relayed > SPLICE_SIZE
+			? SPLICE_SIZE : nbytes - relayed;
+		ssize_t n = splice(servconn, NULL, out[1], NULL, want,
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n <= 0) break;
+		stats_bytes(STAT_SERVER_IN, n);
+
+		if (keep_copy) {
+			//the copy pipe is empty, so it takes all of them at once
+			ssize_t teed = tee(out[0], copy[1], n, 0);
+			if (teed != n) *failed = 1;
+			if (c_block == NULL && flight == NULL && teed > 0) {
+				teed -= disk_splice(disk, copy[0], teed);
+			}
+			while (teed > 0) {
+				ssize_t got = read(copy[0], buf, teed < MAX_BUF ? teed : MAX_BUF);
+				if (got <= 0) break;
 				if (c_block != NULL) {
-					failed |= add_response_block(c_block, buf, nbytes);
+					*failed |= add_response_block(c_block, buf, got);
 				}
-				sem_post(&mutex);
+				flight_append(flight, buf, got);
+				if (disk != NULL) disk_append(disk, buf, got);
+				teed -= got;
 			}
 		}
-		else {
-			//we don't know how many bytes to add (chunking)
-			if (opt.chunk_enabled) {
-				//add this to the cache only if chunking is explicitly enabled
-				sem_wait(&mutex);
-				c_block = safe_add_cache(req.host, req.path, buf, nbytes, res);
-				sem_post(&mutex);
+
+		long moved = 0;
+		while (moved < n) {
+			ssize_t sent = splice(out[0], NULL, connfd, NULL, n - moved,
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (sent <= 0) break;
+			moved += sent;
+		}
+		stats_bytes(STAT_CLIENT_OUT, moved);
+		relayed += n;
+
+		if (moved < n) {
+			//the client is gone; empty the pipe and let the caller finish
+			//reading the response
+			while (moved < n) {
+				ssize_t got = read(out[0], buf, n - moved < MAX_BUF ? n - moved : MAX_BUF);
+				if (got <= 0) break;
+				moved += got;
 			}
+			break;
+		}
+	}
 
-			//we have no idea how many bytes to expect... uh oh
-			memset(&buf, 0, sizeof(buf));
-			while ((nbytes = recv(servconn, buf, MAX_BUF,0)) > 0) {
-				bytes_in += nbytes;
-				bytes_out += write(connfd, buf, nbytes);
-
-				//add next chunk to cache, again only if chunking is enabled
-				if (opt.chunk_enabled) {
-					sem_wait(&mutex);
-					if (c_block != NULL) {
-						failed |= add_response_block(c_block, buf, nbytes);
-					}
-					sem_post(&mutex);
-				}
+	close(out[0]);
+	close(out[1]);
+	if (keep_copy) {
+		close(copy[0]);
+		close(copy[1]);
+	}
+	return relayed;
+}
 
-				//check the last five characters to see if it's terminated
-				if (strcmp(&buf[nbytes-5], "0\r\n\r\n") == 0) {
-					break;
-				}
-				memset(&buf, 0, sizeof(buf));
+/*
+ * Relays the server's response to <req> from <servconn> to the client at
+ * <connfd>, adding it to the cache on the way and passing it on to the
+ * followers of <flight>. <start> is when the request came in. If <req> was
+ * revalidating the stale response in <stale> and the server says it's still
+ * good, that's sent instead, as it is when the server fails and -sie allows
+ * it. <connfd> is -1 for background refreshes, which have no client.
+ *
+ * Returns 1 if we read exactly the whole response and the server is happy to
+ * keep the connection open, 0 if the connection has to be closed, and -1 if
+ * the server closed the connection without sending us anything.
+ */
+int
+relay_response(int servconn, int connfd, struct request* req, struct timeval* start, F_entry* flight, C_block* stale)
+{
+	char buf[MAX_BUF]; //buffer for messages
+	long header_length;
+	struct response res;
+
+	//wait until we have the whole header, or as much of it as we can hold
+	H_parser parser;
+	http_init(&parser);
+	int nbytes = 0;
+	while (http_parse(&parser, buf, nbytes) == HTTP_MORE && nbytes < MAX_BUF - 1) {
+		int got = recv(servconn, buf + nbytes, MAX_BUF - 1 - nbytes, 0);
+		if (got <= 0) break;
+		stats_bytes(STAT_SERVER_IN, got);
+		nbytes += got;
+	}
+	if (nbytes == 0) return -1;
+
+	header_length = parse_response(&parser, buf, &res);
+	log_response(&res);
+
+	if (stale != NULL && res.status_no == 304) {
+		//our copy is still good, so the client gets that
+		revalidate_cache(stale, &res);
+		__atomic_add_fetch(&fresh_stats.revalidated, 1, __ATOMIC_RELAXED);
+		if (connfd < 0) return can_persist(&res);
+		write_cached(connfd, stale, req);
+		log_cache_hit(stale, start);
+		return can_persist(&res) && stale->keep_alive;
+	}
+	if (stale != NULL && res.status_no >= 500) {
+		//rather our old copy than an error, if it's allowed (see -sie)
+		int keep_alive;
+		if (connfd < 0 ? may_serve_stale(stale, opt.stale_error) :
+				serve_stale(stale, opt.stale_error, req, connfd, start, &keep_alive)) {
+			return 0;
+		}
+	}
+	if (stale != NULL) __atomic_add_fetch(&fresh_stats.refetched, 1, __ATOMIC_RELAXED);
+
+	if (connfd >= 0) stats_bytes(STAT_CLIENT_OUT, write(connfd, buf, nbytes));
+	flight_append(flight, buf, nbytes);
+
+	C_block* c_block = NULL;
+	D_fill* d_fill = NULL;
+	int failed = 0;
+	int complete = 0; //true once we've seen the end of the response
+	long bytes_left = expected_body(&res);
+
+	if (bytes_left >= 0) {
+		//we know exactly how many bytes we are expecting
+		//add this to the cache
+		c_block = safe_add_cache(req->host, req->path, buf, nbytes, header_length, res);
+
+		//what doesn't fit in memory can still go to disk
+		if (c_block == NULL && !res.no_store) {
+			d_fill = disk_begin(req->host, req->path, header_length + bytes_left,
+					res.status_no, res.status, res.has_type, res.c_type,
+					can_persist(&res), fresh_until(&res));
+			if (d_fill != NULL) disk_append(d_fill, buf, nbytes);
+		}
+
+		bytes_left -= (nbytes - header_length);
+		if (opt.splice_enabled && connfd >= 0 && bytes_left > 0) {
+			//followers still need the bytes in memory, but a page we
+			//aren't caching has no use for them otherwise
+			F_entry* copy_to = c_block == NULL && flight_detach(flight) ? NULL : flight;
+			bytes_left -= splice_body(servconn, connfd, bytes_left, c_block, copy_to, d_fill, &failed);
+		}
+		while (bytes_left > 0) {
+			nbytes = recv(servconn, buf, MAX_BUF, 0);
+			if (nbytes <= 0) break;
+			stats_bytes(STAT_SERVER_IN, nbytes);
+			if (connfd >= 0) stats_bytes(STAT_CLIENT_OUT, write(connfd, buf, nbytes));
+			flight_append(flight, buf, nbytes);
+			bytes_left -= nbytes;
+
+			//add this to cache too
+			if (c_block != NULL) {
+				failed |= add_response_block(c_block, buf, nbytes);
 			}
+			if (d_fill != NULL) disk_append(d_fill, buf, nbytes);
+		}
+		complete = bytes_left <= 0;
+	}
+	else {
+		//we don't know how many bytes to add (chunking)
+		H_chunked chunks;
+		http_chunked_init(&chunks);
+		long length_at = -1; //where the length of a de-chunked copy goes
+
+		//add this to the cache only if chunking is explicitly enabled
+		if (opt.chunk_enabled && opt.dechunk_enabled && res.chunked &&
+				parser.state == HTTP_DONE) {
+			c_block = add_dechunked(req->host, req->path, &parser, buf, res, &length_at);
+		} else if (opt.chunk_enabled) {
+			c_block = safe_add_cache(req->host, req->path, buf, nbytes, header_length, res);
+		}
+		//the block the decoder adds the chunk data to, if any
+		C_block* data_block = length_at >= 0 ? c_block : NULL;
+
+		//without chunks the response ends when the server hangs up, and we
+		//don't need to look at it to tell
+		if (opt.splice_enabled && connfd >= 0 && !res.chunked) {
+			F_entry* copy_to = c_block == NULL && flight_detach(flight) ? NULL : flight;
+			splice_body(servconn, connfd, -1, c_block, copy_to, NULL, &failed);
+		}
+
+		//follow the chunks to find out where the response ends
+		if (res.chunked) {
+			failed |= dechunk(&chunks, buf + header_length, nbytes - header_length, data_block);
+		}
+		complete = http_chunked_done(&chunks);
+		while (!complete && !http_chunked_failed(&chunks) &&
+				(nbytes = recv(servconn, buf, MAX_BUF, 0)) > 0) {
+			stats_bytes(STAT_SERVER_IN, nbytes);
+			if (connfd >= 0) stats_bytes(STAT_CLIENT_OUT, write(connfd, buf, nbytes));
+			flight_append(flight, buf, nbytes);
+
+			//add next chunk to cache, again only if chunking is enabled
+			if (c_block != NULL && data_block == NULL) {
+				failed |= add_response_block(c_block, buf, nbytes);
+			}
+			if (res.chunked) {
+				failed |= dechunk(&chunks, buf, nbytes, data_block);
+				complete = http_chunked_done(&chunks);
+			}
+		}
+
+		//without chunks the response ends when the server hangs up
+		if (!res.chunked && nbytes == 0) complete = 1;
+		if (complete && data_block != NULL) {
+			finish_dechunked(data_block, &chunks, length_at);
+		}
+	}
+
+	int cached = complete && ((c_block != NULL && !failed) || d_fill != NULL);
+	log_relayed(&res, start, connfd < 0 ? -1 : cached ? STAT_MISS : STAT_SKIP);
+
+	disk_finish(d_fill, complete);
+	if (c_block != NULL && (failed || !complete)) {
+		free_cache_block(c_block);
+		release_cache(c_block);
+	} else if (c_block != NULL) {
+		if (opt.comp_enabled) compress_cache(c_block);
+		finish_cache(c_block);
+	}
+
+	return complete && can_persist(&res);
+}
+
+/*
+ * Sends the client at <connfd> the response another request is fetching
+ * for <flight>, as it comes in, reading it through <reader>. <start> is when
+ * the request came in, and <keep_alive> is set to whether the client can send
+ * another request after it.
+ *
+ * Returns 0 if the other request didn't get anything from the server, and -1
+ * if we fell too far behind it before sending anything, so that the page has
+ * to be fetched on our own.
+ */
+int
+follow_fetch(F_entry* flight, F_reader* reader, int connfd, struct timeval* start, int* keep_alive)
+{
+	char buf[FLIGHT_CHUNK + 1];
+	struct response res;
+	int failed = 0;
+
+	long nbytes = flight_next(flight, reader, buf);
+	if (nbytes <= 0) {
+		flight_leave(flight, reader);
+		return nbytes;
+	}
+
+	//the leader's first part holds the response header
+	H_parser parser;
+	http_init(&parser);
+	http_parse(&parser, buf, nbytes);
+	parse_response(&parser, buf, &res);
+	log_response(&res);
+	for (; nbytes > 0; nbytes = flight_next(flight, reader, buf)) {
+		if (write(connfd, buf, nbytes) == -1) {
+			//the client is gone, no point in waiting for the rest
+			failed = 1;
+			break;
 		}
+		stats_bytes(STAT_CLIENT_OUT, nbytes);
+	}
+	flight_leave(flight, reader);
+	log_relayed(&res, start, res.no_store ? STAT_SKIP : STAT_MISS);
 
-		gettimeofday(&tv, NULL);
-		printf("[CLI <== PRX --- SRV @ ");
-		print_time(&tv);
-		printf("> %d %s\n", res.status_no, res.status);
-		printf("> %s\n", res.c_type);
-		printf("# %ldms\n", ms_elapsed(&start, &tv));
+	//if we were dropped partway through, the client got a cut off response
+	*keep_alive = !failed && nbytes == 0 && flight_keep_alive(flight);
+	return 1;
+}
+
+/*
+ * Connects to the server <name> at <port> like connect_host() does, counting
+ * how long that took.
+ */
+int
+timed_connect(char* name, char* port)
+{
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	int servconn = connect_host(name, port);
+	stats_connect(&start, servconn != -1);
+	return servconn;
+}
 
-		if (failed) {
-			sem_wait(&mutex);
-			free_cache_block(c_block);
-			sem_post(&mutex);
+/*
+ * Fetches the response to <req> from the server and relays it to the client
+ * at <connfd> (-1 if there is none) as the leader of <flight>, see
+ * relay_response(). Idle connections to the server are reused if we have
+ * any, and the connection is given back to the pool afterwards if it can be.
+ *
+ * Returns what relay_response() returned, or -1 if we couldn't reach the
+ * server at all.
+ */
+int
+fetch_response(struct request* req, int connfd, struct timeval* start, F_entry* flight, C_block* stale)
+{
+	char name[NI_MAXHOST];
+	char port[NI_MAXSERV];
+	split_host(req->host, name, sizeof(name), port, sizeof(port));
+
+	//use an idle connection to the server if we have one
+	int servconn = pool_take(name, port, 0);
+	int reused = servconn != -1;
+	if (!reused) servconn = timed_connect(name, port);
+
+	int result = -1;
+	while (servconn != -1) {
+		if (send_request(servconn, *req) == -1) {
+			perror("Error writing to socket");
+		} else {
+			log_note(LOG_DEBUG, "[SRV connected to %s:%s]", name, port);
+			result = relay_response(servconn, connfd, req, start, flight, stale);
 		}
+
+		//the server may have closed an idle connection just as we took it,
+		//in which case it's safe to try again on a fresh one
+		if (result != -1 || !reused) break;
+		close(servconn);
+		reused = 0;
+		servconn = timed_connect(name, port);
 	}
-	close(connfd);
-	printf("[CLI disconnected]\n");
-	close(servconn);
-	printf("[SRV disconnected]\n");
-	return;
+	if (servconn == -1) return -1;
+
+	if (result == 1 && pool_enabled()) {
+		pool_give(name, port, servconn);
+		log_note(LOG_DEBUG, "[SRV kept alive]");
+	} else {
+		close(servconn);
+		log_note(LOG_DEBUG, "[SRV disconnected]");
+	}
+	return result;
 }
 
+/*
+ * Actually process the request.
+ *
+ * The cache does its own locking, so nothing here needs to be mutually
+ * exclusive. Log lines are grouped by locking stdout.
+ *
+ * Returns true if the whole response was sent in a way that lets the client
+ * send another request on the same connection.
+ */
+int
+handle_request(struct request req, struct thread_params* p)
+{
+	int connfd = p->connfd;
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	//the proxy answers its reserved paths itself
+	if (stats_path(req.path)) return serve_stats(connfd, req.path) == 0;
+
+	log_request(&req, p->hoststr, p->portstr, &start);
+
+	//if it's in the cache (and still fresh) serve it from there
+	int keep_alive;
+	C_block* stale = NULL;
+	if (check_cache(&req, connfd, &start, &keep_alive, &stale) ||
+			(stale == NULL && check_disk(req.host, req.path, connfd, &start, &keep_alive))) {
+		return keep_alive;
+	}
+
+	if (stale != NULL) {
+		//ask the server whether our copy is still good
+		log_commit(log_begin(RECORD_STALE, LOG_INFO));
+		conditional_fields(stale, req.conditional, sizeof(req.conditional));
+	} else {
+		log_commit(log_begin(RECORD_MISS, LOG_INFO));
+	}
+
+	//a page asked for in parts can be cached in parts too
+	if (opt.segments_enabled && req.range[0] != '\0' &&
+			serve_segments(&req, connfd, &start, &keep_alive)) {
+		if (stale != NULL) release_cache(stale);
+		return keep_alive;
+	}
+
+	//if someone is already fetching the page, wait for it with them
+	int leader;
+	F_reader reader;
+	F_entry* flight = flight_join(req.host, req.path, &leader, &reader);
+	if (!leader) {
+		log_note(LOG_DEBUG, "[SRV already being fetched]");
+		int got = follow_fetch(flight, &reader, connfd, &start, &keep_alive);
+		flight_release(flight);
+		flight = NULL;
+		if (got == 1) {
+			if (stale != NULL) release_cache(stale);
+			return keep_alive;
+		}
+
+		if (got == 0) {
+			if (stale != NULL) release_cache(stale);
+
+			//the fetch may have found our copy to still be good, and then
+			//it has nothing to pass on, or it may have failed
+			stale = NULL;
+			if (check_cache(&req, connfd, &start, &keep_alive, &stale)) {
+				return keep_alive;
+			}
+			int served = serve_stale(stale, opt.stale_error, &req, connfd, &start, &keep_alive);
+			if (stale != NULL) release_cache(stale);
+			if (!served) {
+				write(connfd, GATEWAY_MSG, strlen(GATEWAY_MSG));
+				stats_done(STAT_ERROR, &start);
+				return 0;
+			}
+			return keep_alive;
+		}
+
+		//we fell too far behind the fetch before sending anything
+		log_note(LOG_DEBUG, "[SRV fetching on our own]");
+	}
+
+	int result = fetch_response(&req, connfd, &start, flight, stale);
+	flight_finish(flight, result == 1);
+	flight_release(flight);
+
+	if (result == -1 && serve_stale(stale, opt.stale_error, &req, connfd, &start, &keep_alive)) {
+		result = keep_alive;
+	} else if (result == -1) {
+		//don't leave the client hanging if we couldn't reach the server
+		write(connfd, GATEWAY_MSG, strlen(GATEWAY_MSG));
+		stats_done(STAT_ERROR, &start);
+		result = 0;
+	}
+	if (stale != NULL) release_cache(stale);
+
+	//the client got the server's own framing, so it can keep going exactly
+	//when the server could
+	return result == 1;
+}
 
 int
 main(int argc, char** argv)
@@ -461,7 +1449,9 @@ main(int argc, char** argv)
 	if (argc < 4) {
 		//remember: the name of the program is the first argument
 		fprintf(stderr, "ERROR: Missing required arguments!\n");
-		printf("Usage: %s <port> <maxConn> <maxSize>\n", argv[0]);
+		printf("Usage: %s <port> <maxConn> <maxSize> [-comp] [-chunk] [-pc]"
+				" [-reject] [-splice] [-dechunk] [-disk <dir>] [-disksize <MB>] [-snapshot <file>] [-snapint <seconds>] [-swr <seconds>] [-sie <seconds>] [-segments] [-cold <seconds>] [-coldfast] [-pool <maxIdle>] [-dnsttl <seconds>] [-hosts <file>]"
+				" [-engine threads|epoll] [-loglevel error|warn|info|debug] [-logcompact] [-logfile <file>]\n", argv[0]);
 		printf("e.g. %s 9001 20 16\n", argv[0]);
 		exit(1);
 	}
@@ -469,11 +1459,30 @@ main(int argc, char** argv)
 	char* port = argv[1]; //port we're listening on
 	opt.max_conn = atol(argv[2]); //max no. connections
 	opt.max_size = atol(argv[3]); //max cache size
-	set_max_cache_size(opt.max_size);
+	init_cache(opt.max_size);
 
 	opt.comp_enabled = 0; //compression enabled
 	opt.chunk_enabled = 0; //chunking enabled
 	opt.pc_enabled = 0; //persistant connection enabled
+	opt.reject_enabled = 0; //turn away connections when the queue is full
+	opt.splice_enabled = 0; //relay bodies with splice()
+	opt.dechunk_enabled = 0; //cache chunked responses without their chunks
+	opt.stale_window = 0; //serve stale responses while refreshing them
+	opt.stale_error = 0; //serve stale responses when the server fails
+	opt.segments_enabled = 0; //cache pages asked for in ranges in segments
+	char* disk_dir = NULL; //where the disk tier keeps its files, if anywhere
+	long disk_size = DISK_SIZE; //size limit of the disk tier in MB
+	char* snapshot_file = NULL; //where the cache is saved for restarts
+	int snapshot_int = SNAPSHOT_INTERVAL; //seconds between snapshots
+	opt.engine = ENGINE_THREADS; //how we handle connections
+	int pool_idle = POOL_MAX_IDLE; //idle server connections kept per server
+	int dns_ttl = DNS_TTL; //seconds resolved hostnames are cached for
+	char* hosts_file = NULL; //hostnames to always resolve the same way
+	long cold_age = 0; //seconds without a hit before a page is packed, 0 for never
+	int cold_fast = 0; //pack pages quickly rather than tightly
+	int log_max = LOG_DEBUG; //least important records logged
+	int log_compact = 0; //log one line per record instead of banners
+	char* log_file = NULL; //where the log goes, stdout if NULL
 
 	//check for optional arguments
 	for (int i = 4; i < argc; i++) {
@@ -483,9 +1492,93 @@ main(int argc, char** argv)
 			opt.chunk_enabled = 1;
 		} else if (strcmp(argv[i], "-pc") == 0) {
 			opt.pc_enabled = 1;
+		} else if (strcmp(argv[i], "-pool") == 0 && i + 1 < argc) {
+			pool_idle = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-dnsttl") == 0 && i + 1 < argc) {
+			dns_ttl = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-hosts") == 0 && i + 1 < argc) {
+			hosts_file = argv[++i];
+		} else if (strcmp(argv[i], "-reject") == 0) {
+			opt.reject_enabled = 1;
+		} else if (strcmp(argv[i], "-splice") == 0) {
+			opt.splice_enabled = 1;
+		} else if (strcmp(argv[i], "-dechunk") == 0) {
+			opt.chunk_enabled = 1;
+			opt.dechunk_enabled = 1;
+		} else if (strcmp(argv[i], "-disk") == 0 && i + 1 < argc) {
+			disk_dir = argv[++i];
+		} else if (strcmp(argv[i], "-disksize") == 0 && i + 1 < argc) {
+			disk_size = atol(argv[++i]);
+		} else if (strcmp(argv[i], "-snapshot") == 0 && i + 1 < argc) {
+			snapshot_file = argv[++i];
+		} else if (strcmp(argv[i], "-snapint") == 0 && i + 1 < argc) {
+			snapshot_int = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-segments") == 0) {
+			opt.segments_enabled = 1;
+		} else if (strcmp(argv[i], "-cold") == 0 && i + 1 < argc) {
+			cold_age = atol(argv[++i]);
+		} else if (strcmp(argv[i], "-coldfast") == 0) {
+			cold_fast = 1;
+		} else if (strcmp(argv[i], "-swr") == 0 && i + 1 < argc) {
+			opt.stale_window = atol(argv[++i]);
+		} else if (strcmp(argv[i], "-sie") == 0 && i + 1 < argc) {
+			opt.stale_error = atol(argv[++i]);
+		} else if (strcmp(argv[i], "-loglevel") == 0 && i + 1 < argc) {
+			log_max = log_level(argv[++i]);
+			if (log_max == -1) {
+				fprintf(stderr, "ERROR: Unknown log level: %s\n", argv[i]);
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "-logcompact") == 0) {
+			log_compact = 1;
+		} else if (strcmp(argv[i], "-logfile") == 0 && i + 1 < argc) {
+			log_file = argv[++i];
+		} else if (strcmp(argv[i], "-engine") == 0 && i + 1 < argc) {
+			char* engine = argv[++i];
+			if (strcmp(engine, "epoll") == 0) {
+				opt.engine = ENGINE_EPOLL;
+			} else if (strcmp(engine, "threads") == 0) {
+				opt.engine = ENGINE_THREADS;
+			} else {
+				fprintf(stderr, "ERROR: Unknown engine: %s\n", engine);
+				exit(1);
+			}
 		}
 	}
 
+	if (init_log(log_file, log_max, log_compact) == -1) {
+		exit(1);
+	}
+	init_stats();
+	init_pool(pool_idle, POOL_IDLE_TIMEOUT);
+	init_dns(dns_ttl);
+	init_flight();
+	init_http();
+	if (hosts_file != NULL && dns_load_hosts(hosts_file) == -1) {
+		exit(1);
+	}
+	if (disk_dir != NULL && opt.engine == ENGINE_EPOLL) {
+		//writing evicted pages to disk would block the event loops
+		fprintf(stderr, "WARNING: -disk is ignored by the epoll engine\n");
+	} else if (disk_dir != NULL && init_disk(disk_dir, disk_size) == -1) {
+		exit(1);
+	}
+	if (opt.segments_enabled && opt.engine == ENGINE_EPOLL) {
+		//fetching segments would block the event loops too
+		fprintf(stderr, "WARNING: -segments is ignored by the epoll engine\n");
+		opt.segments_enabled = 0;
+	}
+	//before any other thread starts, see init_snapshot()
+	if (snapshot_file != NULL && init_snapshot(snapshot_file, snapshot_int) == -1) {
+		exit(1);
+	}
+	if (opt.stale_window > 0 && init_refresh(REFRESH_WORKERS) == -1) {
+		exit(1);
+	}
+	if (cold_age > 0 && init_cold(cold_age, cold_fast) == -1) {
+		exit(1);
+	}
+
 	//don't crash when writing to a closed socket
 	signal(SIGPIPE, SIG_IGN);
 
@@ -496,9 +1589,25 @@ main(int argc, char** argv)
 
 	//set up the server on the specified port
 	setup_server(&listener, port);
-	printf("Starting proxy server on port %s\n", port);
+	log_note(LOG_INFO, "Starting proxy server on port %s", port);
 
-	sem_init(&mutex, 0, 1);
+	if (opt.engine == ENGINE_EPOLL) {
+		//the event loops take it from here
+		run_event_loops(listener);
+	}
+
+	//spawn all the workers up front
+	int workers = opt.max_conn > 0 ? opt.max_conn : DEFAULT_WORKERS;
+	if (init_queue(&conn_queue, workers * QUEUE_PER_WORKER) == -1) {
+		exit(1);
+	}
+	for (int i = 0; i < workers; i++) {
+		pthread_t thread_id;
+		if (pthread_create(&thread_id, NULL, &thread_main, NULL) != 0) {
+			perror("ERROR: Couldn't create worker thread");
+			exit(1);
+		}
+	}
 
 	while(1) {
 		sin_size = sizeof(their_addr);
@@ -509,38 +1618,22 @@ main(int argc, char** argv)
 			continue;
 		}
 
-		//don't create a new thread if we already have too many running
-		while (opt.max_conn > 0) {
-			sem_wait(&mutex);
-			if (thread_count < opt.max_conn) {
-				//release the semaphore before quitting
-				sem_post(&mutex);
-				break;
-			}
-			sem_post(&mutex);
-		}
-
-		//spawn a new thread to handle this request
-		pthread_t thread_id;
-		struct thread_params* params = calloc(1, sizeof(struct thread_params));
-		if (params == NULL) {
-			perror("Couldn't allocate memory for thread parameters");
-			exit(1);
-		}
-		params->connfd = connfd;
+		struct thread_params params;
+		params.connfd = connfd;
 
 		//store the ip address and port into params too
-		getnameinfo((struct sockaddr* )&their_addr, sin_size, params->hoststr,
-				sizeof(params->hoststr), params->portstr, sizeof(params->portstr),
+		getnameinfo((struct sockaddr* )&their_addr, sin_size, params.hoststr,
+				sizeof(params.hoststr), params.portstr, sizeof(params.portstr),
 				NI_NUMERICHOST | NI_NUMERICSERV);
 
-		sem_wait(&mutex);
-		thread_count++;
-		sem_post(&mutex);
-
-		//actually run the thread
-		pthread_create(&thread_id, NULL, &thread_main, (void*) params);
-
+		//hand it to a worker, waiting for a free place in the queue unless
+		//we've been told to turn away connections when we're too busy
+		if (!opt.reject_enabled) {
+			enqueue(&conn_queue, &params);
+		} else if (try_enqueue(&conn_queue, &params) == -1) {
+			write(connfd, BUSY_MSG, strlen(BUSY_MSG));
+			close(connfd);
+		}
 	}
 	close(listener);
 	return 0;
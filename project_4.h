@@ -3,9 +3,34 @@
 
 #include <stdio.h>
 #include <netdb.h> //needed for NI_MAXHOST and NI_MAXSERV
+#include <sys/time.h> //needed for struct timeval
+
+#include "http.h"
+
+struct C_block;
+struct R_block;
+struct F_entry;
+struct F_reader;
+struct D_entry;
+struct D_fill;
 
 #define MAX_BUF 8192 //the max size of messages
 
+#define PC_IDLE_TIMEOUT 15 //seconds a persistent client connection may idle
+#define PC_MAX_REQUESTS 100 //requests served per persistent connection
+
+#define FRESH_DEFAULT 300 //seconds a response that doesn't say is fresh for
+#define FRESH_HEURISTIC_MAX 86400 //most seconds one with only Last-Modified is
+
+#define IOV_BATCH 64 //cached segments written per writev()
+#define SPLICE_SIZE 65536 //bytes moved per splice(), one pipe's worth
+
+#define DEFAULT_WORKERS 64 //worker threads if maxConn is unlimited
+#define QUEUE_PER_WORKER 4 //queued connections allowed per worker
+
+#define ENGINE_THREADS 0 //a pool of worker threads
+#define ENGINE_EPOLL 1   //a few epoll event loops for all connections
+
 
 struct request {
 	char method[8]; //http request method
@@ -18,6 +43,9 @@ struct request {
 	char connection[256];
 	int has_connection;
 	int has_encoding;
+	char conditional[512]; //fields asking the server whether our stale copy is still good
+	char range[256]; //the Range field, empty if the client wants the whole page
+	char upstream_range[64]; //Range field we send the server, see serve_segments()
 };
 
 struct response {
@@ -28,6 +56,15 @@ struct response {
 	char c_length[256]; //content length
 	int has_type;
 	int has_length;
+	int chunked;    //true if the body uses chunked transfer encoding
+	int conn_close; //true if the server will close the connection after this
+	int no_store;   //true if the response mustn't be cached
+	int must_revalidate; //true if the response mustn't be served stale
+	long max_age;   //seconds the response is fresh for, -1 if it doesn't say
+	long age;       //seconds the response spent in other caches
+	time_t date;    //when the server sent the response, -1 if unknown
+	time_t expires; //when the response goes stale, -1 if it doesn't say
+	time_t last_modified; //-1 if unknown
 };
 
 struct options {
@@ -36,6 +73,21 @@ struct options {
 	int comp_enabled;
 	int chunk_enabled;
 	int pc_enabled;
+	int reject_enabled;
+	int splice_enabled; //relay bodies through a pipe instead of our memory
+	int dechunk_enabled; //store chunked responses with a Content-Length
+	long stale_window; //seconds a stale response is served while it's refreshed
+	long stale_error;  //seconds a stale response is served when the server fails
+	int segments_enabled; //cache pages asked for in ranges in segments
+	int engine; //how connections are handled, one of ENGINE_*
+};
+
+struct fresh_stats {
+	long hits;        //fresh responses served from the cache
+	long revalidated; //stale responses the server told us were still good
+	long refetched;   //stale responses we had to fetch again in full
+	long stale;       //stale responses served while being refreshed
+	long stale_errors; //stale responses served because the server failed
 };
 
 struct thread_params {
@@ -44,29 +96,121 @@ struct thread_params {
 	char portstr[NI_MAXSERV]; //readable client port
 };
 
+extern const char* ERROR_MSG;
+extern const char* GATEWAY_MSG;
+extern const char* TOO_LARGE_MSG;
+extern int count;
+extern int thread_count;
+extern struct options opt;
+extern struct fresh_stats fresh_stats;
+
 
 int
 make_space(long nbytes);
 
 struct C_block*
-safe_add_cache(char* host, char* path, char* reference, long nbytes, struct response res);
+safe_add_cache(char* host, char* path, char* reference, long nbytes, long header_length, struct response res);
+
+void
+log_request(struct request* req, char* hoststr, char* portstr, struct timeval* start);
+
+void
+log_cache_hit(struct C_block* c_block, struct timeval* start);
+
+void
+log_forward(struct request* req);
+
+void
+log_response(struct response* res);
+
+void
+log_relayed(struct response* res, struct timeval* start, int class);
+
+void
+log_disk_hit(struct D_entry* e, int promoted, struct timeval* start);
 
 int
-check_cache(char* host, char* path, int connfd, struct timeval* start);
+write_blocks(int fd, struct R_block* r);
+
+struct R_block*
+cached_response(struct C_block* c_block, struct request* req, struct R_block** view);
+
+int
+write_cached(int fd, struct C_block* c_block, struct request* req);
+
+int
+check_cache(struct request* req, int connfd, struct timeval* start, int* keep_alive, struct C_block** stale);
+
+void
+conditional_fields(struct C_block* c_block, char* out, size_t size);
+
+void
+revalidate_cache(struct C_block* c_block, struct response* res);
+
+int
+may_serve_stale(struct C_block* c_block, long window);
+
+int
+serve_stale(struct C_block* c_block, long window, struct request* req, int connfd, struct timeval* start, int* keep_alive);
+
+int
+check_disk(char* host, char* path, int connfd, struct timeval* start, int* keep_alive);
+
+int
+wants_keep_alive(struct request* req);
+
+void
+serve_client(struct thread_params* p);
 
 void*
-thread_main(void* params);
+thread_main(void* arg);
+
+long
+parse_response(H_parser* parser, char* response, struct response* r_ptr);
 
 int
-parse_response(char* response, struct response* r_ptr);
+parse_request(H_parser* parser, char* request, struct request* rptr);
 
 int
-parse_request(char* request, struct request* rptr);
+build_request(struct request* req, char* out, size_t size);
 
 ssize_t
 send_request(int servconn, struct request req);
 
+int
+dechunk(H_chunked* chunks, char* buf, long nbytes, struct C_block* c_block);
+
+struct C_block*
+add_dechunked(char* host, char* path, H_parser* parser, char* buf, struct response res, long* length_at);
+
 void
+finish_dechunked(struct C_block* c_block, H_chunked* chunks, long length_at);
+
+long
+expected_body(struct response* res);
+
+int
+can_persist(struct response* res);
+
+time_t
+fresh_until(struct response* res);
+
+long
+splice_body(int servconn, int connfd, long nbytes, struct C_block* c_block, struct F_entry* flight, struct D_fill* disk, int* failed);
+
+int
+timed_connect(char* name, char* port);
+
+int
+relay_response(int servconn, int connfd, struct request* req, struct timeval* start, struct F_entry* flight, struct C_block* stale);
+
+int
+follow_fetch(struct F_entry* flight, struct F_reader* reader, int connfd, struct timeval* start, int* keep_alive);
+
+int
+fetch_response(struct request* req, int connfd, struct timeval* start, struct F_entry* flight, struct C_block* stale);
+
+int
 handle_request(struct request req, struct thread_params* p);
 
 #endif
@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <semaphore.h>
+
+#include "queue.h"
+
+
+/*
+ * Sets up <q> to hold at most <cap> connections.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int
+init_queue(C_queue* q, int cap)
+{
+	q->ring = calloc(cap, sizeof(struct thread_params));
+	if (q->ring == NULL) {
+		perror("Failed to allocate memory for the connection queue");
+		return -1;
+	}
+	q->cap = cap;
+	q->head = 0;
+	q->tail = 0;
+	sem_init(&q->slots, 0, cap);
+	sem_init(&q->items, 0, 0);
+	sem_init(&q->lock, 0, 1);
+	return 0;
+}
+
+/*
+ * Copies <p> into the place we reserved for it and wakes up a worker.
+ */
+static void
+put(C_queue* q, struct thread_params* p)
+{
+	sem_wait(&q->lock);
+	q->ring[q->tail] = *p;
+	q->tail = (q->tail + 1) % q->cap;
+	sem_post(&q->lock);
+	sem_post(&q->items);
+}
+
+/*
+ * Adds the connection <p> to the queue, blocking while the queue is full.
+ */
+void
+enqueue(C_queue* q, struct thread_params* p)
+{
+	while (sem_wait(&q->slots) == -1); //only fails if interrupted
+	put(q, p);
+}
+
+/*
+ * Adds the connection <p> to the queue unless it is full.
+ *
+ * Returns 0 if successful, -1 if the queue was full.
+ */
+int
+try_enqueue(C_queue* q, struct thread_params* p)
+{
+	if (sem_trywait(&q->slots) == -1) return -1;
+	put(q, p);
+	return 0;
+}
+
+/*
+ * Takes the oldest connection off the queue and copies it into <p>,
+ * blocking until there is one.
+ */
+void
+dequeue(C_queue* q, struct thread_params* p)
+{
+	while (sem_wait(&q->items) == -1);
+	sem_wait(&q->lock);
+	*p = q->ring[q->head];
+	q->head = (q->head + 1) % q->cap;
+	sem_post(&q->lock);
+	sem_post(&q->slots);
+}
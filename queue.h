@@ -0,0 +1,35 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <semaphore.h>
+
+#include "project_4.h"
+
+/*
+ * A bounded queue of accepted connections waiting for a worker thread. The
+ * classic producer/consumer setup: <slots> counts the free places, <items>
+ * the queued connections and <lock> protects the ring itself.
+ */
+typedef struct C_queue {
+	struct thread_params* ring;
+	int cap;
+	int head; //next connection to hand out
+	int tail; //next free place
+	sem_t slots;
+	sem_t items;
+	sem_t lock;
+} C_queue;
+
+int
+init_queue(C_queue* q, int cap);
+
+void
+enqueue(C_queue* q, struct thread_params* p);
+
+int
+try_enqueue(C_queue* q, struct thread_params* p);
+
+void
+dequeue(C_queue* q, struct thread_params* p);
+
+#endif
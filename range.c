@@ -0,0 +1,542 @@
+/*
+ * Byte ranges.
+ *
+ * A request with a Range field is answered with just the parts of the page
+ * it asks for (206 Partial Content), taken straight from the cached body.
+ * Nothing is copied: the response is a chain of segments pointing into the
+ * cached blocks, with only the headers built here.
+ *
+ * With -segments, pages that clients only ask for in parts are cached in
+ * segments of RANGE_SEGMENT bytes, each under a key of its own. A segment
+ * is fetched from the server when a request first needs it, so a page that
+ * has only been partly fetched can still serve the parts it has.
+ */
+
+#define _GNU_SOURCE
+
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "time.h"
+#include "network.h"
+#include "cache.h"
+#include "http.h"
+#include "slab.h"
+#include "pool.h"
+#include "project_4.h"
+#include "range.h"
+#include "log.h"
+#include "stats.h"
+
+
+/*
+ * Reads the number at <*s>, moving <*s> past it.
+ *
+ * Returns the number, or -1 if there isn't one (or it's absurdly long).
+ */
+static long
+read_number(const char **s)
+{
+	long n = 0;
+	int digits = 0;
+	while (**s >= '0' && **s <= '9') {
+		if (++digits > 18) return -1;
+		n = n * 10 + *(*s)++ - '0';
+	}
+	return digits > 0 ? n : -1;
+}
+
+/*
+ * Parses the Range field <spec> for a body of <total> bytes into <out>,
+ * which has room for <max> ranges. Ranges that lie beyond the end of the
+ * body are left out, and the others are cut short at its end.
+ *
+ * Returns the number of ranges, 0 if none of them can be satisfied, or -1
+ * if the field isn't one we understand (or asks for too many ranges), in
+ * which case it should be ignored.
+ */
+int
+range_parse(const char *spec, long total, B_range* out, int max)
+{
+	if (strncasecmp(spec, "bytes=", 6) != 0) return -1;
+	const char* s = spec + 6;
+	int n = 0;
+
+	while (1) {
+		while (*s == ' ' || *s == '\t') s++;
+		long first = read_number(&s);
+		if (*s++ != '-') return -1;
+		long last = read_number(&s);
+		while (*s == ' ' || *s == '\t') s++;
+		if (*s != ',' && *s != '\0') return -1;
+
+		if (first == -1) {
+			//a suffix: the last <last> bytes
+			if (last == -1) return -1;
+			first = last < total ? total - last : 0;
+			last = last > 0 ? total - 1 : -1;
+		} else if (last == -1 || last >= total) {
+			last = total - 1;
+		} else if (last < first) {
+			return -1;
+		}
+
+		if (first <= last && first < total) {
+			if (n == max) return -1;
+			out[n].first = first;
+			out[n].last = last;
+			n++;
+		}
+		if (*s++ == '\0') return n;
+	}
+}
+
+/*
+ * Adds a segment for the <size> bytes at <text> to the chain ending at
+ * <*tail>. If <copy> is true the bytes are copied into the segment,
+ * otherwise it just points at them.
+ *
+ * Returns -1 if we ran out of memory, 0 otherwise.
+ */
+static int
+append_view(R_block*** tail, const char *text, long size, int copy)
+{
+	R_block* r = malloc(sizeof(R_block) + (copy ? size : 0));
+	if (r == NULL) return -1;
+	r->text = copy ? (unsigned char*) (r + 1) : (unsigned char*) text;
+	if (copy) memcpy(r->text, text, size);
+	r->size = r->cap = size;
+	r->class = SLAB_WRAPPED;
+	r->next = NULL;
+	**tail = r;
+	*tail = &r->next;
+	return 0;
+}
+
+/*
+ * Adds the bytes <first> to <last> of the body in <src> to the chain ending
+ * at <*tail>.
+ *
+ * Returns -1 if we ran out of memory or the body is shorter than it should
+ * be, 0 otherwise.
+ */
+static int
+append_body(R_block*** tail, B_source* src, long first, long last)
+{
+	long off = first;
+	while (off <= last) {
+		long index = off / src->span;
+		int i = 0;
+		while (i < src->count && src->index[i] != index) i++;
+		if (i == src->count) return -1;
+
+		//skip to where the bytes start in the block
+		long pos = src->skip[i] + off - index * src->span;
+		long want = (index + 1) * src->span - off;
+		if (want > last - off + 1) want = last - off + 1;
+		R_block* r = src->blocks[i]->response;
+		while (r != NULL && pos >= r->size) {
+			pos -= r->size;
+			r = r->next;
+		}
+
+		for (; want > 0 && r != NULL; r = r->next) {
+			long take = r->size - pos < want ? r->size - pos : want;
+			if (append_view(tail, (char*) r->text + pos, take, 0) == -1) return -1;
+			off += take;
+			want -= take;
+			pos = 0;
+		}
+		if (want > 0) return -1;
+	}
+	return 0;
+}
+
+/*
+ * Writes the header of the part of a multipart/byteranges body holding the
+ * range <r> into <out>, which can hold <size> bytes. <type> is the content
+ * type of the page, <type_len> bytes of it (none if it doesn't have one).
+ *
+ * Returns the length of the header, like snprintf().
+ */
+static int
+part_header(char* out, size_t size, const char *boundary, const char *type, int type_len, B_range* r, long total)
+{
+	return snprintf(out, size, "\r\n--%s\r\n%s%.*s%sContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+			boundary, type_len > 0 ? "Content-Type: " : "", type_len, type,
+			type_len > 0 ? "\r\n" : "", r->first, r->last, total);
+}
+
+/*
+ * Builds the response serving <ranges> (<n> of them) of the body in <src>:
+ * a 206 Partial Content with the fields of the first block's header, its
+ * body a multipart/byteranges if there's more than one range, or a 416 if
+ * <n> is 0. The body is made of views into the blocks of <src>, so they
+ * have to be held until the response is sent.
+ *
+ * Returns the response, or NULL if it couldn't be built.
+ */
+R_block*
+range_view(B_source* src, B_range* ranges, int n)
+{
+	char head[MAX_BUF + 256];
+	int len;
+	R_block* view = NULL;
+	R_block** tail = &view;
+
+	if (n == 0) {
+		len = snprintf(head, sizeof(head), "HTTP/1.1 416 Range Not Satisfiable\r\n"
+				"Content-Range: bytes */%ld\r\n"
+				"Content-Length: 0\r\n\r\n", src->total);
+		append_view(&tail, head, len, 1);
+		return view;
+	}
+
+	C_block* cb = src->blocks[0];
+	char* text = (char*) cb->response->text;
+	H_parser parser;
+	http_init(&parser);
+	if (http_parse(&parser, text, cb->response->size) != HTTP_DONE) return NULL;
+
+	//the fields describing the whole body stay, the framing is ours
+	len = snprintf(head, sizeof(head), "HTTP/1.1 206 Partial Content\r\n");
+	H_view type = { 0, 0 };
+	for (int i = 0; i < parser.count; i++) {
+		H_view name = parser.fields[i].name;
+		H_view value = parser.fields[i].value;
+		if (http_is(text, name, "Content-Type")) type = value;
+		if (http_is(text, name, "Content-Length") || http_is(text, name, "Content-Range") ||
+				http_is(text, name, "Transfer-Encoding") ||
+				(n > 1 && http_is(text, name, "Content-Type"))) {
+			continue;
+		}
+		len += snprintf(head + len, sizeof(head) - len, "%.*s: %.*s\r\n",
+				name.len, text + name.off, value.len, text + value.off);
+		if (len >= (int) sizeof(head)) return NULL;
+	}
+
+	if (n == 1) {
+		len += snprintf(head + len, sizeof(head) - len, "Content-Range: bytes %ld-%ld/%ld\r\n"
+				"Content-Length: %ld\r\n\r\n", ranges[0].first, ranges[0].last,
+				src->total, ranges[0].last - ranges[0].first + 1);
+		if (len >= (int) sizeof(head) || append_view(&tail, head, len, 1) == -1 ||
+				append_body(&tail, src, ranges[0].first, ranges[0].last) == -1) {
+			free_view(view);
+			return NULL;
+		}
+		return view;
+	}
+
+	//each range is a part of its own, and all of them have to be counted
+	//up front for the Content-Length
+	char boundary[40];
+	snprintf(boundary, sizeof(boundary), "p4range%016lx%08lx", cb->hash,
+			(unsigned long) time(NULL));
+	char part[512];
+	long body = snprintf(NULL, 0, "\r\n--%s--\r\n", boundary);
+	for (int i = 0; i < n; i++) {
+		body += part_header(NULL, 0, boundary, text + type.off, type.len, &ranges[i], src->total);
+		body += ranges[i].last - ranges[i].first + 1;
+	}
+	len += snprintf(head + len, sizeof(head) - len, "Content-Type: multipart/byteranges; "
+			"boundary=%s\r\nContent-Length: %ld\r\n\r\n", boundary, body);
+	if (len >= (int) sizeof(head) || append_view(&tail, head, len, 1) == -1) {
+		free_view(view);
+		return NULL;
+	}
+
+	for (int i = 0; i < n; i++) {
+		len = part_header(part, sizeof(part), boundary, text + type.off, type.len, &ranges[i], src->total);
+		if (len >= (int) sizeof(part) || append_view(&tail, part, len, 1) == -1 ||
+				append_body(&tail, src, ranges[i].first, ranges[i].last) == -1) {
+			free_view(view);
+			return NULL;
+		}
+	}
+	len = snprintf(part, sizeof(part), "\r\n--%s--\r\n", boundary);
+	if (append_view(&tail, part, len, 1) == -1) {
+		free_view(view);
+		return NULL;
+	}
+	return view;
+}
+
+/*
+ * Builds the response serving the Range field <spec> from the complete
+ * cached page in <cb>, see range_view().
+ *
+ * Returns the response, or NULL if the whole page should be served instead
+ * because it can't be served in parts or the field is one we ignore.
+ */
+R_block*
+range_cached(C_block* cb, const char *spec)
+{
+	if (spec[0] == '\0' || cb->status_no != 200 || cb->packed) return NULL;
+
+	char* text = (char*) cb->response->text;
+	H_parser parser;
+	http_init(&parser);
+	if (http_parse(&parser, text, cb->response->size) != HTTP_DONE) return NULL;
+	struct response res;
+	long skip = parse_response(&parser, text, &res);
+	if (res.chunked || !res.has_length) return NULL;
+
+	B_source src;
+	src.blocks[0] = cb;
+	src.skip[0] = skip;
+	src.index[0] = 0;
+	src.count = 1;
+	src.total = cb->size - skip;
+	src.span = src.total > 0 ? src.total : 1;
+
+	B_range ranges[RANGE_MAX];
+	int n = range_parse(spec, src.total, ranges, RANGE_MAX);
+	if (n == -1) return NULL;
+	return range_view(&src, ranges, n);
+}
+
+/*
+ * Checks that the cached segment <cb> holds segment <index> of a page's
+ * body, and that it's from the same version of the page as the segments
+ * already in <src>. <validator> holds the ETag or Last-Modified field of
+ * those (and is set from <cb> if it's the first one).
+ *
+ * Returns the number of header bytes before the body, or -1 if the segment
+ * can't be used.
+ */
+static long
+check_segment(C_block* cb, long index, B_source* src, char* validator, size_t size)
+{
+	char* text = (char*) cb->response->text;
+	H_parser parser;
+	http_init(&parser);
+	if (cb->status_no != 206 || http_parse(&parser, text, cb->response->size) != HTTP_DONE) {
+		return -1;
+	}
+
+	H_view* range = http_find(&parser, text, "Content-Range");
+	H_view* v = http_find(&parser, text, "ETag");
+	if (v == NULL) v = http_find(&parser, text, "Last-Modified");
+	char field[256];
+	field[0] = '\0';
+	if (v != NULL) http_copy(text, *v, field, sizeof(field));
+	if (range == NULL) return -1;
+
+	char spec[128];
+	http_copy(text, *range, spec, sizeof(spec));
+	long first, last, total;
+	if (sscanf(spec, "bytes %ld-%ld/%ld", &first, &last, &total) != 3) return -1;
+
+	long expected = (index + 1) * RANGE_SEGMENT < total ? RANGE_SEGMENT : total - index * RANGE_SEGMENT;
+	long skip = parser.pos;
+	if (first != index * RANGE_SEGMENT || last - first + 1 != expected ||
+			cb->size - skip != expected) {
+		return -1;
+	}
+
+	if (src->count == 0) {
+		src->total = total;
+		snprintf(validator, size, "%s", field);
+	} else if (total != src->total || strcmp(validator, field) != 0) {
+		return -1;
+	}
+	return skip;
+}
+
+/*
+ * Fetches segment <index> of the page asked for by <req> from the server
+ * and caches it under <key>.
+ *
+ * Returns the cached block, which the caller has to release, or NULL if the
+ * server didn't send us the segment or it couldn't be cached.
+ */
+static C_block*
+fetch_segment(struct request* req, const char *key, long index)
+{
+	char name[NI_MAXHOST];
+	char port[NI_MAXSERV];
+	split_host(req->host, name, sizeof(name), port, sizeof(port));
+	int servconn = pool_take(name, port, 0);
+	if (servconn == -1) servconn = timed_connect(name, port);
+	if (servconn == -1) return NULL;
+
+	struct request* sreq = malloc(sizeof(struct request));
+	if (sreq == NULL) {
+		close(servconn);
+		return NULL;
+	}
+	*sreq = *req;
+	sreq->conditional[0] = '\0';
+	snprintf(sreq->upstream_range, sizeof(sreq->upstream_range), "Range: bytes=%ld-%ld\r\n",
+			index * RANGE_SEGMENT, (index + 1) * RANGE_SEGMENT - 1);
+	log_note(LOG_DEBUG, "[SRV fetching %s%s]", req->host, key);
+	ssize_t sent = send_request(servconn, *sreq);
+	free(sreq);
+
+	char buf[MAX_BUF];
+	H_parser parser;
+	http_init(&parser);
+	int nbytes = 0;
+	while (sent != -1 && http_parse(&parser, buf, nbytes) == HTTP_MORE && nbytes < MAX_BUF - 1) {
+		int got = recv(servconn, buf + nbytes, MAX_BUF - 1 - nbytes, 0);
+		if (got <= 0) break;
+		stats_bytes(STAT_SERVER_IN, got);
+		nbytes += got;
+	}
+
+	//a server that ignores ranges sends the whole page, which is no use here
+	struct response res;
+	long header_length = parse_response(&parser, buf, &res);
+	long body = expected_body(&res);
+	C_block* c_block = NULL;
+	if (parser.state == HTTP_DONE && res.status_no == 206 && body >= 0 &&
+			body <= RANGE_SEGMENT && nbytes - header_length <= body) {
+		c_block = safe_add_cache(req->host, (char*) key, buf, nbytes, header_length, res);
+	}
+	if (c_block == NULL) {
+		close(servconn);
+		return NULL;
+	}
+
+	int failed = 0;
+	long bytes_left = body - (nbytes - header_length);
+	while (bytes_left > 0 && !failed) {
+		nbytes = recv(servconn, buf, bytes_left < MAX_BUF ? bytes_left : MAX_BUF, 0);
+		if (nbytes <= 0) break;
+		stats_bytes(STAT_SERVER_IN, nbytes);
+		failed |= add_response_block(c_block, buf, nbytes);
+		bytes_left -= nbytes;
+	}
+
+	if (failed || bytes_left > 0) {
+		free_cache_block(c_block);
+		release_cache(c_block);
+		close(servconn);
+		return NULL;
+	}
+
+	//our own reference outlives the filler's
+	hold_cache(c_block);
+	finish_cache(c_block);
+	if (can_persist(&res) && pool_enabled()) {
+		pool_give(name, port, servconn);
+	} else {
+		close(servconn);
+	}
+	return c_block;
+}
+
+/*
+ * Adds segment <index> of the page asked for by <req> to <src>, from the
+ * cache if it has a fresh copy from the same version of the page, and from
+ * the server otherwise. <fetched> is incremented if it came from the server.
+ *
+ * Returns -1 if we couldn't get the segment, 0 otherwise.
+ */
+static int
+add_segment(struct request* req, long index, B_source* src, char* validator, size_t size, int* fetched)
+{
+	char key[sizeof(req->path) + 32];
+	snprintf(key, sizeof(key), "%s #seg%ld", req->path, index);
+
+	C_block* cb = search_cache(req->host, key);
+	long skip = -1;
+	if (cb != NULL && (is_stale(cb) ||
+			(skip = check_segment(cb, index, src, validator, size)) == -1)) {
+		release_cache(cb);
+		cb = NULL;
+	}
+	if (cb == NULL) {
+		cb = fetch_segment(req, key, index);
+		if (cb == NULL) return -1;
+		(*fetched)++;
+		skip = check_segment(cb, index, src, validator, size);
+		if (skip == -1) {
+			release_cache(cb);
+			return -1;
+		}
+	}
+
+	src->blocks[src->count] = cb;
+	src->skip[src->count] = skip;
+	src->index[src->count] = index;
+	src->count++;
+	return 0;
+}
+
+/*
+ * Serves the Range field of <req> from the segments of the page in the
+ * cache, fetching the ones that aren't there yet, see -segments. <start>
+ * and <keep_alive> work like in check_cache().
+ *
+ * Returns true if the request was served, and false if the whole page has
+ * to be fetched instead: when the field asks for the end of a page we don't
+ * know the length of or for too much of it, or the server doesn't support
+ * ranges or changed the page while we were getting its segments.
+ */
+int
+serve_segments(struct request* req, int connfd, struct timeval* start, int* keep_alive)
+{
+	B_source src;
+	src.count = 0;
+	src.span = RANGE_SEGMENT;
+	char validator[256];
+	int fetched = 0;
+	int served = 0;
+
+	//the segment with the first byte asked for tells us how long the page is
+	if (strncasecmp(req->range, "bytes=", 6) != 0) return 0;
+	const char* s = req->range + 6;
+	while (*s == ' ') s++;
+	long first = read_number(&s);
+	if (first == -1 ||
+			add_segment(req, first / RANGE_SEGMENT, &src, validator, sizeof(validator), &fetched) == -1) {
+		return 0;
+	}
+
+	B_range ranges[RANGE_MAX];
+	int n = range_parse(req->range, src.total, ranges, RANGE_MAX);
+	for (int i = 0; i < n; i++) {
+		for (long index = ranges[i].first / RANGE_SEGMENT;
+				index <= ranges[i].last / RANGE_SEGMENT; index++) {
+			int have = 0;
+			for (int j = 0; j < src.count; j++) have |= src.index[j] == index;
+			if (have) continue;
+			if (src.count == RANGE_MAX_SEGMENTS ||
+					add_segment(req, index, &src, validator, sizeof(validator), &fetched) == -1) {
+				n = -1;
+				break;
+			}
+		}
+		if (n == -1) break;
+	}
+
+	R_block* view = n >= 0 ? range_view(&src, ranges, n) : NULL;
+	if (view != NULL) {
+		*keep_alive = src.blocks[0]->keep_alive;
+		if (write_blocks(connfd, view) == -1) *keep_alive = 0;
+		free_view(view);
+		served = 1;
+
+		//segments we had to fetch were cached on the way
+		stats_done(fetched > 0 ? STAT_MISS : STAT_HIT, start);
+		L_record* r = log_begin(RECORD_RANGE_HIT, LOG_INFO);
+		if (r != NULL) {
+			r->n[0] = n;
+			r->n[1] = src.count;
+			r->n[2] = fetched;
+			r->ms = ms_elapsed(start, &r->tv);
+			log_commit(r);
+		}
+	}
+
+	for (int i = 0; i < src.count; i++) release_cache(src.blocks[i]);
+	return served;
+}
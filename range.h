@@ -0,0 +1,43 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#define RANGE_MAX 16             //most ranges served in one response
+#define RANGE_SEGMENT (1 << 20)  //body bytes per segment of a partially cached page
+#define RANGE_MAX_SEGMENTS 64    //most segments one request may need
+
+struct C_block;
+struct R_block;
+struct request;
+struct timeval;
+
+typedef struct B_range {
+	long first; //offset of the first byte
+	long last;  //offset of the last byte, inclusive
+} B_range;
+
+/*
+ * Where the body of a page is cached: either whole in one block, or in
+ * segments of <span> bytes that each have a block of their own.
+ */
+typedef struct B_source {
+	struct C_block* blocks[RANGE_MAX_SEGMENTS];
+	long skip[RANGE_MAX_SEGMENTS];  //header bytes before the body in each block
+	long index[RANGE_MAX_SEGMENTS]; //which segment of the body each block holds
+	int count;
+	long span;  //body bytes per block
+	long total; //body bytes of the whole page
+} B_source;
+
+int
+range_parse(const char *spec, long total, B_range* out, int max);
+
+struct R_block*
+range_view(B_source* src, B_range* ranges, int n);
+
+struct R_block*
+range_cached(struct C_block* cb, const char *spec);
+
+int
+serve_segments(struct request* req, int connfd, struct timeval* start, int* keep_alive);
+
+#endif
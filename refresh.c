@@ -0,0 +1,208 @@
+/*
+ * Background refreshes of stale cached responses.
+ *
+ * With -swr, a response that has only just gone stale is still served
+ * straight from the cache, and a refresh is queued for it instead of making
+ * the client wait for the server. A few worker threads take the refreshes
+ * off the queue and revalidate (or fetch again) the responses the same way
+ * a request would, just without a client. A page only ever has one refresh
+ * pending at a time.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "cache.h"
+#include "flight.h"
+#include "project_4.h"
+#include "refresh.h"
+#include "log.h"
+
+struct refresh_job {
+	unsigned long hash; //see hash_key()
+	char* host;
+	char* path;
+	struct refresh_job* next;    //next job in the queue
+	struct refresh_job* pending; //next pending job in the same bucket
+};
+
+static int enabled = 0;
+static sem_t lock;  //guards everything below
+static sem_t items; //counts the queued jobs
+static struct refresh_job* first = NULL; //next job to carry out
+static struct refresh_job* last = NULL;
+static struct refresh_job* buckets[REFRESH_BUCKETS]; //queued and running jobs
+static int pending = 0;
+static struct refresh_stats stats;
+
+
+/*
+ * Refreshes the page of <job> if it's still stale. Someone else may have
+ * got to it first, or may be fetching it right now, in which case there's
+ * nothing left to do.
+ */
+static void
+refresh(struct refresh_job* job)
+{
+	C_block* stale = search_cache(job->host, job->path);
+	if (stale == NULL) return;
+	if (!is_stale(stale)) {
+		release_cache(stale);
+		return;
+	}
+
+	int leader;
+	F_entry* flight = flight_join(job->host, job->path, &leader, NULL);
+	if (!leader) {
+		flight_release(flight);
+		release_cache(stale);
+		return;
+	}
+
+	struct request req;
+	memset(&req, 0, sizeof(req));
+	strcpy(req.method, "GET");
+	strcpy(req.http_v, "HTTP/1.1");
+	snprintf(req.host, sizeof(req.host), "%s", job->host);
+	snprintf(req.path, sizeof(req.path), "%s", job->path);
+	snprintf(req.url, sizeof(req.url), "http://%s%s", job->host, job->path);
+	conditional_fields(stale, req.conditional, sizeof(req.conditional));
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	log_note(LOG_DEBUG, "[SRV refreshing %s%s]", job->host, job->path);
+	int result = fetch_response(&req, -1, &start, flight, stale);
+
+	flight_finish(flight, result == 1);
+	flight_release(flight);
+	release_cache(stale);
+}
+
+/*
+ * The main function for the refresh workers.
+ */
+static void*
+refresh_main(void* arg)
+{
+	(void) arg;
+
+	while (1) {
+		while (sem_wait(&items) == -1);
+		sem_wait(&lock);
+		struct refresh_job* job = first;
+		first = job->next;
+		if (first == NULL) last = NULL;
+		sem_post(&lock);
+
+		refresh(job);
+
+		//only now can the page be queued again
+		sem_wait(&lock);
+		struct refresh_job** link = &buckets[job->hash % REFRESH_BUCKETS];
+		while (*link != job) link = &(*link)->pending;
+		*link = job->pending;
+		pending--;
+		stats.done++;
+		sem_post(&lock);
+
+		free(job->host);
+		free(job->path);
+		free(job);
+	}
+	return NULL;
+}
+
+/*
+ * Starts <workers> refresh workers.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int
+init_refresh(int workers)
+{
+	sem_init(&lock, 0, 1);
+	sem_init(&items, 0, 0);
+
+	for (int i = 0; i < workers; i++) {
+		pthread_t thread_id;
+		if (pthread_create(&thread_id, NULL, &refresh_main, NULL) != 0) {
+			perror("ERROR: Couldn't create refresh thread");
+			return -1;
+		}
+		pthread_detach(thread_id);
+	}
+	enabled = 1;
+	return 0;
+}
+
+int
+refresh_enabled()
+{
+	return enabled;
+}
+
+/*
+ * Queues a refresh of <host><path>, unless one is already pending or the
+ * queue is full. In the latter case a later request will ask again.
+ */
+void
+refresh_later(const char *host, const char *path)
+{
+	if (!enabled) return;
+
+	unsigned long hash = hash_key(host, path);
+	struct refresh_job** bucket = &buckets[hash % REFRESH_BUCKETS];
+
+	sem_wait(&lock);
+	for (struct refresh_job* job = *bucket; job != NULL; job = job->pending) {
+		if (job->hash == hash && strcmp(job->host, host) == 0 &&
+				strcmp(job->path, path) == 0) {
+			stats.merged++;
+			sem_post(&lock);
+			return;
+		}
+	}
+	if (pending >= REFRESH_QUEUE) {
+		stats.dropped++;
+		sem_post(&lock);
+		return;
+	}
+
+	struct refresh_job* job = calloc(1, sizeof(struct refresh_job));
+	if (job == NULL || (job->host = strdup(host)) == NULL ||
+			(job->path = strdup(path)) == NULL) {
+		sem_post(&lock);
+		perror("Failed to allocate memory for refresh");
+		if (job != NULL) free(job->host);
+		free(job);
+		return;
+	}
+	job->hash = hash;
+	job->pending = *bucket;
+	*bucket = job;
+	if (last != NULL) last->next = job;
+	else first = job;
+	last = job;
+	pending++;
+	stats.queued++;
+	sem_post(&lock);
+	sem_post(&items);
+}
+
+void
+refresh_get_stats(struct refresh_stats *out)
+{
+	if (!enabled) {
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+	sem_wait(&lock);
+	*out = stats;
+	sem_post(&lock);
+}
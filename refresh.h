@@ -0,0 +1,27 @@
+#ifndef REFRESH_H
+#define REFRESH_H
+
+#define REFRESH_WORKERS 2   //threads refreshing stale responses
+#define REFRESH_QUEUE 256   //most refreshes waiting at once
+#define REFRESH_BUCKETS 64  //hash buckets of the pending refreshes
+
+struct refresh_stats {
+	long queued;  //refreshes queued
+	long merged;  //refreshes asked for while one was already pending
+	long dropped; //refreshes turned away because the queue was full
+	long done;    //refreshes carried out
+};
+
+int
+init_refresh(int workers);
+
+int
+refresh_enabled();
+
+void
+refresh_later(const char *host, const char *path);
+
+void
+refresh_get_stats(struct refresh_stats *stats);
+
+#endif
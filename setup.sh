@@ -1,3 +1,3 @@
 # codes for compiling should be written
 
-gcc -o project_4 project_4.c time.c network.c cache.c -std=c99 -I/usr/lib -lpthread
+gcc -o project_4 project_4.c time.c dns.c network.c http.c intern.c slab.c cache.c disk.c snapshot.c event.c queue.c pool.c flight.c refresh.c range.c compress.c cold.c log.c stats.c -std=c99 -I/usr/lib -lpthread -lz
@@ -0,0 +1,177 @@
+/*
+ * Storage for the bodies of cached responses.
+ *
+ * A body is kept in a few large segments instead of one small block per
+ * recv(). When the length of a response is known up front it gets a single
+ * segment of exactly the right size. Otherwise segments come from size
+ * classes that double from SLAB_MIN up to slab_max(), and freed ones are
+ * kept on a free list per class so that they can be handed out again without
+ * going through malloc().
+ *
+ * The segment header and its text are a single allocation.
+ */
+
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cache.h"
+#include "slab.h"
+
+typedef struct S_class {
+	sem_t lock;
+	R_block* free; //segments ready to be reused, linked through <next>
+	long kept;     //bytes on the free list
+} S_class;
+
+static S_class classes[SLAB_CLASSES];
+static struct slab_stats stats;
+
+
+void
+init_slab()
+{
+	for (int i = 0; i < SLAB_CLASSES; i++) {
+		sem_init(&classes[i].lock, 0, 1);
+		classes[i].free = NULL;
+		classes[i].kept = 0;
+	}
+}
+
+/*
+ * Returns the capacity of the largest size class.
+ */
+long
+slab_max()
+{
+	return (long) SLAB_MIN << (SLAB_CLASSES - 1);
+}
+
+/*
+ * Returns the smallest size class holding <cap> bytes, or -1 if it's bigger
+ * than all of them.
+ */
+static int
+class_of(long cap)
+{
+	for (int i = 0; i < SLAB_CLASSES; i++) {
+		if (cap <= (long) SLAB_MIN << i) return i;
+	}
+	return -1;
+}
+
+/*
+ * Locks the size class <c>, counting how often someone else had it.
+ */
+static void
+lock_class(S_class* c)
+{
+	if (sem_trywait(&c->lock) == -1) {
+		__atomic_add_fetch(&stats.contended, 1, __ATOMIC_RELAXED);
+		sem_wait(&c->lock);
+	}
+}
+
+/*
+ * Returns an empty segment with room for at least <cap> bytes. If <exact> is
+ * true (or <cap> is bigger than the largest class) it has exactly that much
+ * room, otherwise it's rounded up to a size class.
+ *
+ * Returns NULL if we ran out of memory.
+ */
+R_block*
+slab_alloc(long cap, int exact)
+{
+	int class = exact ? -1 : class_of(cap);
+	R_block* r = NULL;
+
+	if (class != -1) {
+		S_class* c = &classes[class];
+		cap = (long) SLAB_MIN << class;
+
+		lock_class(c);
+		if ((r = c->free) != NULL) {
+			c->free = r->next;
+			c->kept -= cap;
+		}
+		sem_post(&c->lock);
+		if (r != NULL) __atomic_add_fetch(&stats.reuses, 1, __ATOMIC_RELAXED);
+	}
+
+	if (r == NULL) {
+		r = malloc(sizeof(R_block) + cap);
+		if (r == NULL) {
+			perror("Failed to allocate memory for response segment");
+			return NULL;
+		}
+		r->text = (unsigned char*) (r + 1);
+		r->cap = cap;
+		r->class = class;
+		__atomic_add_fetch(&stats.allocs, 1, __ATOMIC_RELAXED);
+	}
+
+	r->size = 0;
+	r->next = NULL;
+	__atomic_add_fetch(&stats.segments, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.allocated, r->cap, __ATOMIC_RELAXED);
+	return r;
+}
+
+/*
+ * Returns a segment for the <size> bytes at <text>, which live somewhere
+ * else (e.g. in a mapped file) and aren't freed along with the segment.
+ *
+ * Returns NULL if we ran out of memory.
+ */
+R_block*
+slab_wrap(unsigned char *text, long size)
+{
+	R_block* r = malloc(sizeof(R_block));
+	if (r == NULL) {
+		perror("Failed to allocate memory for response segment");
+		return NULL;
+	}
+	r->text = text;
+	r->size = size;
+	r->cap = size;
+	r->class = SLAB_WRAPPED;
+	r->next = NULL;
+	__atomic_add_fetch(&stats.segments, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.allocated, r->cap, __ATOMIC_RELAXED);
+	return r;
+}
+
+/*
+ * Gives the segment <r> back, keeping it for reuse if its class doesn't
+ * have enough spare segments yet.
+ */
+void
+slab_free(R_block* r)
+{
+	__atomic_sub_fetch(&stats.segments, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&stats.allocated, r->cap, __ATOMIC_RELAXED);
+
+	if (r->class >= 0) {
+		S_class* c = &classes[r->class];
+
+		lock_class(c);
+		if (c->kept + r->cap <= SLAB_KEEP) {
+			r->next = c->free;
+			c->free = r;
+			c->kept += r->cap;
+			r = NULL;
+		}
+		sem_post(&c->lock);
+	}
+	free(r);
+}
+
+void
+slab_get_stats(struct slab_stats *out)
+{
+	out->segments = __atomic_load_n(&stats.segments, __ATOMIC_RELAXED);
+	out->allocated = __atomic_load_n(&stats.allocated, __ATOMIC_RELAXED);
+	out->allocs = __atomic_load_n(&stats.allocs, __ATOMIC_RELAXED);
+	out->reuses = __atomic_load_n(&stats.reuses, __ATOMIC_RELAXED);
+	out->contended = __atomic_load_n(&stats.contended, __ATOMIC_RELAXED);
+}
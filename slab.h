@@ -0,0 +1,37 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#define SLAB_MIN 16384      //smallest segment size class
+#define SLAB_CLASSES 7      //size classes, doubling from SLAB_MIN up to 1MB
+#define SLAB_KEEP (4 << 20) //bytes of free segments kept per class for reuse
+#define SLAB_WRAPPED -2     //class of segments whose text isn't ours
+
+struct R_block;
+
+struct slab_stats {
+	long segments;  //segments currently handed out
+	long allocated; //bytes of capacity in those segments
+	long allocs;    //segments that had to come from malloc()
+	long reuses;    //segments that came from a free list instead
+	long contended; //times a class lock was already taken
+};
+
+void
+init_slab();
+
+long
+slab_max();
+
+struct R_block*
+slab_alloc(long cap, int exact);
+
+struct R_block*
+slab_wrap(unsigned char *text, long size);
+
+void
+slab_free(struct R_block* r);
+
+void
+slab_get_stats(struct slab_stats *stats);
+
+#endif
@@ -0,0 +1,459 @@
+/*
+ * Snapshots of the cache, for warm restarts.
+ *
+ * A snapshot file starts with a header, followed by an index with a record
+ * for every cached page (its key, status, content type and where its body
+ * is), followed by the bodies. Pages are listed from the least to the most
+ * recently used within each shard, so loading them in order restores their
+ * recency. The header holds a checksum of the index and every record holds
+ * one of its body. Numbers are stored the way this machine stores them.
+ *
+ * Loading maps the file into memory and hands the bodies to the cache where
+ * they are, so the proxy can serve hits as soon as the index has been read.
+ * The bodies are checked against their checksums in the background, and
+ * pages that don't match are dropped.
+ *
+ * Snapshots are taken periodically and when the proxy gets a SIGTERM. They
+ * are written to a temporary file that's renamed over the old one once
+ * complete.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "cold.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "time.h"
+#include "log.h"
+
+#define MAX_FIELD 65535 //longest string a record can hold
+
+typedef struct S_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;      //number of records
+	uint64_t index_size; //bytes of records following the header
+	uint64_t index_sum;  //checksum of those bytes
+	uint64_t file_size;
+} S_header;
+
+//followed by the host, path, status and content type, padded to 8 bytes
+typedef struct S_record {
+	uint64_t offset; //where the body starts in the file
+	uint64_t size;
+	uint64_t sum;    //checksum of the body
+	int32_t status_no;
+	uint16_t host_len;
+	uint16_t path_len;
+	uint16_t status_len;
+	uint16_t type_len;
+	uint8_t has_type;
+	uint8_t keep_alive;
+	uint8_t pad[2];
+	uint32_t expires; //see C_block
+	uint32_t pad2;
+} S_record;
+
+//a restored page and the checksum its body should have
+typedef struct S_check {
+	C_block* cb;
+	uint64_t sum;
+} S_check;
+
+static char* snapshot_path = NULL;
+static int snapshot_interval = 0;
+
+
+/*
+ * Returns the 64-bit FNV-1a hash <h> continued over the <n> bytes at <p>.
+ */
+static uint64_t
+checksum(uint64_t h, const void *p, size_t n)
+{
+	const unsigned char* c = p;
+	while (n-- > 0) h = (h ^ *c++) * 1099511628211UL;
+	return h;
+}
+
+#define CHECKSUM_START 14695981039346656037UL
+
+/*
+ * Returns <n> rounded up to a multiple of 8.
+ */
+static uint64_t
+pad8(uint64_t n)
+{
+	return (n + 7) & ~(uint64_t) 7;
+}
+
+/*
+ * Returns the checksum of the response starting at the segment <response>.
+ */
+static uint64_t
+body_sum(R_block* response)
+{
+	uint64_t h = CHECKSUM_START;
+	for (R_block* r = response; r != NULL; r = r->next) {
+		h = checksum(h, r->text, r->size);
+	}
+	return h;
+}
+
+/*
+ * Returns the length of the index record for <cb>, strings included, or 0
+ * if it can't be saved: its strings are too long, or it's packed and
+ * couldn't be unpacked into <view>.
+ */
+static uint64_t
+record_size(C_block* cb, R_block* view)
+{
+	if (cb->packed && view == NULL) return 0;
+	size_t lens[4] = { strlen(cb->host), strlen(cb->path),
+		strlen(cb->status), strlen(cb->c_type) };
+	for (int i = 0; i < 4; i++) {
+		if (lens[i] > MAX_FIELD) return 0;
+	}
+	return sizeof(S_record) + pad8(lens[0] + lens[1] + lens[2] + lens[3]);
+}
+
+/*
+ * Writes the cache to a snapshot at <path>.
+ *
+ * Returns the number of pages saved, or -1 if it failed.
+ */
+int
+save_snapshot(const char *path)
+{
+	int count;
+	C_block** blocks = collect_cache(&count);
+	if (blocks == NULL) return -1;
+
+	int saved = -1;
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE* f = NULL;
+	char* rec = malloc(sizeof(S_record) + 4 * (MAX_FIELD + 1));
+	uint64_t* sums = malloc((count + 1) * sizeof(uint64_t));
+	R_block** views = calloc(count + 1, sizeof(R_block*));
+	if (rec == NULL || sums == NULL || views == NULL) goto done;
+
+	//packed blocks only have the header, the body has to be unpacked; those
+	//that fail to unpack are left out like those with overlong strings
+	for (int i = 0; i < count; i++) {
+		if (blocks[i]->packed) views[i] = cold_unpack(blocks[i]);
+	}
+
+	//work out the layout first, since the index comes before the bodies
+	S_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	uint64_t bodies = 0;
+	for (int i = 0; i < count; i++) {
+		uint64_t len = record_size(blocks[i], views[i]);
+		if (len == 0) continue;
+		hdr.count++;
+		hdr.index_size += len;
+		bodies += pad8(blocks[i]->size);
+		sums[i] = body_sum(views[i] != NULL ? views[i] : blocks[i]->response);
+	}
+	hdr.file_size = sizeof(hdr) + hdr.index_size + bodies;
+
+	f = fopen(tmp, "wb");
+	if (f == NULL) {
+		perror("Failed to create snapshot");
+		goto done;
+	}
+	setvbuf(f, NULL, _IOFBF, 1 << 20);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	uint64_t offset = sizeof(hdr) + hdr.index_size;
+	uint64_t sum = CHECKSUM_START;
+	for (int i = 0; i < count; i++) {
+		C_block* cb = blocks[i];
+		uint64_t len = record_size(cb, views[i]);
+		if (len == 0) continue;
+
+		S_record* r = (S_record*) rec;
+		memset(rec, 0, len);
+		r->offset = offset;
+		r->size = cb->size;
+		r->sum = sums[i];
+		r->status_no = cb->status_no;
+		r->host_len = strlen(cb->host);
+		r->path_len = strlen(cb->path);
+		r->status_len = strlen(cb->status);
+		r->type_len = strlen(cb->c_type);
+		r->has_type = cb->has_type;
+		r->keep_alive = cb->keep_alive;
+		r->expires = cb->expires;
+
+		char* strings = rec + sizeof(S_record);
+		memcpy(strings, cb->host, r->host_len);
+		strings += r->host_len;
+		memcpy(strings, cb->path, r->path_len);
+		strings += r->path_len;
+		memcpy(strings, cb->status, r->status_len);
+		strings += r->status_len;
+		memcpy(strings, cb->c_type, r->type_len);
+
+		fwrite(rec, len, 1, f);
+		sum = checksum(sum, rec, len);
+		offset += pad8(cb->size);
+	}
+	hdr.index_sum = sum;
+
+	static const char zeros[8];
+	for (int i = 0; i < count; i++) {
+		if (record_size(blocks[i], views[i]) == 0) continue;
+		for (R_block* r = views[i] != NULL ? views[i] : blocks[i]->response; r != NULL; r = r->next) {
+			fwrite(r->text, 1, r->size, f);
+		}
+		fwrite(zeros, 1, pad8(blocks[i]->size) - blocks[i]->size, f);
+	}
+
+	//now that everything else is there, the header can say so
+	rewind(f);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	if (fflush(f) != 0 || ferror(f) || fsync(fileno(f)) == -1) {
+		perror("Failed to write snapshot");
+		goto done;
+	}
+	if (fclose(f) != 0 || rename(tmp, path) == -1) {
+		f = NULL;
+		perror("Failed to write snapshot");
+		goto done;
+	}
+	f = NULL;
+	saved = hdr.count;
+
+done:
+	if (f != NULL) fclose(f);
+	if (saved == -1) unlink(tmp);
+	for (int i = 0; i < count; i++) {
+		if (views != NULL) free_view(views[i]);
+		release_cache(blocks[i]);
+	}
+	free(blocks);
+	free(views);
+	free(sums);
+	free(rec);
+	return saved;
+}
+
+/*
+ * Checks the bodies of the restored pages in <arg> (an array of S_check
+ * ending with a NULL block) against their checksums, dropping those that
+ * don't match.
+ */
+static void*
+verify_main(void* arg)
+{
+	S_check* checks = arg;
+	int dropped = 0;
+
+	for (S_check* c = checks; c->cb != NULL; c++) {
+		if (body_sum(c->cb->response) != c->sum) {
+			free_cache_block(c->cb);
+			dropped++;
+		}
+		release_cache(c->cb);
+	}
+	if (dropped > 0) {
+		fprintf(stderr, "WARNING: Dropped %d corrupted pages from the snapshot\n", dropped);
+	}
+	free(checks);
+	return NULL;
+}
+
+/*
+ * Copies the <len> byte string at <p> into <out>, terminating it.
+ */
+static char*
+field(char *out, const char *p, size_t len)
+{
+	memcpy(out, p, len);
+	out[len] = '\0';
+	return out;
+}
+
+/*
+ * Fills the cache from the snapshot at <path>. A missing snapshot is fine,
+ * there just isn't anything to restore.
+ *
+ * Returns the number of pages restored, or -1 if the snapshot is unusable.
+ */
+int
+load_snapshot(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT) return 0;
+		perror("ERROR: Couldn't open snapshot");
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(S_header)) {
+		fprintf(stderr, "ERROR: Snapshot %s is truncated\n", path);
+		close(fd);
+		return -1;
+	}
+	unsigned char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("ERROR: Couldn't map snapshot");
+		return -1;
+	}
+
+	//the mapping stays around for as long as the restored pages need it
+	uint64_t size = st.st_size;
+	S_header* hdr = (S_header*) map;
+	if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 ||
+			hdr->version != SNAPSHOT_VERSION || hdr->file_size != size ||
+			hdr->index_size > size - sizeof(S_header) ||
+			checksum(CHECKSUM_START, map + sizeof(S_header), hdr->index_size) != hdr->index_sum) {
+		fprintf(stderr, "ERROR: Snapshot %s is corrupted or from another version\n", path);
+		munmap(map, size);
+		return -1;
+	}
+
+	S_check* checks = calloc(hdr->count + 1, sizeof(S_check));
+	char* strings = malloc(4 * (MAX_FIELD + 1));
+	if (checks == NULL || strings == NULL) {
+		free(checks);
+		free(strings);
+		munmap(map, size);
+		return -1;
+	}
+	char* host = strings;
+	char* rpath = host + MAX_FIELD + 1;
+	char* status = rpath + MAX_FIELD + 1;
+	char* c_type = status + MAX_FIELD + 1;
+
+	int restored = 0;
+	uint64_t pos = sizeof(S_header);
+	uint64_t end = sizeof(S_header) + hdr->index_size;
+	for (uint32_t i = 0; i < hdr->count && pos + sizeof(S_record) <= end; i++) {
+		S_record* r = (S_record*) (map + pos);
+		uint64_t len = (uint64_t) r->host_len + r->path_len + r->status_len + r->type_len;
+		if (pos + sizeof(S_record) + len > end || r->offset > size ||
+				r->size > size - r->offset) {
+			break;
+		}
+
+		const char* p = (const char*) (r + 1);
+		field(host, p, r->host_len);
+		p += r->host_len;
+		field(rpath, p, r->path_len);
+		p += r->path_len;
+		field(status, p, r->status_len);
+		p += r->status_len;
+		field(c_type, p, r->type_len);
+		pos += sizeof(S_record) + pad8(len);
+
+		R_block* body = slab_wrap(map + r->offset, r->size);
+		if (body == NULL) break;
+		C_block* cb = adopt_cache(host, rpath, body, r->size, r->status_no,
+				status, r->has_type, c_type);
+		if (cb == NULL) continue;
+		cb->keep_alive = r->keep_alive;
+		set_expiry(cb, r->expires);
+
+		//hold on to it until its body has been checked
+		hold_cache(cb);
+		finish_cache(cb);
+		checks[restored].cb = cb;
+		checks[restored].sum = r->sum;
+		restored++;
+	}
+	free(strings);
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, verify_main, checks) != 0) {
+		verify_main(checks);
+	} else {
+		pthread_detach(tid);
+	}
+	return restored;
+}
+
+/*
+ * Waits for SIGTERM, taking a snapshot every <snapshot_interval> seconds in
+ * the meantime, and one last one before exiting.
+ */
+static void*
+snapshot_main(void* arg)
+{
+	(void) arg;
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	struct timespec wait = { snapshot_interval, 0 };
+
+	for (;;) {
+		int sig = snapshot_interval > 0 ? sigtimedwait(&set, NULL, &wait)
+			: sigwaitinfo(&set, NULL);
+		if (sig == -1 && errno == EINTR) continue;
+
+		int saved = save_snapshot(snapshot_path);
+		if (saved != -1) {
+			log_note(LOG_INFO, "[Saved %d pages to snapshot %s]", saved, snapshot_path);
+		}
+		if (sig == SIGTERM) exit(0);
+	}
+	return NULL;
+}
+
+/*
+ * Restores the cache from the snapshot at <path>, and takes a new one every
+ * <interval> seconds (never if it's 0) and on SIGTERM. Must be called before
+ * any other threads are started, so that they all leave SIGTERM to us.
+ *
+ * Returns the number of pages restored, or -1 if the snapshot thread couldn't
+ * be started.
+ */
+int
+init_snapshot(const char *path, int interval)
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	snapshot_path = strdup(path);
+	snapshot_interval = interval;
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	int restored = load_snapshot(path);
+	gettimeofday(&end, NULL);
+	if (restored > 0) {
+		log_note(LOG_INFO, "[Restored %d pages from snapshot %s in %ldms]", restored, path,
+				ms_elapsed(&start, &end));
+	}
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, snapshot_main, NULL) != 0) {
+		perror("ERROR: Couldn't start snapshot thread");
+		return -1;
+	}
+	pthread_detach(tid);
+	return restored < 0 ? 0 : restored;
+}
@@ -0,0 +1,17 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#define SNAPSHOT_MAGIC "P4CACHE\n" //first 8 bytes of every snapshot file
+#define SNAPSHOT_VERSION 2         //bumped whenever the format changes
+#define SNAPSHOT_INTERVAL 300      //default seconds between snapshots
+
+int
+save_snapshot(const char *path);
+
+int
+load_snapshot(const char *path);
+
+int
+init_snapshot(const char *path, int interval);
+
+#endif
@@ -0,0 +1,537 @@
+/*
+ * Statistics, served on a reserved path of the proxy itself.
+ *
+ * A GET for STATS_PATH (or STATS_JSON) on any host is answered by the proxy
+ * with its counters instead of being forwarded: how requests turned out and
+ * how long they took, bytes to and from clients and servers, connect times,
+ * and the counters of the cache and of every other part of the proxy.
+ *
+ * Each thread counts into a block of counters of its own, so counting takes
+ * neither locks nor atomic read-modify-writes. Reading the stats adds up the
+ * blocks of all threads. Latencies go into histograms with STATS_SUB buckets
+ * per power of two, which is enough to tell percentiles apart to within
+ * 12.5% over any range.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "cache.h"
+#include "cold.h"
+#include "compress.h"
+#include "disk.h"
+#include "dns.h"
+#include "intern.h"
+#include "log.h"
+#include "project_4.h"
+#include "refresh.h"
+#include "slab.h"
+#include "stats.h"
+
+typedef struct S_counters {
+	long requests[STAT_CLASSES];
+	long latency_us[STAT_CLASSES]; //total microseconds the requests took
+	long latency_max[STAT_CLASSES];
+	long latency[STAT_CLASSES][STATS_BUCKETS];
+	long connects;     //connections made to servers
+	long connect_fails;
+	long connect_us;   //total microseconds they took
+	long connect_max;
+	long connect[STATS_BUCKETS];
+	long bytes[STAT_DIRECTIONS];
+	int owned; //true while a thread counts into the block
+	struct S_counters* next; //blocks are never freed, just handed on
+} S_counters;
+
+typedef struct S_out {
+	char* buf;
+	long len;
+	long cap;
+	int json;
+	int fields; //fields written in the current section
+	const char* section;
+	int failed; //true if we ran out of memory
+} S_out;
+
+static S_counters* counters = NULL; //every block there is, pushed atomically
+static pthread_key_t counters_key; //the calling thread's block
+static pthread_once_t counters_once = PTHREAD_ONCE_INIT;
+static struct timeval started;
+
+static const char* CLASSES[] = { "hit", "miss", "skip", "error" };
+static const char* DIRECTIONS[] = { "client_in", "client_out", "server_in", "server_out" };
+
+
+/*
+ * Called when a thread that has a block of counters exits, so that the next
+ * new thread can take it over and the counts aren't lost.
+ */
+static void
+give_up_counters(void* c)
+{
+	__atomic_store_n(&((S_counters*) c)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void
+make_counters_key()
+{
+	pthread_key_create(&counters_key, give_up_counters);
+}
+
+/*
+ * Returns the calling thread's block of counters, see own_ring() in log.c.
+ */
+static S_counters*
+own_counters()
+{
+	pthread_once(&counters_once, make_counters_key);
+	S_counters* c = pthread_getspecific(counters_key);
+	if (c != NULL) return c;
+
+	for (c = __atomic_load_n(&counters, __ATOMIC_ACQUIRE); c != NULL; c = c->next) {
+		int owned = 0;
+		if (__atomic_compare_exchange_n(&c->owned, &owned, 1, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	if (c == NULL) {
+		c = calloc(1, sizeof(S_counters));
+		if (c == NULL) return NULL;
+		c->owned = 1;
+		c->next = __atomic_load_n(&counters, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&counters, &c->next, c, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	pthread_setspecific(counters_key, c);
+	return c;
+}
+
+/*
+ * Adds <n> to the counter <c> of the calling thread's block. Only the owner
+ * writes to it, so a plain store will do, as long as readers never see half
+ * of one.
+ */
+static void
+bump(long* c, long n)
+{
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Raises the counter <c> of the calling thread's block to <n> if it's lower.
+ */
+static void
+raise_to(long* c, long n)
+{
+	if (n > __atomic_load_n(c, __ATOMIC_RELAXED)) __atomic_store_n(c, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the histogram bucket of <us> microseconds: exact below STATS_SUB,
+ * then STATS_SUB buckets for every power of two.
+ */
+static int
+bucket_of(long us)
+{
+	if (us < STATS_SUB) return us < 0 ? 0 : us;
+	int e = 63 - __builtin_clzl(us);
+	int b = (e - 2) * STATS_SUB + (int) ((us >> (e - 3)) & (STATS_SUB - 1));
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+/*
+ * Returns the smallest value that falls into bucket <b>.
+ */
+static long
+bucket_floor(int b)
+{
+	if (b < STATS_SUB) return b;
+	int e = b / STATS_SUB + 2;
+	return (long) (STATS_SUB + b % STATS_SUB) << (e - 3);
+}
+
+/*
+ * Returns the microseconds from <start> until now.
+ */
+static long
+us_since(struct timeval* start)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_usec - start->tv_usec);
+}
+
+void
+init_stats()
+{
+	gettimeofday(&started, NULL);
+}
+
+/*
+ * Returns true if <path> is one of the reserved paths the stats are served on.
+ */
+int
+stats_path(const char *path)
+{
+	return strcmp(path, STATS_PATH) == 0 || strcmp(path, STATS_JSON) == 0;
+}
+
+/*
+ * Counts a request that came in at <start> and has now been answered, and
+ * how it turned out, <class> being one of STAT_*.
+ */
+void
+stats_done(int class, struct timeval* start)
+{
+	S_counters* c = own_counters();
+	if (c == NULL) return;
+
+	long us = us_since(start);
+	bump(&c->requests[class], 1);
+	bump(&c->latency_us[class], us);
+	bump(&c->latency[class][bucket_of(us)], 1);
+	raise_to(&c->latency_max[class], us);
+}
+
+/*
+ * Counts a connection to a server started at <start>, which was made if
+ * <ok> is true and failed otherwise.
+ */
+void
+stats_connect(struct timeval* start, int ok)
+{
+	S_counters* c = own_counters();
+	if (c == NULL) return;
+
+	if (!ok) {
+		bump(&c->connect_fails, 1);
+		return;
+	}
+	long us = us_since(start);
+	bump(&c->connects, 1);
+	bump(&c->connect_us, us);
+	bump(&c->connect[bucket_of(us)], 1);
+	raise_to(&c->connect_max, us);
+}
+
+/*
+ * Counts <nbytes> bytes going the way <direction> (one of STAT_*_IN/OUT).
+ */
+void
+stats_bytes(int direction, long nbytes)
+{
+	S_counters* c = own_counters();
+	if (c != NULL && nbytes > 0) bump(&c->bytes[direction], nbytes);
+}
+
+/*
+ * Appends to <o> like printf() does.
+ */
+static void
+emit(S_out* o, const char *fmt, ...)
+{
+	if (o->failed) return;
+
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(o->buf + o->len, o->cap - o->len, fmt, args);
+	va_end(args);
+	if (o->len + len >= o->cap) {
+		long cap = (o->cap + len) * 2;
+		char* buf = realloc(o->buf, cap);
+		if (buf == NULL) {
+			o->failed = 1;
+			return;
+		}
+		o->buf = buf;
+		o->cap = cap;
+		va_start(args, fmt);
+		vsnprintf(o->buf + o->len, o->cap - o->len, fmt, args);
+		va_end(args);
+	}
+	o->len += len;
+}
+
+/*
+ * Starts the section <name> of <o>: an object in JSON, a prefix of the
+ * names otherwise.
+ */
+static void
+section(S_out* o, const char *name)
+{
+	if (o->json) emit(o, "%s\"%s\":{", o->section == NULL ? "{" : "},", name);
+	o->section = name;
+	o->fields = 0;
+}
+
+static void
+field(S_out* o, const char *name, long value)
+{
+	if (o->json) emit(o, "%s\"%s\":%ld", o->fields > 0 ? "," : "", name, value);
+	else emit(o, "%s_%s %ld\n", o->section, name, value);
+	o->fields++;
+}
+
+static void
+field_ratio(S_out* o, const char *name, double value)
+{
+	if (o->json) emit(o, "%s\"%s\":%.4f", o->fields > 0 ? "," : "", name, value);
+	else emit(o, "%s_%s %.4f\n", o->section, name, value);
+	o->fields++;
+}
+
+/*
+ * Writes the section <name> of <o> for the histogram <hist> of <count>
+ * values adding up to <total>, the biggest being <max>.
+ */
+static void
+histogram(S_out* o, const char *name, long* hist, long count, long total, long max)
+{
+	static const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+	static const char* NAMES[] = { "p50_us", "p90_us", "p99_us", "p999_us" };
+
+	section(o, name);
+	field(o, "count", count);
+	field(o, "mean_us", count > 0 ? total / count : 0);
+	int b = 0;
+	long seen = 0;
+	for (int i = 0; i < 4; i++) {
+		//the value reported is the top of the bucket the quantile is in
+		long rank = (long) (QUANTILES[i] * count + 0.999999);
+		while (b < STATS_BUCKETS && seen + hist[b] < rank) seen += hist[b++];
+		long top = b < STATS_BUCKETS - 1 ? bucket_floor(b + 1) - 1 : max;
+		field(o, NAMES[i], count > 0 ? (top < max ? top : max) : 0);
+	}
+	field(o, "max_us", max);
+}
+
+/*
+ * Adds up the counters of every thread into <sum>.
+ */
+static void
+merge(S_counters* sum)
+{
+	memset(sum, 0, sizeof(*sum));
+	for (S_counters* c = __atomic_load_n(&counters, __ATOMIC_ACQUIRE); c != NULL; c = c->next) {
+		long* from = (long*) c;
+		long* to = (long*) sum;
+		//everything up to <owned> is a counter
+		for (size_t i = 0; i < offsetof(S_counters, owned) / sizeof(long); i++) {
+			to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+		}
+		for (int i = 0; i < STAT_CLASSES; i++) {
+			long max = __atomic_load_n(&c->latency_max[i], __ATOMIC_RELAXED);
+			to = &sum->latency_max[i];
+			*to -= max; //undo the adding up
+			if (max > *to) *to = max;
+		}
+		long max = __atomic_load_n(&c->connect_max, __ATOMIC_RELAXED);
+		sum->connect_max -= max;
+		if (max > sum->connect_max) sum->connect_max = max;
+	}
+}
+
+/*
+ * Returns the stats as text, or as JSON if <json> is true, setting <len> to
+ * their length. The caller has to free them. Returns NULL if we ran out of
+ * memory.
+ */
+char*
+stats_response(int json, long* len)
+{
+	S_counters* sum = malloc(sizeof(S_counters));
+	S_out o = { malloc(4096), 0, 4096, json, 0, NULL, 0 };
+	if (sum == NULL || o.buf == NULL) {
+		free(sum);
+		free(o.buf);
+		return NULL;
+	}
+	merge(sum);
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	long requests = 0;
+	for (int i = 0; i < STAT_CLASSES; i++) requests += sum->requests[i];
+
+	section(&o, "proxy");
+	field(&o, "uptime_s", now.tv_sec - started.tv_sec);
+	field(&o, "requests", requests);
+	for (int i = 0; i < STAT_CLASSES; i++) field(&o, CLASSES[i], sum->requests[i]);
+	field_ratio(&o, "hit_ratio", requests > 0 ? (double) sum->requests[STAT_HIT] / requests : 0);
+	field(&o, "busy_connections", __atomic_load_n(&thread_count, __ATOMIC_RELAXED));
+	for (int i = 0; i < STAT_DIRECTIONS; i++) field(&o, DIRECTIONS[i], sum->bytes[i]);
+
+	for (int i = 0; i < STAT_CLASSES; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "latency_%s", CLASSES[i]);
+		histogram(&o, name, sum->latency[i], sum->requests[i], sum->latency_us[i], sum->latency_max[i]);
+	}
+	histogram(&o, "connect", sum->connect, sum->connects, sum->connect_us, sum->connect_max);
+	field(&o, "failed", sum->connect_fails);
+
+	section(&o, "cache");
+	field(&o, "bytes", get_current_cache_size());
+	field(&o, "max_bytes", (long) opt.max_size * BYTESINMB);
+	field(&o, "items", get_cache_count());
+	field(&o, "evictions", get_eviction_count());
+
+	section(&o, "fresh");
+	field(&o, "hits", __atomic_load_n(&fresh_stats.hits, __ATOMIC_RELAXED));
+	field(&o, "revalidated", __atomic_load_n(&fresh_stats.revalidated, __ATOMIC_RELAXED));
+	field(&o, "refetched", __atomic_load_n(&fresh_stats.refetched, __ATOMIC_RELAXED));
+	field(&o, "stale", __atomic_load_n(&fresh_stats.stale, __ATOMIC_RELAXED));
+	field(&o, "stale_errors", __atomic_load_n(&fresh_stats.stale_errors, __ATOMIC_RELAXED));
+
+	struct refresh_stats refresh;
+	refresh_get_stats(&refresh);
+	section(&o, "refresh");
+	field(&o, "queued", refresh.queued);
+	field(&o, "merged", refresh.merged);
+	field(&o, "dropped", refresh.dropped);
+	field(&o, "done", refresh.done);
+
+	struct disk_stats disk;
+	disk_get_stats(&disk);
+	section(&o, "disk");
+	field(&o, "hits", disk.hits);
+	field(&o, "misses", disk.misses);
+	field(&o, "stores", disk.stores);
+	field(&o, "promotions", disk.promotions);
+	field(&o, "evictions", disk.evictions);
+	field(&o, "segments", disk.segments);
+	field(&o, "bytes", disk.bytes);
+
+	struct compress_stats comp;
+	compress_get_stats(&comp);
+	section(&o, "compress");
+	field(&o, "compressed", comp.compressed);
+	field(&o, "raw_bytes", comp.raw_bytes);
+	field(&o, "gz_bytes", comp.gz_bytes);
+	field(&o, "cpu_us", comp.cpu_us);
+	field(&o, "hits", comp.hits);
+	field(&o, "sent", comp.sent);
+	field(&o, "saved", comp.saved);
+
+	struct cold_stats cold;
+	cold_get_stats(&cold);
+	section(&o, "cold");
+	field(&o, "packed", cold.packed);
+	field(&o, "raw_bytes", cold.raw_bytes);
+	field(&o, "packed_bytes", cold.packed_bytes);
+	field(&o, "reused", cold.reused);
+	field(&o, "unpacked", cold.unpacked);
+	field(&o, "promoted", cold.promoted);
+	field(&o, "cpu_us", cold.cpu_us);
+
+	struct dns_stats dns;
+	dns_get_stats(&dns);
+	section(&o, "dns");
+	field(&o, "hits", dns.hits);
+	field(&o, "stale_hits", dns.stale_hits);
+	field(&o, "neg_hits", dns.neg_hits);
+	field(&o, "lookups", dns.lookups);
+	field(&o, "failures", dns.failures);
+	field(&o, "lookup_us", dns.lookup_us);
+
+	struct slab_stats slab;
+	slab_get_stats(&slab);
+	section(&o, "slab");
+	field(&o, "segments", slab.segments);
+	field(&o, "allocated", slab.allocated);
+	field(&o, "allocs", slab.allocs);
+	field(&o, "reuses", slab.reuses);
+	field(&o, "contended", slab.contended);
+
+	struct intern_stats strings;
+	intern_get_stats(&strings);
+	section(&o, "intern");
+	field(&o, "strings", strings.strings);
+	field(&o, "bytes", strings.bytes);
+
+	struct log_stats log;
+	log_get_stats(&log);
+	section(&o, "log");
+	field(&o, "written", log.written);
+	field(&o, "dropped", log.dropped);
+	if (json) emit(&o, "}}\n");
+
+	free(sum);
+	if (o.failed) {
+		free(o.buf);
+		return NULL;
+	}
+	*len = o.len;
+	return o.buf;
+}
+
+/*
+ * Builds the whole reply to a request for the reserved path <path>, header
+ * and all, setting <len> to its length.
+ *
+ * Returns the reply, which the caller must free, or NULL if we ran out of
+ * memory.
+ */
+char*
+stats_reply(const char *path, long* len)
+{
+	int json = strcmp(path, STATS_JSON) == 0;
+	long body_len;
+	char* body = stats_response(json, &body_len);
+	if (body == NULL) return NULL;
+
+	char head[256];
+	int head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+			"Content-Type: %s\r\nContent-Length: %ld\r\nCache-Control: no-store\r\n\r\n",
+			json ? "application/json" : "text/plain; charset=utf-8", body_len);
+
+	char* reply = malloc(head_len + body_len);
+	if (reply == NULL) {
+		perror("Failed to allocate memory for stats");
+		free(body);
+		return NULL;
+	}
+	memcpy(reply, head, head_len);
+	memcpy(reply + head_len, body, body_len);
+	free(body);
+	*len = head_len + body_len;
+	return reply;
+}
+
+/*
+ * Answers a request for the reserved path <path> on the blocking client
+ * socket <fd>. The epoll engine queues stats_reply() instead.
+ *
+ * Returns -1 if the stats couldn't be sent, 0 otherwise.
+ */
+int
+serve_stats(int fd, const char *path)
+{
+	long len;
+	char* reply = stats_reply(path, &len);
+	if (reply == NULL) return -1;
+
+	int result = 0;
+	long sent = 0;
+	while (sent < len) {
+		ssize_t n = send(fd, reply + sent, len - sent, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) {
+			result = -1;
+			break;
+		}
+		sent += n;
+	}
+	stats_bytes(STAT_CLIENT_OUT, sent);
+	free(reply);
+	return result;
+}
@@ -0,0 +1,49 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <sys/time.h>
+
+#define STATS_PATH "/.proxy/stats"   //reserved path the stats are served on, plain text
+#define STATS_JSON "/.proxy/stats.json" //and as JSON
+#define STATS_SUB 8      //histogram buckets per power of two, so within 12.5%
+#define STATS_BUCKETS (STATS_SUB * 34) //enough for about 19 hours in microseconds
+
+//how a request turned out, each with its own latency histogram
+#define STAT_HIT 0   //served from memory, disk or cached segments
+#define STAT_MISS 1  //fetched from the server and cached
+#define STAT_SKIP 2  //fetched from the server but not cached
+#define STAT_ERROR 3 //the server couldn't be reached
+#define STAT_CLASSES 4
+
+//which way bytes went, see stats_bytes()
+#define STAT_CLIENT_IN 0
+#define STAT_CLIENT_OUT 1
+#define STAT_SERVER_IN 2
+#define STAT_SERVER_OUT 3
+#define STAT_DIRECTIONS 4
+
+void
+init_stats();
+
+int
+stats_path(const char *path);
+
+void
+stats_done(int class, struct timeval* start);
+
+void
+stats_connect(struct timeval* start, int ok);
+
+void
+stats_bytes(int direction, long nbytes);
+
+char*
+stats_response(int json, long* len);
+
+char*
+stats_reply(const char *path, long* len);
+
+int
+serve_stats(int fd, const char *path);
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * Tests for the cache of resolved hostnames, see dns.c.
+ *
+ * A stub resolver stands in for getaddrinfo(), so no network is needed. It
+ * answers with 10.0.0.<generation>, where the generation can be bumped to
+ * tell a cached answer from a fresh one, and fails for names starting with
+ * "bad". The cache runs with a TTL of one second so that entries expire
+ * while the test waits, and a hosts file pins a few names that mustn't.
+ *
+ * Run with "make test".
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../dns.h"
+
+#define TTL 1            //seconds the cache keeps answers fresh for
+#define REFRESH_MS 2000  //how long a background refresh gets to finish
+
+static int failures = 0;
+static int generation = 1; //last byte of the address the stub answers with
+static int calls = 0;      //times the stub has been asked
+
+/*
+ * The stub resolver, see the top of the file.
+ */
+static int
+stub_resolver(const char *name, D_addr *out, int max)
+{
+	__atomic_add_fetch(&calls, 1, __ATOMIC_SEQ_CST);
+	if (strncmp(name, "bad", 3) == 0 || max < 1) return EAI_NONAME;
+
+	struct sockaddr_in* v4 = (struct sockaddr_in*) &out[0].addr;
+	memset(&out[0], 0, sizeof(out[0]));
+	out[0].family = v4->sin_family = AF_INET;
+	out[0].socktype = SOCK_STREAM;
+	out[0].len = sizeof(struct sockaddr_in);
+	v4->sin_addr.s_addr = htonl(0x0a000000 | __atomic_load_n(&generation, __ATOMIC_SEQ_CST));
+	return 1;
+}
+
+/*
+ * Sleeps for <ms> milliseconds.
+ */
+static void
+sleep_ms(long ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * Returns the last byte of the IPv4 address <a>, after checking that its
+ * port is <port>.
+ */
+static int
+last_byte(D_addr* a, int port)
+{
+	struct sockaddr_in* v4 = (struct sockaddr_in*) &a->addr;
+	if (a->family != AF_INET || ntohs(v4->sin_port) != port) return -1;
+	return ntohl(v4->sin_addr.s_addr) & 0xff;
+}
+
+/*
+ * Reports a failure of <what> if <got> isn't <want>.
+ */
+static void
+expect(const char* what, long got, long want)
+{
+	if (got != want) {
+		failures++;
+		fprintf(stderr, "FAIL: %s: got %ld, expected %ld\n", what, got, want);
+	}
+}
+
+/*
+ * A resolved hostname is answered from the cache until it expires.
+ */
+static void
+test_hit()
+{
+	D_addr out[DNS_MAX_ADDRS];
+	int before = calls;
+
+	expect("first lookup", dns_resolve("www.test", "80", out, DNS_MAX_ADDRS), 1);
+	expect("first lookup's address", last_byte(&out[0], 80), generation);
+	expect("resolver calls for the first lookup", calls - before, 1);
+
+	generation++;
+	expect("cached lookup", dns_resolve("www.test", "8080", out, DNS_MAX_ADDRS), 1);
+	expect("cached lookup's address", last_byte(&out[0], 8080), generation - 1);
+	expect("cached lookup", dns_cached("www.test", "80", out, DNS_MAX_ADDRS), 1);
+	expect("resolver calls for cached lookups", calls - before, 1);
+
+	expect("unknown name", dns_cached("new.test", "80", out, DNS_MAX_ADDRS), 0);
+}
+
+/*
+ * A hostname that doesn't resolve is remembered as such.
+ */
+static void
+test_negative()
+{
+	D_addr out[DNS_MAX_ADDRS];
+	int before = calls;
+
+	expect("failed lookup", dns_resolve("bad.test", "80", out, DNS_MAX_ADDRS), EAI_NONAME);
+	expect("remembered failure", dns_resolve("bad.test", "80", out, DNS_MAX_ADDRS), EAI_NONAME);
+	expect("remembered failure", dns_cached("bad.test", "80", out, DNS_MAX_ADDRS), EAI_NONAME);
+	expect("resolver calls for a failure", calls - before, 1);
+}
+
+/*
+ * Once a hostname expires, the old addresses are still answered with while
+ * the hostname is resolved again in the background, after which the new
+ * ones are. A hostname from the hosts file never expires nor gets resolved.
+ */
+static void
+test_stale_and_hosts()
+{
+	D_addr out[DNS_MAX_ADDRS];
+	generation = 1;
+	expect("lookup to go stale", dns_resolve("stale.test", "80", out, DNS_MAX_ADDRS), 1);
+	expect("pinned lookup", dns_resolve("pinned.test", "80", out, DNS_MAX_ADDRS), 1);
+	expect("pinned address", last_byte(&out[0], 80), 42);
+
+	//let the entries expire
+	sleep_ms((TTL + 1) * 1000 + 100);
+	generation = 2;
+	int before = calls;
+	struct dns_stats s;
+	dns_get_stats(&s);
+	long stale_before = s.stale_hits;
+
+	expect("stale lookup", dns_resolve("stale.test", "80", out, DNS_MAX_ADDRS), 1);
+	expect("stale lookup's address", last_byte(&out[0], 80), 1);
+	dns_get_stats(&s);
+	expect("stale hits", s.stale_hits - stale_before, 1);
+
+	int fresh = -1;
+	for (int waited = 0; waited < REFRESH_MS && fresh != 2; waited += 10) {
+		sleep_ms(10);
+		if (dns_cached("stale.test", "80", out, DNS_MAX_ADDRS) == 1) {
+			fresh = last_byte(&out[0], 80);
+		}
+	}
+	expect("refreshed address", fresh, 2);
+	expect("resolver calls for the refresh", calls - before, 1);
+
+	expect("expired pinned lookup", dns_resolve("pinned.test", "80", out, DNS_MAX_ADDRS), 1);
+	expect("expired pinned address", last_byte(&out[0], 80), 42);
+	expect("pinned v6 lookup", dns_resolve("six.test", "443", out, DNS_MAX_ADDRS), 1);
+	expect("pinned v6 family", out[0].family, AF_INET6);
+	expect("resolver calls for pinned names", calls - before, 1);
+}
+
+int
+main()
+{
+	char hosts[] = "/tmp/dns_test_hostsXXXXXX";
+	int fd = mkstemp(hosts);
+	const char* lines = "# pinned names\n"
+		"10.0.0.42 pinned.test   # with a comment\n"
+		"::1 six.test\n"
+		"not-an-address skipped.test\n";
+	if (fd == -1 || write(fd, lines, strlen(lines)) != (ssize_t) strlen(lines)) {
+		perror("ERROR: couldn't write the hosts file");
+		return 1;
+	}
+	close(fd);
+
+	init_dns(TTL);
+	dns_set_resolver(stub_resolver);
+	expect("hostnames loaded", dns_load_hosts(hosts), 2);
+
+	test_hit();
+	test_negative();
+	test_stale_and_hosts();
+
+	unlink(hosts);
+	printf("%s: dns cache\n", failures == 0 ? "PASS" : "FAIL");
+	return failures != 0;
+}
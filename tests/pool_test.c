@@ -0,0 +1,240 @@
+/*
+ * Tests for the pool of idle server connections, see pool.c.
+ *
+ * The connections are socket pairs rather than TCP connections, so that the
+ * test holds the server's end of each one: it can close it or write to it
+ * while the other end sits in the pool, and tell whether the pool closed
+ * its end. Every test uses its own server name so that they don't share
+ * idle connections.
+ *
+ * Run with "make test".
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../pool.h"
+
+#define MAX_IDLE 2 //idle connections the pool keeps per server
+#define TIMEOUT 1  //seconds a connection may stay idle
+
+static int failures = 0;
+
+/*
+ * Sleeps for <ms> milliseconds.
+ */
+static void
+sleep_ms(long ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * Makes a connection, setting <proxy> to our end (the one that goes into the
+ * pool) and <server> to the server's.
+ */
+static void
+connect_pair(int* proxy, int* server)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		perror("ERROR: couldn't make a socket pair");
+		exit(1);
+	}
+	*proxy = fds[0];
+	*server = fds[1];
+}
+
+/*
+ * Returns true if the server's end <server> sees its connection closed, or
+ * reset if the pool closed it with data left unread.
+ */
+static int
+closed_by_pool(int server)
+{
+	char c;
+	ssize_t n = recv(server, &c, 1, MSG_DONTWAIT);
+	return n == 0 || (n == -1 && errno == ECONNRESET);
+}
+
+/*
+ * Returns true if <fd> is in non-blocking mode.
+ */
+static int
+is_nonblock(int fd)
+{
+	return (fcntl(fd, F_GETFL, 0) & O_NONBLOCK) != 0;
+}
+
+/*
+ * Reports a failure of <what> if <got> isn't <want>.
+ */
+static void
+expect(const char* what, long got, long want)
+{
+	if (got != want) {
+		failures++;
+		fprintf(stderr, "FAIL: %s: got %ld, expected %ld\n", what, got, want);
+	}
+}
+
+/*
+ * A connection given back is taken out again, once.
+ */
+static void
+test_reuse()
+{
+	int proxy, server;
+	connect_pair(&proxy, &server);
+
+	pool_give("reuse", "80", proxy);
+	expect("taken from the other port", pool_take("reuse", "8080", 0), -1);
+	expect("taken", pool_take("reuse", "80", 0), proxy);
+	expect("taken again", pool_take("reuse", "80", 0), -1);
+	close(proxy);
+	close(server);
+}
+
+/*
+ * A connection the server closed, or sent something on, while it was idle
+ * is closed rather than handed out.
+ */
+static void
+test_peer_closed()
+{
+	int proxy, server, late, late_server;
+	connect_pair(&proxy, &server);
+	connect_pair(&late, &late_server);
+
+	pool_give("closed", "80", late);
+	pool_give("closed", "80", proxy);
+	close(server);
+	write(late_server, "x", 1);
+	expect("taken after the server closed it", pool_take("closed", "80", 0), -1);
+	expect("closed after the server sent something", closed_by_pool(late_server), 1);
+	close(late_server);
+}
+
+/*
+ * A connection idle for longer than the timeout is closed, whether it's
+ * taken or another one is given back to its server.
+ */
+static void
+test_timeout()
+{
+	int taken, taken_server, given, given_server, fresh, fresh_server;
+	connect_pair(&taken, &taken_server);
+	connect_pair(&given, &given_server);
+
+	pool_give("timeout", "80", taken);
+	pool_give("timeout", "81", given);
+	sleep_ms(TIMEOUT * 1000 + 100);
+
+	expect("taken after the timeout", pool_take("timeout", "80", 0), -1);
+	expect("closed after the timeout", closed_by_pool(taken_server), 1);
+
+	connect_pair(&fresh, &fresh_server);
+	pool_give("timeout", "81", fresh);
+	expect("closed when another is given", closed_by_pool(given_server), 1);
+	expect("fresh one taken", pool_take("timeout", "81", 0), fresh);
+
+	close(fresh);
+	close(fresh_server);
+	close(taken_server);
+	close(given_server);
+}
+
+/*
+ * No more than MAX_IDLE connections are kept per server, the rest are
+ * closed, and the most recently used one is taken first.
+ */
+static void
+test_max_idle()
+{
+	int proxy[MAX_IDLE + 1], server[MAX_IDLE + 1];
+	for (int i = 0; i <= MAX_IDLE; i++) {
+		connect_pair(&proxy[i], &server[i]);
+		pool_give("max", "80", proxy[i]);
+	}
+	expect("one too many closed", closed_by_pool(server[MAX_IDLE]), 1);
+
+	for (int i = MAX_IDLE - 1; i >= 0; i--) {
+		expect("taken in order", pool_take("max", "80", 0), proxy[i]);
+		expect("kept open", closed_by_pool(server[i]), 0);
+	}
+	expect("taken when empty", pool_take("max", "80", 0), -1);
+
+	for (int i = 0; i <= MAX_IDLE; i++) {
+		if (i < MAX_IDLE) close(proxy[i]);
+		close(server[i]);
+	}
+}
+
+/*
+ * A connection is taken out in the mode it's asked for, whichever mode it
+ * was given back in.
+ */
+static void
+test_modes()
+{
+	int proxy, server;
+	connect_pair(&proxy, &server);
+	fcntl(proxy, F_SETFL, fcntl(proxy, F_GETFL, 0) | O_NONBLOCK);
+
+	pool_give("modes", "80", proxy);
+	expect("non-blocking taken as blocking", pool_take("modes", "80", 0), proxy);
+	expect("blocking mode", is_nonblock(proxy), 0);
+
+	pool_give("modes", "80", proxy);
+	expect("blocking taken as non-blocking", pool_take("modes", "80", 1), proxy);
+	expect("non-blocking mode", is_nonblock(proxy), 1);
+
+	pool_give("modes", "80", proxy);
+	expect("non-blocking taken as non-blocking", pool_take("modes", "80", 1), proxy);
+	expect("still non-blocking", is_nonblock(proxy), 1);
+
+	close(proxy);
+	close(server);
+}
+
+/*
+ * With a maximum of 0 the pool keeps nothing.
+ */
+static void
+test_disabled()
+{
+	int proxy, server;
+	connect_pair(&proxy, &server);
+
+	expect("enabled", pool_enabled(), 0);
+	pool_give("disabled", "80", proxy);
+	expect("closed when given", closed_by_pool(server), 1);
+	expect("taken", pool_take("disabled", "80", 0), -1);
+	close(server);
+}
+
+int
+main()
+{
+	init_pool(0, TIMEOUT);
+	test_disabled();
+
+	init_pool(MAX_IDLE, TIMEOUT);
+	test_reuse();
+	test_peer_closed();
+	test_max_idle();
+	test_modes();
+	test_timeout();
+
+	printf("%s: connection pool\n", failures == 0 ? "PASS" : "FAIL");
+	return failures != 0;
+}
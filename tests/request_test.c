@@ -0,0 +1,314 @@
+/*
+ * Tests for how the proxy reads requests from its clients, see serve_client()
+ * in project_4.c and read_request() in event.c.
+ *
+ * The proxy is started as its own process on both engines, in front of a
+ * small server on loopback that answers every request with its path. A
+ * header too big for the buffer must get a 431 rather than being served cut
+ * short. With -pc, a pipelined request that arrives split across reads must
+ * still be answered after the one before it.
+ *
+ * Run with "make test", from the top directory so that ./project_4 is found.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../project_4.h"
+
+#define WAIT_MS 2000 //how long the proxy gets to start listening
+#define PAUSE_MS 200 //time between the two halves of a split request
+
+static int failures = 0;
+static int server_port; //where the test server listens
+
+/*
+ * Sleeps for <ms> milliseconds.
+ */
+static void
+sleep_ms(long ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * Opens a socket listening on a free loopback port, setting <port> to it.
+ */
+static int
+listen_loopback(int* port)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1 || bind(fd, (struct sockaddr*) &addr, len) == -1 ||
+			listen(fd, 16) == -1 ||
+			getsockname(fd, (struct sockaddr*) &addr, &len) == -1) {
+		perror("ERROR: couldn't listen on loopback");
+		exit(1);
+	}
+	*port = ntohs(addr.sin_port);
+	return fd;
+}
+
+/*
+ * Connects to <port> on loopback.
+ *
+ * Returns the socket, or -1 if nobody is listening.
+ */
+static int
+connect_loopback(int port)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd != -1 && connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/*
+ * Writes all <len> bytes of <buf> to <fd>.
+ */
+static void
+write_all(int fd, const char* buf, long len)
+{
+	while (len > 0) {
+		ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+		if (sent <= 0) return;
+		buf += sent;
+		len -= sent;
+	}
+}
+
+/*
+ * The main function for a connection to the test server, answering every
+ * request on the socket pointed to by <arg> with its path until the proxy
+ * hangs up.
+ */
+static void*
+serve_conn(void* arg)
+{
+	int fd = *(int*) arg;
+	free(arg);
+	char buf[MAX_BUF];
+	long len = 0;
+	ssize_t nbytes;
+
+	while ((nbytes = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) > 0) {
+		len += nbytes;
+		buf[len] = '\0';
+
+		char* end;
+		while ((end = strstr(buf, "\r\n\r\n")) != NULL) {
+			char path[256] = "";
+			sscanf(buf, "GET %255s", path);
+
+			char reply[512];
+			int n = snprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\n"
+					"Content-Length: %zu\r\n\r\n%s", strlen(path), path);
+			write_all(fd, reply, n);
+
+			end += 4;
+			len -= end - buf;
+			memmove(buf, end, len + 1);
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+/*
+ * The main function for the test server, taking connections on the socket
+ * pointed to by <arg>.
+ */
+static void*
+serve(void* arg)
+{
+	int listener = *(int*) arg;
+	for (;;) {
+		int* fd = malloc(sizeof(int));
+		if (fd == NULL || (*fd = accept(listener, NULL, NULL)) == -1) {
+			free(fd);
+			continue;
+		}
+		pthread_t t;
+		pthread_create(&t, NULL, serve_conn, fd);
+		pthread_detach(t);
+	}
+	return NULL;
+}
+
+/*
+ * Starts ./project_4 with -pc and the extra options <engine> on a free port,
+ * setting <port> to it once the proxy takes connections.
+ *
+ * Returns the process ID of the proxy.
+ */
+static pid_t
+start_proxy(const char* engine, int* port)
+{
+	close(listen_loopback(port));
+	char port_arg[16];
+	snprintf(port_arg, sizeof(port_arg), "%d", *port);
+
+	fflush(stdout); //or the child prints it again
+	pid_t pid = fork();
+	if (pid == 0) {
+		freopen("/dev/null", "w", stdout);
+		freopen("/dev/null", "w", stderr);
+		execl("./project_4", "project_4", port_arg, "20", "16", "-pc",
+				"-engine", engine, (char*) NULL);
+		_exit(127);
+	}
+
+	for (int waited = 0; waited < WAIT_MS; waited += 10) {
+		int fd = connect_loopback(*port);
+		if (fd != -1) {
+			close(fd);
+			return pid;
+		}
+		sleep_ms(10);
+	}
+	fprintf(stderr, "ERROR: ./project_4 -engine %s didn't start\n", engine);
+	kill(pid, SIGKILL);
+	exit(1);
+}
+
+/*
+ * Reads from <fd> into <buf>, which can hold <size> bytes, until <until>
+ * has arrived (if it isn't NULL), the proxy hangs up or it has been quiet
+ * for a second.
+ *
+ * Returns the number of bytes read, and terminates <buf>.
+ */
+static long
+read_reply(int fd, char* buf, long size, const char* until)
+{
+	struct timeval timeout = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	long got = 0;
+	ssize_t nbytes;
+	buf[0] = '\0';
+	while ((until == NULL || strstr(buf, until) == NULL) && got < size - 1 &&
+			(nbytes = recv(fd, buf + got, size - 1 - got, 0)) > 0) {
+		got += nbytes;
+		buf[got] = '\0';
+	}
+	return got;
+}
+
+/*
+ * Reports a failure of the test <what> on <engine> if <ok> is false.
+ */
+static void
+check(int ok, const char* what, const char* engine, const char* got)
+{
+	if (!ok) {
+		failures++;
+		fprintf(stderr, "FAIL: %s on %s, got \"%.80s\"\n", what, engine, got);
+	}
+}
+
+/*
+ * Sends a header that fills the proxy's whole buffer without ending, which
+ * must get a 431 and nothing from the server.
+ */
+static void
+test_oversized(const char* engine, int proxy_port)
+{
+	char* req = malloc(MAX_BUF);
+	if (req == NULL) {
+		perror("Failed to allocate memory for the request");
+		exit(1);
+	}
+	//exactly what the proxy can hold, so that it hangs up cleanly
+	int n = snprintf(req, MAX_BUF, "GET http://127.0.0.1:%d/too-large HTTP/1.1\r\n"
+			"Host: 127.0.0.1:%d\r\nX-Filler: ", server_port, server_port);
+	memset(req + n, 'a', MAX_BUF - 1 - n);
+
+	int fd = connect_loopback(proxy_port);
+	write_all(fd, req, MAX_BUF - 1);
+	char reply[1024];
+	read_reply(fd, reply, sizeof(reply), NULL);
+	close(fd);
+	free(req);
+
+	check(strncmp(reply, "HTTP/1.1 431 ", 13) == 0, "oversized header", engine, reply);
+	check(strstr(reply, "too-large") == NULL, "oversized header served", engine, reply);
+}
+
+/*
+ * Sends two pipelined requests, the second split across two reads, and
+ * expects both answers in order on the same connection.
+ */
+static void
+test_pipelined(const char* engine, int proxy_port)
+{
+	char first[512], second[512];
+	int n1 = snprintf(first, sizeof(first),
+			"GET http://127.0.0.1:%d/first HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n"
+			"GET http://127.0.0.1:%d/second HTTP/1.1\r\nHo",
+			server_port, server_port, server_port);
+	int n2 = snprintf(second, sizeof(second), "st: 127.0.0.1:%d\r\n\r\n", server_port);
+
+	int fd = connect_loopback(proxy_port);
+	write_all(fd, first, n1);
+	sleep_ms(PAUSE_MS);
+	write_all(fd, second, n2);
+	char reply[1024];
+	read_reply(fd, reply, sizeof(reply), "\r\n\r\n/second");
+	close(fd);
+
+	//the proxy may add fields of its own, so only the bodies are compared
+	char* one = strstr(reply, "\r\n\r\n/first");
+	char* two = one == NULL ? NULL : strstr(one, "\r\n\r\n/second");
+	check(one != NULL && two != NULL, "pipelined request split across reads", engine, reply);
+}
+
+int
+main()
+{
+	signal(SIGPIPE, SIG_IGN);
+	int listener = listen_loopback(&server_port);
+	pthread_t t;
+	pthread_create(&t, NULL, serve, &listener);
+
+	const char* engines[] = { "threads", "epoll" };
+	for (int i = 0; i < 2; i++) {
+		int proxy_port;
+		pid_t pid = start_proxy(engines[i], &proxy_port);
+		int before = failures;
+
+		test_oversized(engines[i], proxy_port);
+		//the epoll engine closes every connection after one response
+		if (strcmp(engines[i], "threads") == 0) test_pipelined(engines[i], proxy_port);
+
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		printf("%s: %s engine\n", failures == before ? "PASS" : "FAIL", engines[i]);
+	}
+	return failures != 0;
+}
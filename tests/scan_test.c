@@ -0,0 +1,167 @@
+/*
+ * Tests for the line scanners of http.c.
+ *
+ * The SSE2 and AVX2 scanners must find the same newline and colon as the
+ * scalar one for any input. They're compared on generated lines with the
+ * newline, a colon and a CR at every position around the 16 and 32 byte
+ * blocks, for every tail length and start offset. They're also compared on
+ * a corpus of real headers, scanned line by line at every alignment. The
+ * bytes past the end of the input are newlines and colons, so a scanner
+ * that reads too far gets caught.
+ *
+ * Run with "make test".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../http.h"
+
+#define MAX_LEN 80   //longest generated input
+#define MAX_OFF 34   //largest start offset of a generated input
+#define NO_BYTE -1   //a generated input has no newline or colon here
+#define PAD 64       //bytes after an input that the scanner mustn't look at
+
+static const char* SCANNERS[] = { "sse2", "avx2" };
+
+static const char* CORPUS[] = {
+	"GET http://www.example.org/static/js/app.4f2a9c.js HTTP/1.1\r\n"
+	"Host: www.example.org\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+	"Accept: */*\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Referer: http://www.example.org/index.html\r\n"
+	"Cookie: session=6b1f0c2e9a7d4e58b3c1; theme=dark; consent=1\r\n"
+	"If-Modified-Since: Tue, 15 Oct 2024 08:12:31 GMT\r\n"
+	"\r\n",
+
+	"HTTP/1.1 200 OK\r\n"
+	"Date: Thu, 17 Oct 2024 10:04:55 GMT\r\n"
+	"Content-Type: application/javascript\r\n"
+	"Content-Length: 183402\r\n"
+	"Cache-Control: public, max-age=31536000, immutable\r\n"
+	"X-Folded: first part\r\n"
+	"  second part: with a colon\r\n"
+	"X-Empty:\r\n"
+	":no-name\r\n"
+	"no-colon-at-all\r\n"
+	"Bare-LF: yes\n"
+	"\r\n",
+};
+
+#define N_CORPUS (int) (sizeof(CORPUS) / sizeof(CORPUS[0]))
+
+static int failures = 0;
+
+/*
+ * Scans <len> bytes of <buf> from <off> with <scan> and with the scalar
+ * scanner, reporting a failure for <what> if they disagree.
+ */
+static void
+compare(const char* name, http_scanner scan, const char* buf, long off, long len, const char* what)
+{
+	long want_colon, got_colon;
+	long want = http_scanner_named("scalar")(buf, off, len, &want_colon);
+	long got = scan(buf, off, len, &got_colon);
+	if (got != want || got_colon != want_colon) {
+		if (failures++ < 10) {
+			fprintf(stderr, "FAIL: %s on %s: newline %ld colon %ld, expected %ld and %ld\n",
+				name, what, got, got_colon, want, want_colon);
+		}
+	}
+}
+
+/*
+ * Compares <scan> with the scalar scanner on inputs of every length up to
+ * MAX_LEN, scanned from every offset up to MAX_OFF, with the newline and a
+ * colon at every position (or missing). Half of them have a CR before the
+ * newline.
+ */
+static void
+test_generated(const char* name, http_scanner scan)
+{
+	char buf[MAX_LEN + PAD];
+	char what[128];
+
+	for (long len = 0; len <= MAX_LEN; len++) {
+		for (long off = 0; off <= len && off <= MAX_OFF; off++) {
+			for (long nl = NO_BYTE; nl < len; nl++) {
+				if (nl != NO_BYTE && nl < off) continue;
+				for (long colon = NO_BYTE; colon < len; colon++) {
+					if (colon != NO_BYTE && (colon < off || colon == nl)) continue;
+
+					memset(buf, 'a', len);
+					for (long i = len; i < (long) sizeof(buf); i++) {
+						buf[i] = i % 2 ? '\n' : ':';
+					}
+					if (nl != NO_BYTE) buf[nl] = '\n';
+					if (nl > off && nl % 2 == 0 && nl - 1 != colon) buf[nl - 1] = '\r';
+					if (colon != NO_BYTE) buf[colon] = ':';
+
+					snprintf(what, sizeof(what), "len %ld off %ld newline %ld colon %ld",
+						len, off, nl, colon);
+					compare(name, scan, buf, off, len, what);
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Compares <scan> with the scalar scanner on every line of the corpus, with
+ * the headers starting at every offset into a 32 byte block.
+ */
+static void
+test_corpus(const char* name, http_scanner scan)
+{
+	char what[128];
+
+	for (int c = 0; c < N_CORPUS; c++) {
+		long len = strlen(CORPUS[c]);
+		char* buf = malloc(32 + len + PAD);
+		if (buf == NULL) {
+			perror("Failed to allocate memory for the corpus");
+			exit(1);
+		}
+
+		for (long shift = 0; shift < 32; shift++) {
+			memset(buf, 'a', shift);
+			memcpy(buf + shift, CORPUS[c], len);
+			memset(buf + shift + len, ':', PAD);
+
+			//every cut of the header, as if the rest hadn't arrived yet
+			for (long end = shift; end <= shift + len; end++) {
+				long off = shift;
+				while (off < end) {
+					snprintf(what, sizeof(what), "header %d shift %ld off %ld end %ld",
+						c, shift, off, end);
+					compare(name, scan, buf, off, end, what);
+
+					long colon;
+					long nl = http_scanner_named("scalar")(buf, off, end, &colon);
+					if (nl == -1) break;
+					off = nl + 1;
+				}
+			}
+		}
+		free(buf);
+	}
+}
+
+int
+main()
+{
+	for (int i = 0; i < (int) (sizeof(SCANNERS) / sizeof(SCANNERS[0])); i++) {
+		http_scanner scan = http_scanner_named(SCANNERS[i]);
+		if (scan == NULL) {
+			printf("SKIP: %s scanner, not supported here\n", SCANNERS[i]);
+			continue;
+		}
+		int before = failures;
+		test_generated(SCANNERS[i], scan);
+		test_corpus(SCANNERS[i], scan);
+		printf("%s: %s scanner\n", failures == before ? "PASS" : "FAIL", SCANNERS[i]);
+	}
+	return failures != 0;
+}
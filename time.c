@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <time.h>
 #include <sys/time.h>
@@ -5,15 +7,16 @@
 #include "time.h"
 
 /*
- * Print the time specified at address <tv> in the form of
- * hours:minutes:seconds.milliseconds.
+ * Writes the time specified at address <tv> into <out>, which can hold
+ * <size> bytes, in the form of hours:minutes:seconds.milliseconds.
  */
 void
-print_time(struct timeval* tv)
+format_time(struct timeval* tv, char* out, size_t size)
 {
+	struct tm tm;
 	char tmbuf[64];
-	strftime(tmbuf, sizeof tmbuf, "%H:%M:%S", localtime(&tv->tv_sec));
-	printf("%s.%03d\n", tmbuf, (tv->tv_usec / 1000));
+	strftime(tmbuf, sizeof tmbuf, "%H:%M:%S", localtime_r(&tv->tv_sec, &tm));
+	snprintf(out, size, "%s.%03d", tmbuf, (int) (tv->tv_usec / 1000));
 }
 
 /*
@@ -1,8 +1,10 @@
 #ifndef TIME_H
 #define TIME_H
 
+#include <stddef.h>
+
 void
-print_time(struct timeval* tv);
+format_time(struct timeval* tv, char* out, size_t size);
 
 long
 ms_elapsed(struct timeval* start, struct timeval* end);